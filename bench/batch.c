@@ -0,0 +1,147 @@
+/*
+ *    batch.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+/**
+ * UPnP batch benchmark ('make bench'): maps and deletes N ports on a UPnP
+ * gateway of tests/mock_gateway.js, whose device description is at port
+ * 5000. Compared are one call per port with discovery ('pmap_upnp_addport',
+ * on a few ports only since each waits for the M-SEARCH window), one call
+ * per port with a known control URL ('pmap_upnp_action_url', a connection
+ * each) and the batch calls over one keep-alive connection, with and
+ * without discovery.
+ */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pmap_upnp.h"
+
+#define BATCH_PORT 30000
+#define BATCH_DISCOVERY_SAMPLE 2
+
+static void _bench_report(const char *what, int count, int64_t elapsed_ms,
+                          int failures) {
+
+  printf("%-36s %5d ops %6lld ms %8.1f ops/s  %d failed\n", what, count,
+         (long long)elapsed_ms,
+         count * 1000.0 / (elapsed_ms > 0 ? elapsed_ms : 1), failures);
+}
+
+static int _bench_failures(const pmap_upnp_res_t *res, int count) {
+
+  int failures = 0;
+
+  for (int i = 0; i < count; i++) {
+    failures += (res[i].status != 0);
+  }
+  return failures;
+}
+
+/**
+ * One SOAP action on a known control URL, on a connection of its own.
+ */
+static int _bench_action(int action, pmap_field_t *pfield,
+                         pmap_url_comp_t *ucmp) {
+
+  char error[64];
+  int http_status = 0;
+  pbuffer_t *pbfr = pmap_upnp_action_url(action, pfield, ucmp, &http_status,
+                                         NULL);
+
+  /* Frees the response */
+  return pmap_upnp_result(pbfr, http_status, NULL, 0, error, sizeof(error)) !=
+         0;
+}
+
+int main(int argc, char **argv) {
+
+  if (argc < 2) {
+    printf("usage: %s <gateway_IPv4> [<count>]\n", argv[0]);
+    return 1;
+  }
+
+  int count = (argc > 2) ? atoi(argv[2]) : 200;
+  int sample = (count < BATCH_DISCOVERY_SAMPLE) ? count
+                                                : BATCH_DISCOVERY_SAMPLE;
+  pmap_field_t *fields = calloc(count, sizeof(pmap_field_t));
+  pmap_upnp_res_t *res = calloc(count, sizeof(pmap_upnp_res_t));
+  char location[64], error[64];
+  int failures = 0;
+
+  snprintf(location, sizeof(location), "http://%s:5000/rootDesc.xml",
+           argv[1]);
+  pmap_url_comp_t *ucmp = pmap_ut_parse_url(location);
+  if (NULL == fields || NULL == res || NULL == ucmp) {
+    return 1;
+  }
+
+  for (int i = 0; i < count; i++) {
+    fields[i].gateway_ip = inet_addr(argv[1]);
+    fields[i].internal_ip = inet_addr("127.0.0.1");
+    strcpy(fields[i].protocol, "TCP");
+    fields[i].external_port = BATCH_PORT + i;
+    fields[i].internal_port = BATCH_PORT + i;
+    fields[i].lifetime_sec = 3600;
+  }
+
+  int64_t start = pmap_ut_now_ms();
+  for (int i = 0; i < sample; i++) {
+    failures += (pmap_upnp_addport(&fields[i], error, sizeof(error)) != 0);
+    failures += (pmap_upnp_delport(&fields[i], error, sizeof(error)) != 0);
+  }
+  _bench_report("per call, discovery (add + delete)", sample * 2,
+                pmap_ut_now_ms() - start, failures);
+
+  failures = 0;
+  start = pmap_ut_now_ms();
+  for (int i = 0; i < count; i++) {
+    failures += _bench_action(PMAP_UPNP_ACTION_ADDPORT, &fields[i], ucmp);
+    failures += _bench_action(PMAP_UPNP_ACTION_DELPORT, &fields[i], ucmp);
+  }
+  _bench_report("per call, known URL (add + delete)", count * 2,
+                pmap_ut_now_ms() - start, failures);
+
+  start = pmap_ut_now_ms();
+  pmap_upnp_addport_batch_url(ucmp, fields, count, res, NULL);
+  failures = _bench_failures(res, count);
+  pmap_upnp_delport_batch_url(ucmp, fields, count, res, NULL);
+  failures += _bench_failures(res, count);
+  _bench_report("batch, known URL (add + delete)", count * 2,
+                pmap_ut_now_ms() - start, failures);
+
+  start = pmap_ut_now_ms();
+  pmap_upnp_addport_batch(fields, count, res);
+  failures = _bench_failures(res, count);
+  pmap_upnp_delport_batch(fields, count, res);
+  failures += _bench_failures(res, count);
+  _bench_report("batch, discovery (add + delete)", count * 2,
+                pmap_ut_now_ms() - start, failures);
+
+  pmap_ut_free_url(ucmp);
+  free(fields);
+  free(res);
+
+  return 0;
+}
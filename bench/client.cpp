@@ -0,0 +1,202 @@
+/*
+ *    client.cpp
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+/**
+ * C++ policy client benchmark ('make bench'). Builds AddPortMapping
+ * requests with the constexpr message of pmap_client.hpp, with a
+ * hand-written snprintf of the same bytes and with the C builder
+ * ('pmap_upnp_request'), then runs the client over an in-memory gateway.
+ * Exits 1 if the three requests differ.
+ */
+
+#include <chrono>
+#include <cstdio>
+
+#include "pmap_client.hpp"
+
+extern "C" {
+#include "buffer.h"
+}
+
+using namespace pmap;
+
+static constexpr int kRuns = 1000000;
+
+/**
+ * In-memory gateway: answers NAT-PMP and every SOAP action with success.
+ */
+struct MemoryGateway {
+  int handle(int type, uint32_t, uint16_t, const char *req, size_t,
+             char *resp, size_t size) {
+    if (type == SOCK_DGRAM) {
+      const nmpm_pkt_req *map = reinterpret_cast<const nmpm_pkt_req *>(req);
+      nmpm_pkt_resp r{};
+      r.header.op_code = 128 + map->header.op_code;
+      r.internal_port = map->internal_port;
+      r.external_port = map->external_port;
+      r.lifetime_sec = map->lifetime_sec;
+      memcpy(resp, &r, sizeof(r));
+      return sizeof(r);
+    }
+    const char *body = "<ok/>";
+    return snprintf(resp, size, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n%s",
+                    strlen(body), body);
+  }
+};
+
+using Clock = std::chrono::steady_clock;
+
+static double ns_per_op(Clock::time_point start, int runs) {
+  return std::chrono::duration<double, std::nano>(Clock::now() - start)
+             .count() /
+         runs;
+}
+
+/**
+ * The request written by hand, as an application would without the client.
+ */
+static size_t hand_add(char *out, size_t size, const Igd &igd,
+                       const pmap_field_t &f) {
+  char body[1024], ip[16], host[16];
+
+  pmap_ut_inet_ntoa_r(f.internal_ip, ip, sizeof(ip));
+  pmap_ut_inet_ntoa_r(igd.ip, host, sizeof(host));
+  int b = snprintf(
+      body, sizeof(body),
+      "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n<s:Envelope "
+      "xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+      "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n  "
+      "<s:Body>\r\n    <u:AddPortMapping       "
+      "xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:%d\">\r\n      "
+      "<NewRemoteHost></NewRemoteHost>\r\n      "
+      "<NewExternalPort>%d</NewExternalPort>\r\n      "
+      "<NewProtocol>%s</NewProtocol>\r\n      "
+      "<NewInternalPort>%d</NewInternalPort>\r\n      "
+      "<NewInternalClient>%s</NewInternalClient>\r\n      "
+      "<NewEnabled>True</NewEnabled>\r\n      "
+      "<NewPortMappingDescription>pMAP</NewPortMappingDescription>\r\n      "
+      "<NewLeaseDuration>%d</NewLeaseDuration>\r\n    "
+      "</u:AddPortMapping>\r\n  </s:Body>\r\n</s:Envelope>\r\n",
+      igd.version, f.external_port, f.protocol, f.internal_port, ip,
+      f.lifetime_sec);
+  int h = snprintf(out, size,
+                   "POST %s HTTP/1.1\r\nHost: %s:%d\r\nSOAPAction: "
+                   "\"urn:schemas-upnp-org:service:WANIPConnection:%d#"
+                   "AddPortMapping\"\r\nContent-Type: text/xml; "
+                   "charset=\"utf-8\"\r\nContent-Length: %d\r\n\r\n",
+                   igd.control_url, host, igd.port, igd.version, b);
+  memcpy(out + h, body, b);
+  return h + b;
+}
+
+static size_t constexpr_add(char *out, const Igd &igd, const pmap_field_t &f) {
+  using detail::Int;
+  return detail::AddPortMapping::render(
+      out, detail::Path{igd.control_url}, detail::Ip{igd.ip}, Int{igd.port},
+      Int{igd.version}, Int{f.external_port}, detail::Proto{f.protocol},
+      Int{f.internal_port}, detail::Ip{f.internal_ip}, Int{f.lifetime_sec});
+}
+
+int main() {
+  pmap_url_comp_t url{};
+  url.host = (char *)"192.0.2.2";
+  url.port = 5000;
+  url.crtl_url = (char *)"/ctl/IPConn";
+  url.version = 2;
+  Igd igd = Igd::from(&url);
+
+  pmap_field_t f{};
+  f.gateway_ip = igd.ip;
+  f.internal_ip = inet_addr("192.168.100.200");
+  strcpy(f.protocol, "TCP");
+  f.external_port = 40000;
+  f.internal_port = 40001;
+  f.lifetime_sec = 3600;
+
+  char a[detail::AddPortMapping::max_size], b[2048];
+  size_t la = constexpr_add(a, igd, f);
+  size_t lb = hand_add(b, sizeof(b), igd, f);
+  pbuffer_t *c = pmap_upnp_request(PMAP_UPNP_ACTION_ADDPORT, &url, &f);
+  bool same = la == lb && memcmp(a, b, la) == 0 && la == (size_t)c->offset &&
+              memcmp(a, c->buffer, la) == 0;
+  pbfr_destroy(c);
+
+  printf("AddPortMapping: %zu bytes, max_size %zu, identical requests: %s\n",
+         la, detail::AddPortMapping::max_size, same ? "yes" : "NO");
+  printf("sizeof(BasicClient<>) %zu, sizeof(pmap_tmo_t) %zu\n",
+         sizeof(BasicClient<>), sizeof(pmap_tmo_t));
+  if (!same) {
+    return 1;
+  }
+
+  size_t sink = 0;
+  auto start = Clock::now();
+  for (int i = 0; i < kRuns; i++) {
+    f.external_port = 1000 + (i & 4095);
+    sink += constexpr_add(a, igd, f);
+  }
+  double t_constexpr = ns_per_op(start, kRuns);
+
+  start = Clock::now();
+  for (int i = 0; i < kRuns; i++) {
+    f.external_port = 1000 + (i & 4095);
+    sink += hand_add(b, sizeof(b), igd, f);
+  }
+  double t_hand = ns_per_op(start, kRuns);
+
+  start = Clock::now();
+  for (int i = 0; i < kRuns / 10; i++) {
+    f.external_port = 1000 + (i & 4095);
+    pbuffer_t *p = pmap_upnp_request(PMAP_UPNP_ACTION_ADDPORT, &url, &f);
+    sink += p->offset;
+    pbfr_destroy(p);
+  }
+  double t_c = ns_per_op(start, kRuns / 10);
+
+  printf("build AddPortMapping: constexpr %.0f ns, hand-written snprintf "
+         "%.0f ns, C builder %.0f ns\n",
+         t_constexpr, t_hand, t_c);
+
+  MemoryGateway gw;
+  BasicClient<MemoryTransport<MemoryGateway>,
+              ArenaAllocator<PMAP_CLIENT_RESP_LEN + 64>, ManualClock>
+      sim{MemoryTransport<MemoryGateway>(&gw)};
+
+  start = Clock::now();
+  for (int i = 0; i < kRuns / 10; i++) {
+    sink += (bool)sim.upnp_add_port(igd, f);
+  }
+  double t_upnp = ns_per_op(start, kRuns / 10);
+
+  start = Clock::now();
+  for (int i = 0; i < kRuns / 10; i++) {
+    sink += (bool)sim.npmp_add_port(f);
+  }
+  double t_npmp = ns_per_op(start, kRuns / 10);
+
+  printf("in-memory client (arena, manual clock): UPnP add %.0f ns, NAT-PMP "
+         "add %.0f ns (sink %zu)\n",
+         t_upnp, t_npmp, sink);
+
+  return 0;
+}
@@ -0,0 +1,280 @@
+/*
+ *    submit.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+/**
+ * Submission queue microbenchmark ('make bench'): 1 to 32 producer threads
+ * keep a window of requests in flight through the lock-free ring of the I/O
+ * engine, and through a mutex-protected list for comparison. The engine
+ * thread is replaced by a consumer that completes each request at once, so
+ * only the queues, the wakeups and the completion path are measured. The
+ * engine source is included to reach its static ring functions.
+ */
+
+#include <sched.h>
+#include <time.h>
+
+#include "../src/pmap_engine.c"
+
+#define SUBMIT_WINDOW 64
+#define SUBMIT_RING 1024
+#define SUBMIT_MAX_PRODUCERS 32
+
+typedef struct submit_producer_t_ {
+  pmap_engine_t *eng;
+  int64_t *latency_ns;
+  int count;
+  int samples;
+} submit_producer_t;
+
+static int use_mutex;
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pmap_engine_req_t *list_head, **list_tail = &list_head;
+static int list_sleeping;
+
+static int64_t _submit_now_ns(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * 'pmap_engine_submit' with a mutex-protected list instead of the ring.
+ */
+static int _submit_mutex(pmap_engine_t *eng, pmap_engine_cq_t *cq,
+                         pmap_engine_req_t *req) {
+
+  req->cq = cq;
+  req->next = NULL;
+
+  pthread_mutex_lock(&list_lock);
+  *list_tail = req;
+  list_tail = &req->next;
+  int wake = list_sleeping;
+  list_sleeping = 0;
+  pthread_mutex_unlock(&list_lock);
+
+  if (wake) {
+    _pmap_engine_fd_signal(eng->fd);
+  }
+  return 0;
+}
+
+static pmap_engine_req_t *_submit_mutex_pop(void) {
+
+  pthread_mutex_lock(&list_lock);
+  pmap_engine_req_t *req = list_head;
+  if (NULL != req) {
+    list_head = req->next;
+    if (NULL == list_head) {
+      list_tail = &list_head;
+    }
+  }
+  pthread_mutex_unlock(&list_lock);
+
+  return req;
+}
+
+/**
+ * The engine thread without the network: complete every request at once.
+ */
+static void *_submit_consumer(void *arg) {
+
+  pmap_engine_t *eng = arg;
+  pmap_engine_req_t *req;
+
+  for (;;) {
+    while (NULL != (req = use_mutex ? _submit_mutex_pop()
+                                    : _pmap_engine_pop(eng))) {
+      req->status = 0;
+      _pmap_engine_complete(eng, req);
+    }
+    if (_load(&eng->stop)) {
+      break;
+    }
+
+    int tmo = -1;
+    if (use_mutex) {
+      pthread_mutex_lock(&list_lock);
+      list_sleeping = (NULL == list_head);
+      tmo = list_sleeping ? -1 : 0;
+      pthread_mutex_unlock(&list_lock);
+    } else {
+      __atomic_store_n(&eng->sleeping, 1, __ATOMIC_SEQ_CST);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (_load(&eng->ring[eng->head & eng->mask].seq) == eng->head + 1) {
+        tmo = 0;
+      }
+    }
+
+    struct pollfd pfd = {.fd = eng->fd[0], .events = POLLIN};
+    poll(&pfd, 1, tmo);
+    __atomic_store_n(&eng->sleeping, 0, __ATOMIC_RELAXED);
+    if (pfd.revents) {
+      eng->wakeups++;
+      _pmap_engine_fd_clear(eng->fd);
+    }
+  }
+
+  return NULL;
+}
+
+static void *_submit_producer(void *arg) {
+
+  submit_producer_t *prod = arg;
+  pmap_engine_cq_t *cq = pmap_engine_cq_create();
+  pmap_engine_req_t *reqs = calloc(SUBMIT_WINDOW, sizeof(pmap_engine_req_t));
+  pmap_engine_req_t *idle[SUBMIT_WINDOW], *done[SUBMIT_WINDOW];
+  int nidle = SUBMIT_WINDOW, sent = 0, completed = 0;
+
+  if (NULL == cq || NULL == reqs) {
+    exit(1);
+  }
+  for (int i = 0; i < SUBMIT_WINDOW; i++) {
+    reqs[i].action = PMAP_ASYNC_ADDPORT;
+    idle[i] = &reqs[i];
+  }
+
+  while (completed < prod->count) {
+    while (nidle > 0 && sent < prod->count) {
+      pmap_engine_req_t *req = idle[--nidle];
+      int64_t start = _submit_now_ns();
+      int ret = use_mutex ? _submit_mutex(prod->eng, cq, req)
+                          : pmap_engine_submit(prod->eng, cq, req);
+      int64_t elapsed = _submit_now_ns() - start;
+      if (ret != 0) {
+        idle[nidle++] = req; // Ring full
+        break;
+      }
+      prod->latency_ns[prod->samples++] = elapsed;
+      sent++;
+    }
+
+    int n = pmap_engine_reap(cq, done, SUBMIT_WINDOW,
+                             (nidle == SUBMIT_WINDOW) ? 0 : -1);
+    if (nidle == SUBMIT_WINDOW) {
+      sched_yield(); // Ring full and nothing of ours in it
+    }
+    for (int i = 0; i < n; i++) {
+      idle[nidle++] = done[i];
+    }
+    completed += n;
+  }
+
+  pmap_engine_cq_destroy(cq);
+  free(reqs);
+
+  return NULL;
+}
+
+static int _submit_cmp(const void *a, const void *b) {
+
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+  return (x < y) ? -1 : (x > y);
+}
+
+static void _submit_run(int producers, int total) {
+
+  pmap_ctx_t ctx;
+  pmap_engine_t *eng = NULL;
+  submit_producer_t prod[SUBMIT_MAX_PRODUCERS];
+  pthread_t consumer, threads[SUBMIT_MAX_PRODUCERS];
+  int per = total / producers;
+
+  memset(&ctx, 0x00, sizeof(ctx));
+  if (0 != posix_memalign((void **)&eng, PMAP_ENGINE_CACHELINE,
+                          sizeof(pmap_engine_t))) {
+    exit(1);
+  }
+  memset(eng, 0x00, sizeof(pmap_engine_t));
+  eng->ctx = &ctx;
+  eng->mask = SUBMIT_RING - 1;
+  eng->ring = calloc(SUBMIT_RING, sizeof(pmap_engine_slot_t));
+  if (NULL == eng->ring || _pmap_engine_fd_open(eng->fd) != 0) {
+    exit(1);
+  }
+  for (uint32_t i = 0; i < SUBMIT_RING; i++) {
+    eng->ring[i].seq = i;
+  }
+
+  pthread_create(&consumer, NULL, _submit_consumer, eng);
+
+  int64_t start = _submit_now_ns();
+  for (int i = 0; i < producers; i++) {
+    prod[i].eng = eng;
+    prod[i].count = per;
+    prod[i].samples = 0;
+    prod[i].latency_ns = malloc(per * sizeof(int64_t));
+    if (NULL == prod[i].latency_ns) {
+      exit(1);
+    }
+    pthread_create(&threads[i], NULL, _submit_producer, &prod[i]);
+  }
+  for (int i = 0; i < producers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  int64_t elapsed = _submit_now_ns() - start;
+
+  _store(&eng->stop, 1);
+  _pmap_engine_fd_signal(eng->fd);
+  pthread_join(consumer, NULL);
+
+  int64_t *all = malloc((size_t)per * producers * sizeof(int64_t));
+  int n = 0;
+  if (NULL == all) {
+    exit(1);
+  }
+  for (int i = 0; i < producers; i++) {
+    memcpy(all + n, prod[i].latency_ns, prod[i].samples * sizeof(int64_t));
+    n += prod[i].samples;
+    free(prod[i].latency_ns);
+  }
+  qsort(all, n, sizeof(int64_t), _submit_cmp);
+
+  printf("%-5s %2d producers %9.0f req/s  submit p50 %5lld ns  p99 %6lld ns  "
+         "p99.9 %8lld ns  max %9lld ns  wakeups %llu\n",
+         use_mutex ? "mutex" : "ring", producers, n / (elapsed / 1e9),
+         (long long)all[n / 2], (long long)all[(int64_t)n * 99 / 100],
+         (long long)all[(int64_t)n * 999 / 1000], (long long)all[n - 1],
+         (unsigned long long)eng->wakeups);
+
+  free(all);
+  _pmap_engine_fd_close(eng->fd);
+  free(eng->ring);
+  free(eng);
+}
+
+int main(int argc, char **argv) {
+
+  int total = (argc > 1) ? atoi(argv[1]) : 320000;
+
+  for (int producers = 1; producers <= SUBMIT_MAX_PRODUCERS; producers *= 2) {
+    for (use_mutex = 0; use_mutex < 2; use_mutex++) {
+      _submit_run(producers, total);
+    }
+  }
+
+  return 0;
+}
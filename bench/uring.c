@@ -0,0 +1,209 @@
+/*
+ *    uring.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+/**
+ * io_uring transport benchmark ('make bench', Linux only): maps ports on
+ * many NAT-PMP gateways of tests/mock_gateway.js (127.0.0.2 and up) with the
+ * async API, over poll and over io_uring. Reports the operations per second
+ * of a plain run, and the system calls per operation of a second run traced
+ * with ptrace. Only the mapping rounds are measured, not the discovery.
+ */
+
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "pmap_async.h"
+
+#define URING_PORT 3000
+#define URING_FDS 8192
+
+static int completed, succeeded;
+
+static void _uring_done(pmap_aop_t *op, void *arg) {
+
+  (void)arg;
+  completed++;
+  if (op->status == 0) {
+    succeeded++;
+  }
+}
+
+/**
+ * Run the event loop until no operation is pending.
+ */
+static void _uring_loop(pmap_ctx_t *ctx) {
+
+  static struct pollfd fds[URING_FDS];
+  int pending;
+
+  do {
+    int64_t deadline_ms;
+    int n = pmap_fds(ctx, fds, URING_FDS, &deadline_ms);
+    int64_t now = pmap_ut_now_ms();
+    int tmo = -1;
+    if (deadline_ms >= 0) {
+      tmo = (deadline_ms > now) ? (int)(deadline_ms - now) : 0;
+    }
+    poll(fds, n, tmo);
+    pending = pmap_process(ctx, fds, n, pmap_ut_now_ms());
+  } while (pending > 0);
+}
+
+static uint32_t _uring_gateway(int i) {
+
+  return htonl(0x7f000002 + i); // 127.0.0.2 and up
+}
+
+/**
+ * Discover `gateways` gateways, then map `ports` ports on each of them
+ * `rounds` times. With `mark`, SIGUSR1 is raised around the mapping rounds
+ * for the tracer.
+ *
+ * @return 0 on success, 1 if io_uring is not available.
+ */
+static int _uring_workload(int use_uring, int gateways, int rounds, int ports,
+                           int mark, int64_t *elapsed_ms) {
+
+  pmap_ctx_t *ctx = pmap_ctx_create();
+  pmap_field_t field;
+
+  if (NULL == ctx) {
+    return 1;
+  }
+  if (use_uring && pmap_async_uring(ctx, 1) != 0) {
+    pmap_ctx_destroy(ctx);
+    return 1;
+  }
+
+  for (int i = 0; i < gateways; i++) {
+    pmap_discover_async(ctx, _uring_gateway(i), _uring_done, NULL);
+  }
+  _uring_loop(ctx);
+
+  completed = succeeded = 0;
+  if (mark) {
+    raise(SIGUSR1);
+  }
+  int64_t start = pmap_ut_now_ms();
+  for (int r = 0; r < rounds; r++) {
+    for (int p = 0; p < ports; p++) {
+      for (int i = 0; i < gateways; i++) {
+        memset(&field, 0x00, sizeof(field));
+        field.gateway_ip = _uring_gateway(i);
+        field.internal_ip = inet_addr("127.0.0.1");
+        strcpy(field.protocol, "UDP");
+        field.internal_port = URING_PORT + p;
+        field.external_port = URING_PORT + p;
+        field.lifetime_sec = 60;
+        pmap_addport_async(ctx, &field, _uring_done, NULL);
+      }
+    }
+    _uring_loop(ctx);
+  }
+  *elapsed_ms = pmap_ut_now_ms() - start;
+  if (mark) {
+    raise(SIGUSR1);
+  }
+
+  pmap_ctx_destroy(ctx);
+  return 0;
+}
+
+/**
+ * Count the system calls a child makes between its two SIGUSR1.
+ *
+ * @return The count, -1 if the child could not be traced.
+ */
+static long _uring_syscalls(int use_uring, int gateways, int rounds,
+                            int ports) {
+
+  int status, sig = 0, counting = 0, entering = 1;
+  long count = 0;
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    int64_t elapsed_ms;
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
+    _exit(_uring_workload(use_uring, gateways, rounds, ports, 1,
+                          &elapsed_ms));
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+    return -1;
+  }
+  ptrace(PTRACE_SETOPTIONS, pid, NULL,
+         (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+
+  for (;;) {
+    if (ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig) < 0) {
+      return -1;
+    }
+    sig = 0;
+    if (waitpid(pid, &status, 0) < 0 || WIFEXITED(status) ||
+        WIFSIGNALED(status)) {
+      break;
+    }
+    if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+      count += (entering && counting);
+      entering = !entering;
+    } else if (WSTOPSIG(status) == SIGUSR1) {
+      counting = !counting;
+    } else {
+      sig = WSTOPSIG(status);
+    }
+  }
+
+  return count;
+}
+
+int main(int argc, char **argv) {
+
+  int gateways = (argc > 1) ? atoi(argv[1]) : 200;
+  int rounds = (argc > 2) ? atoi(argv[2]) : 4;
+  int ports = (argc > 3) ? atoi(argv[3]) : 4;
+  int ops = gateways * rounds * ports;
+
+  for (int use_uring = 0; use_uring < 2; use_uring++) {
+    int64_t elapsed_ms;
+    if (_uring_workload(use_uring, gateways, rounds, ports, 0, &elapsed_ms) !=
+        0) {
+      printf("io_uring: not available\n");
+      continue;
+    }
+    int ok = succeeded;
+    long syscalls = _uring_syscalls(use_uring, gateways, rounds, ports);
+    printf("%-8s %d gateways: %d/%d ok in %lld ms, %8.0f ops/s, "
+           "%.2f syscalls/op\n",
+           use_uring ? "io_uring" : "poll", gateways, ok, ops,
+           (long long)elapsed_ms, ops * 1000.0 / (elapsed_ms ? elapsed_ms : 1),
+           (syscalls < 0) ? -1.0 : (double)syscalls / ops);
+  }
+
+  return 0;
+}
@@ -42,12 +42,15 @@
 #include "xgetopt.h"
 #endif
 
+#include "pmap.h"
 #include "pmap_npmp.h"
+#include "pmap_pcp.h"
 #include "pmap_upnp.h"
 
 #define OP_PROTOCOL_NAT_PMP 1
 #define OP_PROTOCOL_UPNP 2
 #define OP_LIST 3
+#define OP_PROTOCOL_PCP 4
 
 static const char err_arg_missing[] = "Argument(s) missing !\n";
 int debug_level = 0; // NO_DEBUG;
@@ -64,6 +67,13 @@ int print_npmp_exip(int argc, char **argv);
 int addport_npmp(int argc, char **argv);
 int delport_npmp(int argc, char **argv);
 
+int addport_pcp(int argc, char **argv);
+int delport_pcp(int argc, char **argv);
+
+int print_auto_exip(int argc, char **argv);
+int addport_auto(int argc, char **argv);
+int delport_auto(int argc, char **argv);
+
 /* -------------------------------------------- */
 
 int main(int argc, char *argv[]) {
@@ -77,7 +87,7 @@ int main(int argc, char *argv[]) {
   ERROR_GOTO(ret != 0, "WSAStartup() failed", error);
 #endif
 
-  while ((ret = getopt(argc, argv, "adhpulev")) != EOF) {
+  while ((ret = getopt(argc, argv, "adhpculev")) != EOF) {
     switch (ret) {
 
     case 'p':
@@ -88,6 +98,10 @@ int main(int argc, char *argv[]) {
       operation = OP_PROTOCOL_UPNP;
       break;
 
+    case 'c':
+      operation = OP_PROTOCOL_PCP;
+      break;
+
     case 'a':
       action = 1; // Add port
       break;
@@ -158,6 +172,39 @@ int main(int argc, char *argv[]) {
       }
     }
 
+  } else if (operation == OP_PROTOCOL_PCP) {
+
+    if (action == 0) {
+      printf("-a or -d options should be specified\n");
+    } else if (action == 1) {
+      if (addport_pcp(argc, argv) != 0) {
+        usage(argv[0]);
+      }
+    } else if (action == 2) {
+      if (delport_pcp(argc, argv) != 0) {
+        usage(argv[0]);
+      }
+    } else if (action == 3) {
+      printf("PCP has no external address request, it is reported by -a\n");
+    }
+
+  } else if (action != 0) {
+
+    /* No protocol given, race NAT-PMP and UPnP */
+    if (action == 1) {
+      if (addport_auto(argc, argv) != 0) {
+        usage(argv[0]);
+      }
+    } else if (action == 2) {
+      if (delport_auto(argc, argv) != 0) {
+        usage(argv[0]);
+      }
+    } else if (action == 3) {
+      if (print_auto_exip(argc, argv) != 0) {
+        usage(argv[0]);
+      }
+    }
+
   } else {
     usage(argv[0]);
   }
@@ -177,25 +224,31 @@ error:
 /* -------------------------------------------- */
 
 void usage(char *progname) {
-  printf("usage: %s < -a | -d | -e > < -u | -p > <args>\n", progname);
+  printf("usage: %s < -a | -d | -e > [ -u | -p | -c ] <args>\n", progname);
   printf(""
          "  -a    Add port mapping\n"
          "        <args>: <external port> <my_IPv4> <gateway_IPv4> <protocol> "
          "<lifetime>\n"
          "  -d    Delete port mapping\n"
          "        <args>: <external port> <gateway_IPv4> <protocol>\n"
+         "        with -c: ... <protocol> <nonce> [<internal_IPv4>]\n"
          "  -e    Get external IP address\n"
          "        <args>: <gateway_IPv4>\n"
          "  -l    Print list of available IGDs (UPnP)\n"
          "  -p    Using NAT-PMP protocol for port mapping\n"
          "  -u    Using UPnP protocol for port mapping\n"
+         "  -c    Using PCP protocol for port mapping (falls back to "
+         "NAT-PMP)\n"
+         "        Without -u, -p or -c NAT-PMP and UPnP are tried at the same "
+         "time\n"
          "  -v    show request => response debug output\n"
          "  -h    show this help and exit\n"
          "Example 1: %s -l\n"
          "Example 2: %s -u -a 6568 192.168.1.7 192.168.1.1 TCP 7200\n"
          "Example 3: %s -u -d 6568 192.168.1.1 TCP\n"
-         "Example 4: %s -u -e 192.168.1.1\n",
-         progname, progname, progname, progname);
+         "Example 4: %s -u -e 192.168.1.1\n"
+         "Example 5: %s -c -d 6568 192.168.1.1 TCP <nonce> 192.168.1.7\n",
+         progname, progname, progname, progname, progname);
 }
 
 /* -------------------------------------------- */
@@ -388,7 +441,7 @@ int addport_npmp(int argc, char **argv) {
 
     printf("Add port mapping to [%s => %d] lifetime=%d secs%s\n", protocol,
            pfield.external_port, pfield.lifetime_sec,
-           (lifetime == 0) ? " (no expiration)" : "");
+           (pfield.lifetime_sec == 0) ? " (no expiration)" : "");
   } else {
     printf("Error adding port mapping, error code=%d [%s]\n", errno,
            error_desc);
@@ -430,3 +483,227 @@ int delport_npmp(int argc, char **argv) {
 
   return 0;
 }
+
+/* -------------------------------------------- */
+
+int addport_pcp(int argc, char **argv) {
+
+  int count = argc - optind;
+  if (count < 4) {
+    fprintf(stderr, err_arg_missing);
+    return 1;
+  }
+
+  int port = atoi(argv[optind]);
+  char *my_ip = argv[optind + 1];
+  char *gateway_ip = argv[optind + 2];
+  char *protocol = argv[optind + 3];
+  int lifetime = 0;
+  if (count == 5) {
+    lifetime = atoi(argv[optind + 4]);
+  }
+
+  int ret = 0;
+  char error_desc[64];
+  char nonce[2 * PCP_NONCE_LEN + 1];
+  pmap_field_t pfield;
+  memset(&pfield, 0x00, sizeof(pfield));
+  pfield.external_port = port;
+  pfield.internal_port = port;
+  pfield.lifetime_sec = lifetime;
+
+  pfield.internal_ip = inet_addr(my_ip);
+  pfield.gateway_ip = inet_addr(gateway_ip);
+  strncpy(pfield.protocol, protocol, sizeof(pfield.protocol));
+
+  printf("Request...\n");
+  if ((ret = pmap_pcp_addport(&pfield, error_desc, sizeof(error_desc))) == 0) {
+
+    printf("Add port mapping to [%s => %d] lifetime=%d secs%s\n", protocol,
+           pfield.external_port, pfield.lifetime_sec,
+           (lifetime == 0) ? " (no expiration)" : "");
+    for (int i = 0; i < PCP_NONCE_LEN; i++) {
+      sprintf(&nonce[2 * i], "%02x", pfield.nonce[i]);
+    }
+    printf("nonce=%s (needed to delete it)\n", nonce);
+  } else {
+    printf("Error adding port mapping, error code=%d [%s]\n", errno,
+           error_desc);
+  }
+
+  return 0;
+}
+
+/* -------------------------------------------- */
+
+int delport_pcp(int argc, char **argv) {
+
+  int count = argc - optind;
+  if (count < 3) {
+    fprintf(stderr, err_arg_missing);
+    return 1;
+  }
+  int port = atoi(argv[optind]);
+  char *gateway_ip = argv[optind + 1];
+  char *protocol = argv[optind + 2];
+
+  int ret = 0;
+  char error_desc[64];
+  pmap_field_t pfield;
+  memset(&pfield, 0x00, sizeof(pfield));
+  pfield.external_port = port;
+  pfield.internal_port = port;
+  pfield.internal_ip = INADDR_ANY;
+  pfield.gateway_ip = inet_addr(gateway_ip);
+
+  strncpy(pfield.protocol, protocol, sizeof(pfield.protocol));
+
+  /* Nonce printed by -a, and the host a third party mapping was made for */
+  if (count >= 4) {
+    const char *hex = argv[optind + 3];
+    int ok = (strlen(hex) == 2 * PCP_NONCE_LEN);
+    for (int i = 0; ok && i < PCP_NONCE_LEN; i++) {
+      ok = (sscanf(&hex[2 * i], "%2hhx", &pfield.nonce[i]) == 1);
+    }
+    if (!ok) {
+      fprintf(stderr, "Nonce must be %d hex digits\n", 2 * PCP_NONCE_LEN);
+      return 1;
+    }
+  }
+  if (count >= 5) {
+    pfield.internal_ip = inet_addr(argv[optind + 4]);
+  }
+
+  printf("Request...\n");
+  if ((ret = pmap_pcp_delport(&pfield, error_desc, sizeof(error_desc))) == 0) {
+
+    printf("Delete port mapping to [%s => %d]\n", protocol, port);
+  } else {
+    printf("Error deleting port mapping, error code=%d [%s]\n", errno,
+           error_desc);
+  }
+
+  return 0;
+}
+
+/* -------------------------------------------- */
+
+static const char *proto_names[] = {"none", "NAT-PMP", "UPnP"};
+
+int print_auto_exip(int argc, char **argv) {
+
+  int count = argc - optind;
+  if (count < 1) {
+    fprintf(stderr, err_arg_missing);
+    return 1;
+  }
+
+  char *gateway_ip = argv[optind];
+
+  int ret = 0;
+  char external_ip[16];
+  char error_desc[64];
+  pmap_field_t pfield;
+  pfield.gateway_ip = inet_addr(gateway_ip);
+
+  pmap_ctx_t *ctx = pmap_ctx_create();
+  printf("Request...\n");
+  if ((ret = pmap_getexip(ctx, &pfield, external_ip, sizeof(external_ip),
+                          error_desc, sizeof(error_desc))) == 0) {
+    printf("External IP=[%s] (%s)\n", external_ip,
+           proto_names[pmap_ctx_gateway(ctx, pfield.gateway_ip)->protocol]);
+  } else {
+    printf("Error getting external IP, error code=%d [%s]\n", errno,
+           error_desc);
+  }
+  pmap_ctx_destroy(ctx);
+
+  return 0;
+}
+
+/* -------------------------------------------- */
+
+int addport_auto(int argc, char **argv) {
+
+  int count = argc - optind;
+  if (count < 4) {
+    fprintf(stderr, err_arg_missing);
+    return 1;
+  }
+
+  int port = atoi(argv[optind]);
+  char *my_ip = argv[optind + 1];
+  char *gateway_ip = argv[optind + 2];
+  char *protocol = argv[optind + 3];
+  int lifetime = 0;
+  if (count == 5) {
+    lifetime = atoi(argv[optind + 4]);
+  }
+
+  int ret = 0;
+  char error_desc[64];
+  pmap_field_t pfield;
+  pfield.external_port = port;
+  pfield.internal_port = port;
+  pfield.lifetime_sec = lifetime;
+
+  pfield.internal_ip = inet_addr(my_ip);
+  pfield.gateway_ip = inet_addr(gateway_ip);
+  strncpy(pfield.protocol, protocol, sizeof(pfield.protocol));
+
+  pmap_ctx_t *ctx = pmap_ctx_create();
+  printf("Request...\n");
+  if ((ret = pmap_addport(ctx, &pfield, error_desc, sizeof(error_desc))) ==
+      0) {
+
+    printf("Add port mapping to [%s => %d] lifetime=%d secs%s (%s)\n",
+           protocol, pfield.external_port, pfield.lifetime_sec,
+           (pfield.lifetime_sec == 0) ? " (no expiration)" : "",
+           proto_names[pmap_ctx_gateway(ctx, pfield.gateway_ip)->protocol]);
+  } else {
+    printf("Error adding port mapping, error code=%d [%s]\n", errno,
+           error_desc);
+  }
+  pmap_ctx_destroy(ctx);
+
+  return 0;
+}
+
+/* -------------------------------------------- */
+
+int delport_auto(int argc, char **argv) {
+
+  int count = argc - optind;
+  if (count < 3) {
+    fprintf(stderr, err_arg_missing);
+    return 1;
+  }
+  int port = atoi(argv[optind]);
+  char *gateway_ip = argv[optind + 1];
+  char *protocol = argv[optind + 2];
+
+  int ret = 0;
+  char error_desc[64];
+  pmap_field_t pfield;
+  pfield.external_port = port;
+  pfield.internal_port = port;
+  pfield.internal_ip = INADDR_ANY;
+  pfield.gateway_ip = inet_addr(gateway_ip);
+
+  strncpy(pfield.protocol, protocol, sizeof(pfield.protocol));
+
+  pmap_ctx_t *ctx = pmap_ctx_create();
+  printf("Request...\n");
+  if ((ret = pmap_delport(ctx, &pfield, error_desc, sizeof(error_desc))) ==
+      0) {
+
+    printf("Delete port mapping to [%s => %d] (%s)\n", protocol, port,
+           proto_names[pmap_ctx_gateway(ctx, pfield.gateway_ip)->protocol]);
+  } else {
+    printf("Error deleting port mapping, error code=%d [%s]\n", errno,
+           error_desc);
+  }
+  pmap_ctx_destroy(ctx);
+
+  return 0;
+}
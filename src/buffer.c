@@ -119,6 +119,37 @@ int pbfr_append(pbuffer_t *pbfr, pbuffer_t *pbfr_src) {
   return pbfr_src->offset;
 }
 
+/**
+ * Make sure a pbuffer_t object can hold at least `size` bytes.
+ *
+ * The buffer is grown (at least doubled) if it is smaller, its content and
+ * offset are kept and the new space is zeroed.
+ *
+ * @param pbfr A pointer to a pbuffer_t object.
+ * @param size The number of bytes needed.
+ * @return 0 on success, 1 if memory allocation fails (errno is set to ENOMEM).
+ */
+int pbfr_reserve(pbuffer_t *pbfr, int size) {
+
+  if (size <= pbfr->size) {
+    return 0;
+  }
+
+  int new_size = (pbfr->size * 2 > size) ? pbfr->size * 2 : size;
+  char *buffer = realloc(pbfr->buffer, new_size);
+  if (NULL == buffer) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return 1;
+  }
+
+  memset(buffer + pbfr->size, 0x00, new_size - pbfr->size);
+  pbfr->buffer = buffer;
+  pbfr->size = new_size;
+
+  return 0;
+}
+
 /**
  * Destroy a pbuffer_t object and release its associated memory.
  *
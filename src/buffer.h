@@ -37,6 +37,7 @@ typedef struct pbuffer_t_ {
 pbuffer_t *pbfr_create(int size);
 int pbfr_add(pbuffer_t *pbfr, const char *format, ...);
 int pbfr_append(pbuffer_t *pbfr, pbuffer_t *pbfr_src);
+int pbfr_reserve(pbuffer_t *pbfr, int size);
 void pbfr_destroy(pbuffer_t *pbfr);
 
 #endif // _BUFFER_H
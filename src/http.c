@@ -26,10 +26,13 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -39,8 +42,6 @@
 #include "pmap_debug.h"
 #include "util.h"
 
-extern uint8_t pmap_debug;
-
 /* -------------------------------------------- */
 
 /**
@@ -91,12 +92,13 @@ pbuffer_t *pmap_http_create(const char *method, const char *hostname, int port,
  *
  * @param hostname The hostname or IP address of the remote host.
  * @param port The port number to connect to on the remote host.
+ * @param tmo Timeouts to use (`connect_ms`), NULL for the defaults.
  * @return The socket file descriptor if the connection is established, or -1 on
  * error or timeout.
  */
-int pmap_http_connect(const char *hostname, int port) {
+int pmap_http_connect(const char *hostname, int port, const pmap_tmo_t *tmo) {
 
-  struct hostent *server;
+  struct addrinfo hints, *server;
   struct sockaddr_in server_addr;
   int sockfd;
   fd_set fdset;
@@ -110,19 +112,20 @@ int pmap_http_connect(const char *hostname, int port) {
     return -1;
   }
 
-  // Get server information by hostname
-  server = gethostbyname(hostname);
-  if (server == NULL) {
-    PMAP_DEBUG_ERROR("Host not found");
+  // Get server information by hostname (getaddrinfo is re-entrant)
+  memset(&hints, 0x00, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((ret = getaddrinfo(hostname, NULL, &hints, &server)) != 0) {
+    PMAP_DEBUG_ERROR("Host not found %s", gai_strerror(ret));
+    close(sockfd);
     return -1;
   }
 
   // Initialize the server address structure
-  bzero((char *)&server_addr, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  bcopy((char *)server->h_addr, (char *)&server_addr.sin_addr.s_addr,
-        server->h_length);
+  memcpy(&server_addr, server->ai_addr, sizeof(server_addr));
   server_addr.sin_port = htons(port);
+  freeaddrinfo(server);
 
   fcntl(sockfd, F_SETFL, O_NONBLOCK);
 
@@ -134,9 +137,9 @@ int pmap_http_connect(const char *hostname, int port) {
 
     FD_ZERO(&fdset);
     FD_SET(sockfd, &fdset);
-    tv.tv_sec = PMAP_DEFAULT_WAIT_TIMEOUT; /* PMAP_DEFAULT_WAIT_TIMEOUT in
-                                              second timeout */
-    tv.tv_usec = 0;
+    int wait_ms = (NULL != tmo) ? tmo->connect_ms : PMAP_TMO_CONNECT_DEF;
+    tv.tv_sec = wait_ms / 1000;
+    tv.tv_usec = (wait_ms % 1000) * 1000;
 
     int ret = select(sockfd + 1, NULL, &fdset, NULL, &tv);
     if (ret > 0) {
@@ -182,17 +185,23 @@ int pmap_http_connect(const char *hostname, int port) {
  * @param pbfr A pbuffer_t object containing the HTTP request to be sent.
  * @param http_status A pointer to an integer where the HTTP status code will be
  * stored.
- * @return A pbuffer_t object containing the HTTP response, or NULL on error.
+ * @param tmo Timeouts to use (`connect_ms` and `response_ms`, the longest
+ * silence accepted while reading the response), NULL for the defaults.
+ * @return A pbuffer_t object containing the HTTP response, or NULL on error
+ * (caller should check errno value, ETIMEDOUT if the response did not come).
  * The caller is responsible for freeing the memory allocated for the pbuffer_t
  * object by calling 'pbfr_destroy' function.
  */
 pbuffer_t *pmap_http_req(const char *hostname, int port, pbuffer_t *pbfr,
-                         int *http_status) {
+                         int *http_status, const pmap_tmo_t *tmo) {
 
   int totall_bytes_received = 0;
   int remain_buffer_len = 0;
+  int status_code = 0, err = 0;
+
+  int wait_ms = (NULL != tmo) ? tmo->response_ms : PMAP_TMO_RESPONSE_DEF;
 
-  int sockfd = pmap_http_connect(hostname, port);
+  int sockfd = pmap_http_connect(hostname, port, tmo);
   if (sockfd == -1) {
     PMAP_DEBUG_ERROR("Error connection %s", strerror(errno));
     return NULL;
@@ -200,14 +209,17 @@ pbuffer_t *pmap_http_req(const char *hostname, int port, pbuffer_t *pbfr,
 
   PMAP_DEBUG_LOG("REQUEST: =>>>\n%s\n", pbfr->buffer);
 
-  if (pmap_debug) {
+  if (PMAP_DEBUG_DUMP()) {
     PMAP_RUNTIME_LOG("REQUEST: =>>>\n%s\n", pbfr->buffer);
   }
 
   // Send the request
   int n = write(sockfd, pbfr->buffer, pbfr->offset);
   if (n < 0) {
-    PMAP_DEBUG_ERROR("write() %s", strerror(errno));
+    err = errno;
+    PMAP_DEBUG_ERROR("write() %s", strerror(err));
+    close(sockfd);
+    errno = err;
     return NULL;
   }
 
@@ -216,6 +228,11 @@ pbuffer_t *pmap_http_req(const char *hostname, int port, pbuffer_t *pbfr,
   FD_SET(sockfd, &read_fds);
 
   pbuffer_t *pbfr_recv = pbfr_create(PBUFFER_DEFLEN);
+  if (NULL == pbfr_recv) {
+    close(sockfd);
+    errno = ENOMEM;
+    return NULL;
+  }
 
   remain_buffer_len = pbfr_recv->size;
 
@@ -226,17 +243,19 @@ pbuffer_t *pmap_http_req(const char *hostname, int port, pbuffer_t *pbfr,
   while (1) {
 
     struct timeval timeout;
-    timeout.tv_sec = 2;       // 1 sec
-    timeout.tv_usec = 100000; // 100 milliseconds
+    timeout.tv_sec = wait_ms / 1000;
+    timeout.tv_usec = (wait_ms % 1000) * 1000;
 
     int ready = select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
 
     if (ready == -1) {
-      PMAP_DEBUG_ERROR("select() %s", strerror(errno));
+      err = errno;
+      PMAP_DEBUG_ERROR("select() %s", strerror(err));
       break;
     } else if (ready == 0) {
       // No data available, continue or perform other tasks
       PMAP_DEBUG_LOG("No data available.\n");
+      err = ETIMEDOUT;
       break;
     } else {
       if (FD_ISSET(sockfd, &read_fds)) {
@@ -249,16 +268,15 @@ pbuffer_t *pmap_http_req(const char *hostname, int port, pbuffer_t *pbfr,
         if (bytes_received <= 0) {
           // Connection closed
           char status[16];
+          err = (bytes_received < 0) ? errno : 0;
           pbfr_recv->buffer[totall_bytes_received] = '\0';
           if ((pmap_ut_substr(" ", " ", pbfr_recv->buffer, status,
                               sizeof(status))) == 0) {
-            if (http_status != NULL) {
-              *http_status = atoi(status);
-            }
+            status_code = atoi(status);
           }
 
           PMAP_DEBUG_LOG("RESPONSE: =>>>\n%s\n", pbfr_recv->buffer);
-          if (pmap_debug) {
+          if (PMAP_DEBUG_DUMP()) {
             PMAP_RUNTIME_LOG("RESPONSE: =>>>\n%s\n", pbfr_recv->buffer);
           }
 
@@ -272,15 +290,78 @@ pbuffer_t *pmap_http_req(const char *hostname, int port, pbuffer_t *pbfr,
     }
   }
 
-  /* Release buffer */
-  // pbfr_destroy(pbfr_recv);
-
   /* Close socket connection */
   close(sockfd);
 
+  /* Timed out or reset before the response came */
+  if (status_code == 0) {
+    pbfr_destroy(pbfr_recv);
+    errno = (err != 0) ? err : ECONNRESET;
+    return NULL;
+  }
+
+  if (http_status != NULL) {
+    *http_status = status_code;
+  }
+
   return pbfr_recv;
 }
 
+/**
+ * Build a POST request, see 'pmap_http_post'.
+ */
+static pbuffer_t *_pmap_http_post_create(const char *hostname, int port,
+                                         char *path, char *header,
+                                         pbuffer_t *pbfr_body,
+                                         bool keep_alive) {
+
+  pbuffer_t *pbfr = pmap_http_create("POST", hostname, port, path);
+  if (NULL != pbfr) {
+
+    if (NULL != header) {
+      pbfr_add(pbfr, header);
+      pbfr_add(pbfr, "Content-Type: text/xml; charset=\"utf-8\"\r\n");
+    }
+    if (NULL != pbfr_body) {
+      pbfr_add(pbfr, "Content-Length: %d\r\n", pbfr_body->offset);
+    }
+    if (keep_alive) {
+      pbfr_add(pbfr, "Connection: keep-alive\r\n");
+    }
+
+    pbfr_add(pbfr, "\r\n");
+
+    if (NULL != pbfr_body) {
+      if (pbfr_reserve(pbfr, pbfr->offset + pbfr_body->offset + 1) != 0) {
+        pbfr_destroy(pbfr);
+        return NULL;
+      }
+      pbfr_append(pbfr, pbfr_body);
+    }
+  }
+
+  return pbfr;
+}
+
+/**
+ * Build a POST request without sending it, the server may close the
+ * connection after the response.
+ *
+ * @param hostname The hostname or IP address of the remote host.
+ * @param port The port number of the remote host.
+ * @param path The URL path for the POST request.
+ * @param header Custom headers to be included in the request.
+ * @param pbfr_body The request body, or NULL if there is none.
+ * @return The request, or NULL on error. The caller is responsible for
+ * freeing it by calling 'pbfr_destroy' function.
+ */
+pbuffer_t *pmap_http_post_create(const char *hostname, int port, char *path,
+                                 char *header, pbuffer_t *pbfr_body) {
+
+  return _pmap_http_post_create(hostname, port, path, header, pbfr_body,
+                                false);
+}
+
 /**
  * Send an HTTP POST request to a remote host and receive the response.
  *
@@ -298,34 +379,20 @@ pbuffer_t *pmap_http_req(const char *hostname, int port, pbuffer_t *pbfr,
  * there is no body.
  * @param http_status A pointer to an integer where the HTTP status code will be
  * stored.
+ * @param tmo Timeouts to use, NULL for the defaults.
  * @return A pbuffer_t object containing the HTTP response, or NULL on error.
  * The caller is responsible for managing and deallocating the memory by calling
  * 'pbfr_destroy' function.
  */
 pbuffer_t *pmap_http_post(const char *hostname, int port, char *path,
-                          char *header, pbuffer_t *pbfr_body,
-                          int *http_status) {
+                          char *header, pbuffer_t *pbfr_body, int *http_status,
+                          const pmap_tmo_t *tmo) {
 
   pbuffer_t *pbfr_recv = NULL;
-  pbuffer_t *pbfr = pmap_http_create("POST", hostname, port, path);
+  pbuffer_t *pbfr = _pmap_http_post_create(hostname, port, path, header,
+                                           pbfr_body, false);
   if (NULL != pbfr) {
-
-    if (NULL != header) {
-      pbfr_add(pbfr, header);
-      pbfr_add(pbfr, "Content-Type: text/xml; charset=\"utf-8\"\r\n");
-    }
-    if (NULL != pbfr_body) {
-      pbfr_add(pbfr, "Content-Length: %d\r\n", pbfr_body->offset);
-    }
-
-    pbfr_add(pbfr, "\r\n");
-
-    if (NULL != pbfr_body) {
-      pbfr_append(pbfr, pbfr_body);
-    }
-
-    pbfr_recv = pmap_http_req(hostname, port, pbfr, http_status);
-
+    pbfr_recv = pmap_http_req(hostname, port, pbfr, http_status, tmo);
     pbfr_destroy(pbfr);
   }
 
@@ -346,20 +413,796 @@ pbuffer_t *pmap_http_post(const char *hostname, int port, char *path,
  * @param path The URL path for the GET request.
  * @param http_status A pointer to an integer where the HTTP status code will be
  * stored.
+ * @param tmo Timeouts to use, NULL for the defaults.
  * @return A pbuffer_t object containing the HTTP response, or NULL on error.
  * The caller is responsible for managing and deallocating the memory by calling
  * 'pbfr_destroy' function.
  */
 pbuffer_t *pmap_http_get(const char *hostname, int port, char *path,
-                         int *http_status) {
+                         int *http_status, const pmap_tmo_t *tmo) {
 
   pbuffer_t *pbfr_recv = NULL;
   pbuffer_t *pbfr = pmap_http_create("GET", hostname, port, path);
   if (NULL != pbfr) {
     pbfr_add(pbfr, "\r\n");
-    pbfr_recv = pmap_http_req(hostname, port, pbfr, http_status);
+    pbfr_recv = pmap_http_req(hostname, port, pbfr, http_status, tmo);
+    pbfr_destroy(pbfr);
+  }
+
+  return pbfr_recv;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Create a persistent (keep-alive) connection to a host. Nothing is sent
+ * before the first request, a connection closed by the server is opened
+ * again by the next request.
+ *
+ * @param hostname The hostname or IP address of the remote host.
+ * @param port The port number to connect to on the remote host.
+ * @param tmo Timeouts to use, NULL for the defaults.
+ * @return The connection, or NULL if memory allocation fails. The caller is
+ * responsible for freeing it by calling 'pmap_http_conn_destroy' function.
+ */
+pmap_http_conn_t *pmap_http_conn_create(const char *hostname, int port,
+                                        const pmap_tmo_t *tmo) {
+
+  pmap_http_conn_t *conn = calloc(1, sizeof(pmap_http_conn_t));
+  if (NULL == conn) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  conn->fd = -1;
+  conn->port = port;
+  strncpy(conn->host, hostname, sizeof(conn->host) - 1);
+  if (NULL != tmo) {
+    conn->tmo = *tmo;
+  } else {
+    conn->tmo.connect_ms = PMAP_TMO_CONNECT_DEF;
+    conn->tmo.response_ms = PMAP_TMO_RESPONSE_DEF;
+  }
+
+  conn->in = pbfr_create(PBUFFER_DEFLEN);
+  if (NULL == conn->in) {
+    free(conn);
+    return NULL;
+  }
+
+  return conn;
+}
+
+/**
+ * Close the socket of a connection and drop unread data, the connection
+ * object stays usable.
+ */
+static void _pmap_http_conn_reset(pmap_http_conn_t *conn) {
+
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  conn->in->offset = 0;
+  conn->requests = 0;
+}
+
+/**
+ * Close and free a connection.
+ *
+ * @param conn The connection, NULL is allowed.
+ */
+void pmap_http_conn_destroy(pmap_http_conn_t *conn) {
+
+  if (NULL != conn) {
+    _pmap_http_conn_reset(conn);
+    pbfr_destroy(conn->in);
+    free(conn);
+  }
+}
+
+/**
+ * Wait for the socket and write all of a buffer.
+ */
+static int _pmap_http_write_all(pmap_http_conn_t *conn, const char *data,
+                                int len) {
+
+  while (len > 0) {
+    ssize_t n = send(conn->fd, data, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return 1;
+      }
+
+      fd_set fdset;
+      struct timeval tv;
+      FD_ZERO(&fdset);
+      FD_SET(conn->fd, &fdset);
+      tv.tv_sec = conn->tmo.response_ms / 1000;
+      tv.tv_usec = (conn->tmo.response_ms % 1000) * 1000;
+      if (select(conn->fd + 1, NULL, &fdset, NULL, &tv) <= 0) {
+        errno = ETIMEDOUT;
+        return 1;
+      }
+      continue;
+    }
+    data += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/**
+ * Send a request, connecting first if needed. The response must be read with
+ * 'pmap_http_conn_recv', several requests may be sent before (pipelining).
+ *
+ * @param conn The connection.
+ * @param pbfr The request.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_http_conn_send(pmap_http_conn_t *conn, pbuffer_t *pbfr) {
+
+  if (conn->fd < 0) {
+    conn->fd = pmap_http_connect(conn->host, conn->port, &conn->tmo);
+    if (conn->fd < 0) {
+      return 1; // caller should check errno value
+    }
+  }
+
+  PMAP_DEBUG_LOG("REQUEST: =>>>\n%s\n", pbfr->buffer);
+  if (PMAP_DEBUG_DUMP()) {
+    PMAP_RUNTIME_LOG("REQUEST: =>>>\n%s\n", pbfr->buffer);
+  }
+
+  if (_pmap_http_write_all(conn, pbfr->buffer, pbfr->offset) != 0) {
+    PMAP_DEBUG_ERROR("send() %s", strerror(errno));
+    _pmap_http_conn_reset(conn);
+    return 1; // caller should check errno value
+  }
+  conn->requests++;
+
+  return 0;
+}
+
+/**
+ * Receive more bytes into the input buffer.
+ *
+ * @return Number of bytes received, 0 if the server closed the connection,
+ * -1 on error or timeout (errno is set).
+ */
+static int _pmap_http_fill(pmap_http_conn_t *conn) {
+
+  fd_set fdset;
+  struct timeval tv;
+
+  if (pbfr_reserve(conn->in, conn->in->offset + PBUFFER_DEFLEN) != 0) {
+    return -1;
+  }
+
+  FD_ZERO(&fdset);
+  FD_SET(conn->fd, &fdset);
+  tv.tv_sec = conn->tmo.response_ms / 1000;
+  tv.tv_usec = (conn->tmo.response_ms % 1000) * 1000;
+
+  int ready = select(conn->fd + 1, &fdset, NULL, NULL, &tv);
+  if (ready <= 0) {
+    if (ready == 0) {
+      errno = ETIMEDOUT;
+    }
+    return -1;
+  }
+
+  ssize_t n = recv(conn->fd, conn->in->buffer + conn->in->offset,
+                   conn->in->size - conn->in->offset - 1, 0);
+  if (n < 0) {
+    return -1;
+  }
+  conn->in->offset += n;
+
+  return n;
+}
+
+/**
+ * Offset of `str` in the input buffer at or after `from`, -1 if not there.
+ */
+static int _pmap_http_find(pmap_http_conn_t *conn, int from, const char *str) {
+
+  int len = strlen(str);
+
+  for (int i = from; i + len <= conn->in->offset; i++) {
+    if (memcmp(conn->in->buffer + i, str, len) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Wait until the input buffer holds at least `len` bytes.
+ */
+static int _pmap_http_need(pmap_http_conn_t *conn, int len) {
+
+  while (conn->in->offset < len) {
+    int n = _pmap_http_fill(conn);
+    if (n <= 0) {
+      if (n == 0) {
+        errno = ECONNRESET;
+      }
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Get a header value (case-insensitive name) from the response head.
+ */
+static int _pmap_http_header(const char *head, int head_len, const char *name,
+                             char *value, int size) {
+
+  int len = strlen(name);
+
+  for (const char *line = head; line < head + head_len;) {
+    const char *end = strstr(line, "\r\n");
+    if (NULL == end || end == line) {
+      break;
+    }
+    if (strncasecmp(line, name, len) == 0 && line[len] == ':') {
+      const char *v = line + len + 1;
+      while (*v == ' ' || *v == '\t') {
+        v++;
+      }
+      int n = (end - v < size - 1) ? end - v : size - 1;
+      memcpy(value, v, n);
+      value[n] = '\0';
+      return 0;
+    }
+    line = end + 2;
+  }
+
+  return 1;
+}
+
+/**
+ * Drop `len` bytes from the front of the input buffer.
+ */
+static void _pmap_http_consume(pmap_http_conn_t *conn, int len) {
+
+  memmove(conn->in->buffer, conn->in->buffer + len, conn->in->offset - len);
+  conn->in->offset -= len;
+}
+
+/**
+ * Pass `len` body bytes from the input buffer to the sink, receiving more as
+ * needed.
+ */
+static int _pmap_http_pass(pmap_http_conn_t *conn, int len,
+                           pmap_http_sink_t sink, void *arg) {
+
+  while (len > 0) {
+    if (conn->in->offset == 0 && _pmap_http_need(conn, 1) != 0) {
+      return 1;
+    }
+    int n = (conn->in->offset < len) ? conn->in->offset : len;
+    if (sink(conn->in->buffer, n, arg) != 0) {
+      return 1;
+    }
+    _pmap_http_consume(conn, n);
+    len -= n;
+  }
+
+  return 0;
+}
+
+/**
+ * Receive one response and pass its body to a sink while it arrives, so a
+ * large body is never held in memory. The body is delimited by
+ * Content-Length or chunked transfer encoding (decoded), otherwise by the
+ * end of the connection. Bytes of the next response stay in the connection.
+ *
+ * @param conn The connection.
+ * @param http_status A pointer to an integer where the HTTP status code will
+ * be stored.
+ * @param head If not NULL the response head is appended to it.
+ * @param sink Called with each piece of the body, a non zero return value
+ * aborts the response (errno should be set).
+ * @param arg Passed to `sink`.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_http_conn_recv_sink(pmap_http_conn_t *conn, int *http_status,
+                             pbuffer_t *head, pmap_http_sink_t sink,
+                             void *arg) {
+
+  char value[32];
+  int head_len, content_length = -1;
+  bool chunked = false, close_conn = false;
+
+  *http_status = 0;
+
+  if (conn->fd < 0) {
+    errno = ENOTCONN;
+    return 1;
+  }
+
+  /* Head */
+  while ((head_len = _pmap_http_find(conn, 0, "\r\n\r\n")) < 0) {
+    if (_pmap_http_need(conn, conn->in->offset + 1) != 0) {
+      goto error;
+    }
+  }
+  head_len += 4;
+  conn->in->buffer[conn->in->offset] = '\0';
+
+  int minor = 1;
+  if (sscanf(conn->in->buffer, "HTTP/1.%d %d", &minor, http_status) != 2) {
+    errno = EPROTO;
+    goto error;
+  }
+  if (_pmap_http_header(conn->in->buffer, head_len, "Content-Length", value,
+                        sizeof(value)) == 0) {
+    content_length = atoi(value);
+  }
+  if (_pmap_http_header(conn->in->buffer, head_len, "Transfer-Encoding",
+                        value, sizeof(value)) == 0 &&
+      strcasecmp(value, "chunked") == 0) {
+    chunked = true;
+  }
+  if (_pmap_http_header(conn->in->buffer, head_len, "Connection", value,
+                        sizeof(value)) == 0) {
+    close_conn = (strcasecmp(value, "close") == 0);
+  } else {
+    close_conn = (minor == 0);
+  }
+
+  PMAP_DEBUG_LOG("RESPONSE: =>>>\n%.*s\n", head_len, conn->in->buffer);
+  if (PMAP_DEBUG_DUMP()) {
+    PMAP_RUNTIME_LOG("RESPONSE: =>>>\n%.*s\n", head_len, conn->in->buffer);
+  }
+
+  if (NULL != head) {
+    if (pbfr_reserve(head, head->offset + head_len + 1) != 0) {
+      goto error;
+    }
+    memcpy(head->buffer + head->offset, conn->in->buffer, head_len);
+    head->offset += head_len;
+  }
+  _pmap_http_consume(conn, head_len);
+
+  /* Body */
+  if (chunked) {
+    while (1) {
+      int eol;
+      while ((eol = _pmap_http_find(conn, 0, "\r\n")) < 0) {
+        if (_pmap_http_need(conn, conn->in->offset + 1) != 0) {
+          goto error;
+        }
+      }
+      int chunk = (int)strtol(conn->in->buffer, NULL, 16);
+      _pmap_http_consume(conn, eol + 2);
+      if (chunk <= 0) {
+        /* Trailers end with an empty line */
+        while ((eol = _pmap_http_find(conn, 0, "\r\n")) != 0) {
+          if (eol > 0) {
+            _pmap_http_consume(conn, eol + 2);
+          } else if (_pmap_http_need(conn, conn->in->offset + 1) != 0) {
+            goto error;
+          }
+        }
+        _pmap_http_consume(conn, 2);
+        break;
+      }
+      if (_pmap_http_pass(conn, chunk, sink, arg) != 0 ||
+          _pmap_http_need(conn, 2) != 0) {
+        goto error;
+      }
+      _pmap_http_consume(conn, 2);
+    }
+  } else if (content_length >= 0) {
+    if (_pmap_http_pass(conn, content_length, sink, arg) != 0) {
+      goto error;
+    }
+  } else {
+    int n;
+    do {
+      if (conn->in->offset > 0) {
+        if (sink(conn->in->buffer, conn->in->offset, arg) != 0) {
+          goto error;
+        }
+        conn->in->offset = 0;
+      }
+    } while ((n = _pmap_http_fill(conn)) > 0);
+    if (n < 0) {
+      goto error;
+    }
+    close_conn = true;
+  }
+
+  if (close_conn) {
+    _pmap_http_conn_reset(conn);
+  }
+
+  return 0;
+
+error:
+  PMAP_DEBUG_ERROR("Response %s", strerror(errno));
+  int err = errno;
+  _pmap_http_conn_reset(conn);
+  errno = err;
+
+  return 1;
+}
+
+/**
+ * Sink of 'pmap_http_conn_recv', appends the body to a buffer.
+ */
+static int _pmap_http_sink_pbfr(const char *data, int len, void *arg) {
+
+  pbuffer_t *pbfr = (pbuffer_t *)arg;
+
+  if (pbfr_reserve(pbfr, pbfr->offset + len + 1) != 0) {
+    return 1;
+  }
+  memcpy(pbfr->buffer + pbfr->offset, data, len);
+  pbfr->offset += len;
+
+  return 0;
+}
+
+/**
+ * Terminate a response received by '_pmap_http_sink_pbfr' and log its body.
+ */
+static void _pmap_http_log_body(pbuffer_t *pbfr_recv) {
+
+  pbfr_recv->buffer[pbfr_recv->offset] = '\0';
+
+  char *body = strstr(pbfr_recv->buffer, "\r\n\r\n");
+  body = (NULL != body) ? body + 4 : pbfr_recv->buffer;
+
+  PMAP_DEBUG_LOG("%s\n", body);
+  if (PMAP_DEBUG_DUMP()) {
+    PMAP_RUNTIME_LOG("%s\n", body);
+  }
+}
+
+/**
+ * Receive one response, see 'pmap_http_conn_recv_sink'.
+ *
+ * @param conn The connection.
+ * @param http_status A pointer to an integer where the HTTP status code will
+ * be stored.
+ * @return The response (head and decoded body), or NULL on error (caller
+ * should check errno value). The caller is responsible for freeing it by
+ * calling 'pbfr_destroy' function.
+ */
+pbuffer_t *pmap_http_conn_recv(pmap_http_conn_t *conn, int *http_status) {
+
+  pbuffer_t *pbfr_recv = pbfr_create(PBUFFER_DEFLEN);
+  if (NULL == pbfr_recv) {
+    return NULL;
+  }
+
+  if (pmap_http_conn_recv_sink(conn, http_status, pbfr_recv,
+                               _pmap_http_sink_pbfr, pbfr_recv) != 0) {
+    pbfr_destroy(pbfr_recv);
+    return NULL;
+  }
+  _pmap_http_log_body(pbfr_recv);
+
+  return pbfr_recv;
+}
+
+/**
+ * Send a request and pass the body of its response to a sink, see
+ * 'pmap_http_conn_recv_sink'. If a reused connection was closed by the
+ * server in the meantime (no response received) the request is sent once
+ * more on a new connection.
+ *
+ * @param conn The connection.
+ * @param pbfr The request.
+ * @param http_status A pointer to an integer where the HTTP status code will
+ * be stored.
+ * @param head If not NULL the response head is appended to it.
+ * @param sink Called with each piece of the body.
+ * @param arg Passed to `sink`.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_http_conn_req_sink(pmap_http_conn_t *conn, pbuffer_t *pbfr,
+                            int *http_status, pbuffer_t *head,
+                            pmap_http_sink_t sink, void *arg) {
+
+  *http_status = 0;
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+
+    bool reused = (conn->fd >= 0 && conn->requests > 0);
+    int pending = conn->in->offset;
+
+    if (pmap_http_conn_send(conn, pbfr) == 0 &&
+        pmap_http_conn_recv_sink(conn, http_status, head, sink, arg) == 0) {
+      return 0;
+    }
+
+    if (!reused || pending > 0 || *http_status != 0 || errno == ETIMEDOUT) {
+      break; // Fresh connection failed or the server did answer
+    }
+    PMAP_DEBUG_LOG("Connection closed by server, reconnecting\n");
+  }
+
+  return 1;
+}
+
+/**
+ * Send a request and receive its response, see 'pmap_http_conn_req_sink'.
+ *
+ * @param conn The connection.
+ * @param pbfr The request.
+ * @param http_status A pointer to an integer where the HTTP status code will
+ * be stored.
+ * @return The response, or NULL on error (caller should check errno value).
+ * The caller is responsible for freeing it by calling 'pbfr_destroy' function.
+ */
+pbuffer_t *pmap_http_conn_req(pmap_http_conn_t *conn, pbuffer_t *pbfr,
+                              int *http_status) {
+
+  pbuffer_t *pbfr_recv = pbfr_create(PBUFFER_DEFLEN);
+  if (NULL == pbfr_recv) {
+    return NULL;
+  }
+
+  if (pmap_http_conn_req_sink(conn, pbfr, http_status, pbfr_recv,
+                              _pmap_http_sink_pbfr, pbfr_recv) != 0) {
+    pbfr_destroy(pbfr_recv);
+    return NULL;
+  }
+
+  _pmap_http_log_body(pbfr_recv);
+
+  return pbfr_recv;
+}
+
+/**
+ * Send a POST request on a persistent connection, see 'pmap_http_post'.
+ *
+ * @param conn The connection.
+ * @param path The URL path for the POST request.
+ * @param header Custom headers to be included in the request.
+ * @param pbfr_body The request body, or NULL if there is no body.
+ * @param http_status A pointer to an integer where the HTTP status code will
+ * be stored.
+ * @return The response, or NULL on error. The caller is responsible for
+ * freeing it by calling 'pbfr_destroy' function.
+ */
+pbuffer_t *pmap_http_conn_post(pmap_http_conn_t *conn, char *path,
+                               char *header, pbuffer_t *pbfr_body,
+                               int *http_status) {
+
+  pbuffer_t *pbfr_recv = NULL;
+  pbuffer_t *pbfr = _pmap_http_post_create(conn->host, conn->port, path,
+                                           header, pbfr_body, true);
+  if (NULL != pbfr) {
+    pbfr_recv = pmap_http_conn_req(conn, pbfr, http_status);
     pbfr_destroy(pbfr);
   }
 
   return pbfr_recv;
 }
+
+/**
+ * Build a POST request for a persistent connection without sending it, for
+ * callers that pipeline requests with 'pmap_http_conn_send'.
+ *
+ * @return The request, or NULL if memory allocation fails. The caller is
+ * responsible for freeing it by calling 'pbfr_destroy' function.
+ */
+pbuffer_t *pmap_http_conn_post_create(pmap_http_conn_t *conn, char *path,
+                                      char *header, pbuffer_t *pbfr_body) {
+
+  return _pmap_http_post_create(conn->host, conn->port, path, header,
+                                pbfr_body, true);
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Check whether a response is complete before the server closes the
+ * connection: headers received and as many body bytes as Content-Length.
+ *
+ * @param in The response received so far, NUL terminated.
+ * @return 1 if it is complete, 0 while more bytes are expected.
+ */
+int pmap_http_complete(const pbuffer_t *in) {
+
+  const char *body = strstr(in->buffer, "\r\n\r\n");
+  if (NULL == body) {
+    return 0;
+  }
+  body += 4;
+
+  for (const char *line = strstr(in->buffer, "\r\n"); line != NULL && line < body;
+       line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+      return (in->buffer + in->offset - body) >= atoi(line + 17);
+    }
+  }
+
+  return 0; // Read until the server closes
+}
+
+/**
+ * Start an HTTP exchange without blocking. The caller waits until
+ * `xfer->events` are ready on `xfer->fd` or `xfer->deadline_ms` is reached,
+ * and then calls 'pmap_http_xfer_io'. Only a numeric host is connected to, a
+ * name lookup would block.
+ *
+ * @param xfer The exchange, closed with 'pmap_http_xfer_close' in any case.
+ * @param hostname The IPv4 address of the server.
+ * @param port The port number to connect to.
+ * @param pbfr The request, owned by the exchange from now on.
+ * @param tmo Timeouts to use (`connect_ms` and `response_ms`), NULL for the
+ * defaults.
+ * @param now The current time ('pmap_ut_now_ms').
+ * @return 0 on success, 1 on failure (errno is set).
+ */
+int pmap_http_xfer_start(pmap_http_xfer_t *xfer, const char *hostname,
+                         int port, pbuffer_t *pbfr, const pmap_tmo_t *tmo,
+                         int64_t now) {
+
+  struct sockaddr_in server_addr;
+
+  memset(xfer, 0x00, sizeof(pmap_http_xfer_t));
+  xfer->fd = -1;
+  xfer->out = pbfr;
+  xfer->in = pbfr_create(PBUFFER_DEFLEN);
+  xfer->response_ms = (NULL != tmo) ? tmo->response_ms : PMAP_TMO_RESPONSE_DEF;
+  if (NULL == xfer->out || NULL == xfer->in) {
+    errno = ENOMEM;
+    return 1;
+  }
+
+  memset(&server_addr, 0x00, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, hostname, &server_addr.sin_addr) != 1) {
+    PMAP_DEBUG_ERROR("Host is not an IPv4 address %s", hostname);
+    errno = EINVALIDURL;
+    return 1;
+  }
+
+  if ((xfer->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    PMAP_DEBUG_ERROR("socket() %s", strerror(errno));
+    return 1;
+  }
+  fcntl(xfer->fd, F_SETFL, O_NONBLOCK);
+
+  if (connect(xfer->fd, (struct sockaddr *)&server_addr,
+              sizeof(server_addr)) < 0 &&
+      errno != EINPROGRESS) {
+    PMAP_DEBUG_ERROR("connect() %s", strerror(errno));
+    return 1;
+  }
+
+  PMAP_DEBUG_LOG("REQUEST: =>>>\n%s\n", pbfr->buffer);
+  if (PMAP_DEBUG_DUMP()) {
+    PMAP_RUNTIME_LOG("REQUEST: =>>>\n%s\n", pbfr->buffer);
+  }
+
+  xfer->events = POLLOUT;
+  xfer->deadline_ms =
+      now + ((NULL != tmo) ? tmo->connect_ms : PMAP_TMO_CONNECT_DEF);
+
+  return 0;
+}
+
+/**
+ * Move an HTTP exchange forward, after its socket became ready or its
+ * deadline was reached.
+ *
+ * @param xfer The exchange.
+ * @param now The current time ('pmap_ut_now_ms').
+ * @return 0 while in progress, 1 on failure (errno is set, ETIMEDOUT once the
+ * deadline is over), 2 once `xfer->in` holds the complete response.
+ */
+int pmap_http_xfer_io(pmap_http_xfer_t *xfer, int64_t now) {
+
+  ssize_t n;
+
+  if (xfer->events == POLLOUT) {
+
+    if (!xfer->connected) {
+      struct pollfd pfd = {.fd = xfer->fd, .events = POLLOUT};
+      if (poll(&pfd, 1, 0) == 0) {
+        goto wait;
+      }
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(xfer->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+          err != 0) {
+        errno = (err != 0) ? err : errno;
+        PMAP_DEBUG_ERROR("connect() %s", strerror(errno));
+        return 1;
+      }
+      xfer->connected = 1;
+      xfer->deadline_ms = now + xfer->response_ms;
+    }
+
+    while (xfer->out_sent < xfer->out->offset) {
+      n = send(xfer->fd, xfer->out->buffer + xfer->out_sent,
+               xfer->out->offset - xfer->out_sent, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          goto wait;
+        }
+        PMAP_DEBUG_ERROR("send() %s", strerror(errno));
+        return 1;
+      }
+      xfer->out_sent += n;
+    }
+    xfer->events = POLLIN;
+  }
+
+  pbuffer_t *in = xfer->in;
+  bool eof = false;
+
+  while (true) {
+    if (pbfr_reserve(in, in->offset + 1024) != 0) {
+      return 1;
+    }
+    n = recv(xfer->fd, in->buffer + in->offset, in->size - in->offset - 1,
+             MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      PMAP_DEBUG_ERROR("recv() %s", strerror(errno));
+      return 1;
+    } else if (n == 0) {
+      eof = true;
+      break;
+    }
+    in->offset += n;
+    xfer->deadline_ms = now + xfer->response_ms;
+  }
+  in->buffer[in->offset] = '\0';
+
+  if (eof || pmap_http_complete(in)) {
+
+    PMAP_DEBUG_LOG("RESPONSE: =>>>\n%s\n", in->buffer);
+    if (PMAP_DEBUG_DUMP()) {
+      PMAP_RUNTIME_LOG("RESPONSE: =>>>\n%s\n", in->buffer);
+    }
+
+    if (in->offset == 0) {
+      errno = ECONNRESET;
+      return 1;
+    }
+    return 2;
+  }
+
+wait:
+  if (now >= xfer->deadline_ms) {
+    PMAP_DEBUG_LOG("HTTP exchange timeout\n");
+    errno = ETIMEDOUT;
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Close an HTTP exchange and release its buffers, the response included.
+ */
+void pmap_http_xfer_close(pmap_http_xfer_t *xfer) {
+
+  if (xfer->fd >= 0) {
+    close(xfer->fd);
+    xfer->fd = -1;
+  }
+  pbfr_destroy(xfer->out);
+  pbfr_destroy(xfer->in);
+  xfer->out = NULL;
+  xfer->in = NULL;
+}
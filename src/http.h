@@ -27,13 +27,75 @@
 #include "buffer.h"
 #include "pmap_cfg.h"
 
+/**
+ * Persistent (keep-alive) HTTP connection to one host.
+ */
+typedef struct pmap_http_conn_t_ {
+  int fd; /* -1 while not connected */
+  char host[64];
+  int port;
+  pmap_tmo_t tmo;
+  pbuffer_t *in; /* Received and not consumed yet, offset is the length */
+  int requests;  /* Requests sent on the current socket */
+} pmap_http_conn_t;
+
+/**
+ * HTTP exchange driven by the caller's own poll or select loop, see
+ * 'pmap_http_xfer_start'.
+ */
+typedef struct pmap_http_xfer_t_ {
+  int fd;              /* -1 once closed */
+  short events;        /* POLLOUT while connecting and sending, then POLLIN */
+  int connected;
+  pbuffer_t *out;      /* Request */
+  int out_sent;
+  pbuffer_t *in;       /* Response, offset is the length */
+  int response_ms;     /* Longest silence while reading the response */
+  int64_t deadline_ms; /* Connect or silence deadline */
+} pmap_http_xfer_t;
+
+/**
+ * Receives the body of a response piece by piece, see
+ * 'pmap_http_conn_recv_sink'.
+ */
+typedef int (*pmap_http_sink_t)(const char *data, int len, void *arg);
+
 pbuffer_t *pmap_http_create(const char *method, const char *hostname, int port,
                             char *path);
-int pmap_http_connect(const char *hostname, int port);
+int pmap_http_connect(const char *hostname, int port, const pmap_tmo_t *tmo);
 pbuffer_t *pmap_http_req(const char *hostname, int port, pbuffer_t *pbfr,
-                         int *http_status);
+                         int *http_status, const pmap_tmo_t *tmo);
+pbuffer_t *pmap_http_post_create(const char *hostname, int port, char *path,
+                                 char *header, pbuffer_t *pbfr_body);
 pbuffer_t *pmap_http_post(const char *hostname, int port, char *path,
-                          char *header, pbuffer_t *pbfr_body, int *http_status);
+                          char *header, pbuffer_t *pbfr_body, int *http_status,
+                          const pmap_tmo_t *tmo);
 pbuffer_t *pmap_http_get(const char *hostname, int port, char *path,
-                         int *http_status);
+                         int *http_status, const pmap_tmo_t *tmo);
+
+int pmap_http_complete(const pbuffer_t *in);
+int pmap_http_xfer_start(pmap_http_xfer_t *xfer, const char *hostname,
+                         int port, pbuffer_t *pbfr, const pmap_tmo_t *tmo,
+                         int64_t now);
+int pmap_http_xfer_io(pmap_http_xfer_t *xfer, int64_t now);
+void pmap_http_xfer_close(pmap_http_xfer_t *xfer);
+
+pmap_http_conn_t *pmap_http_conn_create(const char *hostname, int port,
+                                        const pmap_tmo_t *tmo);
+void pmap_http_conn_destroy(pmap_http_conn_t *conn);
+int pmap_http_conn_send(pmap_http_conn_t *conn, pbuffer_t *pbfr);
+pbuffer_t *pmap_http_conn_recv(pmap_http_conn_t *conn, int *http_status);
+int pmap_http_conn_recv_sink(pmap_http_conn_t *conn, int *http_status,
+                             pbuffer_t *head, pmap_http_sink_t sink,
+                             void *arg);
+pbuffer_t *pmap_http_conn_req(pmap_http_conn_t *conn, pbuffer_t *pbfr,
+                              int *http_status);
+int pmap_http_conn_req_sink(pmap_http_conn_t *conn, pbuffer_t *pbfr,
+                            int *http_status, pbuffer_t *head,
+                            pmap_http_sink_t sink, void *arg);
+pbuffer_t *pmap_http_conn_post(pmap_http_conn_t *conn, char *path,
+                               char *header, pbuffer_t *pbfr_body,
+                               int *http_status);
+pbuffer_t *pmap_http_conn_post_create(pmap_http_conn_t *conn, char *path,
+                                      char *header, pbuffer_t *pbfr_body);
 #endif // _HTTP_H
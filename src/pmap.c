@@ -0,0 +1,2073 @@
+/*
+ *    pmap.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "http.h"
+#include "pmap.h"
+#include "pmap_async.h"
+#include "pmap_debug.h"
+#include "pmap_npmp.h"
+#include "pmap_upnp.h"
+#include "util.h"
+
+/* -------------------------------------------- */
+
+/**
+ * Create a client context.
+ *
+ * @return A new context, or NULL if memory allocation fails. The caller is
+ * responsible for freeing it by calling 'pmap_ctx_destroy' function.
+ */
+pmap_ctx_t *pmap_ctx_create(void) {
+
+  pmap_ctx_t *ctx = calloc(1, sizeof(pmap_ctx_t));
+  if (NULL == ctx) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  ctx->tmo_floor.discovery_ms = PMAP_TMO_DISCOVERY_FLOOR;
+  ctx->tmo_floor.connect_ms = PMAP_TMO_CONNECT_FLOOR;
+  ctx->tmo_floor.response_ms = PMAP_TMO_RESPONSE_FLOOR;
+  ctx->tmo_floor.retransmit_ms = PMAP_TMO_RETRANSMIT_FLOOR;
+
+  ctx->tmo_ceil.discovery_ms = PMAP_TMO_DISCOVERY_CEIL;
+  ctx->tmo_ceil.connect_ms = PMAP_TMO_CONNECT_CEIL;
+  ctx->tmo_ceil.response_ms = PMAP_TMO_RESPONSE_CEIL;
+  ctx->tmo_ceil.retransmit_ms = PMAP_TMO_RETRANSMIT_CEIL;
+
+  pthread_mutex_init(&ctx->lock, NULL);
+
+  return ctx;
+}
+
+/**
+ * Destroy a client context and everything it learned about gateways, pending
+ * asynchronous operations are cancelled.
+ *
+ * @param ctx The context, NULL is allowed.
+ */
+void pmap_ctx_destroy(pmap_ctx_t *ctx) {
+
+  if (NULL != ctx) {
+    pmap_async_cancel_all(ctx);
+    pmap_async_uring(ctx, 0);
+    pmap_gw_t *gw = ctx->gateways;
+    while (gw != NULL) {
+      pmap_gw_t *tmp = gw;
+      gw = gw->next;
+      pmap_ut_free_url(tmp->upnp);
+      pmap_ports_destroy(tmp->ports[0]);
+      pmap_ports_destroy(tmp->ports[1]);
+      pthread_cond_destroy(&tmp->admit);
+      free(tmp);
+    }
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+  }
+}
+
+/**
+ * Find the state of a gateway, a new (unknown protocol) entry is created on
+ * first use.
+ *
+ * @param ctx The context.
+ * @param gateway_ip The gateway address, network byte order.
+ * @return The gateway state, or NULL if memory allocation fails.
+ */
+pmap_gw_t *pmap_ctx_gateway(pmap_ctx_t *ctx, uint32_t gateway_ip) {
+
+  pmap_gw_t *gw;
+
+  pthread_mutex_lock(&ctx->lock);
+
+  for (gw = ctx->gateways; gw != NULL; gw = gw->next) {
+    if (gw->gateway_ip == gateway_ip) {
+      pthread_mutex_unlock(&ctx->lock);
+      return gw;
+    }
+  }
+
+  gw = calloc(1, sizeof(pmap_gw_t));
+  if (NULL == gw) {
+    pthread_mutex_unlock(&ctx->lock);
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  gw->gateway_ip = gateway_ip;
+  gw->protocol = PMAP_PROTO_NONE;
+  pthread_cond_init(&gw->admit, NULL);
+  pmap_limit_config(&gw->limit, &ctx->limit, pmap_ut_now_ms());
+  gw->next = ctx->gateways;
+  ctx->gateways = gw;
+
+  pthread_mutex_unlock(&ctx->lock);
+
+  return gw;
+}
+
+/**
+ * Change the bounds of the adaptive timeouts. A timeout estimated from the
+ * round trip times of a gateway is never shorter than `floor` nor longer
+ * than `ceil`.
+ *
+ * @param ctx The context.
+ * @param floor The lower bounds, NULL to keep the current ones.
+ * @param ceil The upper bounds, NULL to keep the current ones.
+ */
+void pmap_ctx_set_timeouts(pmap_ctx_t *ctx, const pmap_tmo_t *floor,
+                           const pmap_tmo_t *ceil) {
+
+  pthread_mutex_lock(&ctx->lock);
+  if (NULL != floor) {
+    ctx->tmo_floor = *floor;
+  }
+  if (NULL != ceil) {
+    ctx->tmo_ceil = *ceil;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Get the timeouts to use for the next operation on a gateway.
+ *
+ * @param ctx The context.
+ * @param gw The gateway state.
+ * @param tmo The timeouts to be filled.
+ */
+void pmap_ctx_timeouts(pmap_ctx_t *ctx, pmap_gw_t *gw, pmap_tmo_t *tmo) {
+
+  pthread_mutex_lock(&ctx->lock);
+  pmap_tmo_estimate(gw->rtt, &ctx->tmo_floor, &ctx->tmo_ceil, tmo);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Forget every negative cache entry, e.g. after a network change. The next
+ * call probes all protocols again.
+ *
+ * @param ctx The context.
+ */
+void pmap_ctx_flush_negative(pmap_ctx_t *ctx) {
+
+  pthread_mutex_lock(&ctx->lock);
+  for (pmap_gw_t *gw = ctx->gateways; gw != NULL; gw = gw->next) {
+    memset(gw->neg, 0x00, sizeof(gw->neg));
+  }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Number of blocking calls that did not reach the gateway because an
+ * identical call was in flight and they shared its result.
+ *
+ * @param ctx The context.
+ */
+uint64_t pmap_ctx_coalesced(pmap_ctx_t *ctx) {
+
+  pthread_mutex_lock(&ctx->lock);
+  uint64_t coalesced = ctx->coalesced;
+  pthread_mutex_unlock(&ctx->lock);
+
+  return coalesced;
+}
+
+/**
+ * Set the admission limits of a gateway, or of every gateway. Calls to a
+ * gateway with limits wait for a token of its bucket and for a free
+ * in-flight slot, background calls ('pmap_priority') give way to
+ * interactive ones. The limits are cut when the gateway times out or
+ * answers HTTP 5xx, and grow back while it answers.
+ *
+ * @param ctx The context.
+ * @param gateway_ip The gateway, network byte order, or 0 for all the known
+ * gateways and the ones met later.
+ * @param cfg The limits, NULL for the defaults (PMAP_LIMIT_*). A zero
+ * `rate` and `max_inflight` remove the limits.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_ctx_set_limit(pmap_ctx_t *ctx, uint32_t gateway_ip,
+                       const pmap_limit_cfg_t *cfg) {
+
+  pmap_limit_cfg_t def;
+  int64_t now = pmap_ut_now_ms();
+
+  if (NULL == cfg) {
+    pmap_limit_default(&def);
+    cfg = &def;
+  }
+
+  pmap_gw_t *gw = NULL;
+  if (0 != gateway_ip && NULL == (gw = pmap_ctx_gateway(ctx, gateway_ip))) {
+    return 1; // caller should check errno value
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  if (NULL != gw) {
+    pmap_limit_config(&gw->limit, cfg, now);
+  } else {
+    ctx->limit = *cfg;
+    for (gw = ctx->gateways; gw != NULL; gw = gw->next) {
+      pmap_limit_config(&gw->limit, cfg, now);
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  return 0;
+}
+
+/**
+ * Describe the admission limits of a gateway as they are now (scaled down
+ * after overloads) with their counters.
+ *
+ * @param ctx The context.
+ * @param gateway_ip The gateway, network byte order.
+ * @param state Receives the limits.
+ * @return 0 on success, 1 if the gateway is not known (errno is ENOENT).
+ */
+int pmap_ctx_limit(pmap_ctx_t *ctx, uint32_t gateway_ip,
+                   pmap_limit_state_t *state) {
+
+  pthread_mutex_lock(&ctx->lock);
+  for (pmap_gw_t *gw = ctx->gateways; gw != NULL; gw = gw->next) {
+    if (gw->gateway_ip == gateway_ip) {
+      pmap_limit_state(&gw->limit, pmap_ut_now_ms(), state);
+      pthread_mutex_unlock(&ctx->lock);
+      return 0;
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  errno = ENOENT;
+  return 1;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Check whether a protocol is known not to work on the gateway.
+ */
+int pmap_gw_neg_valid(pmap_ctx_t *ctx, pmap_gw_t *gw, int protocol,
+                      int64_t now) {
+
+  pthread_mutex_lock(&ctx->lock);
+  int valid = gw->neg[protocol].until_ms > now;
+  pthread_mutex_unlock(&ctx->lock);
+
+  return valid;
+}
+
+/**
+ * 'pmap_gw_neg_fail' under the context lock.
+ */
+static void _pmap_gw_neg_fail(pmap_gw_t *gw, int protocol) {
+
+  pmap_neg_t *neg = &gw->neg[protocol];
+  int ttl = PMAP_NEG_TTL_MIN;
+
+  for (int i = 0; i < neg->failures && ttl < PMAP_NEG_TTL_MAX; i++) {
+    ttl *= 2;
+  }
+  if (ttl > PMAP_NEG_TTL_MAX) {
+    ttl = PMAP_NEG_TTL_MAX;
+  }
+
+  neg->failures++;
+  neg->until_ms = pmap_ut_now_ms() + (int64_t)ttl * 1000;
+
+  PMAP_DEBUG_LOG("%s unsupported on %s, next probe in %ds\n",
+                 (protocol == PMAP_PROTO_NPMP) ? "NAT-PMP" : "UPnP",
+                 pmap_ut_inet_ntoa(gw->gateway_ip), ttl);
+}
+
+/**
+ * Record a failed probe, the protocol is skipped until the TTL expires. The
+ * TTL starts at PMAP_NEG_TTL_MIN and doubles with every failure in a row.
+ */
+void pmap_gw_neg_fail(pmap_ctx_t *ctx, pmap_gw_t *gw, int protocol) {
+
+  pthread_mutex_lock(&ctx->lock);
+  _pmap_gw_neg_fail(gw, protocol);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * The protocol answered, drop its negative cache entry.
+ */
+void pmap_gw_neg_clear(pmap_ctx_t *ctx, pmap_gw_t *gw, int protocol) {
+
+  pthread_mutex_lock(&ctx->lock);
+  gw->neg[protocol].until_ms = 0;
+  gw->neg[protocol].failures = 0;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * The protocol the gateway answered last time, and a copy of its IGD
+ * location. Calls work on the copy, so another thread may replace the
+ * location of the gateway meanwhile.
+ *
+ * @param ctx The context.
+ * @param gw The gateway state.
+ * @param upnp Receives a copy of the IGD location when the protocol is
+ * PMAP_PROTO_UPNP, NULL if the location is not known (or out of memory).
+ * The caller frees it with 'pmap_ut_free_url'. May be NULL.
+ * @return PMAP_PROTO_*.
+ */
+int pmap_gw_protocol(pmap_ctx_t *ctx, pmap_gw_t *gw, pmap_url_comp_t **upnp) {
+
+  pthread_mutex_lock(&ctx->lock);
+  int protocol = gw->protocol;
+  if (NULL != upnp) {
+    *upnp = (protocol == PMAP_PROTO_UPNP && NULL != gw->upnp)
+                ? pmap_ut_dup_url(gw->upnp)
+                : NULL;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  return protocol;
+}
+
+/**
+ * A protocol won the race, later calls go straight to it.
+ *
+ * @param upnp The IGD that answered (PMAP_PROTO_UPNP), the gateway keeps a
+ * copy of it.
+ */
+void pmap_gw_won(pmap_ctx_t *ctx, pmap_gw_t *gw, int protocol,
+                 const pmap_url_comp_t *upnp) {
+
+  pmap_url_comp_t *copy = (NULL != upnp) ? pmap_ut_dup_url(upnp) : NULL;
+
+  pthread_mutex_lock(&ctx->lock);
+  gw->protocol = protocol;
+  gw->neg[protocol].until_ms = 0;
+  gw->neg[protocol].failures = 0;
+  if (protocol == PMAP_PROTO_UPNP) {
+    pmap_ut_free_url(gw->upnp);
+    gw->upnp = copy;
+    copy = NULL;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  pmap_ut_free_url(copy);
+}
+
+/**
+ * The protocol of the gateway is not known (any more), the next call races.
+ *
+ * @param rtt The estimator of the protocol that stopped answering
+ * (PMAP_RTT_*), -1 if none.
+ * @param upnp The IGD location that did not answer, dropped if the gateway
+ * still has it, NULL if none.
+ */
+void pmap_gw_lost(pmap_ctx_t *ctx, pmap_gw_t *gw, int rtt,
+                  const pmap_url_comp_t *upnp) {
+
+  pmap_url_comp_t *stale = NULL;
+
+  pthread_mutex_lock(&ctx->lock);
+  if (rtt >= 0) {
+    pmap_rtt_timeout(&gw->rtt[rtt]);
+  }
+  if (NULL != upnp && NULL != gw->upnp &&
+      PMAP_COMPARE_URLCOMP(upnp, gw->upnp)) {
+    stale = gw->upnp;
+    gw->upnp = NULL;
+  }
+  gw->protocol = PMAP_PROTO_NONE;
+  pthread_mutex_unlock(&ctx->lock);
+
+  pmap_ut_free_url(stale);
+}
+
+/**
+ * Nobody won the race. A NAT-PMP miss within an estimated timeout may only
+ * mean the estimate is too short for this gateway now: it is dropped, and
+ * NAT-PMP is tried again with the default timeout instead of being
+ * negative-cached. Likewise for a device that answered the M-SEARCH but
+ * whose exchange timed out. The M-SEARCH window itself is no estimate
+ * (PMAP_SSDP_MX).
+ *
+ * @param npmp_tmo NAT-PMP was asked and did not answer.
+ * @param try_upnp UPnP was in the race.
+ * @param http_tmo An exchange with a device timed out.
+ */
+void pmap_gw_race_end(pmap_ctx_t *ctx, pmap_gw_t *gw, int npmp_tmo,
+                      int try_upnp, int http_tmo) {
+
+  pthread_mutex_lock(&ctx->lock);
+  if (npmp_tmo) {
+    if (gw->rtt[PMAP_RTT_NPMP].samples == 0) {
+      _pmap_gw_neg_fail(gw, PMAP_PROTO_NPMP);
+    }
+    pmap_rtt_timeout(&gw->rtt[PMAP_RTT_NPMP]);
+  }
+  if (try_upnp) {
+    if (http_tmo) {
+      pmap_rtt_timeout(&gw->rtt[PMAP_RTT_HTTP]); // An IGD, but slow
+    } else {
+      _pmap_gw_neg_fail(gw, PMAP_PROTO_UPNP); // No device or no usable IGD
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Keep what a call learned about the IGD on its copy of the location
+ * ('pmap_gw_protocol'): the control URL and the service version. Nothing is
+ * kept if the gateway moved to another location meanwhile.
+ */
+void pmap_gw_upnp_learn(pmap_ctx_t *ctx, pmap_gw_t *gw,
+                        const pmap_url_comp_t *upnp) {
+
+  char *crtl_url = (NULL != upnp->crtl_url) ? strdup(upnp->crtl_url) : NULL;
+
+  pthread_mutex_lock(&ctx->lock);
+  if (NULL != gw->upnp && PMAP_COMPARE_URLCOMP(upnp, gw->upnp) &&
+      (NULL == upnp->crtl_url || NULL != crtl_url)) {
+    char *old = gw->upnp->crtl_url;
+    gw->upnp->crtl_url = crtl_url;
+    gw->upnp->version = upnp->version;
+    crtl_url = old;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  free(crtl_url);
+}
+
+/**
+ * Feed a round trip time to an estimator of the gateway, see
+ * 'pmap_rtt_sample'.
+ *
+ * @param rtt The estimator (PMAP_RTT_*).
+ */
+void pmap_gw_rtt_sample(pmap_ctx_t *ctx, pmap_gw_t *gw, int rtt, int ms) {
+
+  pthread_mutex_lock(&ctx->lock);
+  pmap_rtt_sample(&gw->rtt[rtt], ms);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Smoothed round trip time of an estimator of the gateway.
+ *
+ * @param rtt The estimator (PMAP_RTT_*).
+ * @return The time in milliseconds, -1 while there is no sample.
+ */
+int pmap_gw_srtt_ms(pmap_ctx_t *ctx, pmap_gw_t *gw, int rtt) {
+
+  pthread_mutex_lock(&ctx->lock);
+  int ms = (gw->rtt[rtt].samples > 0) ? pmap_rtt_srtt_ms(&gw->rtt[rtt]) : -1;
+  pthread_mutex_unlock(&ctx->lock);
+
+  return ms;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * 'pmap_gw_admit' under the context lock.
+ */
+static int _pmap_gw_admit(pmap_gw_t *gw, int prio, int count, int64_t since,
+                          int64_t now, int64_t *wait_ms) {
+
+  pmap_limit_t *lim = &gw->limit;
+
+  int n = pmap_limit_admit(lim, prio, count, now, wait_ms);
+  if (n == 0) {
+    if ((*wait_ms < 0) ? now - since >= lim->cfg.max_wait_ms
+                       : now + *wait_ms - since > lim->cfg.max_wait_ms) {
+      lim->rejected++;
+      n = -1;
+    } else if (now == since) {
+      lim->delayed++;
+    }
+  }
+
+  return n;
+}
+
+/**
+ * Ask to send requests to a gateway, see 'pmap_limit_admit'. A call that
+ * waits since `since` and would wait past the `max_wait_ms` of the gateway
+ * is refused.
+ *
+ * @return The number of requests admitted (give the slot back with
+ * 'pmap_gw_release'), 0 to wait for `wait_ms` (-1 until a request ends), or
+ * -1 if refused (errno is ELIMITED).
+ */
+int pmap_gw_admit(pmap_ctx_t *ctx, pmap_gw_t *gw, int prio, int count,
+                  int64_t since, int64_t now, int64_t *wait_ms) {
+
+  pthread_mutex_lock(&ctx->lock);
+  int n = _pmap_gw_admit(gw, prio, count, since, now, wait_ms);
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (n < 0) {
+    PMAP_DEBUG_LOG("Rate limit of %s, call refused\n",
+                   pmap_ut_inet_ntoa(gw->gateway_ip));
+    errno = ELIMITED;
+  }
+
+  return n;
+}
+
+/**
+ * Count queued asynchronous operations of a gateway.
+ *
+ * @param delta Added to the operations queued at `prio`.
+ * @return The operations queued at `prio` or a higher priority before the
+ * change, a new operation must not overtake them. -1 if the queue already
+ * holds `max_queue` operations (errno is ELIMITED), nothing is added then.
+ */
+int pmap_gw_queue(pmap_ctx_t *ctx, pmap_gw_t *gw, int prio, int delta) {
+
+  pmap_limit_t *lim = &gw->limit;
+  int ahead = 0, queued = 0;
+
+  pthread_mutex_lock(&ctx->lock);
+  for (int p = 0; p < PMAP_PRIO_MAX; p++) {
+    queued += lim->waiting[p];
+    if (p <= prio) {
+      ahead += lim->waiting[p];
+    }
+  }
+  if (delta > 0 && lim->cfg.max_queue > 0 && queued >= lim->cfg.max_queue) {
+    lim->rejected++;
+    ahead = -1;
+  } else {
+    lim->waiting[prio] += delta;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (ahead < 0) {
+    errno = ELIMITED;
+  }
+
+  return ahead;
+}
+
+/**
+ * Whether the result of a call tells that the gateway is overloaded: no
+ * answer, or an HTTP 5xx that is not a UPnP fault (EGWOVERLOAD, a fault is
+ * an answer). Taken from the call itself, not from the gateway state that
+ * concurrent calls overwrite.
+ *
+ * @param ret The return value of the call.
+ * @param err The errno value of the call.
+ * @return PMAP_LIMIT_OVERLOAD or PMAP_LIMIT_OK.
+ */
+int pmap_gw_outcome(int ret, int err) {
+
+  if (ret == 1 && (err == ETIMEDOUT || err == EGWOVERLOAD)) {
+    return PMAP_LIMIT_OVERLOAD;
+  }
+
+  return PMAP_LIMIT_OK;
+}
+
+/**
+ * Give back the in-flight slot of admitted requests, see 'pmap_limit_done'.
+ * The blocking calls waiting for the gateway try again.
+ */
+void pmap_gw_release(pmap_ctx_t *ctx, pmap_gw_t *gw, int outcome) {
+
+  pthread_mutex_lock(&ctx->lock);
+  pmap_limit_done(&gw->limit, outcome, pmap_ut_now_ms());
+  if (outcome == PMAP_LIMIT_OVERLOAD && pmap_limit_enabled(&gw->limit)) {
+    PMAP_DEBUG_LOG("%s overloaded, limits cut to %d%%\n",
+                   pmap_ut_inet_ntoa(gw->gateway_ip), gw->limit.scale_pct);
+  }
+  if (NULL != gw->waiters) {
+    pthread_cond_broadcast(&gw->admit);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Save what the context learned about gateways to a text file, one gateway
+ * per line: "<gateway> <protocol> <location|-> <control URL|->" followed by
+ * "<srtt>,<rttvar>,<samples>" of each round trip estimator (PMAP_RTT_*) and
+ * the WANIPConnection service version.
+ *
+ * @param ctx The context.
+ * @param path The file name.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_ctx_save(pmap_ctx_t *ctx, const char *path) {
+
+  FILE *fp = fopen(path, "w");
+  if (NULL == fp) {
+    PMAP_DEBUG_ERROR("fopen() %s", strerror(errno));
+    return 1;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  for (pmap_gw_t *gw = ctx->gateways; gw != NULL; gw = gw->next) {
+    char ip[16];
+    fprintf(fp, "%s %d", pmap_ut_inet_ntoa_r(gw->gateway_ip, ip, sizeof(ip)),
+            gw->protocol);
+    if (gw->upnp != NULL) {
+      fprintf(fp, " %s://%s:%d/%s %s", gw->upnp->scheme, gw->upnp->host,
+              gw->upnp->port, gw->upnp->path,
+              gw->upnp->crtl_url ? gw->upnp->crtl_url : "-");
+    } else {
+      fprintf(fp, " - -");
+    }
+    for (int i = 0; i < PMAP_RTT_MAX; i++) {
+      fprintf(fp, " %d,%d,%d", gw->rtt[i].srtt >> PMAP_RTT_SRTT_SHIFT,
+              gw->rtt[i].rttvar >> PMAP_RTT_RTTVAR_SHIFT, gw->rtt[i].samples);
+    }
+    fprintf(fp, " %d\n", (gw->upnp != NULL) ? gw->upnp->version : 0);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  return (fclose(fp) == 0) ? 0 : 1;
+}
+
+/**
+ * Load gateway state saved by 'pmap_ctx_save'. Unknown or malformed lines
+ * are skipped, lines without round trip estimators or service version are
+ * accepted.
+ *
+ * @param ctx The context.
+ * @param path The file name.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_ctx_load(pmap_ctx_t *ctx, const char *path) {
+
+  char line[320];
+  char ip[16], location[128], ctrl_url[128];
+  int protocol, version, n;
+  pmap_rtt_t rtt[PMAP_RTT_MAX];
+
+  FILE *fp = fopen(path, "r");
+  if (NULL == fp) {
+    PMAP_DEBUG_ERROR("fopen() %s", strerror(errno));
+    return 1;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+
+    memset(rtt, 0x00, sizeof(rtt));
+    version = 0;
+    n = sscanf(line, "%15s %d %127s %127s %d,%d,%d %d,%d,%d %d,%d,%d %d", ip,
+               &protocol, location, ctrl_url, &rtt[0].srtt, &rtt[0].rttvar,
+               &rtt[0].samples, &rtt[1].srtt, &rtt[1].rttvar, &rtt[1].samples,
+               &rtt[2].srtt, &rtt[2].rttvar, &rtt[2].samples, &version);
+    if (n != 4 && n != 4 + 3 * PMAP_RTT_MAX && n != 5 + 3 * PMAP_RTT_MAX) {
+      continue;
+    }
+
+    pmap_gw_t *gw = pmap_ctx_gateway(ctx, inet_addr(ip));
+    if (NULL == gw) {
+      break;
+    }
+
+    pmap_url_comp_t *upnp = NULL;
+    if (strcmp(location, "-") != 0) {
+      upnp = pmap_ut_parse_url(location);
+      if (upnp != NULL && strcmp(ctrl_url, "-") != 0) {
+        upnp->crtl_url = strdup(ctrl_url);
+        upnp->version = version;
+      }
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    gw->protocol = protocol;
+    if (n > 4) {
+      for (int i = 0; i < PMAP_RTT_MAX; i++) {
+        rtt[i].srtt <<= PMAP_RTT_SRTT_SHIFT; // Saved in milliseconds
+        rtt[i].rttvar <<= PMAP_RTT_RTTVAR_SHIFT;
+      }
+      memcpy(gw->rtt, rtt, sizeof(gw->rtt));
+    }
+    if (NULL != upnp) {
+      pmap_url_comp_t *old = gw->upnp;
+      gw->upnp = upnp;
+      upnp = old;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    pmap_ut_free_url(upnp);
+  }
+
+  fclose(fp);
+
+  return 0;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Finish a UPnP action: return the errorCode of a SOAP fault in `upnp_error`
+ * if not NULL (a result of this call, not of the gateway, which other calls
+ * share) and the port picked by AddAnyPortMapping in `pfield`, see
+ * 'pmap_upnp_result'. On failure errno tells a fault from an overload
+ * ('pmap_upnp_errno').
+ */
+int pmap_gw_upnp_done(int action, pmap_field_t *pfield, pbuffer_t *pbfr_recv,
+                      int http_status, char *external_ip, int esize,
+                      char *error, int size, int *upnp_error_out) {
+
+  char tmp[16];
+  int upnp_error = 0;
+
+  if (NULL != pbfr_recv) {
+    if (http_status != 200) {
+      if (pmap_ut_substr("<errorCode>", "</errorCode>", pbfr_recv->buffer, tmp,
+                         sizeof(tmp)) == 0) {
+        upnp_error = atoi(tmp);
+      }
+    } else if (action == PMAP_UPNP_ACTION_ADDANY &&
+               pmap_ut_substr("<NewReservedPort>", "</NewReservedPort>",
+                              pbfr_recv->buffer, tmp, sizeof(tmp)) == 0) {
+      pfield->external_port = atoi(tmp);
+    }
+  }
+
+  if (NULL != upnp_error_out) {
+    *upnp_error_out = upnp_error;
+  }
+
+  int ret = pmap_upnp_result(pbfr_recv, http_status, external_ip, esize,
+                             error, size);
+  if (ret != 0) {
+    errno = pmap_upnp_errno(http_status, upnp_error);
+  }
+
+  return ret;
+}
+
+/**
+ * Run NAT-PMP and UPnP-IGD concurrently and commit to the first one that
+ * answers.
+ *
+ * A NAT-PMP request (one datagram to port 5351) and an M-SEARCH are sent at
+ * the same time. The first definitive NAT-PMP response wins. An M-SEARCH
+ * response from the gateway wins once the SOAP action on that device got a
+ * HTTP response. The loser socket is closed, a NAT-PMP error result (e.g.
+ * mapping disabled) only removes NAT-PMP from the race.
+ *
+ * The NAT-PMP request is retransmitted once after `retransmit_ms`, the race
+ * ends after `discovery_ms` (at least two retransmission intervals). Both are
+ * estimated from the round trip times seen earlier on this gateway.
+ *
+ * A protocol in the negative cache is left out of the race. A protocol that
+ * does not answer (or has no usable IGD) is put into it.
+ *
+ * The HTTP exchanges with a device do not block, NAT-PMP can still win while
+ * they run. An add request NAT-PMP did not answer is withdrawn at the end,
+ * the gateway may have applied it (response lost, or still on its way).
+ */
+static int _pmap_race(pmap_ctx_t *ctx, pmap_gw_t *gw, int action,
+                      pmap_field_t *pfield, char *external_ip, int esize,
+                      char *error, int size, int *upnp_error) {
+
+  uint8_t req[sizeof(nmpm_pkt_req)];
+  uint8_t pkt[sizeof(nmpm_pkt_resp) + sizeof(nmpm_pkt_exip)];
+  struct sockaddr_in npmp;
+  struct sockaddr_in client;
+  socklen_t ca_size;
+  pmap_tmo_t tmo;
+  int op_code, req_len, len, ret = 1;
+  int npmp_errno = ETIMEDOUT;
+  int npmp_sent = 0;
+  int64_t now = pmap_ut_now_ms();
+  int try_npmp = !pmap_gw_neg_valid(ctx, gw, PMAP_PROTO_NPMP, now);
+  int try_upnp = !pmap_gw_neg_valid(ctx, gw, PMAP_PROTO_UPNP, now);
+
+  if (action == PMAP_UPNP_ACTION_GETEXTIP) {
+    op_code = NPMP_OPCODE_EXIP;
+  } else if ((op_code = pmap_npmp_opcode(pfield->protocol)) < 0) {
+    return -2; // Protocol not supported
+  }
+
+  if (action == PMAP_UPNP_ACTION_DELPORT) {
+    pfield->lifetime_sec = 0; // Remove mapping
+  }
+
+  pmap_ctx_timeouts(ctx, gw, &tmo);
+  PMAP_DEBUG_LOG("Race timeouts: discovery %dms retransmit %dms\n",
+                 tmo.discovery_ms, tmo.retransmit_ms);
+
+  /* NAT-PMP request */
+  npmp.sin_family = AF_INET;
+  npmp.sin_port = htons(NAT_PMP_SERVER_PORT);
+  npmp.sin_addr.s_addr = pfield->gateway_ip;
+  pmap_field_t npmp_field = *pfield; // UPnP keeps a lifetime of 0
+  if (action != PMAP_UPNP_ACTION_DELPORT &&
+      action != PMAP_UPNP_ACTION_GETEXTIP) {
+    npmp_field.lifetime_sec = pmap_npmp_lifetime(pfield->lifetime_sec);
+  }
+  req_len = pmap_npmp_build_req(op_code, &npmp_field, req);
+
+  int npmp_fd = try_npmp ? socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP) : -1;
+  if (npmp_fd >= 0) {
+    if (sendto(npmp_fd, req, req_len, 0, (struct sockaddr *)&npmp,
+               sizeof(npmp)) < 0) {
+      PMAP_DEBUG_ERROR("sendto() %s", strerror(errno));
+      close(npmp_fd);
+      npmp_fd = -1;
+    } else {
+      npmp_sent = 1;
+    }
+  }
+
+  /* UPnP discovery, the devices found are asked one at a time */
+  int ssdp_fd = try_upnp ? pmap_ssdp_search() : -1;
+  int http_tmo = 0; // A device exchange timed out
+  pmap_url_comp_t *dev = NULL;
+  pmap_http_xfer_t xfer;
+  int desc = 0; // `xfer` fetches the device description of `dev`
+  memset(&xfer, 0x00, sizeof(xfer));
+  xfer.fd = -1;
+
+  int64_t start = pmap_ut_now_ms();
+  int64_t retransmit_at = start + tmo.retransmit_ms;
+  int64_t deadline = start + ((tmo.discovery_ms > 2 * tmo.retransmit_ms)
+                                  ? tmo.discovery_ms
+                                  : 2 * tmo.retransmit_ms);
+
+  while (npmp_fd >= 0 || ssdp_fd >= 0 || xfer.fd >= 0) {
+
+    /* An HTTP exchange that started runs until its own deadline */
+    now = pmap_ut_now_ms();
+    if (deadline - now <= 0 && xfer.fd < 0) {
+      break;
+    }
+
+    /* Single NAT-PMP retransmission, the response is no RTT sample then */
+    if (npmp_fd >= 0 && npmp_sent == 1 && now >= retransmit_at) {
+      if (sendto(npmp_fd, req, req_len, 0, (struct sockaddr *)&npmp,
+                 sizeof(npmp)) < 0) {
+        PMAP_DEBUG_ERROR("sendto() %s", strerror(errno));
+      }
+      npmp_sent = 2;
+    }
+
+    int64_t remain = deadline - now;
+    if (npmp_fd >= 0 && npmp_sent == 1 && retransmit_at - now < remain) {
+      remain = retransmit_at - now;
+    }
+    if (xfer.fd >= 0 && (remain < 0 || xfer.deadline_ms - now < remain)) {
+      remain = (xfer.deadline_ms > now) ? xfer.deadline_ms - now : 0;
+    }
+
+    fd_set read_fds, write_fds;
+    struct timeval tv;
+    int maxfd = (npmp_fd > ssdp_fd) ? npmp_fd : ssdp_fd;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    if (npmp_fd >= 0) {
+      FD_SET(npmp_fd, &read_fds);
+    }
+    if (ssdp_fd >= 0) {
+      FD_SET(ssdp_fd, &read_fds);
+    }
+    if (xfer.fd >= 0) {
+      FD_SET(xfer.fd, (xfer.events == POLLOUT) ? &write_fds : &read_fds);
+      maxfd = (xfer.fd > maxfd) ? xfer.fd : maxfd;
+    }
+    tv.tv_sec = remain / 1000;
+    tv.tv_usec = (remain % 1000) * 1000;
+
+    int ready = select(maxfd + 1, &read_fds, &write_fds, NULL, &tv);
+    if (ready < 0) {
+      PMAP_DEBUG_ERROR("select() %s", strerror(errno));
+      break;
+    } else if (ready == 0 && xfer.fd < 0) {
+      continue; // Retransmission or deadline
+    }
+
+    if (npmp_fd >= 0 && FD_ISSET(npmp_fd, &read_fds)) {
+      ca_size = sizeof(client);
+      len = recvfrom(npmp_fd, pkt, sizeof(pkt), MSG_DONTWAIT,
+                     (struct sockaddr *)&client, &ca_size);
+      if (len > 0 && client.sin_addr.s_addr == pfield->gateway_ip) {
+        int res = pmap_npmp_parse_resp(op_code, pfield, pkt, len, external_ip,
+                                       esize, error, size);
+        if (res >= 0 && npmp_sent == 1) {
+          pmap_gw_rtt_sample(ctx, gw, PMAP_RTT_NPMP,
+                             (int)(pmap_ut_now_ms() - start));
+        }
+        if (res >= 0) {
+          close(npmp_fd); // Answered, nothing to withdraw
+          npmp_fd = -1;
+        }
+        if (res == 0) {
+          PMAP_DEBUG_LOG("NAT-PMP won the race\n");
+          pmap_gw_won(ctx, gw, PMAP_PROTO_NPMP, NULL);
+          ret = 0;
+          goto done;
+        } else if (res == 1) {
+          /* NAT-PMP answered with an error, UPnP may still do better */
+          npmp_errno = errno;
+          if (npmp_errno == ENPMP_UNSUPPORTED_VER ||
+              npmp_errno == ENPMP_UNSUPPORTED_OPCODE) {
+            pmap_gw_neg_fail(ctx, gw, PMAP_PROTO_NPMP);
+          } else {
+            pmap_gw_neg_clear(ctx, gw, PMAP_PROTO_NPMP);
+          }
+        }
+      }
+    }
+
+    if (xfer.fd >= 0 && (FD_ISSET(xfer.fd, &read_fds) ||
+                         FD_ISSET(xfer.fd, &write_fds) || ready == 0)) {
+      int res = pmap_http_xfer_io(&xfer, pmap_ut_now_ms());
+      int http_status = 0;
+      if (res == 2) {
+        sscanf(xfer.in->buffer, "HTTP/1.%*d %d", &http_status);
+        PMAP_DEBUG_LOG("[HTTP Status Code=%d]\n", http_status);
+      }
+
+      if (res == 2 && !desc) {
+        PMAP_DEBUG_LOG("UPnP won the race\n");
+        pmap_gw_won(ctx, gw, PMAP_PROTO_UPNP, dev);
+        pbuffer_t *pbfr_recv = xfer.in;
+        xfer.in = NULL;
+        ret = pmap_gw_upnp_done(action, pfield, pbfr_recv, http_status,
+                                external_ip, esize, error, size, upnp_error);
+        goto done;
+      }
+
+      if (res == 2) {
+        /* Device description, the SOAP action follows */
+        pbuffer_t *pbfr = NULL;
+        if (http_status == 200 &&
+            pmap_upnp_desc_parse(dev, xfer.in->buffer) == 0) {
+          PMAP_DEBUG_LOG("[controlURL=%s]\n", dev->crtl_url);
+          pbfr = pmap_upnp_request(action, dev, pfield);
+        }
+        pmap_http_xfer_close(&xfer);
+        desc = 0;
+        res = pmap_http_xfer_start(&xfer, dev->host, dev->port, pbfr, &tmo,
+                                   pmap_ut_now_ms()); // No request, fails
+      }
+
+      if (res == 1) {
+        /* Not an IGD (or not reachable), wait for another device */
+        http_tmo |= (errno == ETIMEDOUT);
+        pmap_http_xfer_close(&xfer);
+        pmap_ut_free_url(dev);
+        dev = NULL;
+      }
+    }
+
+    /* A device whose exchange failed is replaced by one already read */
+    if (ssdp_fd >= 0 && (FD_ISSET(ssdp_fd, &read_fds) || NULL == dev)) {
+      while (NULL == dev &&
+             (dev = pmap_ssdp_read(ssdp_fd, pfield->gateway_ip)) != NULL) {
+        pbuffer_t *pbfr = pmap_http_create("GET", dev->host, dev->port,
+                                           dev->path);
+        if (NULL != pbfr) {
+          pbfr_add(pbfr, "\r\n");
+        }
+        desc = 1;
+        if (pmap_http_xfer_start(&xfer, dev->host, dev->port, pbfr, &tmo,
+                                 pmap_ut_now_ms()) != 0) {
+          pmap_http_xfer_close(&xfer);
+          pmap_ut_free_url(dev);
+          dev = NULL;
+        }
+      }
+    }
+  }
+
+  /* Nobody won */
+  pmap_gw_race_end(ctx, gw, npmp_sent && npmp_errno == ETIMEDOUT, try_upnp,
+                   http_tmo);
+  errno = npmp_errno;
+
+done:
+  if (npmp_fd >= 0) {
+    /* Lost or still on its way, the gateway may apply it after all */
+    if (action != PMAP_UPNP_ACTION_DELPORT &&
+        action != PMAP_UPNP_ACTION_GETEXTIP) {
+      pmap_npmp_withdraw(npmp_fd, op_code, &npmp_field);
+    }
+    close(npmp_fd);
+  }
+  if (ssdp_fd >= 0) {
+    close(ssdp_fd);
+  }
+  pmap_http_xfer_close(&xfer);
+  pmap_ut_free_url(dev);
+
+  return ret;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Execute an action on a gateway, straight with the protocol it answered
+ * last time, or racing both protocols if it is not known (or the known one
+ * stopped answering). `upnp_error` receives the errorCode of a SOAP fault,
+ * 0 if none.
+ */
+static int _pmap_action_gw(pmap_ctx_t *ctx, pmap_gw_t *gw, int action,
+                           pmap_field_t *pfield, char *external_ip, int esize,
+                           char *error, int size, int *upnp_error) {
+
+  pmap_url_comp_t *upnp;
+  pmap_tmo_t tmo;
+  int ret, rtt_ms;
+
+  pmap_ctx_timeouts(ctx, gw, &tmo);
+  *upnp_error = 0;
+  int protocol = pmap_gw_protocol(ctx, gw, &upnp);
+
+  if (protocol == PMAP_PROTO_NPMP) {
+
+    int op_code = NPMP_OPCODE_EXIP;
+    if (action != PMAP_UPNP_ACTION_GETEXTIP &&
+        (op_code = pmap_npmp_opcode(pfield->protocol)) < 0) {
+      return -2; // Protocol not supported
+    }
+    if (action == PMAP_UPNP_ACTION_DELPORT) {
+      pfield->lifetime_sec = 0; // Remove mapping
+    } else if (action != PMAP_UPNP_ACTION_GETEXTIP) {
+      pfield->lifetime_sec = pmap_npmp_lifetime(pfield->lifetime_sec);
+    }
+
+    ret = pmap_npmp_request(op_code, pfield, &tmo, &rtt_ms, external_ip, esize,
+                            error, size);
+    if (rtt_ms >= 0) {
+      pmap_gw_rtt_sample(ctx, gw, PMAP_RTT_NPMP, rtt_ms);
+    }
+
+    if (ret == 0 || errno != ETIMEDOUT) {
+      return ret;
+    }
+    pmap_gw_lost(ctx, gw, PMAP_RTT_NPMP, NULL);
+
+  } else if (protocol == PMAP_PROTO_UPNP && upnp != NULL) {
+
+    /* Only a single HTTP exchange is a sample, not control URL + action */
+    int known = (upnp->crtl_url != NULL);
+    int64_t start = pmap_ut_now_ms();
+    int http_status = 0;
+    pbuffer_t *pbfr_recv =
+        pmap_upnp_action_url(action, pfield, upnp, &http_status, &tmo);
+    if (pbfr_recv != NULL) {
+      if (known) {
+        pmap_gw_rtt_sample(ctx, gw, PMAP_RTT_HTTP,
+                           (int)(pmap_ut_now_ms() - start));
+      } else {
+        pmap_gw_upnp_learn(ctx, gw, upnp);
+      }
+      pmap_ut_free_url(upnp);
+      return pmap_gw_upnp_done(action, pfield, pbfr_recv, http_status,
+                               external_ip, esize, error, size, upnp_error);
+    }
+
+    /* Location is stale (IGD restarted on another port?) */
+    pmap_gw_lost(ctx, gw, PMAP_RTT_HTTP, upnp);
+    pmap_ut_free_url(upnp);
+
+  } else {
+    pmap_gw_lost(ctx, gw, -1, NULL);
+  }
+
+  PMAP_DEBUG_LOG("Protocol unknown for %s, racing\n",
+                 pmap_ut_inet_ntoa(pfield->gateway_ip));
+
+  /* Fail fast while every protocol is in the negative cache */
+  int64_t now = pmap_ut_now_ms();
+  if (pmap_gw_neg_valid(ctx, gw, PMAP_PROTO_NPMP, now) &&
+      pmap_gw_neg_valid(ctx, gw, PMAP_PROTO_UPNP, now)) {
+    if (NULL != error && size > 0) {
+      strncpy(error, "No port mapping protocol on gateway", size);
+      error[size - 1] = '\0';
+    }
+    errno = EGWUNSUPPORTED;
+    return 1; // caller should check errno value
+  }
+
+  return _pmap_race(ctx, gw, action, pfield, external_ip, esize, error, size,
+                    upnp_error);
+}
+
+/**
+ * Wait on the admission condition of a gateway for at most `wait_ms`.
+ */
+static void _pmap_gw_timedwait(pmap_ctx_t *ctx, pmap_gw_t *gw,
+                               int64_t wait_ms) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += wait_ms / 1000;
+  ts.tv_nsec += (wait_ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(&gw->admit, &ctx->lock, &ts);
+}
+
+/**
+ * Wait until requests to a gateway are admitted by its limits, see
+ * 'pmap_gw_admit'. Blocking calls wait in line (`gw->waiters`), only the
+ * first one asks the limits: an interactive call is not overtaken by
+ * background calls that came first. The line moves when a request ends
+ * ('pmap_gw_release'), a waiter leaves, or a token is earned.
+ *
+ * @return The number of requests admitted, 1 to `count`, or 0 if the wait
+ * would be too long (errno is ELIMITED).
+ */
+static int _pmap_gw_wait(pmap_ctx_t *ctx, pmap_gw_t *gw, int count,
+                         char *error, int size) {
+
+  pmap_gw_waiter_t self, **pos;
+  int64_t since = pmap_ut_now_ms();
+  int64_t wait_ms;
+  int n;
+
+  self.prio = pmap_priority_get();
+
+  pthread_mutex_lock(&ctx->lock);
+
+  pos = &gw->waiters;
+  while (NULL != *pos && (*pos)->prio <= self.prio) {
+    pos = &(*pos)->next;
+  }
+  self.next = *pos;
+  *pos = &self;
+
+  for (;;) {
+    int64_t now = pmap_ut_now_ms();
+    if (gw->waiters == &self || !pmap_limit_enabled(&gw->limit)) {
+      n = _pmap_gw_admit(gw, self.prio, count, since, now, &wait_ms);
+    } else if (now - since >= gw->limit.cfg.max_wait_ms) {
+      gw->limit.rejected++;
+      n = -1;
+    } else {
+      n = 0;
+      wait_ms = -1; // Until the waiters ahead are done
+    }
+    if (n != 0) {
+      break;
+    }
+
+    /* A request ending or a waiter leaving wakes up the line */
+    int64_t left = since + gw->limit.cfg.max_wait_ms - now;
+    _pmap_gw_timedwait(ctx, gw, (wait_ms < 0 || wait_ms > left) ? left
+                                                                : wait_ms);
+  }
+
+  for (pos = &gw->waiters; *pos != &self; pos = &(*pos)->next) {
+  }
+  *pos = self.next;
+  if (NULL != gw->waiters) {
+    pthread_cond_broadcast(&gw->admit);
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (n < 0) {
+    PMAP_DEBUG_LOG("Rate limit of %s, call refused\n",
+                   pmap_ut_inet_ntoa(gw->gateway_ip));
+    errno = ELIMITED;
+    if (NULL != error && size > 0) {
+      snprintf(error, size, "%s", pmap_ut_strerror(ELIMITED));
+    }
+    return 0;
+  }
+
+  return n;
+}
+
+/**
+ * Execute an action on a gateway once its limits admit it.
+ */
+static int _pmap_action_run(pmap_ctx_t *ctx, int action, pmap_field_t *pfield,
+                            char *external_ip, int esize, char *error,
+                            int size, int *upnp_error) {
+
+  pmap_gw_t *gw = pmap_ctx_gateway(ctx, pfield->gateway_ip);
+  if (NULL == gw) {
+    return 1; // caller should check errno value
+  }
+
+  if (_pmap_gw_wait(ctx, gw, 1, error, size) == 0) {
+    return 1; // caller should check errno value
+  }
+
+  int ret = _pmap_action_gw(ctx, gw, action, pfield, external_ip, esize,
+                            error, size, upnp_error);
+  int err = errno;
+
+  pmap_gw_release(ctx, gw, pmap_gw_outcome(ret, err));
+
+  errno = err;
+  return ret;
+}
+
+/**
+ * Whether a call is identical to the one in flight. The external IP request
+ * has no argument but the gateway.
+ */
+static int _pmap_flight_match(const pmap_flight_t *flight, int action,
+                              const pmap_field_t *pfield) {
+
+  const pmap_field_t *key = &flight->key;
+
+  if (flight->action != action || key->gateway_ip != pfield->gateway_ip) {
+    return 0;
+  }
+  if (action == PMAP_UPNP_ACTION_GETEXTIP) {
+    return 1;
+  }
+
+  return key->external_port == pfield->external_port &&
+         key->internal_port == pfield->internal_port &&
+         key->internal_ip == pfield->internal_ip &&
+         key->lifetime_sec == pfield->lifetime_sec &&
+         strncmp(key->protocol, pfield->protocol, sizeof(key->protocol)) == 0;
+}
+
+/**
+ * Drop a reference to a flight, under the context lock.
+ */
+static void _pmap_flight_put(pmap_flight_t *flight) {
+
+  if (--flight->refs == 0) {
+    pthread_cond_destroy(&flight->cond);
+    free(flight);
+  }
+}
+
+/**
+ * Execute an action on a gateway, coalesced with an identical call in
+ * flight: the first call runs the exchange ('_pmap_action_run'), the calls
+ * made meanwhile wait for it and get the same result, `upnp_error` (the
+ * errorCode of a SOAP fault, 0 if none) included.
+ */
+static int _pmap_action(pmap_ctx_t *ctx, int action, pmap_field_t *pfield,
+                        char *external_ip, int esize, char *error, int size,
+                        int *upnp_error) {
+
+  pmap_flight_t *flight;
+  int ret, err;
+
+  pthread_mutex_lock(&ctx->lock);
+  for (flight = ctx->flights; flight != NULL; flight = flight->next) {
+    if (_pmap_flight_match(flight, action, pfield)) {
+      break;
+    }
+  }
+
+  if (NULL != flight) {
+    PMAP_DEBUG_LOG("Coalesced with the call in flight\n");
+    flight->refs++;
+    ctx->coalesced++;
+    while (!flight->done) {
+      pthread_cond_wait(&flight->cond, &ctx->lock);
+    }
+
+    ret = flight->ret;
+    err = flight->err;
+    *upnp_error = flight->upnp_error;
+    if (action != PMAP_UPNP_ACTION_GETEXTIP) {
+      /* Set by the gateway (NAT-PMP) */
+      pfield->external_port = flight->pfield.external_port;
+      pfield->lifetime_sec = flight->pfield.lifetime_sec;
+    }
+    if (ret == 0 && NULL != external_ip && esize > 0) {
+      snprintf(external_ip, esize, "%s", flight->external_ip);
+    }
+    if (ret != 0 && NULL != error && size > 0 && flight->error[0] != '\0') {
+      snprintf(error, size, "%s", flight->error);
+    }
+    _pmap_flight_put(flight);
+    pthread_mutex_unlock(&ctx->lock);
+
+    errno = err;
+    return ret;
+  }
+
+  flight = calloc(1, sizeof(pmap_flight_t));
+  if (NULL == flight) {
+    /* Not coalesced, still worth trying */
+    pthread_mutex_unlock(&ctx->lock);
+    return _pmap_action_run(ctx, action, pfield, external_ip, esize, error,
+                            size, upnp_error);
+  }
+  flight->action = action;
+  flight->key = *pfield;
+  flight->refs = 1;
+  pthread_cond_init(&flight->cond, NULL);
+  flight->next = ctx->flights;
+  ctx->flights = flight;
+  pthread_mutex_unlock(&ctx->lock);
+
+  /* The leader reports into its own buffers, the waiters get a copy */
+  if (NULL == external_ip || esize <= 0) {
+    external_ip = flight->external_ip;
+    esize = sizeof(flight->external_ip);
+  }
+  if (NULL == error || size <= 0) {
+    error = flight->error;
+    size = sizeof(flight->error);
+  }
+  error[0] = '\0';
+
+  ret = _pmap_action_run(ctx, action, pfield, external_ip, esize, error, size,
+                         upnp_error);
+  err = errno;
+
+  pthread_mutex_lock(&ctx->lock);
+  flight->ret = ret;
+  flight->err = err;
+  flight->upnp_error = *upnp_error;
+  flight->pfield = *pfield;
+  if (external_ip != flight->external_ip) {
+    snprintf(flight->external_ip, sizeof(flight->external_ip), "%s",
+             (ret == 0) ? external_ip : "");
+  }
+  if (error != flight->error) {
+    snprintf(flight->error, sizeof(flight->error), "%s", error);
+  }
+  flight->done = 1;
+
+  /* Later calls start a new exchange */
+  pmap_flight_t **pp = &ctx->flights;
+  while (*pp != flight) {
+    pp = &(*pp)->next;
+  }
+  *pp = flight->next;
+
+  pthread_cond_broadcast(&flight->cond);
+  _pmap_flight_put(flight);
+  pthread_mutex_unlock(&ctx->lock);
+
+  errno = err;
+  return ret;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Occupancy bitmap of a gateway for a protocol, under the context lock like
+ * the bitmap itself.
+ *
+ * @param create Allocate it if the gateway has none yet.
+ * @return The bitmap, or NULL (errno is EINVALIDPROT for a protocol other
+ * than TCP and UDP).
+ */
+static pmap_ports_t *_pmap_gw_ports(pmap_gw_t *gw, const char *protocol,
+                                    int create) {
+
+  int i;
+
+  if (strcasecmp(protocol, "TCP") == 0) {
+    i = 0;
+  } else if (strcasecmp(protocol, "UDP") == 0) {
+    i = 1;
+  } else {
+    errno = EINVALIDPROT;
+    return NULL;
+  }
+
+  if (NULL == gw->ports[i] && create) {
+    gw->ports[i] = pmap_ports_create();
+  }
+
+  return gw->ports[i];
+}
+
+/**
+ * Record that a mapping was added (`used` is 1) or deleted (`used` is 0)
+ * in the bitmap of its gateway, if the gateway has one.
+ */
+void pmap_ctx_ports_mark(pmap_ctx_t *ctx, pmap_field_t *pfield, int used) {
+
+  pmap_gw_t *gw;
+
+  pthread_mutex_lock(&ctx->lock);
+  for (gw = ctx->gateways; gw != NULL; gw = gw->next) {
+    if (gw->gateway_ip == pfield->gateway_ip) {
+      break;
+    }
+  }
+
+  pmap_ports_t *ports = (NULL != gw)
+                            ? _pmap_gw_ports(gw, pfield->protocol, 0)
+                            : NULL;
+  if (NULL != ports) {
+    if (used) {
+      pmap_ports_set(ports, pfield->external_port);
+    } else {
+      pmap_ports_clear(ports, pfield->external_port);
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * 'pmap_ports_set' under the context lock.
+ */
+static void _pmap_ports_set(pmap_ctx_t *ctx, pmap_ports_t *ports, int port) {
+
+  pthread_mutex_lock(&ctx->lock);
+  pmap_ports_set(ports, port);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Fill a bitmap from the mapping table of an UPnP gateway, with
+ * GetListOfPortMappings on IGD:2 or entry by entry otherwise. Every request
+ * is admitted by the limits of the gateway, the table is read one entry at a
+ * time (no pipelining) while they are enabled. The bitmap stays unseeded if a
+ * request is refused or the walk stops before the end of the table (713
+ * SpecifiedArrayIndexInvalid), so the next allocation reads it again.
+ */
+static void _pmap_ports_seed(pmap_ctx_t *ctx, pmap_gw_t *gw,
+                             pmap_url_comp_t *upnp, pmap_ports_t *ports,
+                             const char *protocol) {
+
+  pmap_upnp_entry_t *entries = NULL, entry;
+  pmap_tmo_t tmo;
+  int count = 0, ret, err;
+
+  pmap_ctx_timeouts(ctx, gw, &tmo);
+
+  if (upnp->version >= 2) {
+    if (_pmap_gw_wait(ctx, gw, 1, NULL, 0) == 0) {
+      return;
+    }
+    ret = pmap_upnp_list_url(upnp, protocol, 1, 65535, &entries, &count, &tmo);
+    err = errno;
+    pmap_gw_release(ctx, gw, pmap_gw_outcome(ret, err));
+    if (ret == 0) {
+      pthread_mutex_lock(&ctx->lock);
+      for (int i = 0; i < count; i++) {
+        pmap_ports_set(ports, entries[i].field.external_port);
+      }
+      ports->seeded = 1;
+      pthread_mutex_unlock(&ctx->lock);
+      free(entries);
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  int depth = pmap_limit_enabled(&gw->limit) ? 1 : 0;
+  pthread_mutex_unlock(&ctx->lock);
+
+  pmap_upnp_iter_t *it = pmap_upnp_iter_create_url(upnp, depth, &tmo);
+  if (NULL == it) {
+    return;
+  }
+  int end = 0;
+  while (_pmap_gw_wait(ctx, gw, 1, NULL, 0) > 0) {
+    ret = pmap_upnp_iter_next(it, &entry);
+    err = errno;
+    pmap_gw_release(ctx, gw, pmap_gw_outcome(ret, err));
+    if (ret != 0) {
+      end = (it->upnp_error == PMAP_UPNP_ERR_INVALID_INDEX);
+      break;
+    }
+    if (strcasecmp(entry.field.protocol, protocol) == 0) {
+      _pmap_ports_set(ctx, ports, entry.field.external_port);
+    }
+  }
+  pmap_upnp_iter_destroy(it);
+
+  if (!end) {
+    PMAP_DEBUG_LOG("%s ports of %s not seeded, walk stopped early\n",
+                   protocol, pmap_ut_inet_ntoa(gw->gateway_ip));
+    return; // The ports read so far stay marked
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  ports->seeded = 1;
+  pthread_mutex_unlock(&ctx->lock);
+
+  PMAP_DEBUG_LOG("%s ports of %s seeded\n", protocol,
+                 pmap_ut_inet_ntoa(gw->gateway_ip));
+}
+
+/**
+ * 'pmap_addport' also returning the errorCode of a SOAP fault in
+ * `upnp_error`, 0 if none.
+ */
+static int _pmap_addport(pmap_ctx_t *ctx, pmap_field_t *pfield, char *error,
+                         int size, int *upnp_error) {
+
+  int ret = _pmap_action(ctx, PMAP_UPNP_ACTION_ADDPORT, pfield, NULL, 0, error,
+                         size, upnp_error);
+  if (ret == 0) {
+    pmap_ctx_ports_mark(ctx, pfield, 1);
+  }
+
+  return ret;
+}
+
+/**
+ * Add a port mapping with whichever protocol the gateway speaks.
+ *
+ * The first call for a gateway sends a NAT-PMP request and an UPnP M-SEARCH
+ * at the same time and uses the protocol that answers first, the winner is
+ * kept in `ctx` so later calls go straight to it.
+ *
+ * @param ctx The client context.
+ * @param pfield A pointer to a `pmap_field_t` structure containing the details
+ * of the port mapping to be added. With NAT-PMP `external_port` and
+ * `lifetime_sec` are updated with the values assigned by the gateway.
+ * @param error A character array where an error description will be stored in
+ * case of failure.
+ * @param size The size of the `error` character array.
+ * @return 0 on success, 1 on failure (caller should check errno value), -2
+ * if protocol is not supported.
+ */
+int pmap_addport(pmap_ctx_t *ctx, pmap_field_t *pfield, char *error,
+                 int size) {
+
+  int upnp_error;
+
+  return _pmap_addport(ctx, pfield, error, size, &upnp_error);
+}
+
+/**
+ * Make sure a port mapping exists, writing to the gateway only if needed.
+ *
+ * With UPnP the mapping is read first (GetSpecificPortMappingEntry) and
+ * AddPortMapping is sent only when it is missing, goes elsewhere or has too
+ * little lease left, see 'pmap_upnp_entry_current'. NAT-PMP has no read
+ * request and a gateway whose protocol is not known yet is raced, in both
+ * cases the mapping is added ('pmap_addport').
+ *
+ * @param ctx The client context.
+ * @param pfield A pointer to a `pmap_field_t` structure containing the details
+ * of the wanted port mapping. `lifetime_sec` is updated with the lease left
+ * when nothing was written, otherwise as by 'pmap_addport'.
+ * @param written Set to 1 if the gateway was written to, 0 otherwise.
+ * @param error A character array where an error description will be stored in
+ * case of failure.
+ * @param size The size of the `error` character array.
+ * @return 0 on success, 1 on failure (caller should check errno value), -2
+ * if protocol is not supported.
+ */
+int pmap_ensureport(pmap_ctx_t *ctx, pmap_field_t *pfield, int *written,
+                    char *error, int size) {
+
+  pmap_upnp_entry_t entry;
+  pmap_url_comp_t *upnp;
+  pmap_tmo_t tmo;
+  int ret, upnp_error;
+
+  *written = 0;
+
+  pmap_gw_t *gw = pmap_ctx_gateway(ctx, pfield->gateway_ip);
+  if (NULL == gw) {
+    return 1; // caller should check errno value
+  }
+
+  if (pmap_gw_protocol(ctx, gw, &upnp) == PMAP_PROTO_UPNP && upnp != NULL) {
+
+    if (_pmap_gw_wait(ctx, gw, 1, error, size) == 0) {
+      pmap_ut_free_url(upnp);
+      return 1; // caller should check errno value
+    }
+
+    int known = (upnp->crtl_url != NULL);
+    int64_t start = pmap_ut_now_ms();
+    pmap_ctx_timeouts(ctx, gw, &tmo);
+
+    ret = pmap_upnp_getspecific_url(upnp, pfield, &entry, &upnp_error, &tmo);
+    int err = errno;
+    pmap_gw_release(ctx, gw, pmap_gw_outcome(ret, err));
+    if (known && (ret == 0 || err == ENOENT || err == EUPNPFAULT)) {
+      pmap_gw_rtt_sample(ctx, gw, PMAP_RTT_HTTP,
+                         (int)(pmap_ut_now_ms() - start));
+    } else if (!known && NULL != upnp->crtl_url) {
+      pmap_gw_upnp_learn(ctx, gw, upnp);
+    }
+    pmap_ut_free_url(upnp);
+    errno = err;
+
+    if (ret == 0 && pmap_upnp_entry_current(&entry, pfield)) {
+      pfield->lifetime_sec = entry.field.lifetime_sec;
+      pmap_ctx_ports_mark(ctx, pfield, 1);
+      return 0;
+    }
+    /* Missing, different or not readable, a stale location is left to the
+     * add which falls back to the race */
+  }
+
+  ret = pmap_addport(ctx, pfield, error, size);
+  *written = (ret == 0);
+
+  return ret;
+}
+
+/**
+ * Add a port mapping on a free external port.
+ *
+ * `pfield->external_port` is the preferred port (0 for any). IGD:2 gateways
+ * pick a free port themselves (AddAnyPortMapping, one call). Otherwise the
+ * port is taken from a per gateway occupancy bitmap. The bitmap is filled
+ * from the mapping table of UPnP gateways and from the ports found taken,
+ * so no port known to be used is tried.
+ *
+ * @param ctx The client context.
+ * @param pfield A pointer to a `pmap_field_t` structure containing the details
+ * of the port mapping to be added. `external_port` and, with NAT-PMP,
+ * `lifetime_sec` are updated with the values assigned by the gateway.
+ * @param error A character array where an error description will be stored in
+ * case of failure.
+ * @param size The size of the `error` character array.
+ * @return 0 on success, 1 on failure (caller should check errno value, ENOSPC
+ * if no free port was found), -2 if protocol is not supported.
+ */
+int pmap_addport_any(pmap_ctx_t *ctx, pmap_field_t *pfield, char *error,
+                     int size) {
+
+  int ret = 1, upnp_error;
+
+  pmap_gw_t *gw = pmap_ctx_gateway(ctx, pfield->gateway_ip);
+  if (NULL == gw) {
+    return 1; // caller should check errno value
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  pmap_ports_t *ports = _pmap_gw_ports(gw, pfield->protocol, 1);
+  pthread_mutex_unlock(&ctx->lock);
+  if (NULL == ports) {
+    return (errno == EINVALIDPROT) ? -2 : 1;
+  }
+
+  int candidate = pfield->external_port;
+
+  for (int tries = 0; tries < PMAP_PORTS_TRIES; tries++) {
+
+    pmap_url_comp_t *upnp;
+    int protocol = pmap_gw_protocol(ctx, gw, &upnp);
+
+    if (protocol == PMAP_PROTO_UPNP && upnp != NULL && upnp->version >= 2) {
+      /* A port not known to be taken is the best hint for the gateway */
+      pthread_mutex_lock(&ctx->lock);
+      candidate = pmap_ports_next(ports, candidate, PMAP_PORTS_MIN,
+                                  PMAP_PORTS_MAX);
+      pthread_mutex_unlock(&ctx->lock);
+      if (candidate >= 0) {
+        pfield->external_port = candidate;
+      }
+      ret = _pmap_action(ctx, PMAP_UPNP_ACTION_ADDANY, pfield, NULL, 0, error,
+                         size, &upnp_error);
+      if (ret == 0 || upnp_error != PMAP_UPNP_ERR_INVALID_ACTION) {
+        if (ret == 0) {
+          _pmap_ports_set(ctx, ports, pfield->external_port);
+        }
+        pmap_ut_free_url(upnp);
+        return ret;
+      }
+      upnp->version = 1; // Announced IGD:2 but not AddAnyPortMapping
+      pmap_gw_upnp_learn(ctx, gw, upnp);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    int seeded = ports->seeded;
+    pthread_mutex_unlock(&ctx->lock);
+    if (protocol == PMAP_PROTO_UPNP && upnp != NULL && !seeded) {
+      _pmap_ports_seed(ctx, gw, upnp, ports, pfield->protocol);
+    }
+    pmap_ut_free_url(upnp);
+
+    pthread_mutex_lock(&ctx->lock);
+    candidate = pmap_ports_next(ports, candidate, PMAP_PORTS_MIN,
+                                PMAP_PORTS_MAX);
+    pthread_mutex_unlock(&ctx->lock);
+    if (candidate < 0) {
+      break;
+    }
+
+    pfield->external_port = candidate;
+    if ((ret = _pmap_addport(ctx, pfield, error, size, &upnp_error)) == 0) {
+      if (pfield->external_port != candidate) {
+        _pmap_ports_set(ctx, ports, candidate); // NAT-PMP gave another port
+      }
+      return 0;
+    }
+    if (upnp_error != PMAP_UPNP_ERR_CONFLICT) {
+      return ret;
+    }
+
+    PMAP_DEBUG_LOG("Port %d taken on %s\n", candidate,
+                   pmap_ut_inet_ntoa(gw->gateway_ip));
+    _pmap_ports_set(ctx, ports, candidate);
+  }
+
+  if (NULL != error && size > 0) {
+    strncpy(error, "No free external port", size);
+    error[size - 1] = '\0';
+  }
+  errno = ENOSPC;
+
+  return 1;
+}
+
+/**
+ * 'pmap_delport' also returning the errorCode of a SOAP fault in
+ * `upnp_error`, 0 if none.
+ */
+static int _pmap_delport(pmap_ctx_t *ctx, pmap_field_t *pfield, char *error,
+                         int size, int *upnp_error) {
+
+  int ret = _pmap_action(ctx, PMAP_UPNP_ACTION_DELPORT, pfield, NULL, 0, error,
+                         size, upnp_error);
+  if (ret == 0) {
+    pmap_ctx_ports_mark(ctx, pfield, 0);
+  }
+
+  return ret;
+}
+
+/**
+ * Delete a port mapping with whichever protocol the gateway speaks.
+ *
+ * @param ctx The client context.
+ * @param pfield A pointer to a `pmap_field_t` structure containing the details
+ * of the port mapping to be deleted.
+ * @param error A character array where an error description will be stored in
+ * case of failure.
+ * @param size The size of the `error` character array.
+ * @return 0 on success, 1 on failure (caller should check errno value), -2
+ * if protocol is not supported.
+ */
+int pmap_delport(pmap_ctx_t *ctx, pmap_field_t *pfield, char *error,
+                 int size) {
+
+  int upnp_error;
+
+  return _pmap_delport(ctx, pfield, error, size, &upnp_error);
+}
+
+/**
+ * Add, delete or ensure the UPnP mappings of one gateway with a known IGD
+ * over one keep-alive connection, see 'pmap_delport_batch'. Each entry of the
+ * gateway gets its status from this one attempt, those the gateway did not
+ * answer for (location stale, out of memory) fail.
+ */
+static void _pmap_batch_upnp(pmap_ctx_t *ctx, pmap_gw_t *gw,
+                             pmap_url_comp_t *upnp, int action,
+                             pmap_field_t *pfields, int count, int *status,
+                             int *errs) {
+
+  pmap_tmo_t tmo;
+  int n = 0, known = (NULL != upnp->crtl_url);
+
+  pmap_field_t *batch = malloc(count * sizeof(pmap_field_t));
+  int *index = malloc(count * sizeof(int));
+  pmap_upnp_res_t *results = malloc(count * sizeof(pmap_upnp_res_t));
+  if (NULL == batch || NULL == index || NULL == results) {
+    PMAP_DEBUG_ERROR("Out of memory");
+    for (int i = 0; i < count; i++) {
+      if (status[i] < 0 && pfields[i].gateway_ip == gw->gateway_ip) {
+        status[i] = 1;
+        errs[i] = ENOMEM;
+      }
+    }
+    free(batch);
+    free(index);
+    free(results);
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (status[i] < 0 && pfields[i].gateway_ip == gw->gateway_ip) {
+      index[n] = i;
+      batch[n++] = pfields[i];
+    }
+  }
+
+  /* As many requests per connection as the limits of the gateway admit */
+  for (int off = 0, chunk; off < n; off += chunk) {
+    if ((chunk = _pmap_gw_wait(ctx, gw, n - off, NULL, 0)) == 0) {
+      for (int j = off; j < n; j++) {
+        status[index[j]] = 1; // ELIMITED, not retried one by one
+        errs[index[j]] = errno;
+      }
+      break;
+    }
+
+    pmap_ctx_timeouts(ctx, gw, &tmo);
+    if (action == PMAP_UPNP_ACTION_ADDPORT) {
+      pmap_upnp_addport_batch_url(upnp, batch + off, chunk, results + off,
+                                  &tmo);
+    } else if (action == PMAP_UPNP_ACTION_ENSURE) {
+      pmap_upnp_ensure_batch_url(upnp, batch + off, chunk, results + off,
+                                 &tmo);
+    } else {
+      pmap_upnp_delport_batch_url(upnp, batch + off, chunk, results + off,
+                                  &tmo);
+    }
+
+    int outcome = PMAP_LIMIT_OK;
+    for (int j = off; j < off + chunk; j++) {
+      if (results[j].http_status == 0 ||
+          (results[j].http_status >= 500 && results[j].upnp_error == 0)) {
+        outcome = PMAP_LIMIT_OVERLOAD;
+      }
+    }
+    pmap_gw_release(ctx, gw, outcome);
+  }
+  if (!known && NULL != upnp->crtl_url) {
+    pmap_gw_upnp_learn(ctx, gw, upnp);
+  }
+
+  /* The gateway had its attempt, a request without response fails too */
+  for (int j = 0; j < n; j++) {
+    if (status[index[j]] >= 0) {
+      continue;
+    }
+    /* NoSuchEntryInArray, the mapping is gone (expired or deleted before) */
+    status[index[j]] =
+        (results[j].status == 0 ||
+         (action == PMAP_UPNP_ACTION_DELPORT &&
+          results[j].upnp_error == PMAP_UPNP_ERR_NO_SUCH_ENTRY))
+            ? 0
+            : 1;
+    if (status[index[j]] == 0) {
+      pfields[index[j]].lifetime_sec = batch[j].lifetime_sec; // Lease left
+      pmap_ctx_ports_mark(ctx, &batch[j], action != PMAP_UPNP_ACTION_DELPORT);
+    } else {
+      /* No answer, the request may have been applied */
+      errs[index[j]] = (results[j].http_status == 0)
+                           ? ETIMEDOUT
+                           : pmap_upnp_errno(results[j].http_status,
+                                             results[j].upnp_error);
+    }
+  }
+
+  free(batch);
+  free(index);
+  free(results);
+}
+
+/**
+ * Batch version of 'pmap_addport', 'pmap_delport' and 'pmap_ensureport'.
+ * `errs`, if not NULL, receives the errno of each entry (0 for success).
+ */
+static int _pmap_batch(pmap_ctx_t *ctx, int action, pmap_field_t *pfields,
+                       int count, int *status, int *errs) {
+
+  char error[64];
+  int ret = 0, upnp_error, written;
+
+  if (count <= 0) {
+    return 0;
+  }
+
+  int *st = (NULL != status) ? status : malloc(count * sizeof(int));
+  int *er = (NULL != errs) ? errs : malloc(count * sizeof(int));
+  if (NULL == st || NULL == er) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    if (st != status) {
+      free(st);
+    }
+    if (er != errs) {
+      free(er);
+    }
+    return 1;
+  }
+  for (int i = 0; i < count; i++) {
+    st[i] = -1; // Not done yet
+    er[i] = 0;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (st[i] >= 0) {
+      continue;
+    }
+    pmap_gw_t *gw = pmap_ctx_gateway(ctx, pfields[i].gateway_ip);
+    pmap_url_comp_t *upnp = NULL;
+    if (NULL != gw &&
+        pmap_gw_protocol(ctx, gw, &upnp) == PMAP_PROTO_UPNP && NULL != upnp) {
+      _pmap_batch_upnp(ctx, gw, upnp, action, pfields, count, st, er);
+    }
+    pmap_ut_free_url(upnp);
+    if (st[i] >= 0) {
+      continue;
+    }
+    memset(error, 0x00, sizeof(error));
+    if (action == PMAP_UPNP_ACTION_ADDPORT) {
+      st[i] = (pmap_addport(ctx, &pfields[i], error, sizeof(error)) == 0)
+                  ? 0
+                  : 1;
+    } else if (action == PMAP_UPNP_ACTION_ENSURE) {
+      st[i] = (pmap_ensureport(ctx, &pfields[i], &written, error,
+                               sizeof(error)) == 0)
+                  ? 0
+                  : 1;
+    } else {
+      int r = _pmap_delport(ctx, &pfields[i], error, sizeof(error),
+                            &upnp_error);
+      st[i] = (r == 0 || upnp_error == PMAP_UPNP_ERR_NO_SUCH_ENTRY) ? 0 : 1;
+    }
+    if (st[i] != 0) {
+      er[i] = errno;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (st[i] != 0) {
+      ret = 1;
+    }
+  }
+
+  if (st != status) {
+    free(st);
+  }
+  if (er != errs) {
+    free(er);
+  }
+
+  return ret;
+}
+
+/**
+ * Add several port mappings with whichever protocol each gateway speaks.
+ * The UPnP requests of a gateway whose IGD is known are sent over one
+ * keep-alive connection, once: those without response fail. Other mappings
+ * are added one by one with 'pmap_addport' (which may update
+ * `external_port` and `lifetime_sec`).
+ *
+ * @param ctx The client context.
+ * @param pfields The port mappings to add, gateways may differ.
+ * @param count Number of entries in `pfields`.
+ * @param status Array of `count` entries receiving 0 for each added
+ * mapping and 1 for each failure, NULL if not needed.
+ * @return 0 if all mappings were added, 1 otherwise.
+ */
+int pmap_addport_batch(pmap_ctx_t *ctx, pmap_field_t *pfields, int count,
+                       int *status) {
+
+  return _pmap_batch(ctx, PMAP_UPNP_ACTION_ADDPORT, pfields, count, status,
+                     NULL);
+}
+
+/**
+ * 'pmap_addport_batch' also returning the errno of each add, so a caller can
+ * tell a refused add from one that may have been applied
+ * ('pmap_ut_unsure').
+ *
+ * @param errs Array of `count` entries receiving 0 for each added mapping and
+ * the errno of each failure (ETIMEDOUT if the gateway did not answer).
+ */
+int pmap_addport_batch_errno(pmap_ctx_t *ctx, pmap_field_t *pfields,
+                             int count, int *status, int *errs) {
+
+  return _pmap_batch(ctx, PMAP_UPNP_ACTION_ADDPORT, pfields, count, status,
+                     errs);
+}
+
+/**
+ * Delete several port mappings with whichever protocol each gateway speaks,
+ * see 'pmap_addport_batch'. A mapping the gateway does not know (UPnP error
+ * 714) counts as deleted.
+ *
+ * @param ctx The client context.
+ * @param pfields The port mappings to delete, gateways may differ.
+ * @param count Number of entries in `pfields`.
+ * @param status Array of `count` entries receiving 0 for each deleted
+ * mapping and 1 for each failure, NULL if not needed.
+ * @return 0 if all mappings were deleted, 1 otherwise.
+ */
+int pmap_delport_batch(pmap_ctx_t *ctx, pmap_field_t *pfields, int count,
+                       int *status) {
+
+  return _pmap_batch(ctx, PMAP_UPNP_ACTION_DELPORT, pfields, count, status,
+                     NULL);
+}
+
+/**
+ * Make sure several port mappings exist without rewriting those that are
+ * current, see 'pmap_ensureport' and 'pmap_addport_batch'. With UPnP the
+ * mappings of a gateway are read over one keep-alive connection and only
+ * those missing or stale are added on it. Other mappings go through
+ * 'pmap_ensureport' one by one.
+ *
+ * @param ctx The client context.
+ * @param pfields The wanted port mappings, gateways may differ. `lifetime_sec`
+ * is updated with the lease left when a mapping was current.
+ * @param count Number of entries in `pfields`.
+ * @param status Array of `count` entries receiving 0 for each mapping in
+ * place and 1 for each failure, NULL if not needed.
+ * @return 0 if all mappings are in place, 1 otherwise.
+ */
+int pmap_ensureport_batch(pmap_ctx_t *ctx, pmap_field_t *pfields, int count,
+                          int *status) {
+
+  return _pmap_batch(ctx, PMAP_UPNP_ACTION_ENSURE, pfields, count, status,
+                     NULL);
+}
+
+/**
+ * Retrieve the external IP address with whichever protocol the gateway
+ * speaks.
+ *
+ * @param ctx The client context.
+ * @param pfield A pointer to a `pmap_field_t` structure, only `gateway_ip` is
+ * used.
+ * @param external_ip A character array where the external IP address will be
+ * stored if the operation is successful.
+ * @param esize The size of the `external_ip` character array.
+ * @param error A character array where an error description will be stored in
+ * case of failure.
+ * @param size The size of the `error` character array.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_getexip(pmap_ctx_t *ctx, pmap_field_t *pfield, char *external_ip,
+                 int esize, char *error, int size) {
+
+  int upnp_error;
+
+  return _pmap_action(ctx, PMAP_UPNP_ACTION_GETEXTIP, pfield, external_ip,
+                      esize, error, size, &upnp_error);
+}
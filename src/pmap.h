@@ -0,0 +1,184 @@
+/*
+ *    pmap.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_H
+#define _PMAP_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "buffer.h"
+#include "pmap_cfg.h"
+#include "pmap_limit.h"
+#include "pmap_ports.h"
+#include "pmap_rtt.h"
+#include "util.h"
+
+/* Port mapping protocols */
+#define PMAP_PROTO_NONE 0 /* Not known yet, race all of them */
+#define PMAP_PROTO_NPMP 1
+#define PMAP_PROTO_UPNP 2
+#define PMAP_PROTO_MAX 3
+
+/**
+ * Negative cache entry of a protocol on a gateway. While `until_ms` is in the
+ * future the protocol is not probed, `failures` counts the failed probes in a
+ * row (the next TTL is doubled for each one).
+ */
+typedef struct pmap_neg_t_ {
+  int64_t until_ms; /* pmap_ut_now_ms() of the next probe, 0 if none */
+  int failures;
+} pmap_neg_t;
+
+/**
+ * Blocking call waiting for admission by the limits of a gateway. Waiters
+ * are served by priority, in arrival order within a priority.
+ */
+typedef struct pmap_gw_waiter_t_ {
+  struct pmap_gw_waiter_t_ *next;
+  int prio; /* PMAP_PRIO_* */
+} pmap_gw_waiter_t;
+
+/**
+ * What the client context knows about one gateway. Everything but
+ * `gateway_ip` and `next` is under the context lock, which is never held
+ * during an exchange: calls read the protocol and a copy of the IGD location
+ * ('pmap_gw_protocol') and report back what they learned (pmap_gw_*).
+ */
+typedef struct pmap_gw_t_ {
+  struct pmap_gw_t_ *next;
+
+  uint32_t gateway_ip;
+  int protocol;          /* Winner of the last race (PMAP_PROTO_*) */
+  pmap_url_comp_t *upnp; /* IGD location and control URL (UPnP only) */
+  pmap_rtt_t rtt[PMAP_RTT_MAX]; /* Round trip estimators (PMAP_RTT_*) */
+  pmap_neg_t neg[PMAP_PROTO_MAX]; /* Negative cache (PMAP_PROTO_*) */
+  pmap_limit_t limit;       /* Admission control */
+  pmap_gw_waiter_t *waiters; /* Blocking calls waiting */
+  pthread_cond_t admit;      /* A request ended or a waiter left */
+  pmap_ports_t *ports[2];   /* External ports in use, TCP and UDP */
+} pmap_gw_t;
+
+/**
+ * Blocking call in flight on a context. Identical calls made meanwhile (same
+ * action, gateway and arguments) wait for it and share its result instead of
+ * starting their own exchange.
+ */
+typedef struct pmap_flight_t_ {
+  struct pmap_flight_t_ *next;
+  int action;       /* PMAP_UPNP_ACTION_* */
+  pmap_field_t key; /* Arguments of the call */
+  int refs;         /* Leader and waiters, the last one frees it */
+  int done;
+  pthread_cond_t cond;
+
+  /* Result, valid once `done` is set */
+  int ret;
+  int err;        /* errno */
+  int upnp_error; /* errorCode of a UPnP fault, 0 if none */
+  pmap_field_t pfield;
+  char external_ip[16];
+  char error[64];
+} pmap_flight_t;
+
+/**
+ * Client context, keeps per gateway state between calls. Create it once with
+ * 'pmap_ctx_create' and pass it to the unified pmap_* functions.
+ *
+ * Threads may share a context, also to work on the same gateway: the state
+ * of the gateways is under `lock` (see pmap_gw_t). Identical calls are
+ * coalesced, only the first one reaches the gateway (see `flights`). The
+ * asynchronous operations of a context (pmap_async.h) are driven by a single
+ * thread.
+ */
+typedef struct pmap_ctx_t_ {
+  pthread_mutex_t lock; /* Protects the gateways and their state */
+  pmap_gw_t *gateways;
+  pmap_tmo_t tmo_floor; /* Lower bounds of the adaptive timeouts */
+  pmap_tmo_t tmo_ceil;  /* Upper bounds of the adaptive timeouts */
+  pmap_limit_cfg_t limit; /* Admission limits of new gateways */
+  struct pmap_aop_t_ *async; /* Pending asynchronous operations */
+  struct pmap_uring_t_ *uring; /* io_uring transport of `async`, or NULL */
+  struct pmap_engine_t_ *engine; /* Thread driving `async`, or NULL */
+  pmap_flight_t *flights; /* Blocking calls in flight, under `lock` */
+  uint64_t coalesced;     /* Calls that shared a flight, under `lock` */
+} pmap_ctx_t;
+
+pmap_ctx_t *pmap_ctx_create(void);
+void pmap_ctx_destroy(pmap_ctx_t *ctx);
+pmap_gw_t *pmap_ctx_gateway(pmap_ctx_t *ctx, uint32_t gateway_ip);
+void pmap_ctx_set_timeouts(pmap_ctx_t *ctx, const pmap_tmo_t *floor,
+                           const pmap_tmo_t *ceil);
+void pmap_ctx_timeouts(pmap_ctx_t *ctx, pmap_gw_t *gw, pmap_tmo_t *tmo);
+void pmap_ctx_flush_negative(pmap_ctx_t *ctx);
+int pmap_ctx_save(pmap_ctx_t *ctx, const char *path);
+int pmap_ctx_load(pmap_ctx_t *ctx, const char *path);
+void pmap_ctx_ports_mark(pmap_ctx_t *ctx, pmap_field_t *pfield, int used);
+uint64_t pmap_ctx_coalesced(pmap_ctx_t *ctx);
+int pmap_ctx_set_limit(pmap_ctx_t *ctx, uint32_t gateway_ip,
+                       const pmap_limit_cfg_t *cfg);
+int pmap_ctx_limit(pmap_ctx_t *ctx, uint32_t gateway_ip,
+                   pmap_limit_state_t *state);
+
+int pmap_gw_neg_valid(pmap_ctx_t *ctx, pmap_gw_t *gw, int protocol,
+                      int64_t now);
+void pmap_gw_neg_fail(pmap_ctx_t *ctx, pmap_gw_t *gw, int protocol);
+void pmap_gw_neg_clear(pmap_ctx_t *ctx, pmap_gw_t *gw, int protocol);
+int pmap_gw_protocol(pmap_ctx_t *ctx, pmap_gw_t *gw, pmap_url_comp_t **upnp);
+void pmap_gw_won(pmap_ctx_t *ctx, pmap_gw_t *gw, int protocol,
+                 const pmap_url_comp_t *upnp);
+void pmap_gw_lost(pmap_ctx_t *ctx, pmap_gw_t *gw, int rtt,
+                  const pmap_url_comp_t *upnp);
+void pmap_gw_race_end(pmap_ctx_t *ctx, pmap_gw_t *gw, int npmp_tmo,
+                      int try_upnp, int http_tmo);
+void pmap_gw_upnp_learn(pmap_ctx_t *ctx, pmap_gw_t *gw,
+                        const pmap_url_comp_t *upnp);
+void pmap_gw_rtt_sample(pmap_ctx_t *ctx, pmap_gw_t *gw, int rtt, int ms);
+int pmap_gw_srtt_ms(pmap_ctx_t *ctx, pmap_gw_t *gw, int rtt);
+int pmap_gw_admit(pmap_ctx_t *ctx, pmap_gw_t *gw, int prio, int count,
+                  int64_t since, int64_t now, int64_t *wait_ms);
+int pmap_gw_queue(pmap_ctx_t *ctx, pmap_gw_t *gw, int prio, int delta);
+int pmap_gw_outcome(int ret, int err);
+void pmap_gw_release(pmap_ctx_t *ctx, pmap_gw_t *gw, int outcome);
+int pmap_gw_upnp_done(int action, pmap_field_t *pfield, pbuffer_t *pbfr_recv,
+                      int http_status, char *external_ip, int esize,
+                      char *error, int size, int *upnp_error);
+
+int pmap_addport(pmap_ctx_t *ctx, pmap_field_t *pfield, char *error, int size);
+int pmap_ensureport(pmap_ctx_t *ctx, pmap_field_t *pfield, int *written,
+                    char *error, int size);
+int pmap_addport_any(pmap_ctx_t *ctx, pmap_field_t *pfield, char *error,
+                     int size);
+int pmap_addport_batch(pmap_ctx_t *ctx, pmap_field_t *pfields, int count,
+                       int *status);
+int pmap_addport_batch_errno(pmap_ctx_t *ctx, pmap_field_t *pfields,
+                             int count, int *status, int *errs);
+int pmap_delport(pmap_ctx_t *ctx, pmap_field_t *pfield, char *error, int size);
+int pmap_delport_batch(pmap_ctx_t *ctx, pmap_field_t *pfields, int count,
+                       int *status);
+int pmap_ensureport_batch(pmap_ctx_t *ctx, pmap_field_t *pfields, int count,
+                          int *status);
+int pmap_getexip(pmap_ctx_t *ctx, pmap_field_t *pfield, char *external_ip,
+                 int esize, char *error, int size);
+
+#endif // _PMAP_H
@@ -0,0 +1,1360 @@
+/*
+ *    pmap_async.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "http.h"
+#include "pmap_async.h"
+#include "pmap_debug.h"
+#include "pmap_uring.h"
+#include "util.h"
+
+/**
+ * Every operation is a state machine driven by 'pmap_process'. It follows
+ * the same path as the blocking call ('_pmap_action' in pmap.c): straight to
+ * the protocol the gateway answered last time, racing NAT-PMP against UPnP
+ * when it is not known or stopped answering. Sockets are never waited on
+ * here, the caller polls the descriptors given by 'pmap_fds'.
+ */
+
+static void _pmap_async_race(pmap_aop_t *op, int64_t now);
+static void _pmap_async_race_npmp(pmap_aop_t *op, int res, int64_t now);
+
+/* -------------------------------------------- */
+
+/**
+ * Close a socket of an operation. Under io_uring its pending request
+ * (PMAP_AOP_IO_*) is cancelled and the close is queued behind it.
+ */
+static void _pmap_async_fd_close(pmap_aop_t *op, int io, int *fd) {
+
+  pmap_uring_t *ring = op->ctx->uring;
+
+  if (op->uring_slot[io] >= 0) {
+    pmap_uring_cancel(ring, op->uring_slot[io]);
+    op->uring_slot[io] = -1;
+  }
+  if (*fd >= 0) {
+    if (NULL != ring) {
+      pmap_uring_close(ring, *fd);
+    } else {
+      close(*fd);
+    }
+    *fd = -1;
+  }
+}
+
+/**
+ * Close the sockets of an operation and release its buffers.
+ */
+static void _pmap_async_close(pmap_aop_t *op) {
+
+  _pmap_async_fd_close(op, PMAP_AOP_IO_NPMP, &op->npmp_fd);
+  _pmap_async_fd_close(op, PMAP_AOP_IO_SSDP, &op->ssdp_fd);
+  _pmap_async_fd_close(op, PMAP_AOP_IO_HTTP, &op->http_fd);
+
+  pbfr_destroy(op->out);
+  op->out = NULL;
+  pbfr_destroy(op->in);
+  op->in = NULL;
+
+  /* A race candidate or a copy of the known IGD ('pmap_gw_protocol') */
+  pmap_ut_free_url(op->dev);
+  op->dev = NULL;
+}
+
+/**
+ * Leave the admission queue of the gateway, or give back the in-flight slot
+ * the operation holds.
+ */
+static void _pmap_async_release(pmap_aop_t *op, int outcome) {
+
+  if (op->state == PMAP_AOP_ST_QUEUED) {
+    pmap_gw_queue(op->ctx, op->gw, op->priority, -1);
+    op->state = 0;
+  }
+  if (op->admitted) {
+    pmap_gw_release(op->ctx, op->gw, outcome);
+    op->admitted = 0;
+  }
+}
+
+/**
+ * Release an operation, it must not be in the list of its context anymore.
+ */
+static void _pmap_async_free(pmap_aop_t *op) {
+
+  _pmap_async_release(op, PMAP_LIMIT_OK);
+  _pmap_async_close(op);
+  free(op->entries);
+  free(op);
+}
+
+/**
+ * End an operation, its callback is called by the next 'pmap_process'.
+ */
+static void _pmap_async_finish(pmap_aop_t *op, int status, int err) {
+
+  _pmap_async_release(op, pmap_gw_outcome(status, err));
+  _pmap_async_close(op);
+
+  op->state = PMAP_AOP_ST_DONE;
+  op->status = status;
+  op->err = (status == 0) ? 0 : err;
+  op->protocol = pmap_gw_protocol(op->ctx, op->gw, NULL);
+
+  if (status != 0 && op->error[0] == 0 && err != 0) {
+    const char *msg = pmap_ut_strerror(err);
+    snprintf(op->error, sizeof(op->error), "%s", msg ? msg : strerror(err));
+  }
+
+  if (status == 0 && op->action == PMAP_ASYNC_ADDPORT) {
+    pmap_ctx_ports_mark(op->ctx, &op->field, 1);
+  } else if (status == 0 && op->action == PMAP_ASYNC_DELPORT) {
+    pmap_ctx_ports_mark(op->ctx, &op->field, 0);
+  }
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Send the NAT-PMP request of an operation, the socket is opened on first
+ * use.
+ *
+ * @return 0 on success, 1 on failure (errno is set).
+ */
+static int _pmap_async_npmp_send(pmap_aop_t *op) {
+
+  pmap_uring_t *ring = op->ctx->uring;
+  struct sockaddr_in npmp;
+
+  memset(&npmp, 0x00, sizeof(npmp));
+  npmp.sin_family = AF_INET;
+  npmp.sin_port = htons(NAT_PMP_SERVER_PORT);
+  npmp.sin_addr.s_addr = op->field.gateway_ip;
+
+  if (op->npmp_fd < 0) {
+    if ((op->npmp_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+      PMAP_DEBUG_ERROR("socket() %s", strerror(errno));
+      return 1;
+    }
+    /* Receives of io_uring have no source address, the kernel drops the
+     * datagrams of other hosts on a connected socket */
+    if (NULL != ring && connect(op->npmp_fd, (struct sockaddr *)&npmp,
+                                sizeof(npmp)) < 0) {
+      PMAP_DEBUG_ERROR("connect() %s", strerror(errno));
+      return 1;
+    }
+  }
+
+  PMAP_DEBUG_HEX_LOG(op->req, op->req_len, "NAT-PMP REQUEST: =>>>\nLEN:%d\n",
+                     op->req_len);
+
+  if (NULL != ring &&
+      pmap_uring_send(ring, NULL, 0, op->npmp_fd, op->req, op->req_len, 0) >=
+          0) {
+    // Sent by the next 'pmap_fds', with the other queued requests
+  } else if (sendto(op->npmp_fd, op->req, op->req_len, 0,
+                    (struct sockaddr *)&npmp, sizeof(npmp)) < 0) {
+    PMAP_DEBUG_ERROR("sendto() %s", strerror(errno));
+    return 1;
+  }
+  op->npmp_sent++;
+
+  return 0;
+}
+
+/**
+ * A race ends without a NAT-PMP answer, an add request the gateway may have
+ * applied anyway is withdrawn (see 'pmap_npmp_withdraw').
+ */
+static void _pmap_async_npmp_withdraw(pmap_aop_t *op) {
+
+  if (op->npmp_fd >= 0 && op->action == PMAP_ASYNC_ADDPORT) {
+    pmap_npmp_withdraw(op->npmp_fd, op->op_code, &op->field);
+  }
+}
+
+/**
+ * A NAT-PMP datagram of the gateway arrived, either transport. Anything but
+ * the response of the operation is ignored.
+ */
+static void _pmap_async_npmp_input(pmap_aop_t *op, const uint8_t *pkt,
+                                   int len, int64_t now) {
+
+  PMAP_DEBUG_HEX_LOG(pkt, len, "NAT-PMP RESPONSE: =>>>\nLEN:%d\n", len);
+
+  int res = pmap_npmp_parse_resp(op->op_code, &op->field, pkt, len,
+                                 op->external_ip, sizeof(op->external_ip),
+                                 op->error, sizeof(op->error));
+  int err = errno;
+  if (res < 0) {
+    return;
+  }
+
+  /* Karn, a response after a retransmission is not a sample */
+  if (op->npmp_sent == 1) {
+    pmap_gw_rtt_sample(op->ctx, op->gw, PMAP_RTT_NPMP,
+                       (int)(now - op->start_ms));
+  }
+
+  if (op->state == PMAP_AOP_ST_RACE) {
+    errno = err;
+    _pmap_async_race_npmp(op, res, now);
+  } else {
+    _pmap_async_finish(op, res, err);
+  }
+}
+
+/**
+ * Read the pending NAT-PMP datagrams until the response of the gateway
+ * (poll transport).
+ */
+static void _pmap_async_npmp_read(pmap_aop_t *op, int64_t now) {
+
+  uint8_t pkt[sizeof(nmpm_pkt_resp) + sizeof(nmpm_pkt_exip)];
+  struct sockaddr_in client;
+  socklen_t ca_size;
+  int len;
+
+  while (op->npmp_fd >= 0 && op->state != PMAP_AOP_ST_DONE) {
+    ca_size = sizeof(client);
+    if ((len = recvfrom(op->npmp_fd, pkt, sizeof(pkt), MSG_DONTWAIT,
+                        (struct sockaddr *)&client, &ca_size)) < 0) {
+      return; // Drained
+    }
+
+    if (client.sin_addr.s_addr == op->field.gateway_ip) {
+      _pmap_async_npmp_input(op, pkt, len, now);
+    }
+  }
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Start an HTTP exchange with `op->dev`: the device description or the SOAP
+ * action of the operation. Only a numeric host is connected to, a name
+ * lookup would block.
+ *
+ * @return 0 on success, 1 on failure (errno is set).
+ */
+static int _pmap_async_http_start(pmap_aop_t *op, int stage, int64_t now) {
+
+  pmap_url_comp_t *dev = op->dev;
+
+  pbfr_destroy(op->out);
+  pbfr_destroy(op->in);
+
+  if (stage == PMAP_AOP_HTTP_DESC) {
+    if (NULL != (op->out = pmap_http_create("GET", dev->host, dev->port,
+                                            dev->path))) {
+      pbfr_add(op->out, "\r\n");
+    }
+  } else if (op->action == PMAP_ASYNC_LIST) {
+    op->out = pmap_upnp_request_generic(dev, op->index);
+  } else {
+    op->out = pmap_upnp_request(op->upnp_action, dev, &op->field);
+  }
+  op->in = pbfr_create(PBUFFER_DEFLEN);
+  if (NULL == op->out || NULL == op->in) {
+    errno = ENOMEM;
+    return 1;
+  }
+
+  memset(&op->http_addr, 0x00, sizeof(op->http_addr));
+  op->http_addr.sin_family = AF_INET;
+  op->http_addr.sin_port = htons(dev->port);
+  if (inet_pton(AF_INET, dev->host, &op->http_addr.sin_addr) != 1) {
+    PMAP_DEBUG_ERROR("Host is not an IPv4 address %s", dev->host);
+    errno = EINVALIDURL;
+    return 1;
+  }
+
+  if ((op->http_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    PMAP_DEBUG_ERROR("socket() %s", strerror(errno));
+    return 1;
+  }
+  fcntl(op->http_fd, F_SETFL, O_NONBLOCK);
+
+  /* Under io_uring the connect is queued by '_pmap_async_uring_arm' */
+  if (NULL == op->ctx->uring &&
+      connect(op->http_fd, (struct sockaddr *)&op->http_addr,
+              sizeof(op->http_addr)) < 0 &&
+      errno != EINPROGRESS) {
+    PMAP_DEBUG_ERROR("connect() %s", strerror(errno));
+    int err = errno;
+    _pmap_async_fd_close(op, PMAP_AOP_IO_HTTP, &op->http_fd);
+    errno = err;
+    return 1;
+  }
+
+  PMAP_DEBUG_LOG("REQUEST: =>>>\n%s\n", op->out->buffer);
+  if (PMAP_DEBUG_DUMP()) {
+    PMAP_RUNTIME_LOG("REQUEST: =>>>\n%s\n", op->out->buffer);
+  }
+
+  op->http_stage = stage;
+  op->http_events = POLLOUT;
+  op->http_connected = 0;
+  op->out_sent = 0;
+  op->http_start_ms = now;
+  op->http_deadline_ms = now + op->tmo.connect_ms;
+
+  return 0;
+}
+
+/**
+ * Response bytes of an HTTP exchange arrived, either transport. `data` is
+ * appended to the response (the poll transport reads in place), `eof` tells
+ * the server closed the connection.
+ *
+ * @return 0 while in progress, 1 on failure (errno is set), 2 once the
+ * response is complete.
+ */
+static int _pmap_async_http_input(pmap_aop_t *op, const char *data, int len,
+                                  bool eof, int64_t now) {
+
+  pbuffer_t *in = op->in;
+
+  if (len > 0) {
+    if (pbfr_reserve(in, in->offset + len + 1) != 0) {
+      return 1;
+    }
+    memcpy(in->buffer + in->offset, data, len);
+    in->offset += len;
+  }
+  in->buffer[in->offset] = '\0';
+  op->http_deadline_ms = now + op->tmo.response_ms;
+
+  if (eof || pmap_http_complete(in)) {
+
+    PMAP_DEBUG_LOG("RESPONSE: =>>>\n%s\n", in->buffer);
+    if (PMAP_DEBUG_DUMP()) {
+      PMAP_RUNTIME_LOG("RESPONSE: =>>>\n%s\n", in->buffer);
+    }
+
+    if (in->offset == 0) {
+      errno = ECONNRESET;
+      return 1;
+    }
+    return 2;
+  }
+
+  return 0;
+}
+
+/**
+ * Move an HTTP exchange forward after its socket became ready.
+ *
+ * @return 0 while in progress, 1 on failure (errno is set), 2 once the
+ * response is complete.
+ */
+static int _pmap_async_http_io(pmap_aop_t *op, int64_t now) {
+
+  ssize_t n;
+
+  if (op->http_events == POLLOUT) {
+
+    if (!op->http_connected) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(op->http_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+          err != 0) {
+        errno = (err != 0) ? err : errno;
+        PMAP_DEBUG_ERROR("connect() %s", strerror(errno));
+        return 1;
+      }
+      op->http_connected = 1;
+      op->http_deadline_ms = now + op->tmo.response_ms;
+    }
+
+    n = write(op->http_fd, op->out->buffer + op->out_sent,
+              op->out->offset - op->out_sent);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      PMAP_DEBUG_ERROR("write() %s", strerror(errno));
+      return 1;
+    }
+    op->out_sent += n;
+    if (op->out_sent == op->out->offset) {
+      op->http_events = POLLIN;
+    }
+
+    return 0;
+  }
+
+  pbuffer_t *in = op->in;
+  bool eof = false;
+
+  while (true) {
+    if (pbfr_reserve(in, in->offset + 1024) != 0) {
+      return 1;
+    }
+    n = recv(op->http_fd, in->buffer + in->offset, in->size - in->offset - 1,
+             MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      PMAP_DEBUG_ERROR("recv() %s", strerror(errno));
+      return 1;
+    } else if (n == 0) {
+      eof = true;
+      break;
+    }
+    in->offset += n;
+  }
+
+  return _pmap_async_http_input(op, NULL, 0, eof, now);
+}
+
+/**
+ * The HTTP exchange got no response.
+ */
+static void _pmap_async_http_fail(pmap_aop_t *op, int64_t now) {
+
+  int err = errno;
+
+  _pmap_async_fd_close(op, PMAP_AOP_IO_HTTP, &op->http_fd);
+
+  if (op->state == PMAP_AOP_ST_RACE) {
+    /* Not an IGD (or not reachable), wait for another device */
+    op->http_tmo |= (err == ETIMEDOUT);
+    pmap_ut_free_url(op->dev);
+    op->dev = NULL;
+    return;
+  }
+
+  if (op->index > 0) {
+    _pmap_async_finish(op, 1, err); // Table walk cut short
+    return;
+  }
+
+  /* Location is stale (IGD restarted on another port?) */
+  pmap_gw_lost(op->ctx, op->gw, PMAP_RTT_HTTP, op->dev);
+  pmap_ut_free_url(op->dev);
+  op->dev = NULL;
+
+  _pmap_async_race(op, now);
+}
+
+/**
+ * Next step of a table walk after a GetGenericPortMappingEntry response,
+ * the walk ends with SpecifiedArrayIndexInvalid.
+ */
+static void _pmap_async_list_next(pmap_aop_t *op, int http_status,
+                                  int64_t now) {
+
+  if (http_status == 200) {
+
+    if (op->count == op->size) {
+      int size = (op->size > 0) ? op->size * 2 : 16;
+      pmap_upnp_entry_t *entries =
+          realloc(op->entries, size * sizeof(pmap_upnp_entry_t));
+      if (NULL == entries) {
+        PMAP_DEBUG_ERROR("Out of memory");
+        _pmap_async_finish(op, 1, ENOMEM);
+        return;
+      }
+      op->entries = entries;
+      op->size = size;
+    }
+
+    pmap_upnp_entry_t *entry = &op->entries[op->count++];
+    memset(entry, 0x00, sizeof(pmap_upnp_entry_t));
+    entry->index = op->index++;
+    entry->field.gateway_ip = op->field.gateway_ip;
+    pmap_upnp_entry_parse(op->in->buffer, entry);
+
+    if (_pmap_async_http_start(op, PMAP_AOP_HTTP_SOAP, now) != 0) {
+      _pmap_async_finish(op, 1, errno);
+    }
+    return;
+  }
+
+  pbuffer_t *in = op->in;
+  op->in = NULL;
+  pmap_gw_upnp_done(op->upnp_action, &op->field, in, http_status, NULL, 0,
+                    op->error, sizeof(op->error), &op->upnp_error);
+
+  if (op->upnp_error == PMAP_UPNP_ERR_INVALID_INDEX) {
+    op->error[0] = '\0';
+    _pmap_async_finish(op, 0, 0);
+  } else {
+    _pmap_async_finish(op, 1, errno);
+  }
+}
+
+/**
+ * The HTTP response is complete.
+ */
+static void _pmap_async_http_done(pmap_aop_t *op, int64_t now) {
+
+  pmap_gw_t *gw = op->gw;
+  int http_status = 0;
+
+  _pmap_async_fd_close(op, PMAP_AOP_IO_HTTP, &op->http_fd);
+
+  sscanf(op->in->buffer, "HTTP/1.%*d %d", &http_status);
+  PMAP_DEBUG_LOG("[HTTP Status Code=%d]\n", http_status);
+
+  if (op->http_stage == PMAP_AOP_HTTP_DESC) {
+    if (http_status != 200 ||
+        pmap_upnp_desc_parse(op->dev, op->in->buffer) != 0) {
+      errno = EGWUNSUPPORTED;
+      _pmap_async_http_fail(op, now);
+    } else if (_pmap_async_http_start(op, PMAP_AOP_HTTP_SOAP, now) != 0) {
+      _pmap_async_http_fail(op, now);
+    }
+    return;
+  }
+
+  if (op->state == PMAP_AOP_ST_RACE) {
+    PMAP_DEBUG_LOG("UPnP won the race\n");
+    pmap_gw_won(op->ctx, gw, PMAP_PROTO_UPNP, op->dev);
+    op->state = PMAP_AOP_ST_UPNP;
+    _pmap_async_npmp_withdraw(op);
+    _pmap_async_fd_close(op, PMAP_AOP_IO_NPMP, &op->npmp_fd);
+    _pmap_async_fd_close(op, PMAP_AOP_IO_SSDP, &op->ssdp_fd);
+  } else {
+    /* Only a single HTTP exchange is a sample, not control URL + action */
+    pmap_gw_rtt_sample(op->ctx, gw, PMAP_RTT_HTTP,
+                       (int)(now - op->http_start_ms));
+    pmap_gw_upnp_learn(op->ctx, gw, op->dev);
+  }
+
+  if (op->action == PMAP_ASYNC_LIST) {
+    _pmap_async_list_next(op, http_status, now);
+    return;
+  }
+
+  pbuffer_t *in = op->in;
+  op->in = NULL;
+  int ret = pmap_gw_upnp_done(
+      op->upnp_action, &op->field, in, http_status,
+      (op->upnp_action == PMAP_UPNP_ACTION_GETEXTIP) ? op->external_ip : NULL,
+      sizeof(op->external_ip), op->error, sizeof(op->error), &op->upnp_error);
+
+  _pmap_async_finish(op, ret, errno);
+}
+
+/* -------------------------------------------- */
+
+/**
+ * End the race once nothing is left to wait for.
+ */
+static void _pmap_async_race_end(pmap_aop_t *op, int64_t now) {
+
+  pmap_gw_t *gw = op->gw;
+
+  if (op->http_fd >= 0 ||
+      ((op->npmp_fd >= 0 || op->ssdp_fd >= 0) && now < op->deadline_ms)) {
+    return;
+  }
+
+  /* Nobody won */
+  pmap_gw_race_end(op->ctx, gw, op->npmp_sent && op->npmp_errno == ETIMEDOUT,
+                   op->try_upnp, op->http_tmo);
+
+  _pmap_async_npmp_withdraw(op);
+  _pmap_async_finish(op, 1, op->npmp_errno);
+}
+
+/**
+ * Start racing NAT-PMP against UPnP, see '_pmap_race' in pmap.c.
+ */
+static void _pmap_async_race(pmap_aop_t *op, int64_t now) {
+
+  pmap_gw_t *gw = op->gw;
+
+  PMAP_DEBUG_LOG("Protocol unknown for %s, racing\n",
+                 pmap_ut_inet_ntoa(gw->gateway_ip));
+
+  pmap_gw_lost(op->ctx, gw, -1, NULL);
+  op->state = PMAP_AOP_ST_RACE;
+
+  if (op->op_code < 0) {
+    _pmap_async_finish(op, -2, EINVALIDPROT); // Protocol not supported
+    return;
+  }
+
+  /* Fail fast while every protocol is in the negative cache */
+  int try_npmp = !pmap_gw_neg_valid(op->ctx, gw, PMAP_PROTO_NPMP, now);
+  op->try_upnp = !pmap_gw_neg_valid(op->ctx, gw, PMAP_PROTO_UPNP, now);
+  if (!try_npmp && !op->try_upnp) {
+    snprintf(op->error, sizeof(op->error),
+             "No port mapping protocol on gateway");
+    _pmap_async_finish(op, 1, EGWUNSUPPORTED);
+    return;
+  }
+
+  pmap_ctx_timeouts(op->ctx, gw, &op->tmo);
+  op->npmp_errno = ETIMEDOUT;
+  op->npmp_sent = 0;
+  op->http_tmo = 0;
+  op->start_ms = now;
+  op->retransmit_ms = now + op->tmo.retransmit_ms;
+  op->deadline_ms =
+      now + ((op->tmo.discovery_ms > 2 * op->tmo.retransmit_ms)
+                 ? op->tmo.discovery_ms
+                 : 2 * op->tmo.retransmit_ms);
+
+  if (try_npmp) {
+    pmap_field_t npmp_field = op->field; // UPnP keeps a lifetime of 0
+    if (op->action == PMAP_ASYNC_ADDPORT) {
+      npmp_field.lifetime_sec = pmap_npmp_lifetime(op->field.lifetime_sec);
+    }
+    op->req_len = pmap_npmp_build_req(op->op_code, &npmp_field, op->req);
+    if (_pmap_async_npmp_send(op) != 0 && op->npmp_fd >= 0) {
+      _pmap_async_fd_close(op, PMAP_AOP_IO_NPMP, &op->npmp_fd);
+    }
+  }
+  if (op->try_upnp) {
+    op->ssdp_fd = pmap_ssdp_search();
+  }
+
+  _pmap_async_race_end(op, now); // Nothing could be sent
+}
+
+/**
+ * NAT-PMP answered during a race, `res` as by 'pmap_npmp_parse_resp'.
+ */
+static void _pmap_async_race_npmp(pmap_aop_t *op, int res, int64_t now) {
+
+  pmap_gw_t *gw = op->gw;
+
+  if (res == 0) {
+    PMAP_DEBUG_LOG("NAT-PMP won the race\n");
+    pmap_gw_won(op->ctx, gw, PMAP_PROTO_NPMP, NULL);
+    if (op->action == PMAP_ASYNC_LIST) {
+      snprintf(op->error, sizeof(op->error), "NAT-PMP has no mapping table");
+      _pmap_async_finish(op, 1, ENOTSUP);
+    } else {
+      _pmap_async_finish(op, 0, 0);
+    }
+  } else if (res == 1) {
+    /* NAT-PMP answered with an error, UPnP may still do better */
+    op->npmp_errno = errno;
+    if (op->npmp_errno == ENPMP_UNSUPPORTED_VER ||
+        op->npmp_errno == ENPMP_UNSUPPORTED_OPCODE) {
+      pmap_gw_neg_fail(op->ctx, gw, PMAP_PROTO_NPMP);
+    } else {
+      pmap_gw_neg_clear(op->ctx, gw, PMAP_PROTO_NPMP);
+    }
+    _pmap_async_fd_close(op, PMAP_AOP_IO_NPMP, &op->npmp_fd);
+    _pmap_async_race_end(op, now);
+  }
+}
+
+/**
+ * M-SEARCH socket of a race is readable, try the devices of the gateway one
+ * at a time.
+ */
+static void _pmap_async_race_ssdp(pmap_aop_t *op, int64_t now) {
+
+  pmap_url_comp_t *ucmp;
+
+  while (NULL == op->dev &&
+         (ucmp = pmap_ssdp_read(op->ssdp_fd, op->field.gateway_ip)) != NULL) {
+    op->dev = ucmp;
+    if (_pmap_async_http_start(op, PMAP_AOP_HTTP_DESC, now) != 0) {
+      pmap_ut_free_url(ucmp);
+      op->dev = NULL;
+    }
+  }
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Start an operation on the protocol the gateway answered last time, or
+ * race them.
+ */
+static void _pmap_async_start(pmap_aop_t *op, int64_t now) {
+
+  pmap_gw_t *gw = op->gw;
+  pmap_url_comp_t *upnp = NULL;
+
+  pmap_ctx_timeouts(op->ctx, gw, &op->tmo);
+  int protocol = (op->action == PMAP_ASYNC_DISCOVER)
+                     ? PMAP_PROTO_NONE
+                     : pmap_gw_protocol(op->ctx, gw, &upnp);
+
+  if (protocol == PMAP_PROTO_NPMP) {
+
+    if (op->action == PMAP_ASYNC_LIST) {
+      snprintf(op->error, sizeof(op->error), "NAT-PMP has no mapping table");
+      _pmap_async_finish(op, 1, ENOTSUP);
+      return;
+    }
+    if (op->op_code < 0) {
+      _pmap_async_finish(op, -2, EINVALIDPROT); // Protocol not supported
+      return;
+    }
+
+    op->state = PMAP_AOP_ST_NPMP;
+    op->start_ms = now;
+    op->deadline_ms = now + op->tmo.retransmit_ms;
+    if (op->action == PMAP_ASYNC_ADDPORT) {
+      op->field.lifetime_sec = pmap_npmp_lifetime(op->field.lifetime_sec);
+    }
+    op->req_len = pmap_npmp_build_req(op->op_code, &op->field, op->req);
+    if (_pmap_async_npmp_send(op) != 0) {
+      _pmap_async_finish(op, 1, errno);
+    }
+
+  } else if (protocol == PMAP_PROTO_UPNP && upnp != NULL) {
+
+    op->state = PMAP_AOP_ST_UPNP;
+    op->dev = upnp;
+    if (_pmap_async_http_start(op,
+                               (NULL != upnp->crtl_url) ? PMAP_AOP_HTTP_SOAP
+                                                        : PMAP_AOP_HTTP_DESC,
+                               now) != 0) {
+      _pmap_async_http_fail(op, now);
+    }
+
+  } else {
+    _pmap_async_race(op, now);
+  }
+}
+
+/**
+ * Start a queued operation once the limits of its gateway admit it, or fail
+ * it with ELIMITED when it waited too long.
+ *
+ * @return 1 if the operation left the queue, 0 if it still waits.
+ */
+static int _pmap_async_admit(pmap_aop_t *op, int64_t now) {
+
+  int64_t wait_ms;
+
+  int n = pmap_gw_admit(op->ctx, op->gw, op->priority, 1, op->queued_ms, now,
+                        &wait_ms);
+  if (n == 0) {
+    op->admit_ms = (wait_ms < 0) ? INT64_MAX : now + wait_ms;
+    return 0;
+  }
+
+  pmap_gw_queue(op->ctx, op->gw, op->priority, -1);
+  op->state = 0;
+  if (n < 0) {
+    _pmap_async_finish(op, 1, ELIMITED);
+  } else {
+    op->admitted = 1;
+    _pmap_async_start(op, now);
+  }
+
+  return 1;
+}
+
+/**
+ * Handle the deadlines of an operation that passed.
+ */
+static void _pmap_async_timer(pmap_aop_t *op, int64_t now) {
+
+  /* Under io_uring the HTTP deadline is a linked timeout */
+  if (op->http_fd >= 0 && NULL == op->ctx->uring &&
+      now >= op->http_deadline_ms) {
+    PMAP_DEBUG_LOG("No HTTP response from %s\n", op->dev->host);
+    errno = ETIMEDOUT;
+    _pmap_async_http_fail(op, now);
+  }
+
+  if (op->state == PMAP_AOP_ST_NPMP && now >= op->deadline_ms) {
+
+    if (op->npmp_sent < 2) {
+      op->deadline_ms = now + op->tmo.retransmit_ms;
+      if (_pmap_async_npmp_send(op) != 0) {
+        _pmap_async_finish(op, 1, errno);
+      }
+      return;
+    }
+
+    /* Gateway stopped answering NAT-PMP */
+    pmap_gw_lost(op->ctx, op->gw, PMAP_RTT_NPMP, NULL);
+    _pmap_async_fd_close(op, PMAP_AOP_IO_NPMP, &op->npmp_fd);
+    _pmap_async_race(op, now);
+
+  } else if (op->state == PMAP_AOP_ST_RACE) {
+
+    /* Single NAT-PMP retransmission, the response is no RTT sample then */
+    if (op->npmp_fd >= 0 && op->npmp_sent == 1 && now >= op->retransmit_ms) {
+      _pmap_async_npmp_send(op);
+      op->npmp_sent = 2;
+    }
+    _pmap_async_race_end(op, now);
+  }
+}
+
+/**
+ * Earliest deadline of an operation, INT64_MAX if none.
+ */
+static int64_t _pmap_async_deadline(const pmap_aop_t *op) {
+
+  int64_t deadline = INT64_MAX;
+
+  if (op->state == PMAP_AOP_ST_DONE) {
+    return 0; // Callback pending
+  }
+  if (op->state == PMAP_AOP_ST_QUEUED) {
+    deadline = op->queued_ms + op->gw->limit.cfg.max_wait_ms;
+    return (op->admit_ms < deadline) ? op->admit_ms : deadline;
+  }
+  if (op->http_fd >= 0 && NULL == op->ctx->uring) {
+    deadline = op->http_deadline_ms;
+  }
+  if (op->state == PMAP_AOP_ST_NPMP ||
+      (op->state == PMAP_AOP_ST_RACE && op->http_fd < 0)) {
+    if (op->deadline_ms < deadline) {
+      deadline = op->deadline_ms;
+    }
+  }
+  if (op->state == PMAP_AOP_ST_RACE && op->npmp_fd >= 0 &&
+      op->npmp_sent == 1 && op->retransmit_ms < deadline) {
+    deadline = op->retransmit_ms;
+  }
+
+  return deadline;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Queue the io_uring requests an operation waits on, the same sockets and
+ * events 'pmap_fds' gives to poll otherwise. Without a free slot the
+ * operation waits for the next 'pmap_process', its deadlines still run.
+ */
+static void _pmap_async_uring_arm(pmap_aop_t *op) {
+
+  pmap_uring_t *ring = op->ctx->uring;
+  int *slot = op->uring_slot;
+
+  if (op->state == PMAP_AOP_ST_DONE) {
+    return;
+  }
+
+  if (op->npmp_fd >= 0 && slot[PMAP_AOP_IO_NPMP] < 0) {
+    if ((slot[PMAP_AOP_IO_NPMP] = pmap_uring_read(
+             ring, op, PMAP_AOP_IO_NPMP, op->npmp_fd, 0)) < 0) {
+      goto fail;
+    }
+  }
+
+  if (op->ssdp_fd >= 0 && NULL == op->dev && slot[PMAP_AOP_IO_SSDP] < 0) {
+    if ((slot[PMAP_AOP_IO_SSDP] = pmap_uring_poll(
+             ring, op, PMAP_AOP_IO_SSDP, op->ssdp_fd, POLLIN)) < 0) {
+      goto fail;
+    }
+  }
+
+  if (op->http_fd >= 0 && slot[PMAP_AOP_IO_HTTP] < 0) {
+    if (!op->http_connected) {
+      slot[PMAP_AOP_IO_HTTP] =
+          pmap_uring_connect(ring, op, PMAP_AOP_IO_HTTP, op->http_fd,
+                             &op->http_addr, op->tmo.connect_ms);
+    } else if (op->http_events == POLLOUT) {
+      slot[PMAP_AOP_IO_HTTP] = pmap_uring_send(
+          ring, op, PMAP_AOP_IO_HTTP, op->http_fd,
+          op->out->buffer + op->out_sent, op->out->offset - op->out_sent,
+          op->tmo.response_ms);
+    } else {
+      slot[PMAP_AOP_IO_HTTP] = pmap_uring_read(
+          ring, op, PMAP_AOP_IO_HTTP, op->http_fd, op->tmo.response_ms);
+    }
+    if (slot[PMAP_AOP_IO_HTTP] < 0) {
+      goto fail;
+    }
+  }
+
+  return;
+
+fail:
+  if (errno != ENOBUFS) {
+    PMAP_DEBUG_ERROR("io_uring %s", strerror(errno));
+    _pmap_async_finish(op, 1, errno);
+  }
+}
+
+/**
+ * Completion of an io_uring request of an operation ('pmap_uring_cb'),
+ * `arg` points to the time of 'pmap_process'.
+ */
+static void _pmap_async_uring_event(void *owner, int kind, int res,
+                                    const char *buf, void *arg) {
+
+  pmap_aop_t *op = owner;
+  int64_t now = *(int64_t *)arg;
+
+  op->uring_slot[kind] = -1;
+  if (op->state == PMAP_AOP_ST_DONE) {
+    return;
+  }
+
+  if (kind == PMAP_AOP_IO_NPMP) {
+    if (res > 0) {
+      _pmap_async_npmp_input(op, (const uint8_t *)buf, res, now);
+    }
+    return; // Errors of a datagram socket are not fatal, the deadline is
+
+  } else if (kind == PMAP_AOP_IO_SSDP) {
+    if (op->state == PMAP_AOP_ST_RACE) {
+      _pmap_async_race_ssdp(op, now);
+    }
+    return;
+  }
+
+  if (res < 0) {
+    /* The linked timeout cancelled the request */
+    errno = (res == -ECANCELED) ? ETIMEDOUT : -res;
+    PMAP_DEBUG_ERROR("HTTP %s", strerror(errno));
+    _pmap_async_http_fail(op, now);
+    return;
+  }
+
+  if (!op->http_connected) {
+    op->http_connected = 1;
+  } else if (op->http_events == POLLOUT) {
+    op->out_sent += res;
+    if (op->out_sent == op->out->offset) {
+      op->http_events = POLLIN;
+    }
+  } else {
+    int done = _pmap_async_http_input(op, buf, res, res == 0, now);
+    if (done == 1) {
+      _pmap_async_http_fail(op, now);
+    } else if (done == 2) {
+      _pmap_async_http_done(op, now);
+    }
+  }
+}
+
+/**
+ * Move the sockets of the asynchronous operations of a context to io_uring
+ * (Linux 5.7 or later). Requests are queued while 'pmap_process' runs and
+ * handed to the kernel together by 'pmap_fds', which then gives the ring
+ * descriptor only. Receives go to buffers registered with the kernel, HTTP
+ * deadlines are linked timeouts.
+ *
+ * @param ctx The client context, without pending operations.
+ * @param enable 1 for io_uring, 0 for poll.
+ * @return 0 on success, 1 on failure (errno is set): EBUSY if operations
+ * are pending, io_uring not available otherwise, poll stays in use then.
+ */
+int pmap_async_uring(pmap_ctx_t *ctx, int enable) {
+
+  if (NULL != ctx->async) {
+    errno = EBUSY;
+    return 1;
+  }
+
+  if (!enable) {
+    pmap_uring_destroy(ctx->uring);
+    ctx->uring = NULL;
+    return 0;
+  }
+
+  if (NULL == ctx->uring &&
+      NULL == (ctx->uring = pmap_uring_create(PMAP_URING_ENTRIES,
+                                              PMAP_URING_SLOTS))) {
+    PMAP_DEBUG_LOG("io_uring not available (%s), using poll\n",
+                   strerror(errno));
+    return 1;
+  }
+
+  return 0;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Create an operation and start it.
+ */
+static pmap_aop_t *_pmap_async_create(pmap_ctx_t *ctx, int action,
+                                      const pmap_field_t *pfield,
+                                      uint32_t gateway_ip, pmap_async_cb cb,
+                                      void *arg) {
+
+  pmap_aop_t *op = calloc(1, sizeof(pmap_aop_t));
+  if (NULL == op) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  if (NULL != pfield) {
+    op->field = *pfield;
+  }
+  op->field.gateway_ip = gateway_ip;
+  op->ctx = ctx;
+  op->action = action;
+  op->cb = cb;
+  op->arg = arg;
+  op->npmp_fd = -1;
+  op->ssdp_fd = -1;
+  op->http_fd = -1;
+  for (int i = 0; i < PMAP_AOP_IO_MAX; i++) {
+    op->uring_slot[i] = -1;
+  }
+
+  if (NULL == (op->gw = pmap_ctx_gateway(ctx, gateway_ip))) {
+    free(op);
+    return NULL;
+  }
+
+  /* Behind the operations already waiting for the gateway, if any */
+  op->priority = pmap_priority_get();
+  int ahead = pmap_gw_queue(ctx, op->gw, op->priority, 1);
+  if (ahead < 0) {
+    free(op);
+    return NULL; // Queue full, errno is ELIMITED
+  }
+  op->state = PMAP_AOP_ST_QUEUED;
+  op->queued_ms = pmap_ut_now_ms();
+  op->admit_ms = op->queued_ms;
+
+  if (action == PMAP_ASYNC_ADDPORT) {
+    op->upnp_action = PMAP_UPNP_ACTION_ADDPORT;
+    op->op_code = pmap_npmp_opcode(op->field.protocol);
+  } else if (action == PMAP_ASYNC_DELPORT) {
+    op->upnp_action = PMAP_UPNP_ACTION_DELPORT;
+    op->op_code = pmap_npmp_opcode(op->field.protocol);
+    op->field.lifetime_sec = 0; // Remove mapping
+  } else {
+    op->upnp_action = PMAP_UPNP_ACTION_GETEXTIP;
+    op->op_code = NPMP_OPCODE_EXIP;
+  }
+
+  pmap_aop_t **tail = &ctx->async;
+  while (NULL != *tail) {
+    tail = &(*tail)->next;
+  }
+  *tail = op;
+
+  if (ahead == 0 && _pmap_async_admit(op, op->queued_ms) &&
+      NULL != ctx->uring) {
+    _pmap_async_uring_arm(op);
+  }
+
+  return op;
+}
+
+/**
+ * Find the protocol of a gateway (racing NAT-PMP against UPnP even if one is
+ * known) and get its external address.
+ *
+ * @param ctx The client context.
+ * @param gateway_ip The gateway address, network byte order.
+ * @param cb Called by 'pmap_process' when done, `op->protocol` is the
+ * winner and `op->external_ip` the address.
+ * @param arg Passed to `cb`.
+ * @return The operation, valid until `cb` returns, or NULL if memory
+ * allocation fails or the admission queue of the gateway is full (errno is
+ * ELIMITED).
+ */
+pmap_aop_t *pmap_discover_async(pmap_ctx_t *ctx, uint32_t gateway_ip,
+                                pmap_async_cb cb, void *arg) {
+
+  return _pmap_async_create(ctx, PMAP_ASYNC_DISCOVER, NULL, gateway_ip, cb,
+                            arg);
+}
+
+/**
+ * Add a port mapping without blocking, see 'pmap_addport'.
+ *
+ * @param ctx The client context.
+ * @param pfield The mapping, copied to `op->field` which is updated as by
+ * 'pmap_addport'.
+ * @param cb Called by 'pmap_process' when done.
+ * @param arg Passed to `cb`.
+ * @return The operation, valid until `cb` returns, or NULL if memory
+ * allocation fails or the admission queue of the gateway is full (errno is
+ * ELIMITED).
+ */
+pmap_aop_t *pmap_addport_async(pmap_ctx_t *ctx, const pmap_field_t *pfield,
+                               pmap_async_cb cb, void *arg) {
+
+  return _pmap_async_create(ctx, PMAP_ASYNC_ADDPORT, pfield,
+                            pfield->gateway_ip, cb, arg);
+}
+
+/**
+ * Delete a port mapping without blocking, see 'pmap_addport_async'.
+ */
+pmap_aop_t *pmap_delport_async(pmap_ctx_t *ctx, const pmap_field_t *pfield,
+                               pmap_async_cb cb, void *arg) {
+
+  return _pmap_async_create(ctx, PMAP_ASYNC_DELPORT, pfield,
+                            pfield->gateway_ip, cb, arg);
+}
+
+/**
+ * Get the external address of a gateway without blocking, the address is
+ * in `op->external_ip`, see 'pmap_addport_async'.
+ */
+pmap_aop_t *pmap_getexip_async(pmap_ctx_t *ctx, const pmap_field_t *pfield,
+                               pmap_async_cb cb, void *arg) {
+
+  return _pmap_async_create(ctx, PMAP_ASYNC_GETEXIP, pfield,
+                            pfield->gateway_ip, cb, arg);
+}
+
+/**
+ * Walk the port mapping table of an UPnP gateway entry by entry
+ * (GetGenericPortMappingEntry), the entries are in `op->entries`. A NAT-PMP
+ * gateway has no table, the operation fails with ENOTSUP.
+ *
+ * @param ctx The client context.
+ * @param gateway_ip The gateway address, network byte order.
+ * @param cb Called by 'pmap_process' when done.
+ * @param arg Passed to `cb`.
+ * @return The operation, valid until `cb` returns, or NULL if memory
+ * allocation fails or the admission queue of the gateway is full (errno is
+ * ELIMITED).
+ */
+pmap_aop_t *pmap_list_async(pmap_ctx_t *ctx, uint32_t gateway_ip,
+                            pmap_async_cb cb, void *arg) {
+
+  return _pmap_async_create(ctx, PMAP_ASYNC_LIST, NULL, gateway_ip, cb, arg);
+}
+
+/**
+ * Drop an operation without calling its callback. A request already sent
+ * can't be called back, the gateway may still apply it.
+ *
+ * @param op The operation, an operation already finished is left alone.
+ */
+void pmap_async_cancel(pmap_aop_t *op) {
+
+  for (pmap_aop_t **pp = &op->ctx->async; NULL != *pp; pp = &(*pp)->next) {
+    if (*pp == op) {
+      *pp = op->next;
+      _pmap_async_free(op);
+      return;
+    }
+  }
+}
+
+/**
+ * Drop every pending operation of a context, see 'pmap_async_cancel'.
+ *
+ * @param ctx The client context.
+ */
+void pmap_async_cancel_all(pmap_ctx_t *ctx) {
+
+  while (NULL != ctx->async) {
+    pmap_aop_t *op = ctx->async;
+    ctx->async = op->next;
+    _pmap_async_free(op);
+  }
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Add a descriptor to the poll set, counted even when it does not fit.
+ */
+static void _pmap_async_fd(struct pollfd *fds, int max, int *n, int fd,
+                           short events) {
+
+  if (*n < max) {
+    fds[*n].fd = fd;
+    fds[*n].events = events;
+    fds[*n].revents = 0;
+  }
+  (*n)++;
+}
+
+/**
+ * Get the descriptors the pending operations wait on and the time
+ * 'pmap_process' must be called at the latest. Under io_uring the queued
+ * requests are submitted and the only descriptor is the ring.
+ *
+ * @param ctx The client context.
+ * @param fds Filled with up to `max` descriptors and their events.
+ * @param max The size of `fds`.
+ * @param deadline_ms Receives the pmap_ut_now_ms() time of the next
+ * deadline, -1 if none.
+ * @return The number of descriptors, more than `max` if `fds` is too small.
+ */
+int pmap_fds(pmap_ctx_t *ctx, struct pollfd *fds, int max,
+             int64_t *deadline_ms) {
+
+  int64_t deadline = INT64_MAX;
+  int n = 0;
+
+  if (NULL != ctx->uring) {
+    if (pmap_uring_submit(ctx->uring) != 0) {
+      deadline = 0; // Retried by the next call
+    }
+    _pmap_async_fd(fds, max, &n, ctx->uring->fd, POLLIN);
+  }
+
+  for (pmap_aop_t *op = ctx->async; NULL != op; op = op->next) {
+    if (NULL == ctx->uring) {
+      if (op->npmp_fd >= 0) {
+        _pmap_async_fd(fds, max, &n, op->npmp_fd, POLLIN);
+      }
+      if (op->ssdp_fd >= 0 && NULL == op->dev) {
+        _pmap_async_fd(fds, max, &n, op->ssdp_fd, POLLIN);
+      }
+      if (op->http_fd >= 0) {
+        _pmap_async_fd(fds, max, &n, op->http_fd, op->http_events);
+      }
+    }
+
+    int64_t d = _pmap_async_deadline(op);
+    if (d < deadline) {
+      deadline = d;
+    }
+  }
+
+  if (NULL != deadline_ms) {
+    *deadline_ms = (deadline == INT64_MAX) ? -1 : deadline;
+  }
+
+  return n;
+}
+
+/**
+ * Events returned for a descriptor, 0 if it is not in `fds`.
+ */
+static short _pmap_async_revents(const struct pollfd *fds, int nfds, int fd) {
+
+  for (int i = 0; i < nfds; i++) {
+    if (fds[i].fd == fd) {
+      return fds[i].revents;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Move the pending operations forward and call the callbacks of those that
+ * finished. Callbacks may start or cancel other operations.
+ *
+ * @param ctx The client context.
+ * @param fds The descriptors that are ready with their `revents`, e.g. the
+ * set of 'pmap_fds' after poll(). Descriptors without events may be left
+ * out. Not used under io_uring ('pmap_async_uring').
+ * @param nfds The number of entries of `fds`.
+ * @param now_ms pmap_ut_now_ms() time.
+ * @return The number of operations still pending.
+ */
+int pmap_process(pmap_ctx_t *ctx, const struct pollfd *fds, int nfds,
+                 int64_t now_ms) {
+
+  pmap_aop_t *op, *done = NULL, **tail = &done, **pp;
+  int pending = 0;
+
+  if (NULL != ctx->uring) {
+    pmap_uring_reap(ctx->uring, _pmap_async_uring_event, &now_ms);
+  }
+
+  for (op = ctx->async; NULL != op; op = op->next) {
+
+    if (NULL == ctx->uring) {
+      if (op->state != PMAP_AOP_ST_DONE && op->npmp_fd >= 0 &&
+          _pmap_async_revents(fds, nfds, op->npmp_fd) != 0) {
+        _pmap_async_npmp_read(op, now_ms);
+      }
+
+      if (op->state == PMAP_AOP_ST_RACE && op->ssdp_fd >= 0 &&
+          NULL == op->dev &&
+          _pmap_async_revents(fds, nfds, op->ssdp_fd) != 0) {
+        _pmap_async_race_ssdp(op, now_ms);
+      }
+
+      if (op->state != PMAP_AOP_ST_DONE && op->http_fd >= 0 &&
+          _pmap_async_revents(fds, nfds, op->http_fd) != 0) {
+        int res = _pmap_async_http_io(op, now_ms);
+        if (res == 1) {
+          _pmap_async_http_fail(op, now_ms);
+        } else if (res == 2) {
+          _pmap_async_http_done(op, now_ms);
+        }
+      }
+    }
+
+    if (op->state != PMAP_AOP_ST_DONE) {
+      _pmap_async_timer(op, now_ms);
+    }
+  }
+
+  /* Finished operations leave the list before their callback is called */
+  pp = &ctx->async;
+  while (NULL != (op = *pp)) {
+    if (op->state == PMAP_AOP_ST_DONE) {
+      *pp = op->next;
+      op->next = NULL;
+      *tail = op;
+      tail = &op->next;
+    } else {
+      pp = &op->next;
+    }
+  }
+
+  while (NULL != (op = done)) {
+    done = op->next;
+    if (NULL != op->cb) {
+      op->cb(op, op->arg);
+    }
+    _pmap_async_free(op);
+  }
+
+  /* Queued operations, interactive ones first, in the order they came */
+  for (int prio = 0; prio < PMAP_PRIO_MAX; prio++) {
+    for (op = ctx->async; NULL != op; op = op->next) {
+      if (op->state == PMAP_AOP_ST_QUEUED && op->priority == prio) {
+        _pmap_async_admit(op, now_ms);
+      }
+    }
+  }
+
+  for (op = ctx->async; NULL != op; op = op->next) {
+    if (NULL != ctx->uring) {
+      _pmap_async_uring_arm(op);
+    }
+    pending++;
+  }
+
+  return pending;
+}
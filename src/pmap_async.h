@@ -0,0 +1,145 @@
+/*
+ *    pmap_async.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_ASYNC_H
+#define _PMAP_ASYNC_H
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+
+#include "buffer.h"
+#include "pmap.h"
+#include "pmap_cfg.h"
+#include "pmap_npmp.h"
+#include "pmap_upnp.h"
+
+/* Operations (pmap_aop_t.action) */
+#define PMAP_ASYNC_DISCOVER 1 /* Race the protocols, get the external IP */
+#define PMAP_ASYNC_ADDPORT 2  /* pmap_addport */
+#define PMAP_ASYNC_DELPORT 3  /* pmap_delport */
+#define PMAP_ASYNC_GETEXIP 4  /* pmap_getexip */
+#define PMAP_ASYNC_LIST 5     /* Port mapping table of an IGD */
+
+/* States of an operation (pmap_aop_t.state) */
+#define PMAP_AOP_ST_NPMP 1 /* NAT-PMP request to a known gateway */
+#define PMAP_AOP_ST_UPNP 2 /* HTTP exchange with a known IGD */
+#define PMAP_AOP_ST_RACE 3 /* Protocol not known, see '_pmap_race' */
+#define PMAP_AOP_ST_DONE 4 /* Callback pending */
+#define PMAP_AOP_ST_QUEUED 5 /* Waiting for admission ('pmap_ctx_set_limit') */
+
+/* HTTP exchange of an operation (pmap_aop_t.http_stage) */
+#define PMAP_AOP_HTTP_DESC 1 /* GET of the device description */
+#define PMAP_AOP_HTTP_SOAP 2 /* POST of the action */
+
+/* Sockets of an operation with an io_uring request (pmap_aop_t.uring_slot) */
+#define PMAP_AOP_IO_NPMP 0
+#define PMAP_AOP_IO_SSDP 1
+#define PMAP_AOP_IO_HTTP 2
+#define PMAP_AOP_IO_MAX 3
+
+typedef struct pmap_aop_t_ pmap_aop_t;
+
+/**
+ * Completion callback, called from 'pmap_process' once the operation
+ * finished. The operation is freed when the callback returns.
+ */
+typedef void (*pmap_async_cb)(pmap_aop_t *op, void *arg);
+
+/**
+ * One asynchronous operation. `field` is updated as by the unified call,
+ * the fields from `status` to `count` are the result, the others are private.
+ */
+struct pmap_aop_t_ {
+  struct pmap_aop_t_ *next;
+  pmap_ctx_t *ctx;
+  int action;         /* PMAP_ASYNC_* */
+  pmap_field_t field; /* Mapping, field.gateway_ip selects the gateway */
+  pmap_async_cb cb;
+  void *arg;          /* Caller data, passed to `cb` */
+
+  int status;         /* 0 success, 1 failure, -2 protocol not supported */
+  int err;            /* errno of a failure */
+  int protocol;       /* PMAP_PROTO_* that answered */
+  char external_ip[16]; /* PMAP_ASYNC_DISCOVER and PMAP_ASYNC_GETEXIP */
+  char error[64];
+  int upnp_error;     /* errorCode of a UPnP SOAP fault, 0 if none */
+  pmap_upnp_entry_t *entries; /* PMAP_ASYNC_LIST, freed with the operation */
+  int count;
+
+  int state;         /* PMAP_AOP_ST_* */
+  pmap_gw_t *gw;
+  int priority;      /* PMAP_PRIO_* of the thread that started it */
+  int admitted;      /* Holds an in-flight slot of the gateway */
+  int64_t queued_ms; /* Start of the wait for admission */
+  int64_t admit_ms;  /* Next admission attempt, INT64_MAX until a slot frees */
+  pmap_tmo_t tmo;
+  int upnp_action;   /* PMAP_UPNP_ACTION_* */
+  int op_code;       /* NAT-PMP opcode */
+  uint8_t req[sizeof(nmpm_pkt_req)];
+  int req_len;
+  int npmp_fd;       /* NAT-PMP socket, -1 if none */
+  int npmp_sent;     /* NAT-PMP requests sent */
+  int npmp_errno;
+  int try_upnp;
+  int ssdp_fd;       /* M-SEARCH socket, -1 if none */
+  int http_tmo;      /* A device exchange of the race timed out */
+  int64_t start_ms;
+  int64_t retransmit_ms; /* Time of the NAT-PMP retransmission */
+  int64_t deadline_ms;   /* End of the race or of the NAT-PMP request */
+  pmap_url_comp_t *dev;  /* Device of the HTTP exchange, owned while racing */
+  int http_fd;       /* -1 if no HTTP exchange */
+  int http_stage;    /* PMAP_AOP_HTTP_* */
+  int http_events;   /* POLLOUT while connecting or sending, POLLIN after */
+  int http_connected;
+  struct sockaddr_in http_addr;
+  int64_t http_start_ms;
+  int64_t http_deadline_ms;
+  pbuffer_t *out;    /* Request, offset is the length */
+  int out_sent;
+  pbuffer_t *in;     /* Response */
+  int index;         /* PMAP_ASYNC_LIST, next entry */
+  int size;          /* PMAP_ASYNC_LIST, entries allocated */
+  int uring_slot[PMAP_AOP_IO_MAX]; /* io_uring request, -1 if none */
+};
+
+pmap_aop_t *pmap_discover_async(pmap_ctx_t *ctx, uint32_t gateway_ip,
+                                pmap_async_cb cb, void *arg);
+pmap_aop_t *pmap_addport_async(pmap_ctx_t *ctx, const pmap_field_t *pfield,
+                               pmap_async_cb cb, void *arg);
+pmap_aop_t *pmap_delport_async(pmap_ctx_t *ctx, const pmap_field_t *pfield,
+                               pmap_async_cb cb, void *arg);
+pmap_aop_t *pmap_getexip_async(pmap_ctx_t *ctx, const pmap_field_t *pfield,
+                               pmap_async_cb cb, void *arg);
+pmap_aop_t *pmap_list_async(pmap_ctx_t *ctx, uint32_t gateway_ip,
+                            pmap_async_cb cb, void *arg);
+void pmap_async_cancel(pmap_aop_t *op);
+void pmap_async_cancel_all(pmap_ctx_t *ctx);
+int pmap_async_uring(pmap_ctx_t *ctx, int enable);
+
+int pmap_fds(pmap_ctx_t *ctx, struct pollfd *fds, int max,
+             int64_t *deadline_ms);
+int pmap_process(pmap_ctx_t *ctx, const struct pollfd *fds, int nfds,
+                 int64_t now_ms);
+
+#endif // _PMAP_ASYNC_H
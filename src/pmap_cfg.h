@@ -35,9 +35,153 @@
 /* Wait timeout in seconds */
 #define PMAP_DEFAULT_WAIT_TIMEOUT 4
 
+/**
+ * Adaptive timeouts in milliseconds. Without RTT samples the default is used
+ * (the historic fixed values), otherwise the estimate is clamped to
+ * [floor, ceil]. Floors and ceilings can be changed per client context.
+ */
+#define PMAP_TMO_DISCOVERY_DEF (PMAP_DEFAULT_WAIT_TIMEOUT * 1000)
+#define PMAP_TMO_DISCOVERY_FLOOR 300
+#define PMAP_TMO_DISCOVERY_CEIL (PMAP_DEFAULT_WAIT_TIMEOUT * 1000)
+#define PMAP_TMO_CONNECT_DEF (PMAP_DEFAULT_WAIT_TIMEOUT * 1000)
+#define PMAP_TMO_CONNECT_FLOOR 100
+#define PMAP_TMO_CONNECT_CEIL 8000
+#define PMAP_TMO_RESPONSE_DEF 2100
+#define PMAP_TMO_RESPONSE_FLOOR 200
+#define PMAP_TMO_RESPONSE_CEIL 8000
+#define PMAP_TMO_RETRANSMIT_DEF 250
+#define PMAP_TMO_RETRANSMIT_FLOOR 50
+#define PMAP_TMO_RETRANSMIT_CEIL 2000
+
+/**
+ * Negative cache, a protocol that did not answer on a gateway is not probed
+ * again for PMAP_NEG_TTL_MIN seconds, doubled on every failed re-probe up to
+ * PMAP_NEG_TTL_MAX seconds.
+ */
+#define PMAP_NEG_TTL_MIN 30
+#define PMAP_NEG_TTL_MAX 3600
+
+/**
+ * Lifetime in seconds asked for a NAT-PMP mapping added without one: 0 means
+ * no expiration to UPnP but deletes the mapping with NAT-PMP (RFC 6886
+ * recommends 7200 seconds).
+ */
+#define PMAP_NPMP_LIFETIME_DEF 7200
+
+/**
+ * Lease renewal. A mapping is renewed after NUM/DEN of its lifetime, +/-
+ * JITTER percent. Renewals of the same gateway due within BATCH_MS are done
+ * together. A failed renewal is retried after RETRY_MIN seconds, doubled on
+ * every failure up to RETRY_MAX.
+ */
+#define PMAP_RENEW_TICK_MS 100
+#define PMAP_RENEW_FRACTION_NUM 1
+#define PMAP_RENEW_FRACTION_DEN 2
+#define PMAP_RENEW_JITTER_PCT 10
+#define PMAP_RENEW_BATCH_MS 1000
+#define PMAP_RENEW_RETRY_MIN 5
+#define PMAP_RENEW_RETRY_MAX 300
+
+/**
+ * Mapping registry. The journal is compacted once it holds more than
+ * PMAP_REG_COMPACT_MIN records and twice as many records as live mappings.
+ */
+#define PMAP_REG_BUCKETS_MIN 64
+#define PMAP_REG_COMPACT_MIN 1024
+#define PMAP_REG_LINE_LEN 128
+
+/**
+ * Mapping pool. The worker wakes up at least every IDLE_MS, waits RETRY_MS
+ * after a failed mapping, and refills once LOW_WATER_PCT percent of the
+ * target are left (default low water mark).
+ */
+#define PMAP_POOL_IDLE_MS 1000
+#define PMAP_POOL_RETRY_MS 5000
+#define PMAP_POOL_LOW_WATER_PCT 50
+
+/**
+ * Delete queue. A delete waits BATCH_MS for others to share its batch, a
+ * batch is sent at once when BATCH_MAX deletes are queued. The shutdown
+ * flush sends CHUNK deletes of a gateway at a time between deadline checks.
+ */
+#define PMAP_DELQ_BATCH_MS 50
+#define PMAP_DELQ_BATCH_MAX 256
+#define PMAP_DELQ_CHUNK 16
+
+/**
+ * Reconciliation renews a lease with less than RENEW_PCT of it left. Costs
+ * are estimated with RTT_MS per request while a gateway has no RTT sample.
+ */
+#define PMAP_RECON_RENEW_PCT 50
+#define PMAP_RECON_RTT_MS 20
+
+/**
+ * An existing UPnP mapping is not rewritten by 'pmap_upnp_ensure_url' while
+ * it has at least ENSURE_PCT of the wanted lifetime left. Above the renewal
+ * point (half of the lease) so that a due renewal still extends the lease.
+ */
+#define PMAP_UPNP_ENSURE_PCT 75
+
+/* Multi-gateway executor (pmap_exec_run), one operation in flight per
+ * gateway */
+#define PMAP_EXEC_WORKERS_DEF 32 /* Worker threads when 0 is given */
+#define PMAP_EXEC_WORKERS_MAX 512
+
+/* io_uring transport of the asynchronous operations (pmap_async_uring) */
+#define PMAP_URING_ENTRIES 256  /* Submission queue entries */
+#define PMAP_URING_SLOTS 1024   /* Requests in flight */
+#define PMAP_URING_BUF_LEN 2048 /* Receive buffer of a request */
+
+/* I/O engine thread (pmap_engine_create) */
+#define PMAP_ENGINE_RING_DEF 1024   /* Submission ring slots when 0 is given */
+#define PMAP_ENGINE_RING_MAX 65536
+#define PMAP_ENGINE_FDS 64          /* Initial poll set, grown on demand */
+
+/**
+ * Per gateway admission control ('pmap_ctx_set_limit'), off unless set. The
+ * defaults suit consumer routers. The limits are halved on overload, down to
+ * SCALE_MIN percent, and grow back by SCALE_STEP percent per HOLD_MS without
+ * one.
+ */
+#define PMAP_LIMIT_RATE 10        /* Requests per second */
+#define PMAP_LIMIT_BURST 5        /* Requests back to back */
+#define PMAP_LIMIT_INFLIGHT 2     /* Requests at once */
+#define PMAP_LIMIT_RESERVE 1      /* Left to interactive calls */
+#define PMAP_LIMIT_WAIT_MS 10000  /* Longest wait for admission */
+#define PMAP_LIMIT_QUEUE 1024     /* Queued async operations per gateway */
+#define PMAP_LIMIT_SCALE_MIN 10
+#define PMAP_LIMIT_SCALE_STEP 10
+#define PMAP_LIMIT_HOLD_MS 1000
+
+/* Policy-based C++ client (pmap_client.hpp) */
+#define PMAP_CLIENT_URL_LEN 128   /* Longest control URL */
+#define PMAP_CLIENT_RESP_LEN 4096 /* HTTP response buffer */
+
+/* SSDP (M-SEARCH) reception */
+#define PMAP_SSDP_RCVBUF (256 * 1024) /* Socket receive buffer in bytes */
+#define PMAP_SSDP_BATCH 32            /* Datagram slots per receive batch */
+#define PMAP_SSDP_DGRAM_LEN 1536      /* Size of one datagram slot */
+#define PMAP_SSDP_MAX_DEVICES 64      /* Max devices kept in discovery list */
+#define PMAP_SSDP_MAX_WAIT (PMAP_DEFAULT_WAIT_TIMEOUT * 2) /* Total, seconds */
+#define PMAP_SSDP_MX 2          /* M-SEARCH MX, max response delay in seconds */
+#define PMAP_SSDP_SLACK_MS 250  /* Network time on top of the MX window */
+
+/* UPnP port mapping table walk */
+#define PMAP_UPNP_PIPELINE_DEF 8 /* GetGenericPortMappingEntry in flight */
+#define PMAP_UPNP_LIST_PAGE 1000 /* GetListOfPortMappings entries per call */
+
+/* External port allocation (pmap_addport_any) */
+#define PMAP_PORTS_MIN 1024  /* Lowest external port handed out */
+#define PMAP_PORTS_MAX 65535 /* Highest external port handed out */
+#define PMAP_PORTS_TRIES 8   /* Conflicts accepted before giving up */
+
 /* Error codes */
 #define EINVALIDURL 200  /* Invalid URL */
 #define EINVALIDPROT 201 /* Invalid Protocol checking for (UDP, TCP) */
+#define EGWUNSUPPORTED 202 /* Gateway speaks no protocol (negative cache) */
+#define EUPNPFAULT 203     /* UPnP SOAP fault, see the UPnP error code */
+#define ELIMITED 204       /* Gateway rate limit, try again later */
+#define EGWOVERLOAD 205    /* HTTP 5xx without UPnP fault, gateway overloaded */
 /* NAT-PMP codes */
 #define NPMP_OK 210                  /* Success */
 #define ENPMP_UNSUPPORTED_VER 211    /* Unsupported Version */
@@ -45,6 +189,33 @@
 #define ENPMP_NETWORK_FAIL 213       /* Network Failure */
 #define ENPMP_OUTOF_RESOURCE 214     /* Out of resources */
 #define ENPMP_UNSUPPORTED_OPCODE 215 /* Unsupported opcode */
+/* PCP codes, PCP_OK + result code (RFC 6887 7.4) */
+#define PCP_OK 220                       /* Success */
+#define EPCP_UNSUPP_VERSION 221          /* Unsupported Version */
+#define EPCP_NOT_AUTHORIZED 222          /* Not Authorized/Refused */
+#define EPCP_MALFORMED_REQUEST 223       /* Malformed request */
+#define EPCP_UNSUPP_OPCODE 224           /* Unsupported opcode */
+#define EPCP_UNSUPP_OPTION 225           /* Unsupported mandatory option */
+#define EPCP_MALFORMED_OPTION 226        /* Malformed option */
+#define EPCP_NETWORK_FAILURE 227         /* Network Failure */
+#define EPCP_NO_RESOURCES 228            /* Out of resources */
+#define EPCP_UNSUPP_PROTOCOL 229         /* Unsupported protocol */
+#define EPCP_USER_EX_QUOTA 230           /* User exceeded quota */
+#define EPCP_CANNOT_PROVIDE_EXTERNAL 231 /* Suggested port not available */
+#define EPCP_ADDRESS_MISMATCH 232        /* Source address mismatch */
+#define EPCP_EXCESSIVE_REMOTE_PEERS 233  /* Too many remote peers */
+
+/**
+ * Timeouts of one operation in milliseconds.
+ */
+typedef struct pmap_tmo_t_ {
+  int discovery_ms;  /* M-SEARCH response wait */
+  int connect_ms;    /* TCP connect */
+  int response_ms;   /* HTTP response, max silence between reads */
+  int retransmit_ms; /* NAT-PMP/PCP retransmission */
+} pmap_tmo_t;
+
+#define PCP_NONCE_LEN 12
 
 typedef struct pmap_field_t_ {
   int external_port;
@@ -53,6 +224,7 @@ typedef struct pmap_field_t_ {
   uint32_t internal_ip;
   uint32_t gateway_ip;
   int lifetime_sec;
+  uint8_t nonce[PCP_NONCE_LEN]; /* PCP only, all zero until a MAP picks it */
 } pmap_field_t;
 
 #endif
@@ -0,0 +1,776 @@
+/*
+ *    pmap_client.hpp
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_CLIENT_HPP
+#define _PMAP_CLIENT_HPP
+
+/**
+ * Port mapping client with compile-time policies, header only:
+ *
+ * - Transport: sockets ('PosixTransport') or an in-memory gateway for
+ *   simulation ('MemoryTransport').
+ * - Allocator: of the HTTP response buffer, heap ('HeapAllocator') or a
+ *   fixed arena ('ArenaAllocator', no heap at all).
+ * - Clock: of the deadlines, 'SteadyClock' or 'ManualClock'.
+ *
+ * Policies are held by value and called directly, an empty policy takes no
+ * space. SOAP requests are laid out at compile time ('detail::Message'), a
+ * request is rendered into a stack buffer of its maximum size.
+ *
+ *   pmap::BasicClient<> client;
+ *   auto granted = client.npmp_add_port(field);
+ *   auto ip = client.upnp_external_ip(pmap::Igd::from(ucmp));
+ *
+ * The client is blocking and not thread safe, like the C calls.
+ */
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+
+#include "pmap_expected.hpp"
+
+extern "C" {
+#include "pmap_cfg.h"
+#include "pmap_npmp.h"
+#include "pmap_upnp.h"
+#include "util.h"
+}
+
+namespace pmap {
+
+/* -------------------------------------------- */
+
+namespace detail {
+
+/**
+ * String literal usable as a template argument.
+ */
+template <size_t N> struct Literal {
+  char text[N] = {};
+  constexpr Literal(const char (&s)[N]) { std::copy_n(s, N, text); }
+  static constexpr size_t length = N - 1;
+};
+
+template <size_t A, size_t B>
+constexpr Literal<A + B - 1> operator+(const Literal<A> &a,
+                                       const Literal<B> &b) {
+  char s[A + B - 1] = {};
+  std::copy_n(a.text, A - 1, s);
+  std::copy_n(b.text, B, s + A - 1);
+  return Literal<A + B - 1>(s);
+}
+
+/* Arguments of a message, one type per placeholder */
+struct Int {
+  long v; /* %d */
+};
+struct Proto {
+  const char *v; /* %p, TCP or UDP */
+};
+struct Ip {
+  uint32_t v; /* %a, network byte order */
+};
+struct Path {
+  const char *v; /* %u, '/' added if missing */
+};
+
+/* Longest text of each placeholder */
+constexpr size_t width(char kind) {
+  return (kind == 'd')   ? 11
+         : (kind == 'p') ? 3
+         : (kind == 'a') ? 15
+         : (kind == 'u') ? PMAP_CLIENT_URL_LEN
+                         : 0;
+}
+
+template <typename A> constexpr char kind_of() {
+  if constexpr (std::is_same_v<A, Int>) {
+    return 'd';
+  } else if constexpr (std::is_same_v<A, Proto>) {
+    return 'p';
+  } else if constexpr (std::is_same_v<A, Ip>) {
+    return 'a';
+  } else {
+    static_assert(std::is_same_v<A, Path>, "Not a message argument");
+    return 'u';
+  }
+}
+
+inline char *put(char *out, Int a) {
+  char tmp[12];
+  int n = 0;
+  unsigned long v = (a.v < 0) ? -(unsigned long)a.v : (unsigned long)a.v;
+  do {
+    tmp[n++] = (char)('0' + v % 10);
+    v /= 10;
+  } while (v != 0);
+  if (a.v < 0) {
+    *out++ = '-';
+  }
+  while (n > 0) {
+    *out++ = tmp[--n];
+  }
+  return out;
+}
+
+inline char *put(char *out, Proto a) {
+  for (int i = 0; i < 3 && a.v[i] != '\0'; i++) {
+    *out++ = a.v[i];
+  }
+  return out;
+}
+
+inline char *put(char *out, Ip a) {
+  const uint8_t *b = reinterpret_cast<const uint8_t *>(&a.v);
+  for (int i = 0; i < 4; i++) {
+    out = put(out, Int{b[i]});
+    if (i < 3) {
+      *out++ = '.';
+    }
+  }
+  return out;
+}
+
+inline char *put(char *out, Path a) {
+  size_t len = strnlen(a.v, PMAP_CLIENT_URL_LEN - 1);
+  if (a.v[0] != '/') {
+    *out++ = '/';
+  }
+  memcpy(out, a.v, len);
+  return out + len;
+}
+
+/**
+ * Message template with placeholders ('%d', '%p', '%a', '%u'), split into
+ * its literal segments at compile time. `max_size` is the longest message.
+ * Rendering copies the segments and formats the arguments, checked against
+ * the placeholders at compile time.
+ */
+template <Literal Fmt> struct Message {
+
+  static constexpr size_t count = [] {
+    size_t n = 0;
+    for (size_t i = 0; i + 1 < Fmt.length; i++) {
+      if (Fmt.text[i] == '%' && width(Fmt.text[i + 1]) > 0) {
+        n++;
+        i++;
+      }
+    }
+    return n;
+  }();
+
+  struct Segment {
+    size_t offset;
+    size_t length;
+    char kind; /* Placeholder after the segment, 0 for the last one */
+  };
+
+  static constexpr std::array<Segment, count + 1> segments = [] {
+    std::array<Segment, count + 1> segs{};
+    size_t start = 0, n = 0;
+    for (size_t i = 0; i + 1 < Fmt.length; i++) {
+      if (Fmt.text[i] == '%' && width(Fmt.text[i + 1]) > 0) {
+        segs[n] = {start, i - start, Fmt.text[i + 1]};
+        n++;
+        i++;
+        start = i + 1;
+      }
+    }
+    segs[n] = {start, Fmt.length - start, 0};
+    return segs;
+  }();
+
+  static constexpr size_t max_size = [] {
+    size_t size = Fmt.length;
+    for (size_t i = 0; i < count; i++) {
+      size += width(segments[i].kind) - 2; // Placeholder replaced
+    }
+    return size;
+  }();
+
+  template <typename... A> static size_t render(char *out, A... args) {
+    static_assert(sizeof...(A) == count, "Wrong number of arguments");
+    return render(out, std::index_sequence_for<A...>{}, args...);
+  }
+
+private:
+  template <size_t... I, typename... A>
+  static size_t render(char *out, std::index_sequence<I...>, A... args) {
+    static_assert(((kind_of<A>() == segments[I].kind) && ...),
+                  "Argument does not match its placeholder");
+    char *p = out;
+    ((p = put(std::copy_n(Fmt.text + segments[I].offset, segments[I].length,
+                          p),
+              args)),
+     ...);
+    p = std::copy_n(Fmt.text + segments[count].offset,
+                    segments[count].length, p);
+    return (size_t)(p - out);
+  }
+};
+
+/* SOAP envelope of a WANIPConnection action, as in upnp_msg.h */
+template <Literal Action, Literal Args> constexpr auto soap_body() {
+  return Literal("<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+                 "<s:Envelope "
+                 "xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+                 "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/"
+                 "encoding/\">\r\n"
+                 "  <s:Body>\r\n"
+                 "    <u:") +
+         Action +
+         Literal(" "
+                 "      xmlns:u=\"urn:schemas-upnp-org:service:"
+                 "WANIPConnection:%d\">\r\n") +
+         Args + Literal("    </u:") + Action +
+         Literal(">\r\n"
+                 "  </s:Body>\r\n"
+                 "</s:Envelope>\r\n");
+}
+
+/* POST header of an action, as 'pmap_http_post_create' writes it */
+template <Literal Action> constexpr auto soap_header() {
+  return Literal("POST %u HTTP/1.1\r\n"
+                 "Host: %a:%d\r\n"
+                 "SOAPAction: \"urn:schemas-upnp-org:service:"
+                 "WANIPConnection:%d#") +
+         Action +
+         Literal("\"\r\n"
+                 "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+                 "Content-Length: %d\r\n"
+                 "\r\n");
+}
+
+/**
+ * HTTP request of an action: header and body, rendered into one buffer of
+ * `max_size` bytes.
+ */
+template <Literal Action, Literal Args> struct SoapRequest {
+  using Header = Message<soap_header<Action>()>;
+  using Body = Message<soap_body<Action, Args>()>;
+
+  static constexpr size_t max_size = Header::max_size + Body::max_size;
+
+  template <typename... A>
+  static size_t render(char *out, Path path, Ip host, Int port, Int version,
+                       A... args) {
+    /* The body goes after the longest header, then moves up to it */
+    size_t body = Body::render(out + Header::max_size, version, args...);
+    size_t header = Header::render(out, path, host, port, version,
+                                   Int{(long)body});
+    memmove(out + header, out + Header::max_size, body);
+    return header + body;
+  }
+};
+
+using AddPortMapping = SoapRequest<
+    Literal("AddPortMapping"),
+    Literal("      <NewRemoteHost></NewRemoteHost>\r\n"
+            "      <NewExternalPort>%d</NewExternalPort>\r\n"
+            "      <NewProtocol>%p</NewProtocol>\r\n"
+            "      <NewInternalPort>%d</NewInternalPort>\r\n"
+            "      <NewInternalClient>%a</NewInternalClient>\r\n"
+            "      <NewEnabled>True</NewEnabled>\r\n"
+            "      <NewPortMappingDescription>pMAP</"
+            "NewPortMappingDescription>\r\n"
+            "      <NewLeaseDuration>%d</NewLeaseDuration>\r\n")>;
+
+using DeletePortMapping =
+    SoapRequest<Literal("DeletePortMapping"),
+                Literal("      <NewRemoteHost></NewRemoteHost>\r\n"
+                        "      <NewExternalPort>%d</NewExternalPort>\r\n"
+                        "      <NewProtocol>%p</NewProtocol>\r\n")>;
+
+using GetExternalIPAddress =
+    SoapRequest<Literal("GetExternalIPAddress"), Literal("")>;
+
+/**
+ * Check whether a response is complete before the server closes the
+ * connection, see '_pmap_async_http_complete'.
+ */
+inline bool http_complete(const char *buf, size_t len) {
+  const char *body = strstr(buf, "\r\n\r\n");
+  if (nullptr == body) {
+    return false;
+  }
+  body += 4;
+  for (const char *line = strstr(buf, "\r\n"); line != nullptr && line < body;
+       line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+      return (buf + len - body) >= atoi(line + 17);
+    }
+  }
+  return false;
+}
+
+inline Error error(int code, const char *message = nullptr) {
+  Error e;
+  e.code = code;
+  if (nullptr != message) {
+    strncpy(e.message, message, sizeof(e.message) - 1);
+  }
+  return e;
+}
+
+} // namespace detail
+
+/* -------------------------------------------- */
+
+/**
+ * UPnP gateway with a known control URL (see 'pmap_req_ctrlurl').
+ */
+struct Igd {
+  uint32_t ip = 0; /* Network byte order */
+  uint16_t port = 0;
+  int version = 1; /* WANIPConnection service version */
+  char control_url[PMAP_CLIENT_URL_LEN] = {};
+
+  static Igd from(const pmap_url_comp_t *ucmp) {
+    Igd igd;
+    igd.ip = inet_addr(ucmp->host);
+    igd.port = (uint16_t)ucmp->port;
+    igd.version = (ucmp->version < 1) ? 1 : ucmp->version;
+    if (nullptr != ucmp->crtl_url) {
+      strncpy(igd.control_url, ucmp->crtl_url, sizeof(igd.control_url) - 1);
+    }
+    return igd;
+  }
+};
+
+/* -------------------------------------------- */
+
+/**
+ * Transport over sockets. A handle is a connected socket, `recv` waits with
+ * poll().
+ */
+struct PosixTransport {
+  using handle = int;
+
+  /**
+   * Open a UDP socket or connect a TCP one.
+   *
+   * @return The handle, -1 on failure (errno is set).
+   */
+  handle open(int type, uint32_t ip, uint16_t port, int timeout_ms) {
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = ip;
+
+    int fd = ::socket(AF_INET, type, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      if (errno != EINPROGRESS || wait(fd, POLLOUT, timeout_ms) != 0) {
+        int err = errno;
+        ::close(fd);
+        errno = err;
+        return -1;
+      }
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        ::close(fd);
+        errno = err;
+        return -1;
+      }
+    }
+    return fd;
+  }
+
+  /** @return 0 on success, -1 on failure (errno is set). */
+  int send(handle h, const void *data, size_t len) {
+    const char *p = static_cast<const char *>(data);
+    while (len > 0) {
+      ssize_t n = ::send(h, p, len, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EAGAIN && wait(h, POLLOUT, PMAP_TMO_RESPONSE_DEF) == 0) {
+          continue;
+        }
+        return -1;
+      }
+      p += n;
+      len -= n;
+    }
+    return 0;
+  }
+
+  /** @return Bytes received, 0 at the end, -1 on failure or timeout. */
+  int recv(handle h, void *buf, size_t size, int timeout_ms) {
+    if (wait(h, POLLIN, timeout_ms) != 0) {
+      return -1;
+    }
+    return (int)::recv(h, buf, size, 0);
+  }
+
+  void close(handle h) { ::close(h); }
+
+private:
+  static int wait(int fd, short events, int timeout_ms) {
+    struct pollfd pfd = {fd, events, 0};
+    int n = poll(&pfd, 1, (timeout_ms < 0) ? 0 : timeout_ms);
+    if (n == 0) {
+      errno = ETIMEDOUT;
+    }
+    return (n == 1) ? 0 : -1;
+  }
+};
+
+/**
+ * Transport to an in-memory gateway, for simulation. `Gateway` answers a
+ * request with
+ *
+ *   int handle(int type, uint32_t ip, uint16_t port, const char *req,
+ *              size_t len, char *resp, size_t size);
+ *
+ * returning the response length, or -1 to drop the request. One exchange is
+ * in flight at a time.
+ */
+template <typename Gateway> struct MemoryTransport {
+  using handle = int;
+
+  explicit MemoryTransport(Gateway *gateway = nullptr) : gateway_(gateway) {}
+
+  handle open(int type, uint32_t ip, uint16_t port, int) {
+    type_ = type;
+    ip_ = ip;
+    port_ = port;
+    len_ = -1;
+    read_ = 0;
+    return 0;
+  }
+
+  int send(handle, const void *data, size_t len) {
+    len_ = gateway_->handle(type_, ip_, port_, static_cast<const char *>(data),
+                            len, resp_, sizeof(resp_));
+    read_ = 0;
+    return 0;
+  }
+
+  int recv(handle, void *buf, size_t size, int) {
+    if (len_ < 0) {
+      errno = ETIMEDOUT; // Dropped
+      return -1;
+    }
+    size_t n = std::min(size, (size_t)len_ - read_);
+    memcpy(buf, resp_ + read_, n);
+    read_ += n;
+    return (int)n; // 0 once read, as a closed connection
+  }
+
+  void close(handle) {}
+
+private:
+  Gateway *gateway_;
+  int type_ = 0;
+  uint32_t ip_ = 0;
+  uint16_t port_ = 0;
+  int len_ = -1;
+  size_t read_ = 0;
+  char resp_[PMAP_CLIENT_RESP_LEN];
+};
+
+/* -------------------------------------------- */
+
+/**
+ * Allocator over malloc()/free().
+ */
+struct HeapAllocator {
+  void *allocate(size_t size) { return malloc(size); }
+  void deallocate(void *p, size_t) { free(p); }
+};
+
+/**
+ * Allocator over a fixed buffer, for targets without a heap. Blocks are
+ * released in reverse order of allocation, as the client does.
+ */
+template <size_t Bytes> struct ArenaAllocator {
+  void *allocate(size_t size) {
+    size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    if (size > Bytes - used_) {
+      return nullptr;
+    }
+    void *p = buf_ + used_;
+    used_ += size;
+    return p;
+  }
+  void deallocate(void *p, size_t) { used_ = (size_t)((char *)p - buf_); }
+
+private:
+  alignas(max_align_t) char buf_[Bytes];
+  size_t used_ = 0;
+};
+
+/* -------------------------------------------- */
+
+/**
+ * Monotonic time of pmap_ut_now_ms().
+ */
+struct SteadyClock {
+  int64_t now_ms() const { return pmap_ut_now_ms(); }
+};
+
+/**
+ * Time moved by hand, for simulation.
+ */
+struct ManualClock {
+  int64_t now = 0;
+  int64_t now_ms() const { return now; }
+  void advance(int64_t ms) { now += ms; }
+};
+
+/* -------------------------------------------- */
+
+/**
+ * Port mapping client over NAT-PMP and UPnP with a known IGD, same requests,
+ * retransmissions and results as the C calls.
+ */
+template <typename Transport = PosixTransport,
+          typename Allocator = HeapAllocator, typename Clock = SteadyClock>
+class BasicClient {
+public:
+  explicit BasicClient(Transport transport = Transport(),
+                       Allocator allocator = Allocator(), Clock clock = Clock())
+      : transport_(std::move(transport)), allocator_(std::move(allocator)),
+        clock_(std::move(clock)) {
+    tmo_.discovery_ms = PMAP_TMO_DISCOVERY_DEF;
+    tmo_.connect_ms = PMAP_TMO_CONNECT_DEF;
+    tmo_.response_ms = PMAP_TMO_RESPONSE_DEF;
+    tmo_.retransmit_ms = PMAP_TMO_RETRANSMIT_DEF;
+  }
+
+  Transport &transport() { return transport_; }
+  Allocator &allocator() { return allocator_; }
+  Clock &clock() { return clock_; }
+  void set_timeouts(const pmap_tmo_t &tmo) { tmo_ = tmo; }
+
+  /* NAT-PMP, see 'pmap_npmp_request' */
+  Expected<pmap_field_t> npmp_add_port(pmap_field_t pfield) {
+    int op_code = pmap_npmp_opcode(pfield.protocol);
+    if (op_code < 0) {
+      return detail::error(errno);
+    }
+    return npmp(op_code, pfield, nullptr);
+  }
+
+  Expected<pmap_field_t> npmp_delete_port(pmap_field_t pfield) {
+    pfield.lifetime_sec = 0; // Remove mapping
+    return npmp_add_port(pfield);
+  }
+
+  Expected<Address> npmp_external_ip(uint32_t gateway_ip) {
+    pmap_field_t pfield{};
+    pfield.gateway_ip = gateway_ip;
+    Address address;
+    Expected<pmap_field_t> res = npmp(NPMP_OPCODE_EXIP, pfield, &address);
+    if (!res) {
+      return res.error();
+    }
+    return address;
+  }
+
+  /* UPnP, see 'pmap_upnp_action_url' */
+  Expected<pmap_field_t> upnp_add_port(const Igd &igd,
+                                       const pmap_field_t &pfield) {
+    char req[detail::AddPortMapping::max_size];
+    size_t len = detail::AddPortMapping::render(
+        req, detail::Path{igd.control_url}, detail::Ip{igd.ip},
+        detail::Int{igd.port}, detail::Int{igd.version},
+        detail::Int{pfield.external_port}, detail::Proto{pfield.protocol},
+        detail::Int{pfield.internal_port}, detail::Ip{pfield.internal_ip},
+        detail::Int{pfield.lifetime_sec});
+    Expected<void> res = soap(igd, req, len, nullptr);
+    if (!res) {
+      return res.error();
+    }
+    return pfield;
+  }
+
+  Expected<void> upnp_delete_port(const Igd &igd, const pmap_field_t &pfield) {
+    char req[detail::DeletePortMapping::max_size];
+    size_t len = detail::DeletePortMapping::render(
+        req, detail::Path{igd.control_url}, detail::Ip{igd.ip},
+        detail::Int{igd.port}, detail::Int{igd.version},
+        detail::Int{pfield.external_port}, detail::Proto{pfield.protocol});
+    return soap(igd, req, len, nullptr);
+  }
+
+  Expected<Address> upnp_external_ip(const Igd &igd) {
+    char req[detail::GetExternalIPAddress::max_size];
+    size_t len = detail::GetExternalIPAddress::render(
+        req, detail::Path{igd.control_url}, detail::Ip{igd.ip},
+        detail::Int{igd.port}, detail::Int{igd.version});
+    Address address;
+    Expected<void> res = soap(igd, req, len, &address);
+    if (!res) {
+      return res.error();
+    }
+    return address;
+  }
+
+private:
+  /**
+   * Send a NAT-PMP request twice, each attempt waits `retransmit_ms`.
+   */
+  Expected<pmap_field_t> npmp(int op_code, pmap_field_t pfield,
+                              Address *address) {
+    uint8_t req[sizeof(nmpm_pkt_req)];
+    uint8_t pkt[sizeof(nmpm_pkt_resp) + sizeof(nmpm_pkt_exip)];
+    Error err = detail::error(ETIMEDOUT);
+
+    int req_len = pmap_npmp_build_req(op_code, &pfield, req);
+
+    auto h = transport_.open(SOCK_DGRAM, pfield.gateway_ip,
+                             NAT_PMP_SERVER_PORT, tmo_.connect_ms);
+    if (h < 0) {
+      return detail::error(errno);
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+      if (transport_.send(h, req, req_len) != 0) {
+        err = detail::error(errno);
+        break;
+      }
+      int64_t deadline = clock_.now_ms() + tmo_.retransmit_ms;
+      int len;
+      while ((len = transport_.recv(h, pkt, sizeof(pkt),
+                                    (int)(deadline - clock_.now_ms()))) > 0) {
+        int res = pmap_npmp_parse_resp(
+            op_code, &pfield, pkt, len, address ? address->ip : nullptr,
+            address ? (int)sizeof(address->ip) : 0, err.message,
+            sizeof(err.message));
+        if (res == 0) {
+          transport_.close(h);
+          return pfield;
+        } else if (res == 1) {
+          err.code = errno;
+          transport_.close(h);
+          return err;
+        }
+      }
+      if (len < 0 && errno != ETIMEDOUT) {
+        err = detail::error(errno);
+        break;
+      }
+    }
+
+    transport_.close(h);
+    return err;
+  }
+
+  /**
+   * POST a SOAP request and read the response into a buffer of the
+   * allocator.
+   */
+  Expected<void> soap(const Igd &igd, const char *req, size_t len,
+                      Address *address) {
+    char *buf = static_cast<char *>(allocator_.allocate(PMAP_CLIENT_RESP_LEN));
+    if (nullptr == buf) {
+      return detail::error(ENOMEM);
+    }
+
+    Expected<void> res = exchange(igd, req, len, buf, address);
+
+    allocator_.deallocate(buf, PMAP_CLIENT_RESP_LEN);
+    return res;
+  }
+
+  Expected<void> exchange(const Igd &igd, const char *req, size_t len,
+                          char *buf, Address *address) {
+    auto h = transport_.open(SOCK_STREAM, igd.ip, igd.port, tmo_.connect_ms);
+    if (h < 0) {
+      return detail::error(errno);
+    }
+    if (transport_.send(h, req, len) != 0) {
+      int err = errno;
+      transport_.close(h);
+      return detail::error(err);
+    }
+
+    size_t got = 0;
+    int n;
+    buf[0] = '\0';
+    while (got < PMAP_CLIENT_RESP_LEN - 1 &&
+           (n = transport_.recv(h, buf + got, PMAP_CLIENT_RESP_LEN - 1 - got,
+                                tmo_.response_ms)) > 0) {
+      got += n;
+      buf[got] = '\0';
+      if (detail::http_complete(buf, got)) {
+        break;
+      }
+    }
+    int err = errno;
+    transport_.close(h);
+
+    if (got == 0) {
+      return detail::error((n < 0) ? err : ECONNRESET);
+    }
+
+    /* Same result as 'pmap_gw_upnp_done' */
+    int status = (strncmp(buf, "HTTP/", 5) == 0 && strchr(buf, ' ') != nullptr)
+                     ? atoi(strchr(buf, ' ') + 1)
+                     : 0;
+    if (status == 200) {
+      if (nullptr != address) {
+        pmap_ut_substr("<NewExternalIPAddress>", "</NewExternalIPAddress>",
+                       buf, address->ip, sizeof(address->ip));
+      }
+      return Expected<void>::success();
+    }
+
+    Error e = detail::error(EUPNPFAULT);
+    char code[16];
+    if (pmap_ut_substr("<errorCode>", "</errorCode>", buf, code,
+                       sizeof(code)) == 0) {
+      e.upnp_error = atoi(code);
+    }
+    pmap_ut_substr("<errorDescription>", "</errorDescription>", buf,
+                   e.message, sizeof(e.message));
+    return e;
+  }
+
+  [[no_unique_address]] Transport transport_;
+  [[no_unique_address]] Allocator allocator_;
+  [[no_unique_address]] Clock clock_;
+  pmap_tmo_t tmo_;
+};
+
+} // namespace pmap
+
+#endif // _PMAP_CLIENT_HPP
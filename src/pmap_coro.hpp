@@ -0,0 +1,706 @@
+/*
+ *    pmap_coro.hpp
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_CORO_HPP
+#define _PMAP_CORO_HPP
+
+/**
+ * C++20 coroutine layer over the asynchronous operations (pmap_async.h),
+ * header only. A single thread drives a 'pmap::Client' from its event loop
+ * ('fds' and 'process', or 'run_once'); coroutines awaiting operations are
+ * resumed from 'process' once their operation finished.
+ *
+ *   pmap::Task<> keep(pmap::Client &client, pmap_field_t field) {
+ *     auto mapping = co_await client.map(field);
+ *     if (!mapping) {
+ *       printf("%s\n", mapping.error().message);
+ *       co_return;
+ *     }
+ *     ... // Renewed until `mapping` goes out of scope, deleted then
+ *   }
+ *
+ * An awaited operation lives in the frame of its coroutine, the wrapper adds
+ * no heap allocation of its own. Destroying a suspended coroutine cancels
+ * its operation ('pmap_async_cancel').
+ */
+
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <optional>
+#include <poll.h>
+#include <utility>
+#include <vector>
+
+#include "pmap_expected.hpp"
+
+extern "C" {
+#include "pmap_async.h"
+#include "pmap_wheel.h"
+}
+
+namespace pmap {
+
+class Client;
+class Mapping;
+
+/**
+ * Result of 'Client::discover'.
+ */
+struct Discovery {
+  int protocol = PMAP_PROTO_NONE; /* PMAP_PROTO_* that answered */
+  char external_ip[16] = {};
+};
+
+/* -------------------------------------------- */
+
+namespace detail {
+
+struct PromiseBase {
+  std::coroutine_handle<> continuation; /* Coroutine awaiting the task */
+  bool detached = false;                /* Frame freed when done */
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  struct Final {
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      PromiseBase &p = h.promise();
+      if (p.continuation) {
+        return p.continuation;
+      }
+      if (p.detached) {
+        h.destroy();
+      }
+      return std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+  Final final_suspend() noexcept { return {}; }
+
+  /* The C library reports failures as results, an exception is a bug */
+  void unhandled_exception() noexcept { std::terminate(); }
+};
+
+template <typename T> struct Promise : PromiseBase {
+  std::optional<T> value;
+  template <typename U> void return_value(U &&v) {
+    value.emplace(std::forward<U>(v));
+  }
+  T take() { return std::move(*value); }
+};
+
+template <> struct Promise<void> : PromiseBase {
+  void return_void() noexcept {}
+  void take() {}
+};
+
+} // namespace detail
+
+/**
+ * Lazy coroutine, started when awaited or detached ('Client::spawn').
+ */
+template <typename T = void> class [[nodiscard]] Task {
+public:
+  struct promise_type : detail::Promise<T> {
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+  };
+
+  Task(Task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      if (h_) {
+        h_.destroy();
+      }
+      h_ = std::exchange(other.h_, {});
+    }
+    return *this;
+  }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() {
+    if (h_) {
+      h_.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+    h_.promise().continuation = c;
+    return h_;
+  }
+  T await_resume() { return h_.promise().take(); }
+
+  /**
+   * Start the coroutine and let it free itself when done.
+   */
+  void detach() {
+    std::coroutine_handle<promise_type> h = std::exchange(h_, {});
+    h.promise().detached = true;
+    h.resume();
+  }
+
+private:
+  explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+  std::coroutine_handle<promise_type> h_;
+};
+
+/* -------------------------------------------- */
+
+namespace detail {
+
+/**
+ * Awaiter of one asynchronous operation, kept in the frame of the awaiting
+ * coroutine. The callback queues it on the client, the coroutine is resumed
+ * once 'pmap_process' returned.
+ */
+class OperationBase {
+public:
+  OperationBase(const OperationBase &) = delete;
+  OperationBase &operator=(const OperationBase &) = delete;
+
+protected:
+  OperationBase(Client *client, int action, const pmap_field_t &field)
+      : client_(client), action_(action), field_(field) {}
+  ~OperationBase();
+
+  bool start(std::coroutine_handle<> waiter);
+  void fail(int code) {
+    error_.status = 1;
+    error_.code = code;
+  }
+
+  Client *client_;
+  int action_;
+  pmap_field_t field_;
+  pmap_aop_t *op_ = nullptr;
+  std::coroutine_handle<> waiter_;
+  Error error_{};
+  bool ok_ = false;
+
+  /* Result, copied before the engine frees the operation */
+  int protocol_ = PMAP_PROTO_NONE;
+  char external_ip_[16] = {};
+
+private:
+  friend class pmap::Client;
+  static void done(pmap_aop_t *op, void *arg);
+  OperationBase *next_ = nullptr; /* Ready list of the client */
+  bool queued_ = false;
+};
+
+template <typename T> class Operation : public OperationBase {
+public:
+  Operation(Client *client, int action, const pmap_field_t &field)
+      : OperationBase(client, action, field) {}
+
+  bool await_ready() const noexcept { return false; }
+  bool await_suspend(std::coroutine_handle<> waiter) { return start(waiter); }
+  Expected<T> await_resume() {
+    if (!ok_) {
+      return Expected<T>(error_);
+    }
+    return result();
+  }
+
+private:
+  Expected<T> result();
+};
+
+template <> inline Expected<Discovery> Operation<Discovery>::result() {
+  Discovery d;
+  d.protocol = protocol_;
+  memcpy(d.external_ip, external_ip_, sizeof(d.external_ip));
+  return d;
+}
+
+template <> inline Expected<Address> Operation<Address>::result() {
+  Address a;
+  memcpy(a.ip, external_ip_, sizeof(a.ip));
+  return a;
+}
+
+template <> inline Expected<pmap_field_t> Operation<pmap_field_t>::result() {
+  return field_;
+}
+
+template <> inline Expected<void> Operation<void>::result() {
+  return Expected<void>::success();
+}
+
+/**
+ * Renewal timer of a mapping, first member so the wheel timer gives it back.
+ */
+struct MappingTimer {
+  pmap_timer_t timer;
+  Mapping *self;
+};
+
+} // namespace detail
+
+/* -------------------------------------------- */
+
+/**
+ * Port mapping kept alive by its client: renewed after half of its
+ * lifetime (see PMAP_RENEW_*) and deleted when the handle is destroyed.
+ * Move only, it must not outlive its client.
+ */
+class Mapping {
+public:
+  Mapping() { init(); }
+  Mapping(Mapping &&other) noexcept {
+    init();
+    take(other);
+  }
+  Mapping &operator=(Mapping &&other) noexcept {
+    if (this != &other) {
+      release();
+      take(other);
+    }
+    return *this;
+  }
+  Mapping(const Mapping &) = delete;
+  Mapping &operator=(const Mapping &) = delete;
+  ~Mapping() { release(); }
+
+  explicit operator bool() const { return nullptr != client_; }
+
+  /** Values granted by the last successful add or renewal. */
+  const pmap_field_t &field() const { return field_; }
+  /** Failed renewals in a row. */
+  int failures() const { return failures_; }
+
+  void release();
+
+private:
+  friend class Client;
+  Mapping(Client *client, const pmap_field_t &granted, int lifetime_sec);
+
+  void init() {
+    node_.timer.slot = -1;
+    node_.timer.next = node_.timer.prev = &node_.timer;
+    node_.self = this;
+  }
+  void take(Mapping &other);
+  void schedule(int64_t delay_ms);
+  void renew();
+  static void renewed(pmap_aop_t *op, void *arg);
+  static void release_after(pmap_aop_t *op, void *arg);
+
+  Client *client_ = nullptr;
+  pmap_field_t field_{};
+  int lifetime_sec_ = 0; /* Requested on every renewal */
+  int failures_ = 0;
+  int64_t renew_ms_ = 0;
+  pmap_aop_t *op_ = nullptr; /* Renewal in flight */
+  detail::MappingTimer node_;
+};
+
+/* -------------------------------------------- */
+
+/**
+ * Client context and the loop glue of its coroutines.
+ */
+class Client {
+public:
+  Client() : ctx_(pmap_ctx_create()), owned_(true) {
+    if (nullptr == ctx_) {
+      throw std::bad_alloc();
+    }
+    init();
+  }
+  /** Use an existing context, not destroyed with the client. */
+  explicit Client(pmap_ctx_t *ctx) : ctx_(ctx), owned_(false) { init(); }
+  Client(const Client &) = delete;
+  Client &operator=(const Client &) = delete;
+  ~Client() {
+    if (owned_) {
+      pmap_ctx_destroy(ctx_);
+    } else {
+      pmap_async_cancel_all(ctx_);
+    }
+  }
+
+  pmap_ctx_t *ctx() const { return ctx_; }
+
+  /* Awaitable operations, see pmap_*_async */
+  detail::Operation<Discovery> discover(uint32_t gateway_ip) {
+    return {this, PMAP_ASYNC_DISCOVER, field(gateway_ip)};
+  }
+  detail::Operation<pmap_field_t> add_port(const pmap_field_t &pfield) {
+    return {this, PMAP_ASYNC_ADDPORT, pfield};
+  }
+  detail::Operation<void> delete_port(const pmap_field_t &pfield) {
+    return {this, PMAP_ASYNC_DELPORT, pfield};
+  }
+  detail::Operation<Address> external_ip(uint32_t gateway_ip) {
+    return {this, PMAP_ASYNC_GETEXIP, field(gateway_ip)};
+  }
+
+  /**
+   * Add a mapping and keep it, see 'Mapping'.
+   */
+  Task<Expected<Mapping>> map(pmap_field_t pfield) {
+    Expected<pmap_field_t> granted = co_await add_port(pfield);
+    if (!granted) {
+      co_return Expected<Mapping>(granted.error());
+    }
+    co_return Expected<Mapping>(Mapping(this, *granted, pfield.lifetime_sec));
+  }
+
+  /**
+   * Start a coroutine that frees itself when done. It must be done before
+   * the client is destroyed.
+   */
+  void spawn(Task<> task) { task.detach(); }
+
+  /**
+   * Descriptors to poll and next deadline, see 'pmap_fds'.
+   */
+  int fds(struct pollfd *fds, int max, int64_t *deadline_ms) {
+    int64_t deadline;
+    int n = pmap_fds(ctx_, fds, max, &deadline);
+    int64_t renew = pmap_wheel_next(&wheel_);
+    if (renew >= 0 && (deadline < 0 || renew < deadline)) {
+      deadline = renew;
+    }
+    if (nullptr != deadline_ms) {
+      *deadline_ms = deadline;
+    }
+    return n;
+  }
+
+  /**
+   * Move the operations forward, renew the mappings that are due and resume
+   * the coroutines whose operation finished, see 'pmap_process'.
+   *
+   * @return The number of operations still pending.
+   */
+  int process(const struct pollfd *fds, int nfds, int64_t now_ms) {
+    pmap_process(ctx_, fds, nfds, now_ms);
+
+    pmap_timer_t due;
+    pmap_timer_list_init(&due);
+    pmap_wheel_expire(&wheel_, now_ms, &due);
+    while (!pmap_timer_list_empty(&due)) {
+      pmap_timer_t *timer = due.next;
+      pmap_timer_list_del(timer);
+      reinterpret_cast<detail::MappingTimer *>(timer)->self->renew();
+    }
+
+    resume();
+
+    return pending();
+  }
+
+  /**
+   * Poll once for at most `max_wait_ms` (-1 for the next deadline) and
+   * process.
+   *
+   * @return The number of operations still pending.
+   */
+  int run_once(int max_wait_ms = -1) {
+    int64_t deadline;
+    int n = fds(pfds_.data(), (int)pfds_.size(), &deadline);
+    if (n > (int)pfds_.size()) {
+      pfds_.resize(n);
+      n = fds(pfds_.data(), n, &deadline);
+    }
+    int64_t now = pmap_ut_now_ms();
+    int wait = (deadline < 0) ? -1
+               : (deadline > now) ? (int)(deadline - now)
+                                  : 0;
+    if (max_wait_ms >= 0 && (wait < 0 || wait > max_wait_ms)) {
+      wait = max_wait_ms;
+    }
+    poll(pfds_.data(), n, wait);
+    return process(pfds_.data(), n, pmap_ut_now_ms());
+  }
+
+  /**
+   * Run until no operation is pending. Renewals are not waited for.
+   */
+  void run() {
+    while (pending() > 0) {
+      run_once();
+    }
+  }
+
+  /** Operations pending in the engine. */
+  int pending() const {
+    int n = 0;
+    for (pmap_aop_t *op = ctx_->async; nullptr != op; op = op->next) {
+      n++;
+    }
+    return n;
+  }
+
+  /** Mappings kept by the client. */
+  int mappings() const { return wheel_.count + renewing_; }
+
+private:
+  friend class detail::OperationBase;
+  friend class Mapping;
+
+  void init() {
+    pmap_wheel_init(&wheel_, PMAP_RENEW_TICK_MS, pmap_ut_now_ms());
+    seed_ = (uint32_t)(uintptr_t)this | 1;
+  }
+
+  static pmap_field_t field(uint32_t gateway_ip) {
+    pmap_field_t f{};
+    f.gateway_ip = gateway_ip;
+    return f;
+  }
+
+  void ready(detail::OperationBase *op) {
+    op->queued_ = true;
+    *ready_tail_ = op;
+    ready_tail_ = &op->next_;
+  }
+
+  void unready(detail::OperationBase *op) {
+    for (detail::OperationBase **pp = &ready_; nullptr != *pp;
+         pp = &(*pp)->next_) {
+      if (*pp == op) {
+        *pp = op->next_;
+        if (ready_tail_ == &op->next_) {
+          ready_tail_ = pp;
+        }
+        break;
+      }
+    }
+    op->next_ = nullptr;
+    op->queued_ = false;
+  }
+
+  /* A resumed coroutine may destroy other awaiters, so one at a time */
+  void resume() {
+    while (nullptr != ready_) {
+      detail::OperationBase *op = ready_;
+      unready(op);
+      op->waiter_.resume();
+    }
+  }
+
+  /* xorshift32, as 'pmap_renew' does */
+  uint32_t rand() {
+    uint32_t x = seed_;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    seed_ = x;
+    return x;
+  }
+
+  /* Delay until the next renewal, see '_pmap_renew_delay' */
+  int64_t renew_delay(int lifetime_sec) {
+    int64_t lifetime_ms = (int64_t)lifetime_sec * 1000;
+    int64_t delay =
+        lifetime_ms * PMAP_RENEW_FRACTION_NUM / PMAP_RENEW_FRACTION_DEN;
+    int64_t spread = delay * PMAP_RENEW_JITTER_PCT / 100;
+    if (spread > 0) {
+      delay += (int64_t)(rand() % (uint32_t)(2 * spread + 1)) - spread;
+    }
+    if (delay > lifetime_ms - PMAP_RENEW_TICK_MS) {
+      delay = lifetime_ms - PMAP_RENEW_TICK_MS;
+    }
+    if (delay < PMAP_RENEW_TICK_MS) {
+      delay = PMAP_RENEW_TICK_MS;
+    }
+    return delay;
+  }
+
+  pmap_ctx_t *ctx_;
+  bool owned_;
+  pmap_wheel_t wheel_;
+  int renewing_ = 0; /* Mappings with a renewal in flight */
+  uint32_t seed_ = 1;
+  detail::OperationBase *ready_ = nullptr;
+  detail::OperationBase **ready_tail_ = &ready_;
+  std::vector<struct pollfd> pfds_ = std::vector<struct pollfd>(64);
+};
+
+/* -------------------------------------------- */
+
+inline detail::OperationBase::~OperationBase() {
+  if (nullptr != op_) {
+    pmap_async_cancel(op_);
+  }
+  if (queued_) {
+    client_->unready(this);
+  }
+}
+
+inline bool detail::OperationBase::start(std::coroutine_handle<> waiter) {
+  pmap_ctx_t *ctx = client_->ctx_;
+
+  waiter_ = waiter;
+  switch (action_) {
+  case PMAP_ASYNC_DISCOVER:
+    op_ = pmap_discover_async(ctx, field_.gateway_ip, done, this);
+    break;
+  case PMAP_ASYNC_ADDPORT:
+    op_ = pmap_addport_async(ctx, &field_, done, this);
+    break;
+  case PMAP_ASYNC_DELPORT:
+    op_ = pmap_delport_async(ctx, &field_, done, this);
+    break;
+  default:
+    op_ = pmap_getexip_async(ctx, &field_, done, this);
+    break;
+  }
+
+  if (nullptr == op_) {
+    fail(errno);
+    return false; // Not suspended, the error is the result
+  }
+  return true;
+}
+
+inline void detail::OperationBase::done(pmap_aop_t *op, void *arg) {
+  OperationBase *self = static_cast<OperationBase *>(arg);
+
+  self->op_ = nullptr; // Freed when the callback returns
+  self->ok_ = (op->status == 0);
+  self->error_.status = op->status;
+  self->error_.code = op->err;
+  memcpy(self->error_.message, op->error, sizeof(self->error_.message));
+  self->protocol_ = op->protocol;
+  memcpy(self->external_ip_, op->external_ip, sizeof(self->external_ip_));
+  self->field_ = op->field;
+
+  self->client_->ready(self);
+}
+
+/* -------------------------------------------- */
+
+inline Mapping::Mapping(Client *client, const pmap_field_t &granted,
+                        int lifetime_sec)
+    : client_(client), field_(granted), lifetime_sec_(lifetime_sec) {
+  init();
+  schedule(client_->renew_delay(field_.lifetime_sec));
+}
+
+inline void Mapping::take(Mapping &other) {
+  client_ = std::exchange(other.client_, nullptr);
+  field_ = other.field_;
+  lifetime_sec_ = other.lifetime_sec_;
+  failures_ = other.failures_;
+  renew_ms_ = other.renew_ms_;
+  op_ = std::exchange(other.op_, nullptr);
+
+  if (nullptr != op_) {
+    op_->arg = this; // Renewal in flight reports here now
+  }
+  if (other.node_.timer.slot >= 0) {
+    pmap_wheel_del(&client_->wheel_, &other.node_.timer);
+    pmap_wheel_add(&client_->wheel_, &node_.timer, renew_ms_);
+  }
+}
+
+/**
+ * Stop renewing and delete the mapping from the gateway, in the background
+ * (the client must keep running for the request to go out).
+ */
+inline void Mapping::release() {
+  if (nullptr == client_) {
+    return;
+  }
+
+  pmap_wheel_del(&client_->wheel_, &node_.timer);
+  if (nullptr != op_) {
+    /* Delete once the renewal in flight is done, not before it */
+    op_->cb = release_after;
+    op_->arg = client_;
+    op_ = nullptr;
+    client_->renewing_--;
+  } else {
+    int prio = pmap_priority(PMAP_PRIO_BACKGROUND);
+    pmap_delport_async(client_->ctx_, &field_, nullptr, nullptr);
+    pmap_priority(prio);
+  }
+  client_ = nullptr;
+}
+
+inline void Mapping::schedule(int64_t delay_ms) {
+  renew_ms_ = pmap_ut_now_ms() + delay_ms;
+  pmap_wheel_add(&client_->wheel_, &node_.timer, renew_ms_);
+}
+
+inline void Mapping::renew() {
+  pmap_field_t request = field_;
+  request.lifetime_sec = lifetime_sec_;
+
+  /* Renewals give way to the calls someone waits for */
+  int prio = pmap_priority(PMAP_PRIO_BACKGROUND);
+  op_ = pmap_addport_async(client_->ctx_, &request, renewed, this);
+  pmap_priority(prio);
+  if (nullptr == op_) {
+    failures_++;
+    schedule((int64_t)PMAP_RENEW_RETRY_MIN * 1000);
+    return;
+  }
+  client_->renewing_++;
+}
+
+inline void Mapping::renewed(pmap_aop_t *op, void *arg) {
+  Mapping *self = static_cast<Mapping *>(arg);
+
+  self->op_ = nullptr;
+  self->client_->renewing_--;
+  if (op->status == 0) {
+    self->field_ = op->field;
+    self->failures_ = 0;
+    self->schedule(self->client_->renew_delay(self->field_.lifetime_sec));
+    return;
+  }
+
+  /* Retry after RETRY_MIN seconds, doubled on every failure */
+  int retry = PMAP_RENEW_RETRY_MIN;
+  for (int i = 0; i < self->failures_ && retry < PMAP_RENEW_RETRY_MAX; i++) {
+    retry *= 2;
+  }
+  if (retry > PMAP_RENEW_RETRY_MAX) {
+    retry = PMAP_RENEW_RETRY_MAX;
+  }
+  self->failures_++;
+  self->schedule((int64_t)retry * 1000);
+}
+
+inline void Mapping::release_after(pmap_aop_t *op, void *arg) {
+  int prio = pmap_priority(PMAP_PRIO_BACKGROUND);
+  pmap_delport_async(static_cast<Client *>(arg)->ctx_, &op->field, nullptr,
+                     nullptr);
+  pmap_priority(prio);
+}
+
+} // namespace pmap
+
+#endif // _PMAP_CORO_HPP
@@ -26,6 +26,10 @@
 
 #include "pmap_cfg.h"
 
+/* Packet dumps, set with 'pmap_set_debug' from any thread */
+extern uint8_t pmap_debug;
+#define PMAP_DEBUG_DUMP() __atomic_load_n(&pmap_debug, __ATOMIC_RELAXED)
+
 #if PMAP_DEBUG_LOG_DEBUG
 
 /* Here is the debug routine */
@@ -0,0 +1,548 @@
+/*
+ *    pmap_delq.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pmap.h"
+#include "pmap_debug.h"
+#include "pmap_delq.h"
+#include "pmap_registry.h"
+#include "util.h"
+
+/**
+ * Deletes of one gateway sent by a shutdown flush thread.
+ */
+typedef struct {
+  pmap_delq_gw_t *gw;
+  pmap_field_t *fields;
+  int *status;
+  int count;
+  int64_t deadline_ms;
+  pthread_t thread;
+  int started;
+} _pmap_delq_job;
+
+/* -------------------------------------------- */
+
+/**
+ * Wait on a condition for at most `wait_ms`.
+ */
+static void _pmap_delq_timedwait(pthread_cond_t *cond, pthread_mutex_t *lock,
+                                 int64_t wait_ms) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += wait_ms / 1000;
+  ts.tv_nsec += (wait_ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(cond, lock, &ts);
+}
+
+static int _pmap_delq_collect(pmap_reg_entry_t *entry, void *arg) {
+
+  pmap_field_t **next = arg;
+
+  *(*next)++ = entry->field;
+
+  return 0;
+}
+
+/**
+ * Remove every delete from `reg`.
+ *
+ * @return The deletes, sorted by gateway, or NULL if there is none or
+ * memory allocation fails. Free it with free().
+ */
+static pmap_field_t *_pmap_delq_take(pmap_reg_t *reg, int *count) {
+
+  *count = 0;
+  if (reg->count == 0) {
+    return NULL;
+  }
+
+  pmap_field_t *fields = malloc(reg->count * sizeof(pmap_field_t));
+  if (NULL == fields) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  pmap_field_t *next = fields;
+  pmap_reg_foreach(reg, _pmap_delq_collect, &next);
+  *count = (int)(next - fields);
+
+  for (int i = 0; i < *count; i++) {
+    pmap_reg_del(reg, fields[i].gateway_ip, fields[i].protocol,
+                 fields[i].external_port);
+  }
+
+  return fields;
+}
+
+static int _pmap_delq_cmp(const void *a, const void *b) {
+
+  uint32_t ga = ((const pmap_field_t *)a)->gateway_ip;
+  uint32_t gb = ((const pmap_field_t *)b)->gateway_ip;
+
+  return (ga > gb) - (ga < gb);
+}
+
+/**
+ * Number of entries from `first` that go to the same gateway.
+ */
+static int _pmap_delq_run(pmap_field_t *fields, int count, int first) {
+
+  int n = 1;
+
+  while (first + n < count &&
+         fields[first + n].gateway_ip == fields[first].gateway_ip) {
+    n++;
+  }
+
+  return n;
+}
+
+/**
+ * Client context of a gateway, created on first use.
+ */
+static pmap_delq_gw_t *_pmap_delq_gw(pmap_delq_t *q, uint32_t gateway_ip) {
+
+  for (pmap_delq_gw_t *gw = q->gateways; gw != NULL; gw = gw->next) {
+    if (gw->gateway_ip == gateway_ip) {
+      return gw;
+    }
+  }
+
+  pmap_delq_gw_t *gw = calloc(1, sizeof(pmap_delq_gw_t));
+  if (NULL == gw || NULL == (gw->ctx = pmap_ctx_create())) {
+    free(gw);
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  gw->gateway_ip = gateway_ip;
+  gw->next = q->gateways;
+  q->gateways = gw;
+
+  return gw;
+}
+
+/**
+ * Shorten the timeouts of a context so one request ends within `left_ms`.
+ */
+static void _pmap_delq_limit(pmap_ctx_t *ctx, int64_t left_ms) {
+
+  pmap_tmo_t floor = ctx->tmo_floor, ceil = ctx->tmo_ceil;
+  int left = (left_ms > 0x7fffffff) ? 0x7fffffff : (int)left_ms;
+
+#define _PMAP_DELQ_MIN(a, b) (((a) < (b)) ? (a) : (b))
+  ceil.discovery_ms = _PMAP_DELQ_MIN(ceil.discovery_ms, left);
+  ceil.connect_ms = _PMAP_DELQ_MIN(ceil.connect_ms, left);
+  ceil.response_ms = _PMAP_DELQ_MIN(ceil.response_ms, left);
+  ceil.retransmit_ms = _PMAP_DELQ_MIN(ceil.retransmit_ms, left);
+  floor.discovery_ms = _PMAP_DELQ_MIN(floor.discovery_ms, ceil.discovery_ms);
+  floor.connect_ms = _PMAP_DELQ_MIN(floor.connect_ms, ceil.connect_ms);
+  floor.response_ms = _PMAP_DELQ_MIN(floor.response_ms, ceil.response_ms);
+  floor.retransmit_ms =
+      _PMAP_DELQ_MIN(floor.retransmit_ms, ceil.retransmit_ms);
+#undef _PMAP_DELQ_MIN
+
+  pmap_ctx_set_timeouts(ctx, &floor, &ceil);
+}
+
+/**
+ * Delete the mappings of one gateway. With a deadline they are sent
+ * PMAP_DELQ_CHUNK at a time with timeouts cut to the time left, and the
+ * ones not sent by the deadline fail.
+ *
+ * @param deadline_ms pmap_ut_now_ms() to give up at, 0 for none.
+ * @return Number of mappings not deleted.
+ */
+static int _pmap_delq_send(pmap_delq_gw_t *gw, pmap_field_t *fields,
+                           int *status, int count, int64_t deadline_ms) {
+
+  int failed = 0;
+  int chunk = (deadline_ms > 0) ? PMAP_DELQ_CHUNK : count;
+
+  for (int i = 0; i < count; i += chunk) {
+
+    int n = (count - i < chunk) ? count - i : chunk;
+
+    if (NULL == gw) {
+      for (int j = i; j < i + n; j++) {
+        status[j] = 1;
+      }
+    } else if (deadline_ms > 0 && pmap_ut_now_ms() >= deadline_ms) {
+      for (int j = i; j < count; j++) {
+        status[j] = 1;
+      }
+      failed += count - i;
+      break;
+    } else {
+      if (deadline_ms > 0) {
+        _pmap_delq_limit(gw->ctx, deadline_ms - pmap_ut_now_ms());
+      }
+      pmap_delport_batch(gw->ctx, &fields[i], n, &status[i]);
+    }
+
+    for (int j = i; j < i + n; j++) {
+      failed += (status[j] != 0);
+    }
+  }
+
+  return failed;
+}
+
+/**
+ * Worker thread. It sleeps until a delete has waited `batch_ms` (or
+ * PMAP_DELQ_BATCH_MAX are queued), then sends all of them, gateway by
+ * gateway.
+ */
+static void *_pmap_delq_worker(void *arg) {
+
+  pmap_delq_t *q = arg;
+
+  pmap_priority(PMAP_PRIO_BACKGROUND);
+
+  pthread_mutex_lock(&q->lock);
+  while (!q->stop) {
+
+    if (q->pending->count == 0) {
+      pthread_cond_wait(&q->wake, &q->lock);
+      continue;
+    }
+
+    int64_t wait = q->first_ms + q->batch_ms - pmap_ut_now_ms();
+    if (wait > 0 && q->pending->count < PMAP_DELQ_BATCH_MAX) {
+      _pmap_delq_timedwait(&q->wake, &q->lock, wait);
+      continue;
+    }
+
+    int count;
+    pmap_field_t *fields = _pmap_delq_take(q->pending, &count);
+    int *status = (NULL != fields) ? malloc(count * sizeof(int)) : NULL;
+    if (NULL == status) {
+      /* Out of memory, put them back and try again later */
+      for (int i = 0; i < count; i++) {
+        pmap_reg_add(q->pending, &fields[i]);
+      }
+      free(fields);
+      _pmap_delq_timedwait(&q->wake, &q->lock, q->batch_ms + 1);
+      continue;
+    }
+    for (int i = 0; i < count; i++) {
+      pmap_reg_add(q->inflight, &fields[i]);
+    }
+    q->first_ms = 0;
+    pthread_mutex_unlock(&q->lock);
+
+    qsort(fields, count, sizeof(pmap_field_t), _pmap_delq_cmp);
+    int failed = 0;
+    for (int i = 0; i < count;) {
+      int n = _pmap_delq_run(fields, count, i);
+      failed += _pmap_delq_send(_pmap_delq_gw(q, fields[i].gateway_ip),
+                                &fields[i], &status[i], n, 0);
+      i += n;
+    }
+    PMAP_DEBUG_LOG("Deleted %d mappings, %d failed\n", count - failed,
+                   failed);
+
+    pthread_mutex_lock(&q->lock);
+    for (int i = 0; i < count; i++) {
+      pmap_reg_del(q->inflight, fields[i].gateway_ip, fields[i].protocol,
+                   fields[i].external_port);
+    }
+    q->stats.deleted += count - failed;
+    q->stats.failed += failed;
+    q->stats.batches++;
+    pthread_cond_broadcast(&q->done);
+
+    free(status);
+    free(fields);
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return NULL;
+}
+
+static void *_pmap_delq_flush_job(void *arg) {
+
+  _pmap_delq_job *job = arg;
+
+  pmap_priority(PMAP_PRIO_BACKGROUND);
+  _pmap_delq_send(job->gw, job->fields, job->status, job->count,
+                  job->deadline_ms);
+
+  return NULL;
+}
+
+/**
+ * Delete everything still pending, one thread per gateway, within
+ * `timeout_ms`.
+ *
+ * @return Number of mappings not deleted.
+ */
+static int _pmap_delq_flush(pmap_delq_t *q, int timeout_ms) {
+
+  int64_t deadline_ms = pmap_ut_now_ms() + ((timeout_ms > 0) ? timeout_ms : 1);
+  int count, jobs = 0, failed = 0;
+
+  pmap_field_t *fields = _pmap_delq_take(q->pending, &count);
+  if (NULL == fields) {
+    return count;
+  }
+
+  int *status = malloc(count * sizeof(int));
+  _pmap_delq_job *job = calloc(count, sizeof(_pmap_delq_job));
+  if (NULL == status || NULL == job) {
+    free(status);
+    free(job);
+    free(fields);
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return count;
+  }
+
+  qsort(fields, count, sizeof(pmap_field_t), _pmap_delq_cmp);
+  for (int i = 0; i < count; jobs++) {
+    job[jobs].count = _pmap_delq_run(fields, count, i);
+    job[jobs].gw = _pmap_delq_gw(q, fields[i].gateway_ip);
+    job[jobs].fields = &fields[i];
+    job[jobs].status = &status[i];
+    job[jobs].deadline_ms = deadline_ms;
+    i += job[jobs].count;
+  }
+
+  for (int j = 0; j < jobs; j++) {
+    job[j].started = (pthread_create(&job[j].thread, NULL,
+                                     _pmap_delq_flush_job, &job[j]) == 0);
+  }
+  for (int j = 0; j < jobs; j++) {
+    if (job[j].started) {
+      pthread_join(job[j].thread, NULL);
+    } else {
+      _pmap_delq_flush_job(&job[j]); // No thread, the deadline still holds
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    failed += (status[i] != 0);
+  }
+  q->stats.deleted += count - failed;
+  q->stats.failed += failed;
+
+  free(job);
+  free(status);
+  free(fields);
+
+  return failed;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Create a delete queue and start its worker thread.
+ *
+ * @param batch_ms Time a delete waits for others before the batch is sent,
+ * -1 for PMAP_DELQ_BATCH_MS.
+ * @return A new queue, or NULL on failure (caller should check errno
+ * value). The caller is responsible for freeing it by calling
+ * 'pmap_delq_destroy' function.
+ */
+pmap_delq_t *pmap_delq_create(int batch_ms) {
+
+  pmap_delq_t *q = calloc(1, sizeof(pmap_delq_t));
+  if (NULL == q) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  q->batch_ms = (batch_ms >= 0) ? batch_ms : PMAP_DELQ_BATCH_MS;
+  q->pending = pmap_reg_open(NULL, 0);
+  q->inflight = pmap_reg_open(NULL, 0);
+  if (NULL == q->pending || NULL == q->inflight) {
+    pmap_reg_close(q->pending);
+    pmap_reg_close(q->inflight);
+    free(q);
+    return NULL; // caller should check errno value
+  }
+
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->wake, NULL);
+  pthread_cond_init(&q->done, NULL);
+
+  int ret = pthread_create(&q->thread, NULL, _pmap_delq_worker, q);
+  if (ret != 0) {
+    pthread_cond_destroy(&q->done);
+    pthread_cond_destroy(&q->wake);
+    pthread_mutex_destroy(&q->lock);
+    pmap_reg_close(q->pending);
+    pmap_reg_close(q->inflight);
+    free(q);
+    errno = ret;
+    PMAP_DEBUG_ERROR("Cannot start the delete worker");
+    return NULL;
+  }
+
+  return q;
+}
+
+/**
+ * Stop the worker and delete everything still queued, the gateways in
+ * parallel. Returns after about `timeout_ms` at most, plus the batch the
+ * worker may be sending; mappings not deleted by then are left to expire.
+ *
+ * @param q The queue, NULL is allowed.
+ * @param timeout_ms Time allowed for the final flush.
+ * @return Number of mappings not deleted by the final flush.
+ */
+int pmap_delq_destroy(pmap_delq_t *q, int timeout_ms) {
+
+  if (NULL == q) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  q->stop = 1;
+  pthread_cond_signal(&q->wake);
+  pthread_mutex_unlock(&q->lock);
+  pthread_join(q->thread, NULL);
+
+  int failed = _pmap_delq_flush(q, timeout_ms);
+  if (failed > 0) {
+    PMAP_DEBUG_LOG("%d mappings left to expire\n", failed);
+  }
+
+  while (q->gateways != NULL) {
+    pmap_delq_gw_t *gw = q->gateways;
+    q->gateways = gw->next;
+    pmap_ctx_destroy(gw->ctx);
+    free(gw);
+  }
+  pmap_reg_close(q->pending);
+  pmap_reg_close(q->inflight);
+  pthread_cond_destroy(&q->done);
+  pthread_cond_destroy(&q->wake);
+  pthread_mutex_destroy(&q->lock);
+  free(q);
+
+  return failed;
+}
+
+/**
+ * Queue the delete of a mapping and return at once. A mapping already
+ * queued is queued once.
+ *
+ * @param q The queue.
+ * @param pfield The mapping, keyed by gateway_ip, protocol and
+ * external_port.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_delq_push(pmap_delq_t *q, const pmap_field_t *pfield) {
+
+  pthread_mutex_lock(&q->lock);
+
+  int queued = (pmap_reg_find(q->pending, pfield->gateway_ip,
+                              pfield->protocol, pfield->external_port) != NULL);
+  if (pmap_reg_add(q->pending, pfield) != 0) {
+    pthread_mutex_unlock(&q->lock);
+    return 1; // caller should check errno value
+  }
+
+  if (queued) {
+    q->stats.coalesced++;
+  } else {
+    q->stats.queued++;
+    if (q->pending->count == 1) {
+      q->first_ms = pmap_ut_now_ms();
+      pthread_cond_signal(&q->wake);
+    } else if (q->pending->count == PMAP_DELQ_BATCH_MAX) {
+      pthread_cond_signal(&q->wake);
+    }
+  }
+
+  pthread_mutex_unlock(&q->lock);
+
+  return 0;
+}
+
+/**
+ * Cancel the queued delete of a mapping, call it before adding the mapping
+ * again. If the delete is being sent, wait until the gateway answered, so
+ * the add that follows is not undone by it.
+ *
+ * @param q The queue.
+ * @param pfield The mapping, keyed by gateway_ip, protocol and
+ * external_port.
+ * @return 0 if a queued delete was cancelled (the mapping still exists), 1
+ * if there was none.
+ */
+int pmap_delq_cancel(pmap_delq_t *q, const pmap_field_t *pfield) {
+
+  int ret = 1;
+
+  pthread_mutex_lock(&q->lock);
+
+  if (pmap_reg_find(q->pending, pfield->gateway_ip, pfield->protocol,
+                    pfield->external_port) != NULL) {
+    pmap_reg_del(q->pending, pfield->gateway_ip, pfield->protocol,
+                 pfield->external_port);
+    q->stats.cancelled++;
+    ret = 0;
+  }
+
+  while (pmap_reg_find(q->inflight, pfield->gateway_ip, pfield->protocol,
+                       pfield->external_port) != NULL) {
+    pthread_cond_wait(&q->done, &q->lock);
+  }
+
+  pthread_mutex_unlock(&q->lock);
+
+  return ret;
+}
+
+/**
+ * Read the queue metrics.
+ *
+ * @param q The queue.
+ * @param stats Filled with the counters.
+ */
+void pmap_delq_stats(pmap_delq_t *q, pmap_delq_stats_t *stats) {
+
+  pthread_mutex_lock(&q->lock);
+  *stats = q->stats;
+  stats->pending = q->pending->count;
+  pthread_mutex_unlock(&q->lock);
+}
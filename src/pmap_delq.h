@@ -0,0 +1,83 @@
+/*
+ *    pmap_delq.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_DELQ_H
+#define _PMAP_DELQ_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "pmap.h"
+#include "pmap_cfg.h"
+#include "pmap_registry.h"
+
+/**
+ * Delete queue metrics, see 'pmap_delq_stats'.
+ */
+typedef struct pmap_delq_stats_t_ {
+  uint64_t queued;    /* Deletes accepted by 'pmap_delq_push' */
+  uint64_t coalesced; /* Pushes of a mapping already queued */
+  uint64_t cancelled; /* Deletes dropped by 'pmap_delq_cancel' */
+  uint64_t deleted;   /* Mappings deleted on the gateways */
+  uint64_t failed;    /* Mappings the gateways failed to delete */
+  uint64_t batches;   /* Flushes done by the worker */
+  int pending;        /* Deletes waiting for the next flush */
+} pmap_delq_stats_t;
+
+/**
+ * Client context of one gateway. Each gateway has its own so the shutdown
+ * flush can work on all of them in parallel.
+ */
+typedef struct pmap_delq_gw_t_ {
+  struct pmap_delq_gw_t_ *next;
+  uint32_t gateway_ip;
+  pmap_ctx_t *ctx;
+} pmap_delq_gw_t;
+
+/**
+ * Deferred delete queue. Deletes are indexed by (gateway_ip, protocol,
+ * external_port) in an in-memory registry, so a mapping is queued once. A
+ * worker thread sends them in batches, per gateway.
+ */
+typedef struct pmap_delq_t_ {
+  pmap_reg_t *pending;  /* Deletes waiting for the next flush */
+  pmap_reg_t *inflight; /* Deletes being sent by the worker */
+  pmap_delq_gw_t *gateways;
+  int batch_ms;     /* Time a delete waits for others to join its batch */
+  int64_t first_ms; /* pmap_ut_now_ms() of the oldest pending delete */
+  pmap_delq_stats_t stats;
+
+  pthread_t thread;
+  pthread_mutex_t lock; /* Protects everything above but `gateways` */
+  pthread_cond_t wake;  /* Worker wakeup */
+  pthread_cond_t done;  /* A batch was sent */
+  int stop;
+} pmap_delq_t;
+
+pmap_delq_t *pmap_delq_create(int batch_ms);
+int pmap_delq_destroy(pmap_delq_t *q, int timeout_ms);
+int pmap_delq_push(pmap_delq_t *q, const pmap_field_t *pfield);
+int pmap_delq_cancel(pmap_delq_t *q, const pmap_field_t *pfield);
+void pmap_delq_stats(pmap_delq_t *q, pmap_delq_stats_t *stats);
+
+#endif // _PMAP_DELQ_H
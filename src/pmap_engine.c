@@ -0,0 +1,587 @@
+/*
+ *    pmap_engine.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef LINUX
+#include <sys/eventfd.h>
+#endif
+
+#include "pmap.h"
+#include "pmap_async.h"
+#include "pmap_debug.h"
+#include "pmap_engine.h"
+#include "pmap_txn.h"
+#include "util.h"
+
+#define _load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define _store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define _relaxed(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+
+/* -------------------------------------------- */
+
+/**
+ * Open a wakeup descriptor: an eventfd on Linux, a pipe elsewhere. Both are
+ * non-blocking, fd[0] is polled and read, fd[1] is written.
+ *
+ * @return 0 on success, 1 on failure (errno is set).
+ */
+static int _pmap_engine_fd_open(int fd[2]) {
+
+#ifdef LINUX
+  fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return (fd[0] < 0) ? 1 : 0;
+#else
+  if (pipe(fd) != 0) {
+    return 1;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(fd[i], F_SETFL, fcntl(fd[i], F_GETFL) | O_NONBLOCK);
+    fcntl(fd[i], F_SETFD, FD_CLOEXEC);
+  }
+  return 0;
+#endif
+}
+
+static void _pmap_engine_fd_close(int fd[2]) {
+
+  close(fd[0]);
+  if (fd[1] != fd[0]) {
+    close(fd[1]);
+  }
+}
+
+/**
+ * Make the wakeup descriptor readable. A full counter or pipe is already
+ * readable, the error is ignored.
+ */
+static void _pmap_engine_fd_signal(int fd[2]) {
+
+  uint64_t one = 1;
+
+  if (write(fd[1], &one, (fd[1] == fd[0]) ? sizeof(one) : 1) < 0) {
+    // EAGAIN, a wakeup is pending anyway
+  }
+}
+
+/**
+ * Consume the pending wakeups.
+ */
+static void _pmap_engine_fd_clear(int fd[2]) {
+
+  uint64_t buf[8];
+
+  while (read(fd[0], buf, sizeof(buf)) > 0 && fd[1] != fd[0]) {
+    // Drain the pipe, an eventfd is reset by one read
+  }
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Deliver a finished request to its completion queue (engine thread). The
+ * owner is signalled only when its list was empty: it takes the whole list
+ * after every wakeup.
+ */
+static void _pmap_engine_complete(pmap_engine_t *eng, pmap_engine_req_t *req) {
+
+  pmap_engine_cq_t *cq = req->cq;
+  pmap_engine_req_t *head = _relaxed(&cq->done);
+
+  do {
+    req->next = head;
+  } while (!__atomic_compare_exchange_n(&cq->done, &head, req, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  __atomic_store_n(&eng->completed, eng->completed + 1, __ATOMIC_RELAXED);
+  if (NULL == head) {
+    _pmap_engine_fd_signal(cq->fd);
+  }
+}
+
+/**
+ * Completion callback of the asynchronous operations.
+ */
+static void _pmap_engine_done(pmap_aop_t *op, void *arg) {
+
+  pmap_engine_req_t *req = arg;
+
+  req->field = op->field;
+  req->status = op->status;
+  req->err = op->err;
+  req->protocol = op->protocol;
+  memcpy(req->external_ip, op->external_ip, sizeof(req->external_ip));
+  memcpy(req->error, op->error, sizeof(req->error));
+
+  _pmap_engine_complete(op->ctx->engine, req);
+}
+
+/**
+ * Completion callback of the transactions.
+ */
+static void _pmap_engine_txn_done(pmap_txn_t *txn, void *arg) {
+
+  pmap_engine_req_t *req = arg;
+
+  req->status = txn->ret;
+  req->err = txn->err;
+  memcpy(req->error, txn->error, sizeof(req->error));
+
+  _pmap_engine_complete(txn->ctx->engine, req);
+}
+
+/**
+ * Start the asynchronous operation of a request (engine thread), a request
+ * that can't start is completed at once with the errno of the failure.
+ */
+static void _pmap_engine_start(pmap_engine_t *eng, pmap_engine_req_t *req) {
+
+  pmap_aop_t *op = NULL;
+
+  switch (req->action) {
+  case PMAP_ASYNC_DISCOVER:
+    op = pmap_discover_async(eng->ctx, req->field.gateway_ip,
+                             _pmap_engine_done, req);
+    break;
+  case PMAP_ASYNC_ADDPORT:
+    op = pmap_addport_async(eng->ctx, &req->field, _pmap_engine_done, req);
+    break;
+  case PMAP_ASYNC_DELPORT:
+    op = pmap_delport_async(eng->ctx, &req->field, _pmap_engine_done, req);
+    break;
+  case PMAP_ASYNC_GETEXIP:
+    op = pmap_getexip_async(eng->ctx, &req->field, _pmap_engine_done, req);
+    break;
+  case PMAP_ENGINE_TXN:
+    if (NULL != pmap_addport_txn_async(eng->ctx, req->fields, req->statuses,
+                                       req->count, _pmap_engine_txn_done,
+                                       req)) {
+      return;
+    }
+    break;
+  }
+
+  if (NULL == op) {
+    req->status = 1;
+    req->err = errno;
+    const char *msg = pmap_ut_strerror(req->err);
+    snprintf(req->error, sizeof(req->error), "%s",
+             msg ? msg : strerror(req->err));
+    _pmap_engine_complete(eng, req);
+  }
+}
+
+/**
+ * Take the oldest request of the submission ring (engine thread).
+ *
+ * @return The request, NULL if the ring is empty or the next slot is
+ * claimed but not written yet.
+ */
+static pmap_engine_req_t *_pmap_engine_pop(pmap_engine_t *eng) {
+
+  pmap_engine_slot_t *slot = &eng->ring[eng->head & eng->mask];
+
+  if (_load(&slot->seq) != eng->head + 1) {
+    return NULL;
+  }
+
+  pmap_engine_req_t *req = slot->req;
+  _store(&slot->seq, eng->head + eng->mask + 1); // Free for the next lap
+  eng->head++;
+
+  return req;
+}
+
+/**
+ * Engine thread: start what was submitted, poll the sockets of the
+ * operations and the wakeup descriptor, move the operations forward. Stops
+ * once asked to and every submitted request is completed.
+ */
+static void *_pmap_engine_worker(void *arg) {
+
+  pmap_engine_t *eng = arg;
+  int max = PMAP_ENGINE_FDS;
+  struct pollfd *fds = malloc(max * sizeof(struct pollfd));
+  pmap_engine_req_t *req;
+  int64_t deadline_ms;
+
+  if (NULL == fds) {
+    PMAP_DEBUG_ERROR("Out of memory, engine stopped");
+    return NULL;
+  }
+
+  for (;;) {
+    while (NULL != (req = _pmap_engine_pop(eng))) {
+      _pmap_engine_start(eng, req);
+    }
+    if (_load(&eng->stop) && NULL == eng->ctx->async &&
+        _load(&eng->tail) == eng->head) {
+      break;
+    }
+
+    int n = pmap_fds(eng->ctx, fds + 1, max - 1, &deadline_ms);
+    if (n > max - 1) {
+      struct pollfd *more = realloc(fds, (n + 1) * 2 * sizeof(struct pollfd));
+      if (NULL != more) {
+        fds = more;
+        max = (n + 1) * 2;
+        n = pmap_fds(eng->ctx, fds + 1, max - 1, &deadline_ms);
+      } else {
+        n = max - 1; // The others are polled on a later round
+      }
+    }
+    fds[0].fd = eng->fd[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+
+    int64_t now = pmap_ut_now_ms();
+    int tmo = -1;
+    if (deadline_ms >= 0) {
+      tmo = (deadline_ms > now) ? (int)(deadline_ms - now) : 0;
+    }
+
+    /*
+     * Announce the sleep before looking at the ring a last time, a producer
+     * writes its slot before reading `sleeping`: one of the two sees the
+     * other.
+     */
+    __atomic_store_n(&eng->sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (_load(&eng->ring[eng->head & eng->mask].seq) == eng->head + 1) {
+      tmo = 0;
+    }
+
+    int ret = poll(fds, n + 1, tmo);
+    __atomic_store_n(&eng->sleeping, 0, __ATOMIC_RELAXED);
+    if (ret < 0 && errno != EINTR) {
+      PMAP_DEBUG_ERROR("poll failed: %s", strerror(errno));
+    }
+
+    if (fds[0].revents) {
+      __atomic_store_n(&eng->wakeups, eng->wakeups + 1, __ATOMIC_RELAXED);
+      _pmap_engine_fd_clear(eng->fd);
+    }
+
+    int pending = pmap_process(eng->ctx, fds + 1, (ret > 0) ? n : 0,
+                               pmap_ut_now_ms());
+    __atomic_store_n(&eng->pending, pending, __ATOMIC_RELAXED);
+  }
+
+  free(fds);
+
+  return NULL;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Start an I/O engine thread on a client context. From then on the thread
+ * drives the asynchronous operations of the context: no other thread may
+ * start them or call 'pmap_process'. Blocking calls on the context remain
+ * allowed. Enable io_uring ('pmap_async_uring') before, if wanted.
+ *
+ * @param ctx The client context, must outlive the engine.
+ * @param size Slots of the submission ring, rounded up to a power of two
+ * (0 for PMAP_ENGINE_RING_DEF).
+ * @return A new engine, or NULL on failure (caller should check errno
+ * value). The caller is responsible for freeing it by calling
+ * 'pmap_engine_destroy' function.
+ */
+pmap_engine_t *pmap_engine_create(pmap_ctx_t *ctx, int size) {
+
+  if (size == 0) {
+    size = PMAP_ENGINE_RING_DEF;
+  }
+  if (NULL == ctx || size < 0 || size > PMAP_ENGINE_RING_MAX) {
+    errno = EINVAL;
+    PMAP_DEBUG_ERROR("Invalid engine ring size");
+    return NULL;
+  }
+  if (NULL != ctx->engine) {
+    errno = EBUSY;
+    PMAP_DEBUG_ERROR("Context already has an engine");
+    return NULL;
+  }
+
+  uint32_t slots = 2;
+  while (slots < (uint32_t)size) {
+    slots <<= 1;
+  }
+
+  pmap_engine_t *eng = NULL;
+  if (0 != posix_memalign((void **)&eng, PMAP_ENGINE_CACHELINE,
+                          sizeof(pmap_engine_t))) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+  memset(eng, 0x00, sizeof(pmap_engine_t));
+
+  eng->ctx = ctx;
+  eng->mask = slots - 1;
+  eng->ring = calloc(slots, sizeof(pmap_engine_slot_t));
+  if (NULL == eng->ring) {
+    free(eng);
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+  for (uint32_t i = 0; i < slots; i++) {
+    eng->ring[i].seq = i;
+  }
+
+  if (_pmap_engine_fd_open(eng->fd) != 0) {
+    int err = errno;
+    free(eng->ring);
+    free(eng);
+    errno = err;
+    PMAP_DEBUG_ERROR("Cannot open the engine wakeup descriptor");
+    return NULL;
+  }
+
+  ctx->engine = eng;
+  int ret = pthread_create(&eng->thread, NULL, _pmap_engine_worker, eng);
+  if (ret != 0) {
+    ctx->engine = NULL;
+    _pmap_engine_fd_close(eng->fd);
+    free(eng->ring);
+    free(eng);
+    errno = ret;
+    PMAP_DEBUG_ERROR("Cannot start the engine thread");
+    return NULL;
+  }
+
+  return eng;
+}
+
+/**
+ * Stop the engine thread once every submitted request is completed (each
+ * is bounded by the timeouts of the context), and free the engine. No
+ * submission may race with it. The completion queues are left alone.
+ *
+ * @param eng The engine, NULL is allowed.
+ */
+void pmap_engine_destroy(pmap_engine_t *eng) {
+
+  if (NULL == eng) {
+    return;
+  }
+
+  _store(&eng->stop, 1);
+  _pmap_engine_fd_signal(eng->fd);
+  pthread_join(eng->thread, NULL);
+
+  eng->ctx->engine = NULL;
+  _pmap_engine_fd_close(eng->fd);
+  free(eng->ring);
+  free(eng);
+}
+
+/**
+ * Hand a request to the engine thread. Lock-free, may be called from any
+ * thread; the system call to wake the engine thread is only made when it
+ * sleeps.
+ *
+ * @param eng The engine.
+ * @param cq Completion queue the request is delivered to, usually the one
+ * of the calling thread.
+ * @param req The request, owned by the engine until it is reaped.
+ * @return 0 on success, 1 on failure: the ring is full (errno EAGAIN, reap
+ * and try again) or the action is not supported (errno EINVAL).
+ */
+int pmap_engine_submit(pmap_engine_t *eng, pmap_engine_cq_t *cq,
+                       pmap_engine_req_t *req) {
+
+  if ((req->action < PMAP_ASYNC_DISCOVER ||
+       req->action > PMAP_ASYNC_GETEXIP) &&
+      req->action != PMAP_ENGINE_TXN) {
+    errno = EINVAL;
+    return 1;
+  }
+
+  req->cq = cq;
+  req->status = 0;
+  req->err = 0;
+  req->error[0] = 0;
+
+  pmap_engine_slot_t *slot;
+  uint64_t pos = _relaxed(&eng->tail);
+
+  for (;;) {
+    slot = &eng->ring[pos & eng->mask];
+    int64_t diff = (int64_t)(_load(&slot->seq) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&eng->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      __atomic_add_fetch(&eng->full, 1, __ATOMIC_RELAXED);
+      errno = EAGAIN; // A lap behind: not taken by the engine yet
+      return 1;
+    } else {
+      pos = _relaxed(&eng->tail); // Claimed by another producer meanwhile
+    }
+  }
+
+  slot->req = req;
+  _store(&slot->seq, pos + 1);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (_relaxed(&eng->sleeping) &&
+      __atomic_exchange_n(&eng->sleeping, 0, __ATOMIC_ACQ_REL)) {
+    _pmap_engine_fd_signal(eng->fd);
+  }
+
+  return 0;
+}
+
+/**
+ * Get the statistics of an engine, may be called from any thread.
+ *
+ * @param eng The engine.
+ * @param stats Filled with the counters.
+ */
+void pmap_engine_stats(pmap_engine_t *eng, pmap_engine_stats_t *stats) {
+
+  stats->submitted = _relaxed(&eng->tail);
+  stats->full = _relaxed(&eng->full);
+  stats->completed = _relaxed(&eng->completed);
+  stats->wakeups = _relaxed(&eng->wakeups);
+  stats->pending = _relaxed(&eng->pending);
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Create a completion queue, one per thread that submits requests.
+ *
+ * @return A new queue, or NULL on failure (caller should check errno
+ * value). The caller is responsible for freeing it by calling
+ * 'pmap_engine_cq_destroy' function.
+ */
+pmap_engine_cq_t *pmap_engine_cq_create(void) {
+
+  pmap_engine_cq_t *cq = calloc(1, sizeof(pmap_engine_cq_t));
+  if (NULL == cq) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  if (_pmap_engine_fd_open(cq->fd) != 0) {
+    int err = errno;
+    free(cq);
+    errno = err;
+    PMAP_DEBUG_ERROR("Cannot open the completion descriptor");
+    return NULL;
+  }
+
+  return cq;
+}
+
+/**
+ * Free a completion queue. Requests still on their way to it must be
+ * reaped first.
+ *
+ * @param cq The queue, NULL is allowed.
+ */
+void pmap_engine_cq_destroy(pmap_engine_cq_t *cq) {
+
+  if (NULL == cq) {
+    return;
+  }
+
+  _pmap_engine_fd_close(cq->fd);
+  free(cq);
+}
+
+/**
+ * Descriptor that becomes readable when requests are delivered, to wait for
+ * them in the event loop of the thread. Call 'pmap_engine_reap' when it is.
+ *
+ * @param cq The queue.
+ * @return The descriptor, poll it for POLLIN.
+ */
+int pmap_engine_cq_fd(pmap_engine_cq_t *cq) { return cq->fd[0]; }
+
+/**
+ * Take completed requests, in the order they finished.
+ *
+ * @param cq The queue, of the calling thread.
+ * @param reqs Filled with up to `max` requests.
+ * @param max The size of `reqs`.
+ * @param tmo_ms Longest wait for a first request, 0 not to wait, -1 to wait
+ * without limit.
+ * @return The number of requests, 0 if none came in time.
+ */
+int pmap_engine_reap(pmap_engine_cq_t *cq, pmap_engine_req_t **reqs, int max,
+                     int tmo_ms) {
+
+  int64_t end_ms = pmap_ut_now_ms() + tmo_ms;
+  int n = 0;
+
+  for (;;) {
+    if (NULL == cq->ready) {
+      _pmap_engine_fd_clear(cq->fd);
+
+      pmap_engine_req_t *list =
+          __atomic_exchange_n(&cq->done, NULL, __ATOMIC_ACQUIRE);
+      while (NULL != list) { // Newest first, turn it around
+        pmap_engine_req_t *next = list->next;
+        list->next = cq->ready;
+        cq->ready = list;
+        list = next;
+      }
+    }
+
+    while (n < max && NULL != cq->ready) {
+      reqs[n++] = cq->ready;
+      cq->ready = cq->ready->next;
+    }
+    if (n > 0 || tmo_ms == 0) {
+      return n;
+    }
+
+    int wait_ms = -1;
+    if (tmo_ms > 0) {
+      int64_t now = pmap_ut_now_ms();
+      if (now >= end_ms) {
+        return 0;
+      }
+      wait_ms = (int)(end_ms - now);
+    }
+
+    struct pollfd pfd = {.fd = cq->fd[0], .events = POLLIN, .revents = 0};
+    if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR) {
+      return 0;
+    }
+  }
+}
@@ -0,0 +1,137 @@
+/*
+ *    pmap_engine.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_ENGINE_H
+#define _PMAP_ENGINE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "pmap.h"
+#include "pmap_async.h"
+#include "pmap_cfg.h"
+
+#define PMAP_ENGINE_CACHELINE 64
+
+/* Request of the engine besides the PMAP_ASYNC_* ones (pmap_engine_req_t) */
+#define PMAP_ENGINE_TXN 16 /* All or none of `fields`, see pmap_txn.h */
+
+typedef struct pmap_engine_cq_t_ pmap_engine_cq_t;
+
+/**
+ * One request to the engine. `field` is updated as by the asynchronous
+ * operation, the fields from `status` to `error` are the result, the others
+ * are private. The request belongs to the caller and must stay valid until
+ * it comes back from 'pmap_engine_reap'.
+ */
+typedef struct pmap_engine_req_t_ {
+  int action;         /* PMAP_ASYNC_* except PMAP_ASYNC_LIST, or TXN */
+  pmap_field_t field; /* Mapping, field.gateway_ip selects the gateway */
+  pmap_field_t *fields; /* PMAP_ENGINE_TXN: the mappings */
+  int *statuses;        /* PMAP_ENGINE_TXN: PMAP_TXN_* of each mapping */
+  int count;            /* PMAP_ENGINE_TXN: the number of mappings */
+  void *arg;          /* Caller data, not used by the engine */
+
+  int status;         /* 0 success, 1 failure, -2 protocol not supported */
+  int err;            /* errno of a failure */
+  int protocol;       /* PMAP_PROTO_* that answered */
+  char external_ip[16]; /* PMAP_ASYNC_DISCOVER and PMAP_ASYNC_GETEXIP */
+  char error[64];
+
+  struct pmap_engine_req_t_ *next; /* Completion list */
+  pmap_engine_cq_t *cq;            /* Where it is delivered */
+} pmap_engine_req_t;
+
+/**
+ * Completion queue of a submitting thread. The engine thread pushes the
+ * finished requests on a lock-free list and signals `fd` when the list was
+ * empty, the owner takes the whole list at once.
+ */
+struct pmap_engine_cq_t_ {
+  pmap_engine_req_t *done;  /* Pushed by the engine, newest first */
+  pmap_engine_req_t *ready; /* Taken by the owner, oldest first */
+  int fd[2];                /* eventfd (both the same) or pipe */
+};
+
+/**
+ * Slot of the submission ring. `seq` is the position the slot is free for,
+ * position + 1 once it holds a request.
+ */
+typedef struct pmap_engine_slot_t_ {
+  uint64_t seq;
+  pmap_engine_req_t *req;
+} pmap_engine_slot_t;
+
+/**
+ * Engine statistics, see 'pmap_engine_stats'.
+ */
+typedef struct pmap_engine_stats_t_ {
+  uint64_t submitted; /* Requests taken by 'pmap_engine_submit' */
+  uint64_t full;      /* Submissions refused, the ring was full */
+  uint64_t completed; /* Requests delivered to their completion queue */
+  uint64_t wakeups;   /* Engine thread woken up by a submission */
+  int pending;        /* Operations in flight on the context */
+} pmap_engine_stats_t;
+
+/**
+ * I/O engine: one thread owns the asynchronous operations of a context and
+ * all their sockets, any thread submits requests to it through a bounded
+ * multi-producer ring. Producers claim a slot with a compare-and-swap of
+ * `tail`, the engine thread alone reads from `head`. A producer writes to
+ * the wakeup descriptor only when the engine thread sleeps.
+ */
+typedef struct pmap_engine_t_ {
+  pmap_ctx_t *ctx;
+  pmap_engine_slot_t *ring;
+  uint32_t mask; /* Slots - 1, a power of two */
+  int fd[2];     /* Wakeup, eventfd (both the same) or pipe */
+  pthread_t thread;
+
+  /* Producers */
+  uint64_t tail __attribute__((aligned(PMAP_ENGINE_CACHELINE)));
+  uint64_t full;
+
+  /* Set by the engine thread, read by every producer */
+  int sleeping __attribute__((aligned(PMAP_ENGINE_CACHELINE))); /* Polls */
+
+  /* Engine thread */
+  uint64_t head __attribute__((aligned(PMAP_ENGINE_CACHELINE)));
+  int stop;
+  int pending;
+  uint64_t completed;
+  uint64_t wakeups;
+} pmap_engine_t;
+
+pmap_engine_t *pmap_engine_create(pmap_ctx_t *ctx, int size);
+void pmap_engine_destroy(pmap_engine_t *eng);
+int pmap_engine_submit(pmap_engine_t *eng, pmap_engine_cq_t *cq,
+                       pmap_engine_req_t *req);
+void pmap_engine_stats(pmap_engine_t *eng, pmap_engine_stats_t *stats);
+
+pmap_engine_cq_t *pmap_engine_cq_create(void);
+void pmap_engine_cq_destroy(pmap_engine_cq_t *cq);
+int pmap_engine_cq_fd(pmap_engine_cq_t *cq);
+int pmap_engine_reap(pmap_engine_cq_t *cq, pmap_engine_req_t **reqs, int max,
+                     int tmo_ms);
+
+#endif // _PMAP_ENGINE_H
@@ -0,0 +1,299 @@
+/*
+ *    pmap_exec.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pmap_debug.h"
+#include "pmap_exec.h"
+#include "util.h"
+
+/**
+ * The operations of one gateway, run one after the other in batch order.
+ */
+typedef struct _pmap_exec_gw_ {
+  uint32_t gateway_ip;
+  int *index; /* Operations of the gateway, in batch order */
+  int count;
+  int next; /* Next operation to run */
+} _pmap_exec_gw;
+
+typedef struct _pmap_exec_ {
+  pmap_ctx_t *ctx;
+  pmap_exec_op_t *ops;
+  _pmap_exec_gw *gws;
+  int ngws;
+  _pmap_exec_gw **ready; /* FIFO of gateways with no operation in flight */
+  int head;
+  int tail;
+  int pending; /* Operations not started yet */
+  int failed;
+  pmap_exec_cb cb;
+  void *cb_arg;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} _pmap_exec;
+
+typedef struct _pmap_exec_key_ {
+  uint32_t gateway_ip;
+  int index;
+} _pmap_exec_key;
+
+/* -------------------------------------------- */
+
+/**
+ * Order of the operations: by gateway, then batch order.
+ */
+static int _pmap_exec_cmp_key(const void *a, const void *b) {
+
+  const _pmap_exec_key *ka = a, *kb = b;
+
+  if (ka->gateway_ip != kb->gateway_ip) {
+    return (ka->gateway_ip < kb->gateway_ip) ? -1 : 1;
+  }
+
+  return ka->index - kb->index;
+}
+
+/**
+ * Gateways with the most operations first, they bound the total time.
+ */
+static int _pmap_exec_cmp_gw(const void *a, const void *b) {
+
+  const _pmap_exec_gw *ga = *(_pmap_exec_gw *const *)a;
+  const _pmap_exec_gw *gb = *(_pmap_exec_gw *const *)b;
+
+  return gb->count - ga->count;
+}
+
+/**
+ * Run one operation with the unified API.
+ */
+static void _pmap_exec_op(pmap_ctx_t *ctx, pmap_exec_op_t *op) {
+
+  int64_t start = pmap_ut_now_ms();
+
+  memset(op->error, 0x00, sizeof(op->error));
+  memset(op->external_ip, 0x00, sizeof(op->external_ip));
+  op->written = 0;
+  errno = 0;
+
+  switch (op->action) {
+  case PMAP_EXEC_ADDPORT:
+    op->status = pmap_addport(ctx, &op->field, op->error, sizeof(op->error));
+    break;
+  case PMAP_EXEC_DELPORT:
+    op->status = pmap_delport(ctx, &op->field, op->error, sizeof(op->error));
+    break;
+  case PMAP_EXEC_GETEXIP:
+    op->status = pmap_getexip(ctx, &op->field, op->external_ip,
+                              sizeof(op->external_ip), op->error,
+                              sizeof(op->error));
+    break;
+  case PMAP_EXEC_ADDANY:
+    op->status =
+        pmap_addport_any(ctx, &op->field, op->error, sizeof(op->error));
+    break;
+  case PMAP_EXEC_ENSURE:
+    op->status = pmap_ensureport(ctx, &op->field, &op->written, op->error,
+                                 sizeof(op->error));
+    break;
+  default:
+    op->status = 1;
+    errno = EINVAL;
+    break;
+  }
+
+  op->err = (op->status != 0) ? errno : 0;
+  op->done_ms = pmap_ut_now_ms() - start;
+}
+
+/**
+ * Worker: take the next operation of the first ready gateway, run it, put
+ * the gateway back at the end of the queue.
+ */
+static void *_pmap_exec_worker(void *arg) {
+
+  _pmap_exec *ex = arg;
+
+  pthread_mutex_lock(&ex->lock);
+
+  while (ex->pending > 0) {
+
+    if (ex->head == ex->tail) {
+      /* Every gateway left has an operation in flight */
+      pthread_cond_wait(&ex->cond, &ex->lock);
+      continue;
+    }
+
+    _pmap_exec_gw *gw = ex->ready[ex->head++ % ex->ngws];
+    pmap_exec_op_t *op = &ex->ops[gw->index[gw->next++]];
+    ex->pending--;
+
+    pthread_mutex_unlock(&ex->lock);
+    _pmap_exec_op(ex->ctx, op);
+    pthread_mutex_lock(&ex->lock);
+
+    if (gw->next < gw->count) {
+      ex->ready[ex->tail++ % ex->ngws] = gw;
+      pthread_cond_signal(&ex->cond);
+    }
+    if (op->status != 0) {
+      ex->failed++;
+    }
+    if (NULL != ex->cb) {
+      ex->cb(op, ex->cb_arg);
+    }
+  }
+
+  /* Waiting workers have nothing left to take */
+  pthread_cond_broadcast(&ex->cond);
+  pthread_mutex_unlock(&ex->lock);
+
+  return NULL;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Run a batch of operations on many gateways at once.
+ *
+ * A pool of `workers` threads (the calling thread is one of them) takes the
+ * operations. A gateway has at most one operation in flight, its operations
+ * run in batch order, so an add followed by a delete of the same mapping
+ * stays in that order. Gateways with the most operations start first.
+ * The operations of different gateways run in parallel, the total time is
+ * about the time of the slowest gateway, or count / workers round trips.
+ *
+ * `ctx` is shared by the workers and keeps what they learn (protocol,
+ * control URL, round trip times) for later calls.
+ *
+ * @param ctx The client context.
+ * @param ops The operations, results are stored in them.
+ * @param count Number of entries in `ops`.
+ * @param workers Number of threads, 0 for PMAP_EXEC_WORKERS_DEF. No more
+ * threads than gateways are started.
+ * @param cb Called once per operation when it finished, may be NULL. It runs
+ * on a worker thread with the executor locked, so it should return quickly.
+ * @param arg Passed to `cb`.
+ * @return 0 if all operations succeeded, 1 otherwise (check the status of
+ * each operation, errno is ENOMEM if none was run).
+ */
+int pmap_exec_run(pmap_ctx_t *ctx, pmap_exec_op_t *ops, int count,
+                  int workers, pmap_exec_cb cb, void *arg) {
+
+  _pmap_exec ex;
+  pthread_t *threads = NULL;
+  int started = 0;
+
+  if (count <= 0) {
+    return 0;
+  }
+
+  memset(&ex, 0x00, sizeof(ex));
+  ex.ctx = ctx;
+  ex.ops = ops;
+  ex.pending = count;
+  ex.cb = cb;
+  ex.cb_arg = arg;
+
+  _pmap_exec_key *keys = malloc(count * sizeof(_pmap_exec_key));
+  int *index = malloc(count * sizeof(int));
+  ex.gws = calloc(count, sizeof(_pmap_exec_gw));
+  ex.ready = malloc(count * sizeof(_pmap_exec_gw *));
+  if (NULL == keys || NULL == index || NULL == ex.gws || NULL == ex.ready) {
+    free(keys);
+    free(index);
+    free(ex.gws);
+    free(ex.ready);
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return 1;
+  }
+
+  /* Group the operations by gateway */
+  for (int i = 0; i < count; i++) {
+    keys[i].gateway_ip = ops[i].field.gateway_ip;
+    keys[i].index = i;
+  }
+  qsort(keys, count, sizeof(_pmap_exec_key), _pmap_exec_cmp_key);
+
+  for (int i = 0; i < count; i++) {
+    index[i] = keys[i].index;
+    if (i == 0 || keys[i].gateway_ip != keys[i - 1].gateway_ip) {
+      _pmap_exec_gw *gw = &ex.gws[ex.ngws++];
+      gw->gateway_ip = keys[i].gateway_ip;
+      gw->index = &index[i];
+    }
+    ex.gws[ex.ngws - 1].count++;
+  }
+  free(keys);
+
+  for (int i = 0; i < ex.ngws; i++) {
+    ex.ready[i] = &ex.gws[i];
+  }
+  qsort(ex.ready, ex.ngws, sizeof(_pmap_exec_gw *), _pmap_exec_cmp_gw);
+  ex.tail = ex.ngws;
+
+  if (workers <= 0) {
+    workers = PMAP_EXEC_WORKERS_DEF;
+  }
+  if (workers > PMAP_EXEC_WORKERS_MAX) {
+    workers = PMAP_EXEC_WORKERS_MAX;
+  }
+  if (workers > ex.ngws) {
+    workers = ex.ngws;
+  }
+
+  pthread_mutex_init(&ex.lock, NULL);
+  pthread_cond_init(&ex.cond, NULL);
+
+  if (workers > 1 && NULL != (threads = malloc((workers - 1) *
+                                                sizeof(pthread_t)))) {
+    while (started < workers - 1 &&
+           pthread_create(&threads[started], NULL, _pmap_exec_worker, &ex) ==
+               0) {
+      started++;
+    }
+  }
+  PMAP_DEBUG_LOG("%d operations on %d gateways, %d workers\n", count,
+                 ex.ngws, started + 1);
+
+  _pmap_exec_worker(&ex);
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&ex.cond);
+  pthread_mutex_destroy(&ex.lock);
+  free(threads);
+  free(ex.ready);
+  free(ex.gws);
+  free(index);
+
+  return (ex.failed > 0) ? 1 : 0;
+}
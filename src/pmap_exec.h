@@ -0,0 +1,64 @@
+/*
+ *    pmap_exec.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_EXEC_H
+#define _PMAP_EXEC_H
+
+#include <stdint.h>
+
+#include "pmap.h"
+#include "pmap_cfg.h"
+
+/* Operations (pmap_exec_op_t.action) */
+#define PMAP_EXEC_ADDPORT 1 /* pmap_addport */
+#define PMAP_EXEC_DELPORT 2 /* pmap_delport */
+#define PMAP_EXEC_GETEXIP 3 /* pmap_getexip */
+#define PMAP_EXEC_ADDANY 4  /* pmap_addport_any */
+#define PMAP_EXEC_ENSURE 5  /* pmap_ensureport */
+
+/**
+ * One operation of a batch. `field` is updated as by the unified call, the
+ * other fields after `arg` are the result.
+ */
+typedef struct pmap_exec_op_t_ {
+  int action;         /* PMAP_EXEC_* */
+  pmap_field_t field; /* Mapping, field.gateway_ip selects the gateway */
+  void *arg;          /* Caller data, not used by the executor */
+  int status;         /* 0 success, 1 failure, -2 protocol not supported */
+  int err;            /* errno of a failure */
+  int written;        /* PMAP_EXEC_ENSURE: the gateway was written to */
+  int64_t done_ms;    /* Time it took */
+  char external_ip[16]; /* PMAP_EXEC_GETEXIP */
+  char error[64];
+} pmap_exec_op_t;
+
+/**
+ * Completion callback, called once per operation as soon as it finished.
+ * Calls are serialized, never two at the same time.
+ */
+typedef void (*pmap_exec_cb)(pmap_exec_op_t *op, void *arg);
+
+int pmap_exec_run(pmap_ctx_t *ctx, pmap_exec_op_t *ops, int count,
+                  int workers, pmap_exec_cb cb, void *arg);
+
+#endif // _PMAP_EXEC_H
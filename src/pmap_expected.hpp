@@ -0,0 +1,99 @@
+/*
+ *    pmap_expected.hpp
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_EXPECTED_HPP
+#define _PMAP_EXPECTED_HPP
+
+/**
+ * Results of the C++ layers (pmap_coro.hpp, pmap_client.hpp).
+ */
+
+#include <utility>
+
+namespace pmap {
+
+/**
+ * Failure of an operation, as reported by the C call.
+ */
+struct Error {
+  int status = 1;        /* 1 failure, -2 protocol not supported */
+  int code = 0;          /* errno */
+  char message[64] = {}; /* Gateway or library message, may be empty */
+  int upnp_error = 0;    /* errorCode of a SOAP fault, 0 if none */
+};
+
+/**
+ * Value or error, in the manner of std::expected (C++23).
+ */
+template <typename T> class Expected {
+public:
+  Expected() = default;
+  Expected(T value) : value_(std::move(value)), ok_(true) {}
+  Expected(const Error &error) : error_(error), ok_(false) {}
+
+  bool has_value() const { return ok_; }
+  explicit operator bool() const { return ok_; }
+  T &value() { return value_; }
+  const T &value() const { return value_; }
+  T &operator*() { return value_; }
+  const T &operator*() const { return value_; }
+  T *operator->() { return &value_; }
+  const T *operator->() const { return &value_; }
+  const Error &error() const { return error_; }
+
+private:
+  T value_{};
+  Error error_{};
+  bool ok_ = false;
+};
+
+template <> class Expected<void> {
+public:
+  Expected() = default;
+  Expected(const Error &error) : error_(error), ok_(false) {}
+  static Expected success() {
+    Expected e;
+    e.ok_ = true;
+    return e;
+  }
+
+  bool has_value() const { return ok_; }
+  explicit operator bool() const { return ok_; }
+  const Error &error() const { return error_; }
+
+private:
+  Error error_{};
+  bool ok_ = false;
+};
+
+/**
+ * External address of a gateway.
+ */
+struct Address {
+  char ip[16] = {};
+  const char *c_str() const { return ip; }
+};
+
+} // namespace pmap
+
+#endif // _PMAP_EXPECTED_HPP
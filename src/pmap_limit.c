@@ -0,0 +1,284 @@
+/*
+ *    pmap_limit.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pmap_limit.h"
+
+/* Priority of the calls of the current thread */
+static __thread int _pmap_prio = PMAP_PRIO_INTERACTIVE;
+
+/* -------------------------------------------- */
+
+/**
+ * Set the priority of the calls the current thread makes from now on, both
+ * blocking and asynchronous. Background calls give way to interactive ones
+ * on a gateway with admission limits ('pmap_ctx_set_limit').
+ *
+ * @param prio PMAP_PRIO_INTERACTIVE (default) or PMAP_PRIO_BACKGROUND.
+ * @return The previous priority, to restore it.
+ */
+int pmap_priority(int prio) {
+
+  int prev = _pmap_prio;
+
+  if (prio >= 0 && prio < PMAP_PRIO_MAX) {
+    _pmap_prio = prio;
+  }
+
+  return prev;
+}
+
+/**
+ * Priority of the calls of the current thread, see 'pmap_priority'.
+ */
+int pmap_priority_get(void) { return _pmap_prio; }
+
+/* -------------------------------------------- */
+
+/**
+ * Fill a configuration with the defaults for consumer routers
+ * (PMAP_LIMIT_*).
+ *
+ * @param cfg The configuration to be filled.
+ */
+void pmap_limit_default(pmap_limit_cfg_t *cfg) {
+
+  cfg->rate = PMAP_LIMIT_RATE;
+  cfg->burst = PMAP_LIMIT_BURST;
+  cfg->max_inflight = PMAP_LIMIT_INFLIGHT;
+  cfg->reserve = PMAP_LIMIT_RESERVE;
+  cfg->max_wait_ms = PMAP_LIMIT_WAIT_MS;
+  cfg->max_queue = PMAP_LIMIT_QUEUE;
+}
+
+/**
+ * A configured limit scaled down, at least 1. 0 (no limit) stays 0.
+ */
+static int _pmap_limit_scaled(const pmap_limit_t *lim, int value) {
+
+  if (value <= 0) {
+    return 0;
+  }
+
+  int scaled = value * lim->scale_pct / 100;
+  return (scaled > 0) ? scaled : 1;
+}
+
+/**
+ * Bucket size in thousandths of a request.
+ */
+static int64_t _pmap_limit_cap(const pmap_limit_t *lim) {
+
+  int burst = _pmap_limit_scaled(lim, lim->cfg.burst);
+  return (int64_t)((burst > 0) ? burst : 1) * 1000;
+}
+
+/**
+ * Add the tokens earned since the last refill, `rate` requests per second is
+ * `rate` thousandths of a request per millisecond.
+ */
+static void _pmap_limit_refill(pmap_limit_t *lim, int64_t now) {
+
+  int rate = _pmap_limit_scaled(lim, lim->cfg.rate);
+
+  if (rate > 0 && now > lim->last_ms) {
+    lim->tokens += (now - lim->last_ms) * rate;
+    int64_t cap = _pmap_limit_cap(lim);
+    if (lim->tokens > cap) {
+      lim->tokens = cap;
+    }
+  }
+  lim->last_ms = now;
+}
+
+/**
+ * Set the limits of a gateway, the bucket starts full. Requests in flight
+ * and queued operations are kept.
+ *
+ * @param lim The limiter.
+ * @param cfg The limits, NULL for no limit.
+ * @param now pmap_ut_now_ms() time.
+ */
+void pmap_limit_config(pmap_limit_t *lim, const pmap_limit_cfg_t *cfg,
+                       int64_t now) {
+
+  if (NULL != cfg) {
+    lim->cfg = *cfg;
+  } else {
+    memset(&lim->cfg, 0x00, sizeof(lim->cfg));
+  }
+  if (lim->cfg.reserve < 0) {
+    lim->cfg.reserve = 0;
+  }
+
+  lim->scale_pct = 100;
+  lim->tokens = _pmap_limit_cap(lim);
+  lim->last_ms = now;
+  lim->recover = 0;
+  lim->grow_ms = now;
+}
+
+/**
+ * Whether a gateway has a rate or an in-flight limit.
+ */
+int pmap_limit_enabled(const pmap_limit_t *lim) {
+
+  return lim->cfg.rate > 0 || lim->cfg.max_inflight > 0;
+}
+
+/**
+ * Ask to send requests to a gateway. The requests admitted together take
+ * one in-flight slot (e.g. a keep-alive batch), give it back with
+ * 'pmap_limit_done'.
+ *
+ * A background call leaves `reserve` tokens and slots to interactive calls,
+ * as far as the limits in use allow it.
+ *
+ * @param lim The limiter.
+ * @param prio PMAP_PRIO_*.
+ * @param count The number of requests wanted, at least 1.
+ * @param now pmap_ut_now_ms() time.
+ * @param wait_ms Receives the time until a token is earned if none is
+ * admitted, -1 if a request in flight must end first.
+ * @return The number of requests admitted, 1 to `count`, or 0.
+ */
+int pmap_limit_admit(pmap_limit_t *lim, int prio, int count, int64_t now,
+                     int64_t *wait_ms) {
+
+  int reserve = (prio == PMAP_PRIO_BACKGROUND) ? lim->cfg.reserve : 0;
+  int admitted = count;
+
+  if (!pmap_limit_enabled(lim)) {
+    return count;
+  }
+
+  int max_inflight = _pmap_limit_scaled(lim, lim->cfg.max_inflight);
+  if (max_inflight > 0) {
+    int slots = (max_inflight > reserve) ? max_inflight - reserve : 1;
+    if (lim->inflight >= slots) {
+      *wait_ms = -1;
+      return 0;
+    }
+  }
+
+  int rate = _pmap_limit_scaled(lim, lim->cfg.rate);
+  if (rate > 0) {
+    _pmap_limit_refill(lim, now);
+
+    int64_t keep = (int64_t)reserve * 1000;
+    int64_t cap = _pmap_limit_cap(lim);
+    if (keep + 1000 > cap) {
+      keep = cap - 1000; // Full bucket
+    }
+    if (lim->tokens - keep < 1000) {
+      *wait_ms = (keep + 1000 - lim->tokens + rate - 1) / rate;
+      return 0;
+    }
+
+    int64_t have = (lim->tokens - keep) / 1000;
+    if (have < admitted) {
+      admitted = (int)have;
+    }
+    lim->tokens -= (int64_t)admitted * 1000;
+  }
+
+  lim->inflight++;
+  lim->admitted += admitted;
+
+  return admitted;
+}
+
+/**
+ * Give back the slot of admitted requests and adapt the limits. They are
+ * halved when the gateway looks overloaded, but only once for the requests
+ * that were in flight at the time: they were sent together and fail
+ * together. They grow back by SCALE_STEP percent for every
+ * PMAP_LIMIT_HOLD_MS the gateway answered without an overload.
+ *
+ * @param lim The limiter.
+ * @param outcome PMAP_LIMIT_OK or PMAP_LIMIT_OVERLOAD.
+ * @param now pmap_ut_now_ms() time.
+ */
+void pmap_limit_done(pmap_limit_t *lim, int outcome, int64_t now) {
+
+  int sent_before_cut = lim->recover > 0;
+
+  if (lim->inflight > 0) {
+    lim->inflight--;
+  }
+  if (sent_before_cut) {
+    lim->recover--;
+  }
+  if (!pmap_limit_enabled(lim)) {
+    return;
+  }
+
+  if (outcome == PMAP_LIMIT_OVERLOAD) {
+    lim->overloads++;
+    if (!sent_before_cut) {
+      lim->scale_pct /= 2;
+      if (lim->scale_pct < PMAP_LIMIT_SCALE_MIN) {
+        lim->scale_pct = PMAP_LIMIT_SCALE_MIN;
+      }
+      lim->tokens = 0; // No burst into a struggling gateway
+      lim->recover = lim->inflight;
+    }
+    lim->grow_ms = now;
+  } else if (lim->scale_pct < 100 && now - lim->grow_ms >= PMAP_LIMIT_HOLD_MS) {
+    lim->scale_pct += PMAP_LIMIT_SCALE_STEP;
+    if (lim->scale_pct > 100) {
+      lim->scale_pct = 100;
+    }
+    lim->grow_ms = now;
+  }
+}
+
+/**
+ * Describe the limits in use.
+ *
+ * @param lim The limiter.
+ * @param now pmap_ut_now_ms() time.
+ * @param state Receives the scaled limits and the counters.
+ */
+void pmap_limit_state(pmap_limit_t *lim, int64_t now,
+                      pmap_limit_state_t *state) {
+
+  _pmap_limit_refill(lim, now);
+
+  state->rate = _pmap_limit_scaled(lim, lim->cfg.rate);
+  state->burst = (state->rate > 0) ? (int)(_pmap_limit_cap(lim) / 1000) : 0;
+  state->max_inflight = _pmap_limit_scaled(lim, lim->cfg.max_inflight);
+  state->scale_pct = lim->scale_pct;
+  state->inflight = lim->inflight;
+  state->queued = 0;
+  for (int p = 0; p < PMAP_PRIO_MAX; p++) {
+    state->queued += lim->waiting[p];
+  }
+  state->admitted = lim->admitted;
+  state->delayed = lim->delayed;
+  state->rejected = lim->rejected;
+  state->overloads = lim->overloads;
+}
@@ -0,0 +1,104 @@
+/*
+ *    pmap_limit.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_LIMIT_H
+#define _PMAP_LIMIT_H
+
+#include <stdint.h>
+
+#include "pmap_cfg.h"
+
+/* Priorities of the calls of a thread ('pmap_priority') */
+#define PMAP_PRIO_INTERACTIVE 0 /* Default, someone waits for the result */
+#define PMAP_PRIO_BACKGROUND 1  /* Renewals, pools, delete queues */
+#define PMAP_PRIO_MAX 2
+
+/* Outcome of an admitted request ('pmap_limit_done') */
+#define PMAP_LIMIT_OK 0       /* The gateway answered, success or not */
+#define PMAP_LIMIT_OVERLOAD 1 /* Timeout, or HTTP 5xx without a UPnP fault */
+
+/**
+ * Admission limits of a gateway. A zero `rate` and `max_inflight` leave the
+ * gateway unlimited (the default).
+ */
+typedef struct pmap_limit_cfg_t_ {
+  int rate;         /* Requests per second, 0 for no rate limit */
+  int burst;        /* Requests sent back to back after a quiet period */
+  int max_inflight; /* Requests at once, 0 for no limit */
+  int reserve;      /* Tokens and slots background calls leave free */
+  int max_wait_ms;  /* Longest wait for admission, then ELIMITED */
+  int max_queue;    /* Queued async operations, then ELIMITED (0 no limit) */
+} pmap_limit_cfg_t;
+
+/**
+ * Token bucket and in-flight count of a gateway. The limits in use are the
+ * configured ones scaled by `scale_pct`, which is halved when the gateway
+ * looks overloaded and grows back while it answers.
+ */
+typedef struct pmap_limit_t_ {
+  pmap_limit_cfg_t cfg;
+  int scale_pct;    /* Share of the configured limits in use */
+  int64_t tokens;   /* In thousandths of a request */
+  int64_t last_ms;  /* Time of the last refill */
+  int64_t grow_ms;  /* Time of the last growth or overload */
+  int inflight;
+  int recover;      /* Answers owed by requests sent before the last cut */
+  int waiting[PMAP_PRIO_MAX]; /* Queued async operations per priority */
+
+  /* Statistics */
+  uint64_t admitted;
+  uint64_t delayed;   /* Admission requests that had to wait */
+  uint64_t rejected;  /* Calls failed with ELIMITED */
+  uint64_t overloads; /* Answers that looked like overload */
+} pmap_limit_t;
+
+/**
+ * Limits of a gateway as they are now, see 'pmap_ctx_limit'.
+ */
+typedef struct pmap_limit_state_t_ {
+  int rate;         /* Scaled limits, 0 if unlimited */
+  int burst;
+  int max_inflight;
+  int scale_pct;
+  int inflight;
+  int queued;
+  uint64_t admitted;
+  uint64_t delayed;
+  uint64_t rejected;
+  uint64_t overloads;
+} pmap_limit_state_t;
+
+int pmap_priority(int prio);
+int pmap_priority_get(void);
+
+void pmap_limit_default(pmap_limit_cfg_t *cfg);
+void pmap_limit_config(pmap_limit_t *lim, const pmap_limit_cfg_t *cfg,
+                       int64_t now);
+int pmap_limit_enabled(const pmap_limit_t *lim);
+int pmap_limit_admit(pmap_limit_t *lim, int prio, int count, int64_t now,
+                     int64_t *wait_ms);
+void pmap_limit_done(pmap_limit_t *lim, int outcome, int64_t now);
+void pmap_limit_state(pmap_limit_t *lim, int64_t now,
+                      pmap_limit_state_t *state);
+
+#endif // _PMAP_LIMIT_H
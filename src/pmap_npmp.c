@@ -39,7 +39,6 @@
 #include "http.h"
 #include "pmap_debug.h"
 #include "pmap_npmp.h"
-#include "upnp_msg.h"
 #include "util.h"
 
 static const char *npmp_res_codes[] = {
@@ -51,7 +50,8 @@ static const char npmp_fatal_err[] = "Fatal Error";
 
 /* -------------------------------------------- */
 
-int _pmap_npm_setup_socket(struct sockaddr_in *npmp, uint32_t gateway_ip) {
+int _pmap_npm_setup_socket(struct sockaddr_in *npmp, uint32_t gateway_ip,
+                           int wait_ms) {
 
   int sockfd = 0;
   /*
@@ -63,10 +63,11 @@ int _pmap_npm_setup_socket(struct sockaddr_in *npmp, uint32_t gateway_ip) {
   }
 
   struct timeval tv;
-  tv.tv_sec = 0;
-  tv.tv_usec = 250000; // 250ms
+  tv.tv_sec = wait_ms / 1000;
+  tv.tv_usec = (wait_ms % 1000) * 1000;
   if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
     PMAP_DEBUG_ERROR("setsockopt() %s", strerror(errno));
+    close(sockfd);
     return -1;
   }
 
@@ -83,166 +84,283 @@ int _pmap_npm_setup_socket(struct sockaddr_in *npmp, uint32_t gateway_ip) {
 
 /* -------------------------------------------- */
 
-int pmap_npmp_getexip(pmap_field_t *pfield, char *external_ip, int esize,
-                      char *error, int size) {
+/**
+ * Get the NAT-PMP mapping opcode for a protocol name.
+ *
+ * @param protocol "UDP" or "TCP".
+ * @return NPMP_OPCODE_MAP_UDP, NPMP_OPCODE_MAP_TCP or -1 (errno is set to
+ * EINVALIDPROT).
+ */
+int pmap_npmp_opcode(const char *protocol) {
 
-  int sockfd = 0;
-  struct sockaddr_in npmp;
-  struct sockaddr_in client;
-  uint32_t ca_size = sizeof(client);
-  int len;
+  if (strcmp(protocol, "UDP") == 0) {
+    return NPMP_OPCODE_MAP_UDP;
+  } else if (strcmp(protocol, "TCP") == 0) {
+    return NPMP_OPCODE_MAP_TCP;
+  }
 
-  /* Setup socket */
-  sockfd = _pmap_npm_setup_socket(&npmp, pfield->gateway_ip);
-  if (sockfd < 0) {
-    return 1; // caller should check errno value
+  errno = EINVALIDPROT;
+  return -1;
+}
+
+/**
+ * Lifetime to request when adding a NAT-PMP mapping, see
+ * PMAP_NPMP_LIFETIME_DEF. The response tells the lifetime granted.
+ *
+ * @param lifetime_sec The lifetime wanted, 0 for no expiration.
+ * @return The lifetime to put in the request, never 0.
+ */
+int pmap_npmp_lifetime(int lifetime_sec) {
+
+  return (lifetime_sec > 0) ? lifetime_sec : PMAP_NPMP_LIFETIME_DEF;
+}
+
+/**
+ * Serialize a NAT-PMP request.
+ *
+ * @param op_code NPMP_OPCODE_EXIP, NPMP_OPCODE_MAP_UDP or NPMP_OPCODE_MAP_TCP.
+ * @param pfield Mapping details (ignored for NPMP_OPCODE_EXIP).
+ * @param pkt Buffer of at least sizeof(nmpm_pkt_req) bytes.
+ * @return The packet length in bytes.
+ */
+int pmap_npmp_build_req(int op_code, pmap_field_t *pfield, uint8_t *pkt) {
+
+  if (op_code == NPMP_OPCODE_EXIP) {
+    nmpm_pkt_header *npmp_hdr = (nmpm_pkt_header *)pkt;
+    npmp_hdr->version = NAT_PMP_VERSION;
+    npmp_hdr->op_code = NPMP_OPCODE_EXIP;
+    return sizeof(nmpm_pkt_header);
   }
 
-  nmpm_pkt_header npmp_hdr;
-  npmp_hdr.version = NAT_PMP_VERSION;
-  npmp_hdr.op_code = 0;
+  nmpm_pkt_req *req_map = (nmpm_pkt_req *)pkt;
+  req_map->header.version = NAT_PMP_VERSION;
+  req_map->header.op_code = op_code;
+  req_map->reserverd = 0;
+  req_map->lifetime_sec = htonl(pfield->lifetime_sec);
+  req_map->internal_port = htons(pfield->internal_port);
+  req_map->external_port = htons(pfield->external_port);
 
-  PMAP_DEBUG_HEX_LOG(npmp_hdr, sizeof(nmpm_pkt_header),
-                     "NAT-PMP REQUEST: =>>>\nLEN:%d\n",
-                     (int)sizeof(nmpm_pkt_header));
+  return sizeof(nmpm_pkt_req);
+}
 
-  if (sendto(sockfd, &npmp_hdr, sizeof(npmp_hdr), 0, (struct sockaddr *)&npmp,
+/**
+ * Withdraw a mapping request that got no response, the gateway may have
+ * applied it anyway. A deletion (lifetime 0, external port 0, see RFC 6886
+ * section 3.4) is sent without waiting for its response.
+ *
+ * @param sockfd The socket the request was sent on.
+ * @param op_code NPMP_OPCODE_MAP_UDP or NPMP_OPCODE_MAP_TCP.
+ * @param pfield The mapping requested.
+ */
+void pmap_npmp_withdraw(int sockfd, int op_code, const pmap_field_t *pfield) {
+
+  uint8_t req[sizeof(nmpm_pkt_req)];
+  struct sockaddr_in npmp;
+  pmap_field_t field = *pfield;
+
+  memset(&npmp, 0x00, sizeof(npmp));
+  npmp.sin_family = AF_INET;
+  npmp.sin_port = htons(NAT_PMP_SERVER_PORT);
+  npmp.sin_addr.s_addr = pfield->gateway_ip;
+
+  field.external_port = 0;
+  field.lifetime_sec = 0; // Remove mapping
+  int req_len = pmap_npmp_build_req(op_code, &field, req);
+
+  PMAP_DEBUG_LOG("Withdraw NAT-PMP mapping of port %d\n", field.internal_port);
+  if (sendto(sockfd, req, req_len, 0, (struct sockaddr *)&npmp,
              sizeof(npmp)) < 0) {
     PMAP_DEBUG_ERROR("sendto() %s", strerror(errno));
-    return 1; // caller should check errno value
   }
+}
 
-  nmpm_pkt_exip resp;
-  memset(&resp, 0x00, sizeof(nmpm_pkt_exip));
-  int retry = 2;
-  while (true) {
-    retry--;
-    /* Receive NAT-PMP response */
-    if ((len = recvfrom(sockfd, &resp, sizeof(nmpm_pkt_exip), 0,
-                        (struct sockaddr *)&client, &ca_size)) > 0) {
-
-      PMAP_DEBUG_HEX_LOG(&resp, sizeof(nmpm_pkt_exip),
-                         "NAT-PMP RESPONSE: =>>>\nLEN:%d\n", len);
-
-      if (len && client.sin_addr.s_addr == pfield->gateway_ip) {
-        if (resp.res_code == 0) {
-          strncpy(external_ip, pmap_ut_inet_ntoa(resp.external_ip), esize);
-          return 0; // OK
-        } else {
-          resp.res_code = ntohs(resp.res_code);
-          errno = NPMP_OK + resp.res_code;
-          if (resp.res_code < sizeof(npmp_res_codes) && error != NULL) {
-            memcpy(error, npmp_res_codes[resp.res_code], size);
-          } else {
-            /*
-             * Fatal error described in RFC 6886 Page 16
-             */
-            memcpy(error, npmp_fatal_err, size);
-          }
-          return 1; // caller should check errno value
-        }
-      }
+/**
+ * Parse a NAT-PMP response.
+ *
+ * On success of a mapping request `pfield` is updated with the values
+ * assigned by the gateway, on success of an external address request the
+ * address is stored in `external_ip`.
+ *
+ * @param op_code The opcode of the request.
+ * @param pfield Mapping details.
+ * @param pkt The received datagram.
+ * @param len The datagram length.
+ * @param external_ip Buffer for the external address (may be NULL for a
+ * mapping request).
+ * @param esize The size of the `external_ip` buffer.
+ * @param error A character array where an error description will be stored in
+ * case of failure.
+ * @param size The size of the `error` character array.
+ * @return 0 on success, 1 on error result (errno is set), -1 when the datagram
+ * is not a response to this request.
+ */
+int pmap_npmp_parse_resp(int op_code, pmap_field_t *pfield, const uint8_t *pkt,
+                         int len, char *external_ip, int esize, char *error,
+                         int size) {
 
-    } else {
-      if (retry <= 0) {
-        errno = ETIMEDOUT; // caller should check errno value
-        break;
+  int min_len = (op_code == NPMP_OPCODE_EXIP) ? sizeof(nmpm_pkt_exip)
+                                              : sizeof(nmpm_pkt_resp);
+  const nmpm_pkt_header *hdr = (const nmpm_pkt_header *)pkt;
+
+  if (len < (int)sizeof(nmpm_pkt_header) + 2 ||
+      hdr->op_code != NPMP_OPCODE_RESPONSE + op_code) {
+    return -1;
+  }
+
+  uint16_t res_code = ntohs(((const nmpm_pkt_exip *)pkt)->res_code);
+
+  if (res_code != 0) {
+    errno = NPMP_OK + res_code;
+    if (error != NULL) {
+      if (res_code < sizeof(npmp_res_codes) / sizeof(npmp_res_codes[0])) {
+        strncpy(error, npmp_res_codes[res_code], size);
+      } else {
+        /*
+         * Fatal error described in RFC 6886 Page 16
+         */
+        strncpy(error, npmp_fatal_err, size);
       }
     }
+    return 1; // caller should check errno value
   }
 
-  return 1; // caller should check errno value
+  if (len < min_len) {
+    return -1;
+  }
+
+  if (op_code == NPMP_OPCODE_EXIP) {
+    const nmpm_pkt_exip *resp = (const nmpm_pkt_exip *)pkt;
+    if (external_ip != NULL) {
+      pmap_ut_inet_ntoa_r(resp->external_ip, external_ip, esize);
+    }
+  } else {
+    const nmpm_pkt_resp *resp = (const nmpm_pkt_resp *)pkt;
+    pfield->external_port = ntohs(resp->external_port);
+    pfield->internal_port = ntohs(resp->internal_port);
+    pfield->lifetime_sec = ntohl(resp->lifetime_sec);
+  }
+
+  return 0; // OK
 }
 
 /* -------------------------------------------- */
 
-int pmap_npmp_addport(pmap_field_t *pfield, char *error, int size) {
+/**
+ * Send a NAT-PMP request and wait for the response, the request is sent
+ * twice and each attempt waits `tmo->retransmit_ms` (2 x 250ms by default).
+ *
+ * @param op_code NPMP_OPCODE_EXIP, NPMP_OPCODE_MAP_UDP or NPMP_OPCODE_MAP_TCP.
+ * @param pfield A pointer to a `pmap_field_t` structure, updated with the
+ * values assigned by the gateway.
+ * @param tmo Timeouts to use, NULL for the defaults.
+ * @param rtt_ms Where the round trip time is stored, -1 if the response can't
+ * be matched to one request (it came after a retransmission). May be NULL.
+ * @param external_ip Where the external IP address is stored (EXIP only).
+ * @param esize The size of the `external_ip` character array.
+ * @param error A character array where an error description will be stored in
+ * case of failure.
+ * @param size The size of the `error` character array.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_npmp_request(int op_code, pmap_field_t *pfield, const pmap_tmo_t *tmo,
+                      int *rtt_ms, char *external_ip, int esize, char *error,
+                      int size) {
 
   int sockfd = 0;
   struct sockaddr_in npmp;
   struct sockaddr_in client;
-  uint32_t ca_size = sizeof(client);
-  int len;
+  socklen_t ca_size;
+  uint8_t req[sizeof(nmpm_pkt_req)];
+  uint8_t pkt[sizeof(nmpm_pkt_resp) + sizeof(nmpm_pkt_exip)];
+  int req_len, len, ret = 1;
+  int64_t sent_ms;
+
+  if (rtt_ms != NULL) {
+    *rtt_ms = -1;
+  }
 
   /* Setup socket */
-  sockfd = _pmap_npm_setup_socket(&npmp, pfield->gateway_ip);
+  sockfd = _pmap_npm_setup_socket(
+      &npmp, pfield->gateway_ip,
+      (NULL != tmo) ? tmo->retransmit_ms : PMAP_TMO_RETRANSMIT_DEF);
   if (sockfd < 0) {
     return 1; // caller should check errno value
   }
 
-  nmpm_pkt_req req_map;
-  req_map.header.version = 0;
+  req_len = pmap_npmp_build_req(op_code, pfield, req);
 
-  if (strcmp(pfield->protocol, "UDP") == 0) {
-    req_map.header.op_code = 1;
-  } else if (strcmp(pfield->protocol, "TCP") == 0) {
-    req_map.header.op_code = 2;
-  } else {
-    errno = EINVALIDPROT;
-    return -2; // Protocol not supported
-  }
+  for (int attempt = 0; attempt < 2; attempt++) {
 
-  req_map.reserverd = 0;
-  req_map.lifetime_sec = htonl(pfield->lifetime_sec);
-  req_map.internal_port = htons(pfield->internal_port);
-  req_map.external_port = htons(pfield->external_port);
+    PMAP_DEBUG_HEX_LOG(req, req_len, "NAT-PMP REQUEST: =>>>\nLEN:%d\n",
+                       req_len);
 
-  PMAP_DEBUG_HEX_LOG(&req_map, sizeof(nmpm_pkt_req),
-                     "NAT-PMP REQUEST: =>>>\nLEN:%d\n",
-                     (int)sizeof(nmpm_pkt_req));
+    if (sendto(sockfd, req, req_len, 0, (struct sockaddr *)&npmp,
+               sizeof(npmp)) < 0) {
+      PMAP_DEBUG_ERROR("sendto() %s", strerror(errno));
+      close(sockfd);
+      return 1; // caller should check errno value
+    }
+    sent_ms = pmap_ut_now_ms();
 
-  if (sendto(sockfd, &req_map, sizeof(nmpm_pkt_req), 0,
-             (struct sockaddr *)&npmp, sizeof(npmp)) < 0) {
-    PMAP_DEBUG_ERROR("sendto() %s", strerror(errno));
-    return 1; // caller should check errno value
-  }
+    /* Receive NAT-PMP response, anything else is dropped */
+    for (;;) {
+      ca_size = sizeof(client); // recvfrom() overwrites it
+      if ((len = recvfrom(sockfd, pkt, sizeof(pkt), 0,
+                          (struct sockaddr *)&client, &ca_size)) <= 0) {
+        break;
+      }
 
-  nmpm_pkt_resp resp;
-  memset(&resp, 0x00, sizeof(nmpm_pkt_resp));
-  int retry = 2;
-  while (true) {
-    retry--;
-    /* Receive NAT-PMP response */
-    if ((len = recvfrom(sockfd, &resp, sizeof(nmpm_pkt_resp), 0,
-                        (struct sockaddr *)&client, &ca_size)) > 0) {
-
-      PMAP_DEBUG_HEX_LOG(&resp, sizeof(nmpm_pkt_resp),
-                         "NAT-PMP RESPONSE: =>>>\nLEN:%d\n", len);
-
-      if (len && client.sin_addr.s_addr == pfield->gateway_ip) {
-        if ((resp.header.op_code - 128) == req_map.header.op_code &&
-            resp.res_code == 0) {
-          pfield->external_port = ntohs(resp.external_port);
-          pfield->internal_port = ntohs(resp.internal_port);
-          pfield->lifetime_sec = ntohl(resp.lifetime_sec);
-          return 0; // OK
-        } else {
-          resp.res_code = ntohs(resp.res_code);
-          errno = NPMP_OK + resp.res_code;
-          if (resp.res_code < sizeof(npmp_res_codes) && error != NULL) {
-            memcpy(error, npmp_res_codes[resp.res_code], size);
-          } else {
-            /*
-             * Fatal error described in RFC 6886 Page 16
-             */
-            memcpy(error, npmp_fatal_err, size);
-          }
-          return 1; // caller should check errno value
+      PMAP_DEBUG_HEX_LOG(pkt, len, "NAT-PMP RESPONSE: =>>>\nLEN:%d\n", len);
+
+      if (client.sin_addr.s_addr == pfield->gateway_ip &&
+          (ret = pmap_npmp_parse_resp(op_code, pfield, pkt, len, external_ip,
+                                      esize, error, size)) >= 0) {
+        /* Karn, a response after a retransmission is not a sample */
+        if (rtt_ms != NULL && attempt == 0) {
+          *rtt_ms = (int)(pmap_ut_now_ms() - sent_ms);
         }
+        close(sockfd);
+        return ret; // caller should check errno value
       }
-    } else {
-      if (retry <= 0) {
-        errno = ETIMEDOUT; // caller should check errno value
-        break;
-      }
+      ret = 1;
     }
   }
 
-  return 1; // caller should check errno value
+  close(sockfd);
+  errno = ETIMEDOUT; // caller should check errno value
+
+  return ret;
+}
+
+/* -------------------------------------------- */
+
+int pmap_npmp_getexip(pmap_field_t *pfield, char *external_ip, int esize,
+                      char *error, int size) {
+
+  return pmap_npmp_request(NPMP_OPCODE_EXIP, pfield, NULL, NULL, external_ip,
+                           esize, error, size);
+}
+
+/* -------------------------------------------- */
+
+int pmap_npmp_addport(pmap_field_t *pfield, char *error, int size) {
+
+  int op_code = pmap_npmp_opcode(pfield->protocol);
+  if (op_code < 0) {
+    return -2; // Protocol not supported
+  }
+
+  pfield->lifetime_sec = pmap_npmp_lifetime(pfield->lifetime_sec);
+  return pmap_npmp_request(op_code, pfield, NULL, NULL, NULL, 0, error, size);
 }
 
 int pmap_npmp_delport(pmap_field_t *pfield, char *error, int size) {
 
+  int op_code = pmap_npmp_opcode(pfield->protocol);
+  if (op_code < 0) {
+    return -2; // Protocol not supported
+  }
+
   pfield->lifetime_sec = 0; // Remove mapping
-  return pmap_npmp_addport(pfield, error, size);
+  return pmap_npmp_request(op_code, pfield, NULL, NULL, NULL, 0, error, size);
 }
@@ -33,6 +33,12 @@
 #define NAT_PMP_VERSION 0
 #define NAT_PMP_SERVER_PORT 5351
 
+/* Opcodes */
+#define NPMP_OPCODE_EXIP 0
+#define NPMP_OPCODE_MAP_UDP 1
+#define NPMP_OPCODE_MAP_TCP 2
+#define NPMP_OPCODE_RESPONSE 128
+
 /**
  * The use of the __attribute__((__packed__)) directive ensures that the data
  * is tightly packed without any padding.
@@ -91,6 +97,17 @@ typedef struct nmpm_pkt_resp_ {
   uint32_t lifetime_sec;
 } __attribute__((__packed__)) nmpm_pkt_resp;
 
+int pmap_npmp_opcode(const char *protocol);
+int pmap_npmp_lifetime(int lifetime_sec);
+int pmap_npmp_build_req(int op_code, pmap_field_t *pfield, uint8_t *pkt);
+void pmap_npmp_withdraw(int sockfd, int op_code, const pmap_field_t *pfield);
+int pmap_npmp_parse_resp(int op_code, pmap_field_t *pfield, const uint8_t *pkt,
+                         int len, char *external_ip, int esize, char *error,
+                         int size);
+int pmap_npmp_request(int op_code, pmap_field_t *pfield, const pmap_tmo_t *tmo,
+                      int *rtt_ms, char *external_ip, int esize, char *error,
+                      int size);
+
 int pmap_npmp_getexip(pmap_field_t *pfield, char *external_ip, int esize,
                       char *error, int size);
 int pmap_npmp_addport(pmap_field_t *pfield, char *error, int size);
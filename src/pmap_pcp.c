@@ -0,0 +1,543 @@
+/*
+ *    pmap_pcp.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "pmap_debug.h"
+#include "pmap_npmp.h"
+#include "pmap_pcp.h"
+#include "util.h"
+
+static const char *pcp_res_codes[] = {
+    "Success",
+    "Unsupported Version",
+    "Not Authorized/Refused",
+    "Malformed request",
+    "Unsupported opcode",
+    "Unsupported option",
+    "Malformed option",
+    "Network Failure",
+    "Out of resources",
+    "Unsupported protocol",
+    "User exceeded quota",
+    "Cannot provide external",
+    "Address mismatch",
+    "Excessive remote peers",
+};
+
+static const char pcp_fatal_err[] = "Fatal Error";
+
+/* Retransmission, first wait 250ms then doubled on every retry */
+#define PCP_INITIAL_WAIT_MS 250
+#define PCP_MAX_RETRY 3
+
+/* -------------------------------------------- */
+
+/**
+ * Convert an IPv4 address (network byte order) to an IPv4-mapped IPv6
+ * address (::ffff:a.b.c.d) as required by every PCP address field.
+ *
+ * @param ip The IPv4 address in network byte order.
+ * @param addr The IPv6 address to be filled.
+ */
+void pmap_pcp_mapped_addr(uint32_t ip, struct in6_addr *addr) {
+
+  memset(addr, 0x00, sizeof(struct in6_addr));
+  addr->s6_addr[10] = 0xFF;
+  addr->s6_addr[11] = 0xFF;
+  memcpy(&addr->s6_addr[12], &ip, sizeof(ip));
+}
+
+/**
+ * Check whether an IPv6 address is an IPv4-mapped address and optionally
+ * extract the IPv4 part.
+ *
+ * @param addr The IPv6 address to be checked.
+ * @param ip Where the IPv4 address (network byte order) is stored, may be
+ * NULL.
+ * @return 1 if the address is IPv4-mapped, 0 otherwise.
+ */
+int pmap_pcp_is_mapped_addr(const struct in6_addr *addr, uint32_t *ip) {
+
+  static const uint8_t prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+
+  if (memcmp(addr->s6_addr, prefix, sizeof(prefix)) != 0) {
+    return 0;
+  }
+
+  if (ip != NULL) {
+    memcpy(ip, &addr->s6_addr[12], sizeof(uint32_t));
+  }
+
+  return 1;
+}
+
+/**
+ * Generate a random 96 bit mapping nonce.
+ *
+ * The nonce is read from /dev/urandom, when it is not available it falls
+ * back to rand_r() seeded with the time, process id and buffer address.
+ *
+ * @param nonce Buffer of PCP_NONCE_LEN bytes.
+ */
+void pmap_pcp_nonce(uint8_t *nonce) {
+
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd >= 0) {
+    ssize_t n = read(fd, nonce, PCP_NONCE_LEN);
+    close(fd);
+    if (n == PCP_NONCE_LEN) {
+      return;
+    }
+  }
+
+  unsigned int seed = time(NULL) ^ getpid() ^ (uintptr_t)nonce;
+  for (int i = 0; i < PCP_NONCE_LEN; i++) {
+    nonce[i] = rand_r(&seed) & 0xFF;
+  }
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Nonce of a mapping of the pmap_field_t based API.
+ *
+ * PCP only renews or deletes a mapping when the request carries the nonce of
+ * the original MAP. A random one is picked for a new mapping and kept in
+ * `pfield->nonce`, the caller passes it back to renew or delete.
+ */
+static void _pmap_pcp_field_nonce(pmap_field_t *pfield, uint8_t *nonce) {
+
+  static const uint8_t none[PCP_NONCE_LEN];
+
+  if (pfield->lifetime_sec != 0 &&
+      memcmp(pfield->nonce, none, PCP_NONCE_LEN) == 0) {
+    pmap_pcp_nonce(pfield->nonce);
+  }
+  memcpy(nonce, pfield->nonce, PCP_NONCE_LEN);
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Create a UDP socket connected to the PCP server of the gateway. Connecting
+ * the socket filters datagrams from other hosts and lets us learn the source
+ * address the kernel selected, which is the PCP client address.
+ *
+ * @param gateway The gateway address (IPv6 or IPv4-mapped).
+ * @param client Where the local source address is stored.
+ * @return The socket file descriptor, or -1 on error (errno is set).
+ */
+static int _pmap_pcp_setup_socket(const struct in6_addr *gateway,
+                                  struct in6_addr *client) {
+
+  struct sockaddr_storage ss;
+  socklen_t ss_len;
+  uint32_t ip4;
+  int sockfd;
+
+  memset(&ss, 0x00, sizeof(ss));
+
+  if (pmap_pcp_is_mapped_addr(gateway, &ip4)) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(PCP_SERVER_PORT);
+    sin->sin_addr.s_addr = ip4;
+    ss_len = sizeof(struct sockaddr_in);
+  } else {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(PCP_SERVER_PORT);
+    sin6->sin6_addr = *gateway;
+    ss_len = sizeof(struct sockaddr_in6);
+  }
+
+  if ((sockfd = socket(ss.ss_family, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+    PMAP_DEBUG_ERROR("socket() %s", strerror(errno));
+    return -1;
+  }
+
+  if (connect(sockfd, (struct sockaddr *)&ss, ss_len) < 0) {
+    PMAP_DEBUG_ERROR("connect() %s", strerror(errno));
+    close(sockfd);
+    return -1;
+  }
+
+  ss_len = sizeof(ss);
+  if (getsockname(sockfd, (struct sockaddr *)&ss, &ss_len) < 0) {
+    PMAP_DEBUG_ERROR("getsockname() %s", strerror(errno));
+    close(sockfd);
+    return -1;
+  }
+
+  if (ss.ss_family == AF_INET) {
+    pmap_pcp_mapped_addr(((struct sockaddr_in *)&ss)->sin_addr.s_addr, client);
+  } else {
+    *client = ((struct sockaddr_in6 *)&ss)->sin6_addr;
+  }
+
+  return sockfd;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Serialize a MAP or PEER request with its options.
+ *
+ * @return The packet length in bytes.
+ */
+static int _pmap_pcp_build_req(pmap_pcp_field_t *pcp,
+                               const struct in6_addr *client, uint8_t *pkt) {
+
+  int len = 0;
+  pcp_pkt_req_hdr *hdr = (pcp_pkt_req_hdr *)pkt;
+
+  memset(pkt, 0x00, PCP_MAX_PAYLOAD);
+
+  hdr->version = PCP_VERSION;
+  hdr->op_code = pcp->opcode;
+  hdr->lifetime_sec = htonl(pcp->lifetime_sec);
+  memcpy(hdr->client_ip, client->s6_addr, sizeof(hdr->client_ip));
+  len += sizeof(pcp_pkt_req_hdr);
+
+  pcp_pkt_map *map = (pcp_pkt_map *)(pkt + len);
+  memcpy(map->nonce, pcp->nonce, PCP_NONCE_LEN);
+  map->protocol = pcp->protocol;
+  map->internal_port = htons(pcp->internal_port);
+  map->external_port = htons(pcp->external_port);
+  memcpy(map->external_ip, pcp->external_ip.s6_addr, sizeof(map->external_ip));
+
+  if (pcp->opcode == PCP_OPCODE_PEER) {
+    pcp_pkt_peer *peer = (pcp_pkt_peer *)map;
+    peer->peer_port = htons(pcp->peer_port);
+    memcpy(peer->peer_ip, pcp->peer_ip.s6_addr, sizeof(peer->peer_ip));
+    len += sizeof(pcp_pkt_peer);
+  } else {
+    len += sizeof(pcp_pkt_map);
+  }
+
+  if (pcp->flags & PMAP_PCP_THIRD_PARTY) {
+    pcp_pkt_option *opt = (pcp_pkt_option *)(pkt + len);
+    opt->code = PCP_OPTION_THIRD_PARTY;
+    opt->length = htons(sizeof(struct in6_addr));
+    len += sizeof(pcp_pkt_option);
+    memcpy(pkt + len, pcp->internal_ip.s6_addr, sizeof(struct in6_addr));
+    len += sizeof(struct in6_addr);
+  }
+
+  /* PREFER_FAILURE is only valid for MAP (RFC 6887 13.2) */
+  if ((pcp->flags & PMAP_PCP_PREFER_FAILURE) &&
+      pcp->opcode == PCP_OPCODE_MAP) {
+    pcp_pkt_option *opt = (pcp_pkt_option *)(pkt + len);
+    opt->code = PCP_OPTION_PREFER_FAILURE;
+    opt->length = 0;
+    len += sizeof(pcp_pkt_option);
+  }
+
+  return len;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Parse a response datagram.
+ *
+ * @return 0 on success, 1 on error result (errno is set), -1 when the
+ * datagram does not belong to this request and should be ignored.
+ */
+static int _pmap_pcp_parse_resp(pmap_pcp_field_t *pcp, uint8_t *pkt, int len,
+                                char *error, int size) {
+
+  int res_code;
+
+  /**
+   * A NAT-PMP only server answers with its own version 0 header and result
+   * code 1 (Unsupported Version), RFC 6887 9.
+   */
+  if (len >= (int)sizeof(nmpm_pkt_header) + 2 && pkt[0] == NAT_PMP_VERSION) {
+    errno = EPCP_UNSUPP_VERSION;
+    if (error != NULL) {
+      strncpy(error, pcp_res_codes[1], size);
+    }
+    return 1;
+  }
+
+  if (len < (int)sizeof(pcp_pkt_resp_hdr)) {
+    return -1;
+  }
+
+  pcp_pkt_resp_hdr *hdr = (pcp_pkt_resp_hdr *)pkt;
+  res_code = hdr->res_code;
+
+  if (res_code == 1 && hdr->version != PCP_VERSION) {
+    /* Server speaks another version, let the caller negotiate */
+    errno = EPCP_UNSUPP_VERSION;
+    if (error != NULL) {
+      strncpy(error, pcp_res_codes[1], size);
+    }
+    return 1;
+  }
+
+  if (hdr->op_code != (pcp->opcode | PCP_OPCODE_RESPONSE)) {
+    return -1;
+  }
+
+  int expected = sizeof(pcp_pkt_resp_hdr) + ((pcp->opcode == PCP_OPCODE_PEER)
+                                                 ? sizeof(pcp_pkt_peer)
+                                                 : sizeof(pcp_pkt_map));
+  pcp_pkt_map *map = (pcp_pkt_map *)(pkt + sizeof(pcp_pkt_resp_hdr));
+
+  if (len >= expected &&
+      memcmp(map->nonce, pcp->nonce, PCP_NONCE_LEN) != 0) {
+    /* Response to some other request of ours (or spoofed), RFC 6887 11.3 */
+    return -1;
+  }
+
+  pcp->epoch = ntohl(hdr->epoch);
+
+  if (res_code != 0) {
+    errno = PCP_OK + res_code;
+    if (error != NULL) {
+      if (res_code < (int)(sizeof(pcp_res_codes) / sizeof(pcp_res_codes[0]))) {
+        strncpy(error, pcp_res_codes[res_code], size);
+      } else {
+        strncpy(error, pcp_fatal_err, size);
+      }
+    }
+    return 1;
+  }
+
+  if (len < expected) {
+    return -1;
+  }
+
+  pcp->lifetime_sec = ntohl(hdr->lifetime_sec);
+  pcp->external_port = ntohs(map->external_port);
+  memcpy(pcp->external_ip.s6_addr, map->external_ip, sizeof(struct in6_addr));
+
+  return 0;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Send a PCP MAP or PEER request and wait for the matching response.
+ *
+ * The request is retransmitted PCP_MAX_RETRY times, the wait time is doubled
+ * on each retry. Responses with a different nonce or opcode are ignored. When
+ * PMAP_PCP_THIRD_PARTY is set and internal_ip is the address of this host the
+ * option is omitted and the flag cleared.
+ *
+ * @param pcp A pointer to a `pmap_pcp_field_t` structure describing the
+ * request, it is updated with the server response.
+ * @param error A character array where an error description will be stored in
+ * case of failure.
+ * @param size The size of the `error` character array.
+ * @return 0 on success, 1 on failure (caller should check errno value,
+ * EPCP_UNSUPP_VERSION means the gateway does not speak PCP).
+ */
+int pmap_pcp_request(pmap_pcp_field_t *pcp, char *error, int size) {
+
+  struct in6_addr client;
+  uint8_t pkt[PCP_MAX_PAYLOAD];
+  int sockfd, len, ret = 1;
+  int wait_ms = PCP_INITIAL_WAIT_MS;
+
+  if (pcp->opcode != PCP_OPCODE_MAP && pcp->opcode != PCP_OPCODE_PEER) {
+    errno = EPCP_UNSUPP_OPCODE;
+    return 1;
+  }
+
+  sockfd = _pmap_pcp_setup_socket(&pcp->gateway_ip, &client);
+  if (sockfd < 0) {
+    return 1; // caller should check errno value
+  }
+
+  if ((pcp->flags & PMAP_PCP_THIRD_PARTY) &&
+      memcmp(&pcp->internal_ip, &client, sizeof(client)) == 0) {
+    pcp->flags &= ~PMAP_PCP_THIRD_PARTY;
+  }
+
+  int req_len = _pmap_pcp_build_req(pcp, &client, pkt);
+  uint8_t req[PCP_MAX_PAYLOAD];
+  memcpy(req, pkt, req_len);
+
+  errno = ETIMEDOUT;
+  for (int retry = 0; retry < PCP_MAX_RETRY; retry++) {
+
+    PMAP_DEBUG_HEX_LOG(req, req_len, "PCP REQUEST: =>>>\nLEN:%d\n", req_len);
+    if (PMAP_DEBUG_DUMP()) {
+      PMAP_RUNTIME_LOG("PCP REQUEST: =>>> LEN:%d\n", req_len);
+    }
+
+    if (send(sockfd, req, req_len, 0) < 0) {
+      PMAP_DEBUG_ERROR("send() %s", strerror(errno));
+      break;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = wait_ms / 1000;
+    tv.tv_usec = (wait_ms % 1000) * 1000;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+      PMAP_DEBUG_ERROR("setsockopt() %s", strerror(errno));
+      break;
+    }
+
+    /* Drain until timeout, ignoring datagrams which are not ours */
+    while ((len = recv(sockfd, pkt, sizeof(pkt), 0)) > 0) {
+
+      PMAP_DEBUG_HEX_LOG(pkt, len, "PCP RESPONSE: =>>>\nLEN:%d\n", len);
+      if (PMAP_DEBUG_DUMP()) {
+        PMAP_RUNTIME_LOG("PCP RESPONSE: =>>> LEN:%d\n", len);
+      }
+
+      if ((ret = _pmap_pcp_parse_resp(pcp, pkt, len, error, size)) >= 0) {
+        goto done;
+      }
+      ret = 1;
+    }
+
+    errno = ETIMEDOUT;
+    wait_ms *= 2;
+  }
+
+done:
+  close(sockfd);
+  return ret; // caller should check errno value
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Add a port mapping using PCP, falling back to NAT-PMP.
+ *
+ * This function sends a PCP MAP request to the gateway. When the gateway
+ * replies with UNSUPP_VERSION (it is a NAT-PMP only server) the request is
+ * repeated with NAT-PMP, as a delete when `lifetime_sec` is 0. If
+ * `internal_ip` is set and is not the address of this host the mapping is
+ * created on its behalf with the THIRD_PARTY option, this has no NAT-PMP
+ * equivalent so there is no fallback in that case.
+ *
+ * A new mapping (`nonce` all zero) gets a random nonce, renew it with the
+ * same `pfield` and its nonce.
+ *
+ * @param pfield A pointer to a `pmap_field_t` structure containing the details
+ * of the port mapping to be added. `external_port` and `lifetime_sec` are
+ * updated with the values assigned by the gateway, `nonce` with the one
+ * picked for a new mapping.
+ * @param error A character array where an error description will be stored in
+ * case of failure.
+ * @param size The size of the `error` character array.
+ * @return 0 on success, 1 on failure (caller should check errno value), -2
+ * if protocol is not supported.
+ */
+int pmap_pcp_addport(pmap_field_t *pfield, char *error, int size) {
+
+  pmap_pcp_field_t pcp;
+  memset(&pcp, 0x00, sizeof(pcp));
+
+  if (strcmp(pfield->protocol, "UDP") == 0) {
+    pcp.protocol = PCP_PROTO_UDP;
+  } else if (strcmp(pfield->protocol, "TCP") == 0) {
+    pcp.protocol = PCP_PROTO_TCP;
+  } else {
+    errno = EINVALIDPROT;
+    return -2; // Protocol not supported
+  }
+
+  pcp.opcode = PCP_OPCODE_MAP;
+  pcp.internal_port = pfield->internal_port;
+  pcp.external_port = pfield->external_port;
+  pcp.lifetime_sec = pfield->lifetime_sec;
+  pmap_pcp_mapped_addr(pfield->gateway_ip, &pcp.gateway_ip);
+  pmap_pcp_mapped_addr(INADDR_ANY, &pcp.external_ip);
+
+  /**
+   * Resolve the source address of this host (no packet is sent), it tells
+   * whether the mapping is for us or on behalf of another internal host.
+   */
+  struct in6_addr client;
+  int sockfd = _pmap_pcp_setup_socket(&pcp.gateway_ip, &client);
+  if (sockfd < 0) {
+    return 1; // caller should check errno value
+  }
+  close(sockfd);
+
+  uint32_t self_ip = INADDR_ANY;
+  pmap_pcp_is_mapped_addr(&client, &self_ip);
+  if (pfield->internal_ip != INADDR_ANY && pfield->internal_ip != self_ip) {
+    pmap_pcp_mapped_addr(pfield->internal_ip, &pcp.internal_ip);
+    pcp.flags |= PMAP_PCP_THIRD_PARTY;
+  } else {
+    pfield->internal_ip = self_ip;
+  }
+  _pmap_pcp_field_nonce(pfield, pcp.nonce);
+
+  if (pmap_pcp_request(&pcp, error, size) == 0) {
+    pfield->external_port = pcp.external_port;
+    pfield->lifetime_sec = pcp.lifetime_sec;
+    return 0; // OK
+  }
+
+  if (errno == EPCP_UNSUPP_VERSION && !(pcp.flags & PMAP_PCP_THIRD_PARTY)) {
+    PMAP_DEBUG_LOG("PCP unsupported, fallback to NAT-PMP\n");
+    /* pmap_npmp_addport turns lifetime 0 into the default lifetime */
+    return (pcp.lifetime_sec == 0) ? pmap_npmp_delport(pfield, error, size)
+                                   : pmap_npmp_addport(pfield, error, size);
+  }
+
+  return 1; // caller should check errno value
+}
+
+/**
+ * Delete a port mapping using PCP, falling back to NAT-PMP.
+ *
+ * @param pfield A pointer to a `pmap_field_t` structure containing the details
+ * of the port mapping to be deleted (same fields as used to add it, `nonce`
+ * and `internal_ip` included: the gateway refuses another nonce with
+ * NOT_AUTHORIZED).
+ * @param error A character array where an error description will be stored in
+ * case of failure.
+ * @param size The size of the `error` character array.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_pcp_delport(pmap_field_t *pfield, char *error, int size) {
+
+  pfield->lifetime_sec = 0; // Remove mapping
+  return pmap_pcp_addport(pfield, error, size);
+}
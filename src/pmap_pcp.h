@@ -0,0 +1,152 @@
+/*
+ *    pmap_pcp.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_PCP_H
+#define _PMAP_PCP_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "buffer.h"
+#include "pmap_cfg.h"
+#include "util.h"
+
+#define PCP_VERSION 2
+#define PCP_SERVER_PORT 5351 /* Same port as NAT-PMP (RFC 6887 19.1) */
+#define PCP_MAX_PAYLOAD 1100 /* Maximum UDP payload (RFC 6887 7) */
+
+/* Opcodes */
+#define PCP_OPCODE_ANNOUNCE 0
+#define PCP_OPCODE_MAP 1
+#define PCP_OPCODE_PEER 2
+#define PCP_OPCODE_RESPONSE 0x80 /* R bit */
+
+/* Options */
+#define PCP_OPTION_THIRD_PARTY 1
+#define PCP_OPTION_PREFER_FAILURE 2
+#define PCP_OPTION_FILTER 3
+
+/* Request flags (pmap_pcp_field_t.flags) */
+#define PMAP_PCP_PREFER_FAILURE 0x01 /* Do not accept an alternative port */
+#define PMAP_PCP_THIRD_PARTY 0x02    /* Map on behalf of internal_ip */
+
+/* IANA protocol numbers used by PCP */
+#define PCP_PROTO_ALL 0
+#define PCP_PROTO_TCP 6
+#define PCP_PROTO_UDP 17
+
+/**
+ * Common request header. The client address is always 128 bits, IPv4
+ * addresses are carried as IPv4-mapped IPv6 addresses (::ffff:a.b.c.d).
+ */
+typedef struct pcp_pkt_req_hdr_ {
+  uint8_t version;
+  uint8_t op_code; /* R bit (0) + 7 bit opcode */
+  uint16_t reserved;
+  uint32_t lifetime_sec;
+  uint8_t client_ip[16];
+} __attribute__((__packed__)) pcp_pkt_req_hdr;
+
+/**
+ * Common response header. Result code, lifetime granted by the server and
+ * the server epoch used to detect a gateway restart.
+ */
+typedef struct pcp_pkt_resp_hdr_ {
+  uint8_t version;
+  uint8_t op_code; /* R bit (1) + 7 bit opcode */
+  uint8_t reserved;
+  uint8_t res_code;
+  uint32_t lifetime_sec;
+  uint32_t epoch;
+  uint8_t reserved2[12];
+} __attribute__((__packed__)) pcp_pkt_resp_hdr;
+
+/**
+ * MAP opcode payload, shared by request and response.
+ */
+typedef struct pcp_pkt_map_ {
+  uint8_t nonce[PCP_NONCE_LEN];
+  uint8_t protocol;
+  uint8_t reserved[3];
+  uint16_t internal_port;
+  uint16_t external_port;
+  uint8_t external_ip[16];
+} __attribute__((__packed__)) pcp_pkt_map;
+
+/**
+ * PEER opcode payload, MAP payload followed by the remote peer.
+ */
+typedef struct pcp_pkt_peer_ {
+  pcp_pkt_map map;
+  uint16_t peer_port;
+  uint16_t reserved;
+  uint8_t peer_ip[16];
+} __attribute__((__packed__)) pcp_pkt_peer;
+
+/**
+ * Option header, option data follows padded to a multiple of 4 bytes.
+ */
+typedef struct pcp_pkt_option_ {
+  uint8_t code;
+  uint8_t reserved;
+  uint16_t length;
+} __attribute__((__packed__)) pcp_pkt_option;
+
+/**
+ * PCP request/response description. Addresses are IPv6 or IPv4-mapped IPv6,
+ * so the same structure drives IPv4 and IPv6 gateways.
+ *
+ * Input fields: opcode, protocol, internal_port, external_port (suggested),
+ * external_ip (suggested, may be unspecified), peer_port/peer_ip (PEER only),
+ * internal_ip (THIRD_PARTY only), gateway_ip, lifetime_sec, nonce, flags.
+ *
+ * Output fields: external_port, external_ip, lifetime_sec, epoch.
+ *
+ * The nonce must be kept by the caller, the server refuses to renew or
+ * delete a mapping with a different nonce.
+ */
+typedef struct pmap_pcp_field_t_ {
+  uint8_t opcode;
+  uint8_t protocol;
+  uint16_t internal_port;
+  uint16_t external_port;
+  uint16_t peer_port;
+  struct in6_addr internal_ip;
+  struct in6_addr external_ip;
+  struct in6_addr peer_ip;
+  struct in6_addr gateway_ip;
+  uint32_t lifetime_sec;
+  uint32_t epoch;
+  uint8_t nonce[PCP_NONCE_LEN];
+  int flags;
+} pmap_pcp_field_t;
+
+void pmap_pcp_mapped_addr(uint32_t ip, struct in6_addr *addr);
+int pmap_pcp_is_mapped_addr(const struct in6_addr *addr, uint32_t *ip);
+void pmap_pcp_nonce(uint8_t *nonce);
+int pmap_pcp_request(pmap_pcp_field_t *pcp, char *error, int size);
+
+int pmap_pcp_addport(pmap_field_t *pfield, char *error, int size);
+int pmap_pcp_delport(pmap_field_t *pfield, char *error, int size);
+
+#endif // _PMAP_PCP_H
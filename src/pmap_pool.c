@@ -0,0 +1,518 @@
+/*
+ *    pmap_pool.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pmap.h"
+#include "pmap_debug.h"
+#include "pmap_pool.h"
+#include "pmap_renew.h"
+#include "util.h"
+
+#define _load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define _store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define _add(p, v) __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+
+/* -------------------------------------------- */
+
+/**
+ * Push a slot on the ready stack.
+ */
+static void _pmap_pool_push(pmap_pool_t *pool, int idx) {
+
+  uint64_t head = _load(&pool->head);
+  uint64_t top;
+
+  do {
+    _store(&pool->slots[idx].next, (uint32_t)(head & 0xffffffff));
+    top = (((head >> 32) + 1) << 32) | (uint32_t)(idx + 1);
+  } while (!__atomic_compare_exchange_n(&pool->head, &head, top, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Pop a slot from the ready stack. The tag in the high half of the head
+ * changes on every push and pop, so a slot popped and pushed again by
+ * another thread in between (ABA) fails the exchange.
+ *
+ * @return The slot index, -1 if the stack is empty.
+ */
+static int _pmap_pool_pop(pmap_pool_t *pool) {
+
+  uint64_t head = _load(&pool->head);
+  uint64_t top;
+  uint32_t idx;
+
+  do {
+    idx = (uint32_t)(head & 0xffffffff);
+    if (idx == 0) {
+      return -1;
+    }
+    top = (((head >> 32) + 1) << 32) | _load(&pool->slots[idx - 1].next);
+  } while (!__atomic_compare_exchange_n(&pool->head, &head, top, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  return (int)idx - 1;
+}
+
+/**
+ * Copy the mapping of a slot, consistent with a concurrent update by the
+ * worker. The words are loaded one by one with relaxed atomics, so a copy
+ * racing with an update is torn, never undefined, and the sequence check
+ * throws it away.
+ */
+static void _pmap_pool_read(pmap_pool_slot_t *slot, pmap_field_t *pfield) {
+
+  union {
+    pmap_field_t field;
+    uint64_t words[PMAP_POOL_FIELD_WORDS];
+  } copy;
+  uint32_t seq;
+
+  do {
+    while ((seq = _load(&slot->seq)) & 1) {
+      // Update in progress, a few stores
+    }
+    for (size_t i = 0; i < PMAP_POOL_FIELD_WORDS; i++) {
+      copy.words[i] = __atomic_load_n(&slot->words[i], __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq);
+
+  *pfield = copy.field;
+}
+
+/**
+ * Change the mapping of a slot (worker only).
+ */
+static void _pmap_pool_write(pmap_pool_slot_t *slot,
+                             const pmap_field_t *pfield) {
+
+  union {
+    pmap_field_t field;
+    uint64_t words[PMAP_POOL_FIELD_WORDS];
+  } copy;
+  uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+  memset(&copy, 0x00, sizeof(copy));
+  copy.field = *pfield;
+
+  __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (size_t i = 0; i < PMAP_POOL_FIELD_WORDS; i++) {
+    __atomic_store_n(&slot->words[i], copy.words[i], __ATOMIC_RELAXED);
+  }
+  _store(&slot->seq, seq + 2);
+}
+
+/**
+ * Wake up the worker.
+ */
+static void _pmap_pool_kick(pmap_pool_t *pool) {
+
+  pthread_mutex_lock(&pool->lock);
+  pool->kick = 1;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Renewal callback. NAT-PMP may grant another external port on renewal, a
+ * failed renewal marks the slot stale so it is replaced, not handed out.
+ */
+static void _pmap_pool_renewed(pmap_lease_t *lease, int ret,
+                               const char *error, void *arg) {
+
+  pmap_pool_slot_t *slot = lease->user;
+
+  (void)arg;
+
+  if (ret == 0) {
+    if (slot->field.external_port != lease->field.external_port) {
+      _pmap_pool_write(slot, &lease->field);
+    }
+    _store(&slot->stale, 0);
+    return;
+  }
+
+  PMAP_DEBUG_LOG("Pool mapping %d/%s not renewed [%s]\n",
+                 lease->field.external_port, lease->field.protocol, error);
+  _store(&slot->stale, 1);
+  if (ret == -2) {
+    slot->lease = NULL; // Freed by the engine when this call returns
+  }
+}
+
+/**
+ * Map one spare slot and make it ready. A stale mapping is deleted first.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+static int _pmap_pool_map(pmap_pool_t *pool, int idx) {
+
+  pmap_pool_slot_t *slot = &pool->slots[idx];
+  pmap_field_t field;
+  char error[64];
+
+  memset(error, 0x00, sizeof(error));
+
+  if (NULL != slot->lease) {
+    field = slot->lease->field;
+    pmap_renew_remove(pool->rn, slot->lease);
+    slot->lease = NULL;
+    pmap_delport(pool->ctx, &field, error, sizeof(error));
+  }
+
+  field = slot->field; // Last external port is the preferred one
+  int64_t start = pmap_ut_now_ms();
+  int ret = pmap_addport_any(pool->ctx, &field, error, sizeof(error));
+  uint64_t elapsed = (uint64_t)(pmap_ut_now_ms() - start);
+
+  if (ret == 0) {
+    slot->lease = pmap_renew_add(pool->rn, &field);
+    if (NULL == slot->lease) {
+      pmap_delport(pool->ctx, &field, error, sizeof(error));
+      ret = 1;
+    }
+  }
+  if (ret != 0) {
+    _add(&pool->stats.failures, 1);
+    PMAP_DEBUG_LOG("Pool mapping of %d/%s failed (%d) [%s]\n",
+                   field.internal_port, field.protocol, errno, error);
+    return 1;
+  }
+
+  slot->lease->user = slot;
+  _pmap_pool_write(slot, &field);
+  _store(&slot->stale, 0);
+  _store(&slot->state, PMAP_POOL_READY);
+
+  _add(&pool->stats.refills, 1);
+  _add(&pool->stats.refill_ms_total, elapsed);
+  if (elapsed > _load(&pool->stats.refill_ms_max)) {
+    _store(&pool->stats.refill_ms_max, elapsed); // Worker is the only writer
+  }
+
+  _add(&pool->ready, 1);
+  _pmap_pool_push(pool, idx);
+
+  return 0;
+}
+
+/**
+ * Map spare slots until `target` mappings are ready.
+ *
+ * @return 0 on success, 1 if a mapping failed.
+ */
+static int _pmap_pool_refill(pmap_pool_t *pool) {
+
+  for (int i = 0; i < pool->count && _load(&pool->ready) < pool->target;
+       i++) {
+    if (_load(&pool->stop)) {
+      break;
+    }
+    if (_load(&pool->slots[i].state) == PMAP_POOL_SPARE &&
+        _pmap_pool_map(pool, i) != 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Worker thread, renews the mappings and refills the pool. It sleeps until
+ * the next renewal, or until 'pmap_pool_get' finds the pool low.
+ */
+static void *_pmap_pool_worker(void *arg) {
+
+  pmap_pool_t *pool = arg;
+  int64_t retry_ms = 0;
+
+  pmap_priority(PMAP_PRIO_BACKGROUND);
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stop) {
+    pool->kick = 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    int64_t now = pmap_ut_now_ms();
+    pmap_renew_run(pool->rn, now);
+    if (now >= retry_ms) {
+      retry_ms = (_pmap_pool_refill(pool) != 0)
+                     ? pmap_ut_now_ms() + PMAP_POOL_RETRY_MS
+                     : 0;
+    }
+
+    int64_t wake = pmap_renew_next(pool->rn);
+    if (wake < 0 || wake > now + PMAP_POOL_IDLE_MS) {
+      wake = now + PMAP_POOL_IDLE_MS;
+    }
+    if (retry_ms > 0 && retry_ms < wake) {
+      wake = retry_ms;
+    }
+
+    int64_t wait = wake - pmap_ut_now_ms();
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (wait > 0) {
+      ts.tv_sec += wait / 1000;
+      ts.tv_nsec += (wait % 1000) * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->stop && !pool->kick && wait > 0) {
+      pthread_cond_timedwait(&pool->cond, &pool->lock, &ts);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Create a pool of pre-created mappings and start its worker thread. The
+ * worker maps `target` internal ports at once, asking for the same external
+ * port (see 'pmap_addport_any'), renews them, and maps more whenever
+ * 'pmap_pool_get' leaves `low_water` or less ready.
+ *
+ * @param pfield Template of the mappings: internal_port is the first
+ * internal port of the pool, protocol, internal_ip, gateway_ip and
+ * lifetime_sec are used for every mapping.
+ * @param count Number of internal ports, from pfield->internal_port.
+ * @param target Mappings kept ready, 1 to `count`.
+ * @param low_water Refill when ready mappings fall to this, below `target`
+ * (-1 for PMAP_POOL_LOW_WATER_PCT of it).
+ * @return A new pool, or NULL on failure (caller should check errno value).
+ * The caller is responsible for freeing it by calling 'pmap_pool_destroy'
+ * function.
+ */
+pmap_pool_t *pmap_pool_create(const pmap_field_t *pfield, int count,
+                              int target, int low_water) {
+
+  if (count <= 0 || target <= 0 || target > count ||
+      pfield->internal_port <= 0 || pfield->internal_port + count - 1 > 65535) {
+    errno = EINVAL;
+    PMAP_DEBUG_ERROR("Invalid pool size");
+    return NULL;
+  }
+  if (low_water < 0 || low_water >= target) {
+    low_water = target * PMAP_POOL_LOW_WATER_PCT / 100;
+  }
+
+  pmap_pool_t *pool = calloc(1, sizeof(pmap_pool_t));
+  if (NULL == pool) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  pool->first_port = pfield->internal_port;
+  pool->count = count;
+  pool->target = target;
+  pool->low_water = low_water;
+  pool->slots = calloc(count, sizeof(pmap_pool_slot_t));
+  pool->ctx = pmap_ctx_create();
+  pool->rn = (NULL != pool->ctx)
+                 ? pmap_renew_create(pool->ctx, _pmap_pool_renewed, pool)
+                 : NULL;
+  if (NULL == pool->slots || NULL == pool->rn) {
+    pmap_ctx_destroy(pool->ctx);
+    free(pool->slots);
+    free(pool);
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  for (int i = 0; i < count; i++) {
+    pool->slots[i].field = *pfield;
+    pool->slots[i].field.internal_port = pfield->internal_port + i;
+    pool->slots[i].field.external_port = pfield->internal_port + i;
+    pool->slots[i].state = PMAP_POOL_SPARE;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  int ret = pthread_create(&pool->thread, NULL, _pmap_pool_worker, pool);
+  if (ret != 0) {
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    pmap_renew_destroy(pool->rn);
+    pmap_ctx_destroy(pool->ctx);
+    free(pool->slots);
+    free(pool);
+    errno = ret;
+    PMAP_DEBUG_ERROR("Cannot start the pool worker");
+    return NULL;
+  }
+
+  return pool;
+}
+
+/**
+ * Stop the worker and delete every mapping of the pool on the gateway,
+ * including the ones still handed out.
+ *
+ * @param pool The pool, NULL is allowed.
+ */
+void pmap_pool_destroy(pmap_pool_t *pool) {
+
+  char error[64];
+
+  if (NULL == pool) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  pthread_join(pool->thread, NULL);
+
+  for (int i = 0; i < pool->count; i++) {
+    if (NULL != pool->slots[i].lease) {
+      pmap_field_t field = pool->slots[i].lease->field;
+      memset(error, 0x00, sizeof(error));
+      pmap_delport(pool->ctx, &field, error, sizeof(error));
+    }
+  }
+
+  pmap_renew_destroy(pool->rn);
+  pmap_ctx_destroy(pool->ctx);
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->slots);
+  free(pool);
+}
+
+/**
+ * Take a ready mapping, without waiting for the gateway. Lock-free, may be
+ * called from any thread. The mapping stays renewed by the pool until it is
+ * given back with 'pmap_pool_put' or the pool is destroyed.
+ *
+ * @param pool The pool.
+ * @param pfield Filled with the mapping (external_port is the mapped port).
+ * @return 0 on success, 1 if no mapping is ready (errno EAGAIN).
+ */
+int pmap_pool_get(pmap_pool_t *pool, pmap_field_t *pfield) {
+
+  int idx;
+
+  while ((idx = _pmap_pool_pop(pool)) >= 0) {
+
+    pmap_pool_slot_t *slot = &pool->slots[idx];
+    int ready = _add(&pool->ready, -1);
+
+    if (_load(&slot->stale)) {
+      _store(&slot->state, PMAP_POOL_SPARE); // Worker maps it again
+      _pmap_pool_kick(pool);
+      continue;
+    }
+
+    _store(&slot->state, PMAP_POOL_TAKEN);
+    _add(&pool->taken, 1);
+    _pmap_pool_read(slot, pfield);
+    _add(&pool->stats.hits, 1);
+
+    if (ready == pool->low_water) {
+      _pmap_pool_kick(pool); // Only the get crossing the mark takes the lock
+    }
+    return 0;
+  }
+
+  _add(&pool->stats.misses, 1);
+  errno = EAGAIN;
+  return 1;
+}
+
+/**
+ * Give back a mapping taken with 'pmap_pool_get'. It is kept and renewed for
+ * the next caller.
+ *
+ * @param pool The pool.
+ * @param pfield The mapping, as returned by 'pmap_pool_get'.
+ * @return 0 on success, 1 if the mapping was not taken from this pool
+ * (errno EINVAL).
+ */
+int pmap_pool_put(pmap_pool_t *pool, const pmap_field_t *pfield) {
+
+  int idx = pfield->internal_port - pool->first_port;
+  int taken = PMAP_POOL_TAKEN;
+
+  if (idx < 0 || idx >= pool->count ||
+      !__atomic_compare_exchange_n(&pool->slots[idx].state, &taken,
+                                   PMAP_POOL_READY, 0, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE)) {
+    errno = EINVAL;
+    PMAP_DEBUG_ERROR("Mapping not taken from the pool");
+    return 1;
+  }
+
+  _add(&pool->taken, -1);
+  _add(&pool->stats.returns, 1);
+
+  if (_load(&pool->slots[idx].stale)) {
+    _store(&pool->slots[idx].state, PMAP_POOL_SPARE);
+    _pmap_pool_kick(pool);
+    return 0;
+  }
+
+  _add(&pool->ready, 1);
+  _pmap_pool_push(pool, idx);
+
+  return 0;
+}
+
+/**
+ * Read the pool metrics. The hit rate is hits / (hits + misses), the mean
+ * refill latency refill_ms_total / refills.
+ *
+ * @param pool The pool.
+ * @param stats Filled with the counters.
+ */
+void pmap_pool_stats(pmap_pool_t *pool, pmap_pool_stats_t *stats) {
+
+  stats->hits = _load(&pool->stats.hits);
+  stats->misses = _load(&pool->stats.misses);
+  stats->returns = _load(&pool->stats.returns);
+  stats->refills = _load(&pool->stats.refills);
+  stats->failures = _load(&pool->stats.failures);
+  stats->refill_ms_total = _load(&pool->stats.refill_ms_total);
+  stats->refill_ms_max = _load(&pool->stats.refill_ms_max);
+  stats->ready = _load(&pool->ready);
+  stats->taken = _load(&pool->taken);
+}
@@ -0,0 +1,106 @@
+/*
+ *    pmap_pool.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_POOL_H
+#define _PMAP_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "pmap.h"
+#include "pmap_cfg.h"
+#include "pmap_renew.h"
+
+/* Slot states */
+#define PMAP_POOL_SPARE 0 /* Owned by the worker, no usable mapping */
+#define PMAP_POOL_READY 1 /* Mapped and renewed, on the ready stack */
+#define PMAP_POOL_TAKEN 2 /* Handed out by 'pmap_pool_get' */
+
+/**
+ * Pool metrics, see 'pmap_pool_stats'.
+ */
+typedef struct pmap_pool_stats_t_ {
+  uint64_t hits;            /* 'pmap_pool_get' served from the pool */
+  uint64_t misses;          /* 'pmap_pool_get' found the pool empty */
+  uint64_t returns;         /* Ports given back with 'pmap_pool_put' */
+  uint64_t refills;         /* Mappings created by the worker */
+  uint64_t failures;        /* Mappings the worker failed to create */
+  uint64_t refill_ms_total; /* Time spent creating mappings */
+  uint64_t refill_ms_max;   /* Slowest mapping creation */
+  int ready;                /* Mappings ready to be handed out */
+  int taken;                /* Mappings handed out */
+} pmap_pool_stats_t;
+
+#define PMAP_POOL_FIELD_WORDS ((sizeof(pmap_field_t) + 7) / 8)
+
+/**
+ * One internal port of the pool. `field` is written by the worker only,
+ * under the `seq` sequence lock (odd while it changes). Other threads copy it
+ * through `words` with atomic loads, a torn copy is retried.
+ */
+typedef struct pmap_pool_slot_t_ {
+  union {
+    pmap_field_t field; /* Mapping, as last granted */
+    uint64_t words[PMAP_POOL_FIELD_WORDS];
+  };
+  pmap_lease_t *lease; /* Renewal, NULL if not mapped (worker only) */
+  uint32_t next;       /* Next slot on the ready stack, index + 1 */
+  uint32_t seq;
+  int state; /* PMAP_POOL_* */
+  int stale; /* Renewal failed, replace the mapping before handing it out */
+} pmap_pool_slot_t;
+
+/**
+ * Pool of pre-created mappings. Slot i maps internal port
+ * `first_port + i`. Ready slots are kept on a lock-free stack, the worker
+ * thread owns the client context and the renewal engine.
+ */
+typedef struct pmap_pool_t_ {
+  pmap_pool_slot_t *slots;
+  int first_port;
+  int count;
+  int target;    /* Ready mappings kept in reserve */
+  int low_water; /* Wake the worker when ready falls to this */
+
+  uint64_t head; /* Ready stack, ABA tag << 32 | slot index + 1 */
+  int ready;
+  int taken;
+  pmap_pool_stats_t stats;
+
+  pmap_ctx_t *ctx;
+  pmap_renew_t *rn;
+  pthread_t thread;
+  pthread_mutex_t lock; /* Protects `kick` and `stop` */
+  pthread_cond_t cond;
+  int kick;
+  int stop;
+} pmap_pool_t;
+
+pmap_pool_t *pmap_pool_create(const pmap_field_t *pfield, int count,
+                              int target, int low_water);
+void pmap_pool_destroy(pmap_pool_t *pool);
+int pmap_pool_get(pmap_pool_t *pool, pmap_field_t *pfield);
+int pmap_pool_put(pmap_pool_t *pool, const pmap_field_t *pfield);
+void pmap_pool_stats(pmap_pool_t *pool, pmap_pool_stats_t *stats);
+
+#endif // _PMAP_POOL_H
@@ -0,0 +1,175 @@
+/*
+ *    pmap_ports.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "pmap_debug.h"
+#include "pmap_ports.h"
+
+/**
+ * Create an empty bitmap (every port free).
+ *
+ * @return The bitmap, or NULL if memory allocation fails. The caller is
+ * responsible for freeing it by calling 'pmap_ports_destroy' function.
+ */
+pmap_ports_t *pmap_ports_create(void) {
+
+  pmap_ports_t *ports = calloc(1, sizeof(pmap_ports_t));
+  if (NULL == ports) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+  }
+
+  return ports;
+}
+
+/**
+ * Free a bitmap.
+ *
+ * @param ports The bitmap, NULL is allowed.
+ */
+void pmap_ports_destroy(pmap_ports_t *ports) { free(ports); }
+
+/**
+ * Mark a port used.
+ *
+ * @param ports The bitmap.
+ * @param port The port, out of range values are ignored.
+ */
+void pmap_ports_set(pmap_ports_t *ports, int port) {
+
+  if (port < 0 || port > 65535 || pmap_ports_test(ports, port)) {
+    return;
+  }
+
+  int w = port >> 6;
+  ports->used[w] |= 1ULL << (port & 63);
+  if (ports->used[w] == ~0ULL) {
+    ports->full[w >> 6] |= 1ULL << (w & 63);
+  }
+  ports->count++;
+}
+
+/**
+ * Mark a port free.
+ *
+ * @param ports The bitmap.
+ * @param port The port, out of range values are ignored.
+ */
+void pmap_ports_clear(pmap_ports_t *ports, int port) {
+
+  if (port < 0 || port > 65535 || !pmap_ports_test(ports, port)) {
+    return;
+  }
+
+  int w = port >> 6;
+  ports->used[w] &= ~(1ULL << (port & 63));
+  ports->full[w >> 6] &= ~(1ULL << (w & 63));
+  ports->count--;
+}
+
+/**
+ * Check if a port is marked used.
+ *
+ * @return 1 if used, 0 if free.
+ */
+int pmap_ports_test(pmap_ports_t *ports, int port) {
+
+  return (ports->used[port >> 6] >> (port & 63)) & 1;
+}
+
+/**
+ * First word at or after `w` with a free port, -1 if none.
+ */
+static int _pmap_ports_word(pmap_ports_t *ports, int w) {
+
+  if (w >= PMAP_PORTS_WORDS) {
+    return -1;
+  }
+
+  int s = w >> 6;
+  uint64_t avail = ~ports->full[s] & (~0ULL << (w & 63));
+
+  while (avail == 0) {
+    if (++s >= PMAP_PORTS_SUMMARY) {
+      return -1;
+    }
+    avail = ~ports->full[s];
+  }
+
+  return (s << 6) + __builtin_ctzll(avail);
+}
+
+/**
+ * First free port in [a, b], -1 if none.
+ */
+static int _pmap_ports_find(pmap_ports_t *ports, int a, int b) {
+
+  if (a > b) {
+    return -1;
+  }
+
+  int w = a >> 6;
+  uint64_t avail = ~ports->used[w] & (~0ULL << (a & 63));
+
+  while (avail == 0) {
+    if ((w = _pmap_ports_word(ports, w + 1)) < 0) {
+      return -1;
+    }
+    avail = ~ports->used[w];
+  }
+
+  int port = (w << 6) + __builtin_ctzll(avail);
+
+  return (port <= b) ? port : -1;
+}
+
+/**
+ * Find a free port, the search starts at `from` and wraps around at `hi`.
+ *
+ * @param ports The bitmap.
+ * @param from First port to look at.
+ * @param lo Lowest port allowed.
+ * @param hi Highest port allowed.
+ * @return The port, or -1 if every port of the range is used.
+ */
+int pmap_ports_next(pmap_ports_t *ports, int from, int lo, int hi) {
+
+  if (lo < 0) {
+    lo = 0;
+  }
+  if (hi > 65535) {
+    hi = 65535;
+  }
+  if (from < lo || from > hi) {
+    from = lo;
+  }
+
+  int port = _pmap_ports_find(ports, from, hi);
+  if (port < 0) {
+    port = _pmap_ports_find(ports, lo, from - 1);
+  }
+
+  return port;
+}
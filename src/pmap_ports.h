@@ -0,0 +1,52 @@
+/*
+ *    pmap_ports.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_PORTS_H
+#define _PMAP_PORTS_H
+
+#include <stdint.h>
+
+#define PMAP_PORTS_WORDS 1024 /* 65536 ports, one bit each */
+#define PMAP_PORTS_SUMMARY (PMAP_PORTS_WORDS / 64)
+
+/**
+ * Occupancy bitmap of the external ports of one gateway and protocol. A bit
+ * of `full` is set when the matching word of `used` has no free port left,
+ * so a free port is found by looking at no more than 16 summary words and
+ * one bitmap word.
+ */
+typedef struct pmap_ports_t_ {
+  uint64_t used[PMAP_PORTS_WORDS];
+  uint64_t full[PMAP_PORTS_SUMMARY];
+  int count;  /* Ports marked used */
+  int seeded; /* Filled from the mapping table of the gateway */
+} pmap_ports_t;
+
+pmap_ports_t *pmap_ports_create(void);
+void pmap_ports_destroy(pmap_ports_t *ports);
+void pmap_ports_set(pmap_ports_t *ports, int port);
+void pmap_ports_clear(pmap_ports_t *ports, int port);
+int pmap_ports_test(pmap_ports_t *ports, int port);
+int pmap_ports_next(pmap_ports_t *ports, int from, int lo, int hi);
+
+#endif // _PMAP_PORTS_H
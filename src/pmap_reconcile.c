@@ -0,0 +1,588 @@
+/*
+ *    pmap_reconcile.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "pmap.h"
+#include "pmap_debug.h"
+#include "pmap_reconcile.h"
+#include "pmap_registry.h"
+#include "pmap_upnp.h"
+#include "util.h"
+
+/**
+ * Mappings of one gateway applied by one thread.
+ */
+typedef struct {
+  pmap_ctx_t *ctx;
+  pmap_recon_op_t *ops; /* Deletes first */
+  int count;
+  pthread_t thread;
+  int started;
+} _pmap_recon_job;
+
+/**
+ * State of the diff, see 'pmap_reconcile'.
+ */
+typedef struct {
+  pmap_reg_t *want; /* Desired mappings */
+  pmap_reg_t *cur;  /* Current mappings */
+  pmap_recon_plan_t *plan;
+  time_t now;
+} _pmap_recon_diff;
+
+/* -------------------------------------------- */
+
+static void _pmap_recon_op(pmap_recon_plan_t *plan, int op,
+                           const pmap_field_t *pfield) {
+
+  pmap_recon_op_t *o = &plan->ops[plan->count++];
+
+  o->op = op;
+  o->field = *pfield;
+  o->status = -1;
+
+  switch (op) {
+  case PMAP_RECON_ADD:
+    plan->adds++;
+    break;
+  case PMAP_RECON_DEL:
+    plan->deletes++;
+    break;
+  case PMAP_RECON_RENEW:
+    plan->renewals++;
+    break;
+  default:
+    plan->kept++;
+    o->status = 0;
+    break;
+  }
+}
+
+/**
+ * Compare a desired mapping with the current one.
+ */
+static int _pmap_recon_want(pmap_reg_entry_t *entry, void *arg) {
+
+  _pmap_recon_diff *diff = arg;
+  pmap_field_t *want = &entry->field;
+
+  pmap_reg_entry_t *cur = pmap_reg_find(diff->cur, want->gateway_ip,
+                                        want->protocol, want->external_port);
+  if (NULL == cur) {
+    _pmap_recon_op(diff->plan, PMAP_RECON_ADD, want);
+    return 0;
+  }
+
+  if (cur->field.internal_ip != want->internal_ip ||
+      cur->field.internal_port != want->internal_port) {
+    _pmap_recon_op(diff->plan, PMAP_RECON_DEL, &cur->field);
+    _pmap_recon_op(diff->plan, PMAP_RECON_ADD, want);
+    return 0;
+  }
+
+  /* Renew a lease that runs out soon, or that should not run out at all */
+  int64_t remain = (int64_t)cur->expires - diff->now;
+  if (cur->expires != 0 &&
+      (want->lifetime_sec == 0 ||
+       remain * 100 < (int64_t)want->lifetime_sec * PMAP_RECON_RENEW_PCT)) {
+    _pmap_recon_op(diff->plan, PMAP_RECON_RENEW, want);
+  } else {
+    _pmap_recon_op(diff->plan, PMAP_RECON_KEEP, want);
+  }
+
+  return 0;
+}
+
+/**
+ * Delete a current mapping that is not desired.
+ */
+static int _pmap_recon_stale(pmap_reg_entry_t *entry, void *arg) {
+
+  _pmap_recon_diff *diff = arg;
+
+  if (pmap_reg_find(diff->want, entry->field.gateway_ip,
+                    entry->field.protocol, entry->field.external_port) == NULL) {
+    _pmap_recon_op(diff->plan, PMAP_RECON_DEL, &entry->field);
+  }
+
+  return 0;
+}
+
+/**
+ * Whether a mapping of the gateway table belongs to us, i.e. points to an
+ * internal address some desired mapping of that gateway points to.
+ */
+static int _pmap_recon_owned(const pmap_field_t *desired, int count,
+                             const pmap_field_t *pfield) {
+
+  for (int i = 0; i < count; i++) {
+    if (desired[i].gateway_ip == pfield->gateway_ip &&
+        desired[i].internal_ip == pfield->internal_ip) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void _pmap_recon_found(pmap_reg_t *cur, const pmap_field_t *desired,
+                              int count, uint32_t gateway_ip,
+                              pmap_field_t *pfield) {
+
+  pfield->gateway_ip = gateway_ip;
+  if (_pmap_recon_owned(desired, count, pfield)) {
+    pmap_reg_add(cur, pfield); // lifetime_sec is the remaining lease
+  }
+}
+
+/**
+ * Read the mappings we own from the table of the IGD `upnp` into `cur`.
+ *
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+static int _pmap_recon_enum_upnp(pmap_url_comp_t *upnp, const pmap_tmo_t *tmo,
+                                 const pmap_field_t *desired, int count,
+                                 uint32_t gateway_ip, pmap_reg_t *cur,
+                                 int *requests) {
+
+  pmap_upnp_entry_t *entries, entry;
+  int n;
+
+  if (upnp->version >= 2) {
+    const char *protocols[] = {"TCP", "UDP"};
+    int p;
+    for (p = 0; p < 2; p++) {
+      (*requests)++;
+      if (pmap_upnp_list_url(upnp, protocols[p], 1, 65535, &entries, &n,
+                             tmo) != 0) {
+        break; // Walk the table instead
+      }
+      for (int i = 0; i < n; i++) {
+        _pmap_recon_found(cur, desired, count, gateway_ip, &entries[i].field);
+      }
+      free(entries);
+    }
+    if (p == 2) {
+      return 0;
+    }
+  }
+
+  pmap_upnp_iter_t *it = pmap_upnp_iter_create_url(upnp, 0, tmo);
+  if (NULL == it) {
+    return 1; // caller should check errno value
+  }
+  while (pmap_upnp_iter_next(it, &entry) == 0) {
+    (*requests)++;
+    _pmap_recon_found(cur, desired, count, gateway_ip, &entry.field);
+  }
+  (*requests)++;
+  int err = errno;
+  pmap_upnp_iter_destroy(it);
+  if (err != 0) {
+    errno = err;
+    return 1; // A partial table would plan wrong operations
+  }
+
+  return 0;
+}
+
+/**
+ * Read the mappings we own from the table of a gateway into `cur`. A
+ * NAT-PMP gateway has no table, nothing is read.
+ *
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+static int _pmap_recon_enum(pmap_ctx_t *ctx, const pmap_field_t *desired,
+                            int count, uint32_t gateway_ip, pmap_reg_t *cur,
+                            int *requests) {
+
+  pmap_url_comp_t *upnp;
+  pmap_tmo_t tmo;
+
+  pmap_gw_t *gw = pmap_ctx_gateway(ctx, gateway_ip);
+  if (NULL == gw) {
+    return 1; // caller should check errno value
+  }
+
+  if (pmap_gw_protocol(ctx, gw, NULL) == PMAP_PROTO_NONE) {
+    /* Learn what the gateway speaks */
+    char external_ip[16], error[64];
+    pmap_field_t field;
+    memset(&field, 0x00, sizeof(field));
+    field.gateway_ip = gateway_ip;
+    (*requests)++;
+    if (pmap_getexip(ctx, &field, external_ip, sizeof(external_ip), error,
+                     sizeof(error)) != 0) {
+      return 1; // caller should check errno value
+    }
+  }
+
+  if (pmap_gw_protocol(ctx, gw, &upnp) != PMAP_PROTO_UPNP || NULL == upnp) {
+    return 0;
+  }
+
+  pmap_ctx_timeouts(ctx, gw, &tmo);
+  int ret = _pmap_recon_enum_upnp(upnp, &tmo, desired, count, gateway_ip, cur,
+                                  requests);
+  int err = errno;
+  pmap_ut_free_url(upnp);
+  errno = err;
+
+  return ret;
+}
+
+/**
+ * Rank of an operation when applied: deletes first.
+ */
+static int _pmap_recon_rank(int op) {
+
+  return (op == PMAP_RECON_DEL) ? 0 : (op == PMAP_RECON_KEEP) ? 2 : 1;
+}
+
+static int _pmap_recon_cmp(const void *a, const void *b) {
+
+  const pmap_recon_op_t *oa = a, *ob = b;
+
+  if (oa->field.gateway_ip != ob->field.gateway_ip) {
+    return (oa->field.gateway_ip > ob->field.gateway_ip) ? 1 : -1;
+  }
+
+  return _pmap_recon_rank(oa->op) - _pmap_recon_rank(ob->op);
+}
+
+/**
+ * Estimated time to apply `dels` deletes and `adds` adds or renewals on a
+ * gateway, from its round trip times (PMAP_RECON_RTT_MS while there is no
+ * sample).
+ */
+static int _pmap_recon_cost(pmap_ctx_t *ctx, uint32_t gateway_ip, int dels,
+                            int adds) {
+
+  pmap_url_comp_t *upnp;
+  pmap_tmo_t tmo;
+  int n = dels + adds, rtt;
+
+  pmap_gw_t *gw = pmap_ctx_gateway(ctx, gateway_ip);
+  if (NULL == gw || n == 0) {
+    return 0;
+  }
+  pmap_ctx_timeouts(ctx, gw, &tmo);
+  int protocol = pmap_gw_protocol(ctx, gw, &upnp);
+
+  if (protocol == PMAP_PROTO_UPNP && NULL != upnp) {
+    int known = (NULL != upnp->crtl_url);
+    pmap_ut_free_url(upnp);
+    if ((rtt = pmap_gw_srtt_ms(ctx, gw, PMAP_RTT_HTTP)) < 0) {
+      rtt = PMAP_RECON_RTT_MS;
+    }
+    /* One connection for the deletes and one for the adds */
+    return (n + (dels > 0) + (adds > 0) + !known) * rtt;
+  }
+
+  if (protocol == PMAP_PROTO_NPMP) {
+    if ((rtt = pmap_gw_srtt_ms(ctx, gw, PMAP_RTT_NPMP)) < 0) {
+      rtt = PMAP_RECON_RTT_MS;
+    }
+    return n * rtt;
+  }
+
+  return tmo.discovery_ms + n * PMAP_RECON_RTT_MS; // Race first
+}
+
+/**
+ * Apply the operations of one gateway: the deletes in one batch, then the
+ * adds and renewals in another.
+ */
+static void *_pmap_recon_apply(void *arg) {
+
+  _pmap_recon_job *job = arg;
+  int n = 0;
+
+  pmap_field_t *fields = malloc(job->count * sizeof(pmap_field_t));
+  int *status = malloc(job->count * sizeof(int));
+  int *errs = malloc(job->count * sizeof(int));
+  int *index = malloc(job->count * sizeof(int));
+  if (NULL == fields || NULL == status || NULL == errs || NULL == index) {
+    for (int i = 0; i < job->count; i++) {
+      if (job->ops[i].op != PMAP_RECON_KEEP) {
+        job->ops[i].status = 1;
+        job->ops[i].err = ENOMEM;
+      }
+    }
+    goto out;
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    n = 0;
+    for (int i = 0; i < job->count; i++) {
+      if (_pmap_recon_rank(job->ops[i].op) == pass) {
+        index[n] = i;
+        fields[n++] = job->ops[i].field;
+      }
+    }
+    if (pass == 0) {
+      pmap_delport_batch(job->ctx, fields, n, status);
+    } else {
+      pmap_addport_batch_errno(job->ctx, fields, n, status, errs);
+    }
+    for (int j = 0; j < n; j++) {
+      job->ops[index[j]].status = status[j];
+      job->ops[index[j]].err = (pass == 1) ? errs[j] : 0;
+      if (pass == 1 && status[j] == 0) {
+        job->ops[index[j]].field = fields[j]; // As granted (NAT-PMP)
+      }
+    }
+  }
+
+out:
+  free(fields);
+  free(status);
+  free(errs);
+  free(index);
+
+  return NULL;
+}
+
+/**
+ * Registry records around the operations, see 'pmap_reg_add'. Called with
+ * `done` 0 before the requests, and 1 after them. The record of a failed add
+ * is removed only if the gateway refused it: after a timeout or a reset the
+ * add may have been applied, and the record keeps the mapping ours.
+ */
+static void _pmap_recon_journal(pmap_reg_t *reg, pmap_recon_plan_t *plan,
+                                const pmap_field_t *asked, int done) {
+
+  /* Deletes first, a moved mapping is deleted and added with the same key */
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < plan->count; i++) {
+      pmap_recon_op_t *o = &plan->ops[i];
+      if (_pmap_recon_rank(o->op) != pass) {
+        continue;
+      }
+      if (o->op == PMAP_RECON_DEL) {
+        if (done && o->status == 0) {
+          pmap_reg_del(reg, o->field.gateway_ip, o->field.protocol,
+                       o->field.external_port);
+        }
+      } else if (!done || o->status == 0) {
+        if (o->field.external_port != asked[i].external_port) {
+          pmap_reg_del(reg, asked[i].gateway_ip, asked[i].protocol,
+                       asked[i].external_port);
+        }
+        pmap_reg_add(reg, &o->field);
+      } else if (o->op == PMAP_RECON_ADD && !pmap_ut_unsure(o->err)) {
+        pmap_reg_del(reg, o->field.gateway_ip, o->field.protocol,
+                     o->field.external_port);
+      }
+    }
+  }
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Bring the gateways to a desired set of mappings with the fewest requests.
+ *
+ * The current mappings are read from `reg` if given (every mapping in it is
+ * ours), or from the table of each gateway of `desired` otherwise. In a
+ * gateway table, the mappings to an internal address of a desired mapping
+ * of that gateway are ours. NAT-PMP gateways have no table: without a
+ * registry, each desired mapping is requested again and nothing is deleted.
+ *
+ * Then a mapping that is missing is added. One of ours that is not desired
+ * is deleted. A mapping that points to another internal address or port is
+ * deleted and added again. A lease with less than PMAP_RECON_RENEW_PCT
+ * percent of the desired lifetime left is renewed. The operations of each
+ * gateway are sent in batches (see 'pmap_addport_batch'), the gateways
+ * in parallel, one thread each. `ctx` is shared by these threads, each
+ * only touching the state of its own gateway.
+ *
+ * With PMAP_RECON_DRY_RUN nothing is changed, `plan` tells what would be
+ * sent and its estimated cost. Reading the tables is done anyway.
+ *
+ * @param ctx The client context.
+ * @param desired The mappings that should exist. Keyed by gateway_ip,
+ * protocol and external_port, the last of duplicates wins.
+ * @param count Number of entries in `desired`.
+ * @param reg The registry of our mappings, NULL to read the gateway
+ * tables. It is updated with the changes made.
+ * @param flags PMAP_RECON_DRY_RUN or 0.
+ * @param plan Receives the operations, free it with 'pmap_recon_free'.
+ * @return 0 if the gateways are in the desired state (or, for a dry run,
+ * the plan is complete), 1 on failure (caller should check errno value and
+ * the status of each operation).
+ */
+int pmap_reconcile(pmap_ctx_t *ctx, const pmap_field_t *desired, int count,
+                   pmap_reg_t *reg, int flags, pmap_recon_plan_t *plan) {
+
+  _pmap_recon_diff diff;
+  _pmap_recon_job *jobs = NULL;
+  pmap_field_t *asked = NULL;
+  int njobs = 0, ret = 1;
+
+  memset(plan, 0x00, sizeof(pmap_recon_plan_t));
+  memset(&diff, 0x00, sizeof(diff));
+  diff.plan = plan;
+  diff.now = time(NULL);
+
+  diff.want = pmap_reg_open(NULL, 0);
+  diff.cur = (NULL != reg) ? reg : pmap_reg_open(NULL, 0);
+  if (NULL == diff.want || NULL == diff.cur) {
+    goto out; // caller should check errno value
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (pmap_reg_add(diff.want, &desired[i]) != 0) {
+      goto out;
+    }
+  }
+
+  /* Current state of each gateway we want mappings on */
+  if (NULL == reg) {
+    for (int i = 0; i < count; i++) {
+      int seen = 0;
+      for (int j = 0; j < i && !seen; j++) {
+        seen = (desired[j].gateway_ip == desired[i].gateway_ip);
+      }
+      if (!seen && _pmap_recon_enum(ctx, desired, count, desired[i].gateway_ip,
+                                    diff.cur, &plan->requests) != 0) {
+        PMAP_DEBUG_ERROR("Cannot read the mappings of %s",
+                         pmap_ut_inet_ntoa(desired[i].gateway_ip));
+        goto out;
+      }
+    }
+  }
+
+  /* Diff, at most two operations per desired mapping and one per current */
+  plan->ops = calloc(2 * diff.want->count + diff.cur->count + 1,
+                     sizeof(pmap_recon_op_t));
+  if (NULL == plan->ops) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    goto out;
+  }
+  pmap_reg_foreach(diff.want, _pmap_recon_want, &diff);
+  pmap_reg_foreach(diff.cur, _pmap_recon_stale, &diff);
+  qsort(plan->ops, plan->count, sizeof(pmap_recon_op_t), _pmap_recon_cmp);
+
+  /* One job per gateway */
+  jobs = calloc(plan->count + 1, sizeof(_pmap_recon_job));
+  asked = malloc((plan->count + 1) * sizeof(pmap_field_t));
+  if (NULL == jobs || NULL == asked) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    goto out;
+  }
+  for (int i = 0; i < plan->count;) {
+    int n = 0, dels = 0, adds = 0;
+    while (i + n < plan->count &&
+           plan->ops[i + n].field.gateway_ip == plan->ops[i].field.gateway_ip) {
+      dels += (plan->ops[i + n].op == PMAP_RECON_DEL);
+      adds += (plan->ops[i + n].op == PMAP_RECON_ADD ||
+               plan->ops[i + n].op == PMAP_RECON_RENEW);
+      n++;
+    }
+    int cost = _pmap_recon_cost(ctx, plan->ops[i].field.gateway_ip, dels, adds);
+    if (cost > plan->cost_ms) {
+      plan->cost_ms = cost;
+    }
+    plan->requests += dels + adds;
+    if (dels + adds > 0) {
+      jobs[njobs].ctx = ctx;
+      jobs[njobs].ops = &plan->ops[i];
+      jobs[njobs].count = n;
+      njobs++;
+    }
+    i += n;
+  }
+
+  PMAP_DEBUG_LOG("Plan: %d adds, %d deletes, %d renewals, %d kept, ~%dms\n",
+                 plan->adds, plan->deletes, plan->renewals, plan->kept,
+                 plan->cost_ms);
+
+  if (flags & PMAP_RECON_DRY_RUN) {
+    ret = 0;
+    goto out;
+  }
+
+  for (int i = 0; i < plan->count; i++) {
+    asked[i] = plan->ops[i].field;
+  }
+  if (NULL != reg) {
+    _pmap_recon_journal(reg, plan, asked, 0);
+  }
+
+  for (int j = 0; j < njobs; j++) {
+    jobs[j].started = (njobs > 1 && pthread_create(&jobs[j].thread, NULL,
+                                                   _pmap_recon_apply,
+                                                   &jobs[j]) == 0);
+  }
+  for (int j = 0; j < njobs; j++) {
+    if (jobs[j].started) {
+      pthread_join(jobs[j].thread, NULL);
+    } else {
+      _pmap_recon_apply(&jobs[j]);
+    }
+  }
+
+  if (NULL != reg) {
+    _pmap_recon_journal(reg, plan, asked, 1);
+  }
+
+  for (int i = 0; i < plan->count; i++) {
+    plan->failed += (plan->ops[i].status != 0);
+  }
+  ret = (plan->failed > 0);
+
+out:
+  free(asked);
+  free(jobs);
+  pmap_reg_close(diff.want);
+  if (diff.cur != reg) {
+    pmap_reg_close(diff.cur);
+  }
+
+  return ret;
+}
+
+/**
+ * Free the operations of a plan.
+ *
+ * @param plan The plan, NULL is allowed.
+ */
+void pmap_recon_free(pmap_recon_plan_t *plan) {
+
+  if (NULL != plan) {
+    free(plan->ops);
+    plan->ops = NULL;
+    plan->count = 0;
+  }
+}
@@ -0,0 +1,72 @@
+/*
+ *    pmap_reconcile.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_RECONCILE_H
+#define _PMAP_RECONCILE_H
+
+#include <stdint.h>
+
+#include "pmap.h"
+#include "pmap_cfg.h"
+#include "pmap_registry.h"
+
+/* Operations (pmap_recon_op_t.op) */
+#define PMAP_RECON_KEEP 0  /* Mapping is as desired */
+#define PMAP_RECON_ADD 1   /* Mapping is missing */
+#define PMAP_RECON_DEL 2   /* Mapping is not desired, or points elsewhere */
+#define PMAP_RECON_RENEW 3 /* Mapping is as desired, lease runs out soon */
+
+/* Flags of 'pmap_reconcile' */
+#define PMAP_RECON_DRY_RUN 0x01 /* Plan only, change nothing */
+
+/**
+ * One operation of a plan.
+ */
+typedef struct pmap_recon_op_t_ {
+  int op;             /* PMAP_RECON_* */
+  pmap_field_t field; /* Mapping to add, renew or delete */
+  int status;         /* 0 done, 1 failed, -1 not applied (dry run) */
+  int err;            /* errno of a failed add or renewal, 0 otherwise */
+} pmap_recon_op_t;
+
+/**
+ * Result of 'pmap_reconcile'. `ops` lists the deletes first, so a port
+ * moved to another internal client is freed before it is added again.
+ */
+typedef struct pmap_recon_plan_t_ {
+  pmap_recon_op_t *ops;
+  int count;
+  int adds;
+  int deletes;
+  int renewals;
+  int kept;
+  int requests; /* Requests sent to the gateways (or to send) */
+  int cost_ms;  /* Estimated time to apply, gateways in parallel */
+  int failed;   /* Operations that failed */
+} pmap_recon_plan_t;
+
+int pmap_reconcile(pmap_ctx_t *ctx, const pmap_field_t *desired, int count,
+                   pmap_reg_t *reg, int flags, pmap_recon_plan_t *plan);
+void pmap_recon_free(pmap_recon_plan_t *plan);
+
+#endif // _PMAP_RECONCILE_H
@@ -0,0 +1,674 @@
+/*
+ *    pmap_registry.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pmap_debug.h"
+#include "pmap_registry.h"
+#include "pmap_renew.h"
+#include "util.h"
+
+/* Journal records */
+#define REG_REC_ADD 'A'
+#define REG_REC_RENEW 'R'
+#define REG_REC_DEL 'D'
+
+/* -------------------------------------------- */
+
+/**
+ * FNV-1a of a byte string.
+ */
+static uint32_t _pmap_reg_fnv(const void *data, size_t len) {
+
+  const uint8_t *p = data;
+  uint32_t hash = 2166136261u;
+
+  while (len--) {
+    hash ^= *p++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static uint32_t _pmap_reg_hash(uint32_t gateway_ip, const char *protocol,
+                               int external_port) {
+
+  uint32_t key[2];
+  key[0] = gateway_ip;
+  key[1] = ((uint32_t)(uint8_t)protocol[0] << 16) | (uint16_t)external_port;
+
+  return _pmap_reg_fnv(key, sizeof(key));
+}
+
+static int _pmap_reg_match(pmap_reg_entry_t *entry, uint32_t gateway_ip,
+                           const char *protocol, int external_port) {
+
+  return entry->field.gateway_ip == gateway_ip &&
+         entry->field.external_port == external_port &&
+         strncmp(entry->field.protocol, protocol,
+                 sizeof(entry->field.protocol)) == 0;
+}
+
+/**
+ * Find the link pointing to an entry, or to the end of its chain.
+ */
+static pmap_reg_entry_t **_pmap_reg_slot(pmap_reg_t *reg, uint32_t gateway_ip,
+                                         const char *protocol,
+                                         int external_port) {
+
+  uint32_t hash = _pmap_reg_hash(gateway_ip, protocol, external_port);
+  pmap_reg_entry_t **link = &reg->buckets[hash & (reg->nbuckets - 1)];
+
+  while (*link != NULL &&
+         !_pmap_reg_match(*link, gateway_ip, protocol, external_port)) {
+    link = &(*link)->next;
+  }
+
+  return link;
+}
+
+/**
+ * Double the number of buckets, the registry keeps working if memory
+ * allocation fails (chains just get longer).
+ */
+static void _pmap_reg_grow(pmap_reg_t *reg) {
+
+  uint32_t nbuckets = reg->nbuckets * 2;
+  pmap_reg_entry_t **buckets = calloc(nbuckets, sizeof(pmap_reg_entry_t *));
+  if (NULL == buckets) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < reg->nbuckets; i++) {
+    pmap_reg_entry_t *entry = reg->buckets[i];
+    while (entry != NULL) {
+      pmap_reg_entry_t *next = entry->next;
+      uint32_t hash =
+          _pmap_reg_hash(entry->field.gateway_ip, entry->field.protocol,
+                         entry->field.external_port);
+      entry->next = buckets[hash & (nbuckets - 1)];
+      buckets[hash & (nbuckets - 1)] = entry;
+      entry = next;
+    }
+  }
+
+  free(reg->buckets);
+  reg->buckets = buckets;
+  reg->nbuckets = nbuckets;
+}
+
+/**
+ * Insert or update an entry in memory.
+ */
+static int _pmap_reg_set(pmap_reg_t *reg, const pmap_field_t *pfield,
+                         int64_t expires) {
+
+  pmap_reg_entry_t **link = _pmap_reg_slot(reg, pfield->gateway_ip,
+                                           pfield->protocol,
+                                           pfield->external_port);
+  if (*link != NULL) {
+    (*link)->field = *pfield;
+    (*link)->expires = expires;
+    return 0;
+  }
+
+  pmap_reg_entry_t *entry = malloc(sizeof(pmap_reg_entry_t));
+  if (NULL == entry) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return 1;
+  }
+  entry->next = NULL;
+  entry->field = *pfield;
+  entry->expires = expires;
+  *link = entry;
+
+  if (++reg->count > (int)reg->nbuckets) {
+    _pmap_reg_grow(reg);
+  }
+
+  return 0;
+}
+
+/**
+ * Remove an entry from memory.
+ */
+static void _pmap_reg_unset(pmap_reg_t *reg, uint32_t gateway_ip,
+                            const char *protocol, int external_port) {
+
+  pmap_reg_entry_t **link =
+      _pmap_reg_slot(reg, gateway_ip, protocol, external_port);
+  if (*link != NULL) {
+    pmap_reg_entry_t *entry = *link;
+    *link = entry->next;
+    free(entry);
+    reg->count--;
+  }
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Whether a mapping has a PCP nonce to keep.
+ */
+static int _pmap_reg_has_nonce(const pmap_field_t *pfield) {
+
+  for (int i = 0; i < PCP_NONCE_LEN; i++) {
+    if (pfield->nonce[i] != 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Format a journal record, terminated by its checksum. The PCP nonce of a
+ * mapping, if any, follows the expiry in hex: a renewal or delete after a
+ * restart needs it.
+ *
+ * @return The record length.
+ */
+static int _pmap_reg_format(char *line, int size, char type,
+                            const pmap_field_t *pfield, int64_t expires) {
+
+  char gateway_ip[16], internal_ip[16];
+  int len;
+
+  pmap_ut_inet_ntoa_r(pfield->gateway_ip, gateway_ip, sizeof(gateway_ip));
+  if (type == REG_REC_DEL) {
+    len = snprintf(line, size, "%c %s %s %d", type, gateway_ip,
+                   pfield->protocol, pfield->external_port);
+  } else {
+    pmap_ut_inet_ntoa_r(pfield->internal_ip, internal_ip, sizeof(internal_ip));
+    len = snprintf(line, size, "%c %s %s %d %d %s %d %lld", type, gateway_ip,
+                   pfield->protocol, pfield->external_port,
+                   pfield->internal_port, internal_ip, pfield->lifetime_sec,
+                   (long long)expires);
+    if (_pmap_reg_has_nonce(pfield)) {
+      len += snprintf(line + len, size - len, " ");
+      for (int i = 0; i < PCP_NONCE_LEN; i++) {
+        len += snprintf(line + len, size - len, "%02x", pfield->nonce[i]);
+      }
+    }
+  }
+
+  len += snprintf(line + len, size - len, " #%08x\n",
+                  _pmap_reg_fnv(line, len));
+
+  return len;
+}
+
+/**
+ * Append a record to the journal, compacting it when it got too long.
+ */
+static int _pmap_reg_append(pmap_reg_t *reg, char type,
+                            const pmap_field_t *pfield, int64_t expires) {
+
+  char line[PMAP_REG_LINE_LEN];
+
+  if (reg->fd < 0) {
+    return 0; // In memory only
+  }
+
+  int len = _pmap_reg_format(line, sizeof(line), type, pfield, expires);
+  if (reg->torn) {
+    /* Terminate the fragment of a failed append, so it is skipped alone */
+    if (write(reg->fd, "\n", 1) != 1) {
+      PMAP_DEBUG_ERROR("write() %s", strerror(errno));
+      return 1;
+    }
+    reg->torn = 0;
+  }
+
+  off_t end = lseek(reg->fd, 0, SEEK_END);
+  ssize_t written = write(reg->fd, line, len);
+  if (written != len) {
+    int err = (written < 0) ? errno : EIO;
+    PMAP_DEBUG_ERROR("write() %s", strerror(err));
+    if (written > 0 && (end < 0 || ftruncate(reg->fd, end) < 0)) {
+      reg->torn = 1;
+    }
+    errno = err;
+    return 1;
+  }
+  if ((reg->flags & PMAP_REG_SYNC) && fdatasync(reg->fd) < 0) {
+    PMAP_DEBUG_ERROR("fdatasync() %s", strerror(errno));
+    return 1;
+  }
+  reg->records++;
+
+  return 0;
+}
+
+/**
+ * Parse and apply one journal record. Records written before the nonce was
+ * kept end with the expiry, their mapping has no nonce.
+ *
+ * @return 0 if applied, 1 if the record is torn or malformed, -1 on failure
+ * (caller should check errno value).
+ */
+static int _pmap_reg_replay_line(pmap_reg_t *reg, char *line, time_t now) {
+
+  char type, protocol[4], gateway_ip[16], internal_ip[16];
+  char nonce[2 * PCP_NONCE_LEN + 1];
+  unsigned int sum;
+  long long expires;
+  int end = 0;
+  pmap_field_t field;
+
+  char *mark = strstr(line, " #");
+  if (NULL == mark || sscanf(mark, " #%08x", &sum) != 1 ||
+      _pmap_reg_fnv(line, mark - line) != sum) {
+    return 1;
+  }
+  *mark = '\0';
+
+  memset(&field, 0x00, sizeof(field));
+  if (line[0] == REG_REC_DEL) {
+    if (sscanf(line, "%c %15s %3s %d", &type, gateway_ip, protocol,
+               &field.external_port) != 4) {
+      return 1;
+    }
+    _pmap_reg_unset(reg, inet_addr(gateway_ip), protocol, field.external_port);
+    return 0;
+  }
+
+  if (sscanf(line, "%c %15s %3s %d %d %15s %d %lld%n", &type, gateway_ip,
+             field.protocol, &field.external_port, &field.internal_port,
+             internal_ip, &field.lifetime_sec, &expires, &end) != 8 ||
+      (type != REG_REC_ADD && type != REG_REC_RENEW)) {
+    return 1;
+  }
+
+  if (sscanf(line + end, " %24[0-9a-f]", nonce) == 1) {
+    if (strlen(nonce) != 2 * PCP_NONCE_LEN) {
+      return 1;
+    }
+    for (int i = 0; i < PCP_NONCE_LEN; i++) {
+      unsigned int byte;
+      sscanf(nonce + 2 * i, "%2x", &byte);
+      field.nonce[i] = (uint8_t)byte;
+    }
+  }
+
+  field.gateway_ip = inet_addr(gateway_ip);
+  field.internal_ip = inet_addr(internal_ip);
+
+  if (expires != 0 && expires <= now) {
+    /* Gone from the gateway already */
+    _pmap_reg_unset(reg, field.gateway_ip, field.protocol,
+                    field.external_port);
+    return 0;
+  }
+
+  return (_pmap_reg_set(reg, &field, expires) == 0) ? 0 : -1;
+}
+
+/**
+ * Rebuild the registry from the journal. A torn or corrupted record is
+ * skipped, and a torn tail is truncated after the last good record.
+ */
+static int _pmap_reg_replay(pmap_reg_t *reg) {
+
+  char line[PMAP_REG_LINE_LEN];
+  time_t now = time(NULL);
+  long good = 0;
+  int skipped = 0;
+
+  FILE *fp = fopen(reg->path, "r");
+  if (NULL == fp) {
+    return (errno == ENOENT) ? 0 : 1; // No journal yet
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    int ret = (strchr(line, '\n') == NULL) ? 1
+                                            : _pmap_reg_replay_line(reg, line, now);
+    if (ret < 0) {
+      fclose(fp);
+      return 1;
+    } else if (ret > 0) {
+      skipped++;
+      continue;
+    }
+    reg->records++;
+    good = ftell(fp);
+  }
+
+  int torn = !feof(fp) || (ftell(fp) != good);
+  fclose(fp);
+
+  if (skipped > 0) {
+    PMAP_DEBUG_LOG("Journal %s: skipped %d bad records\n", reg->path, skipped);
+    reg->records += skipped; // Still in the file until the next compaction
+  }
+
+  if (torn) {
+    PMAP_DEBUG_LOG("Journal %s truncated at %ld\n", reg->path, good);
+    if (truncate(reg->path, good) < 0) {
+      PMAP_DEBUG_ERROR("truncate() %s", strerror(errno));
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Open a registry and replay its journal.
+ *
+ * @param path The journal file, created if it does not exist. NULL for a
+ * registry in memory only.
+ * @param flags PMAP_REG_SYNC to make every record durable before returning.
+ * @return The registry, or NULL on failure (caller should check errno value).
+ * The caller is responsible for freeing it by calling 'pmap_reg_close'.
+ */
+pmap_reg_t *pmap_reg_open(const char *path, int flags) {
+
+  pmap_reg_t *reg = calloc(1, sizeof(pmap_reg_t));
+  if (NULL == reg) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  reg->fd = -1;
+  reg->flags = flags;
+  reg->nbuckets = PMAP_REG_BUCKETS_MIN;
+  reg->buckets = calloc(reg->nbuckets, sizeof(pmap_reg_entry_t *));
+  if (NULL == reg->buckets) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    goto error;
+  }
+
+  if (NULL == path) {
+    return reg;
+  }
+
+  if (NULL == (reg->path = strdup(path)) || _pmap_reg_replay(reg) != 0) {
+    goto error;
+  }
+
+  reg->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (reg->fd < 0) {
+    PMAP_DEBUG_ERROR("open() %s", strerror(errno));
+    goto error;
+  }
+
+  if (reg->records > PMAP_REG_COMPACT_MIN && reg->records > 2 * reg->count) {
+    pmap_reg_compact(reg);
+  }
+
+  return reg;
+
+error:
+  pmap_reg_close(reg);
+  return NULL;
+}
+
+/**
+ * Close a registry. The journal is kept, mappings are not touched.
+ *
+ * @param reg The registry, NULL is allowed.
+ */
+void pmap_reg_close(pmap_reg_t *reg) {
+
+  if (NULL != reg) {
+    if (NULL != reg->buckets) {
+      for (uint32_t i = 0; i < reg->nbuckets; i++) {
+        pmap_reg_entry_t *entry = reg->buckets[i];
+        while (entry != NULL) {
+          pmap_reg_entry_t *next = entry->next;
+          free(entry);
+          entry = next;
+        }
+      }
+      free(reg->buckets);
+    }
+    if (reg->fd >= 0) {
+      close(reg->fd);
+    }
+    free(reg->path);
+    free(reg);
+  }
+}
+
+/**
+ * Record an add or renew intent, call it before sending the request to the
+ * gateway (and 'pmap_reg_del' if the request failed).
+ *
+ * @param reg The registry.
+ * @param pfield The mapping, the expiry is computed from `lifetime_sec`.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_reg_add(pmap_reg_t *reg, const pmap_field_t *pfield) {
+
+  int64_t expires = 0;
+  if (pfield->lifetime_sec > 0) {
+    expires = (int64_t)time(NULL) + pfield->lifetime_sec;
+  }
+
+  char type = (*_pmap_reg_slot(reg, pfield->gateway_ip, pfield->protocol,
+                               pfield->external_port) == NULL)
+                  ? REG_REC_ADD
+                  : REG_REC_RENEW;
+
+  if (_pmap_reg_append(reg, type, pfield, expires) != 0) {
+    return 1;
+  }
+
+  if (_pmap_reg_set(reg, pfield, expires) != 0) {
+    return 1;
+  }
+
+  if (reg->records > PMAP_REG_COMPACT_MIN && reg->records > 2 * reg->count) {
+    return pmap_reg_compact(reg);
+  }
+
+  return 0;
+}
+
+/**
+ * Record that a mapping is gone, call it after the gateway confirmed the
+ * delete.
+ *
+ * @param reg The registry.
+ * @param gateway_ip The gateway address, network byte order.
+ * @param protocol "TCP" or "UDP".
+ * @param external_port The external port.
+ * @return 0 on success (also if the mapping is not registered), 1 on failure
+ * (caller should check errno value).
+ */
+int pmap_reg_del(pmap_reg_t *reg, uint32_t gateway_ip, const char *protocol,
+                 int external_port) {
+
+  pmap_reg_entry_t **link =
+      _pmap_reg_slot(reg, gateway_ip, protocol, external_port);
+  if (*link == NULL) {
+    return 0;
+  }
+
+  if (_pmap_reg_append(reg, REG_REC_DEL, &(*link)->field, 0) != 0) {
+    return 1;
+  }
+  _pmap_reg_unset(reg, gateway_ip, protocol, external_port);
+
+  if (reg->records > PMAP_REG_COMPACT_MIN && reg->records > 2 * reg->count) {
+    return pmap_reg_compact(reg);
+  }
+
+  return 0;
+}
+
+/**
+ * Look up a mapping.
+ *
+ * @return The entry, NULL if the mapping is not registered.
+ */
+pmap_reg_entry_t *pmap_reg_find(pmap_reg_t *reg, uint32_t gateway_ip,
+                                const char *protocol, int external_port) {
+
+  return *_pmap_reg_slot(reg, gateway_ip, protocol, external_port);
+}
+
+/**
+ * Call `fn` for every registered mapping, in no particular order. The
+ * registry must not be changed from `fn`.
+ *
+ * @return 0, or the first non zero value returned by `fn` (which stops the
+ * iteration).
+ */
+int pmap_reg_foreach(pmap_reg_t *reg, pmap_reg_fn fn, void *arg) {
+
+  for (uint32_t i = 0; i < reg->nbuckets; i++) {
+    for (pmap_reg_entry_t *entry = reg->buckets[i]; entry != NULL;
+         entry = entry->next) {
+      int ret = fn(entry, arg);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Rewrite the journal with one record per live mapping. The new journal is
+ * written aside and renamed over the old one, so a crash leaves either of
+ * them intact.
+ *
+ * @param reg The registry.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_reg_compact(pmap_reg_t *reg) {
+
+  char line[PMAP_REG_LINE_LEN];
+  char tmp[PATH_MAX];
+  int records = 0;
+
+  if (reg->fd < 0) {
+    return 0;
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", reg->path);
+  FILE *fp = fopen(tmp, "w");
+  if (NULL == fp) {
+    PMAP_DEBUG_ERROR("fopen() %s", strerror(errno));
+    return 1;
+  }
+
+  for (uint32_t i = 0; i < reg->nbuckets; i++) {
+    for (pmap_reg_entry_t *entry = reg->buckets[i]; entry != NULL;
+         entry = entry->next) {
+      _pmap_reg_format(line, sizeof(line), REG_REC_ADD, &entry->field,
+                       entry->expires);
+      fputs(line, fp);
+      records++;
+    }
+  }
+
+  if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+    PMAP_DEBUG_ERROR("fsync() %s", strerror(errno));
+    fclose(fp);
+    unlink(tmp);
+    return 1;
+  }
+  fclose(fp);
+
+  if (rename(tmp, reg->path) < 0) {
+    PMAP_DEBUG_ERROR("rename() %s", strerror(errno));
+    unlink(tmp);
+    return 1;
+  }
+
+  /* Make the rename durable */
+  strncpy(tmp, reg->path, sizeof(tmp) - 1);
+  tmp[sizeof(tmp) - 1] = '\0';
+  int dirfd = open(dirname(tmp), O_RDONLY | O_DIRECTORY);
+  if (dirfd >= 0) {
+    fsync(dirfd);
+    close(dirfd);
+  }
+
+  int fd = open(reg->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (fd < 0) {
+    PMAP_DEBUG_ERROR("open() %s", strerror(errno));
+    return 1;
+  }
+  close(reg->fd);
+  reg->fd = fd;
+  reg->records = records;
+
+  PMAP_DEBUG_LOG("Journal %s compacted to %d records\n", reg->path, records);
+
+  return 0;
+}
+
+/* -------------------------------------------- */
+
+static int _pmap_reg_resume_one(pmap_reg_entry_t *entry, void *arg) {
+
+  pmap_renew_t *rn = arg;
+
+  if (entry->expires != 0) {
+    int64_t remain = entry->expires - (int64_t)time(NULL);
+    if (pmap_renew_resume(rn, &entry->field, (int)remain) == NULL) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Hand every registered mapping with a lifetime to a renewal engine, e.g.
+ * after a restart. Each one is renewed at the configured fraction of the
+ * lifetime it has left.
+ *
+ * @param reg The registry.
+ * @param rn The renewal engine.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_reg_resume(pmap_reg_t *reg, pmap_renew_t *rn) {
+
+  return pmap_reg_foreach(reg, _pmap_reg_resume_one, rn);
+}
@@ -0,0 +1,78 @@
+/*
+ *    pmap_registry.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_REGISTRY_H
+#define _PMAP_REGISTRY_H
+
+#include <stdint.h>
+
+#include "pmap_cfg.h"
+#include "pmap_renew.h"
+
+/* Open flags */
+#define PMAP_REG_SYNC 0x01 /* fdatasync() the journal after every record */
+
+/**
+ * A mapping owned by this host. Key is (gateway_ip, protocol, external_port).
+ */
+typedef struct pmap_reg_entry_t_ {
+  struct pmap_reg_entry_t_ *next; /* Hash chain */
+  pmap_field_t field;
+  int64_t expires; /* time() the gateway drops the mapping, 0 if never */
+} pmap_reg_entry_t;
+
+/**
+ * Registry of owned mappings, a hash table backed by an append-only journal.
+ *
+ * Every change is appended to the journal before the caller acts on the
+ * gateway for an add or renew, and after the gateway confirmed a delete. So
+ * the journal never misses a mapping that may exist on a gateway. Each record
+ * carries a checksum, a torn or corrupted record is skipped when the journal
+ * is replayed by 'pmap_reg_open', and one at the end (crash while writing) is
+ * cut off.
+ */
+typedef struct pmap_reg_t_ {
+  pmap_reg_entry_t **buckets;
+  uint32_t nbuckets; /* Power of 2 */
+  int count;         /* Live mappings */
+  int records;       /* Records in the journal */
+  int flags;
+  int fd;   /* Journal, -1 if the registry is in memory only */
+  int torn; /* A failed append left an unterminated record */
+  char *path;
+} pmap_reg_t;
+
+typedef int (*pmap_reg_fn)(pmap_reg_entry_t *entry, void *arg);
+
+pmap_reg_t *pmap_reg_open(const char *path, int flags);
+void pmap_reg_close(pmap_reg_t *reg);
+int pmap_reg_add(pmap_reg_t *reg, const pmap_field_t *pfield);
+int pmap_reg_del(pmap_reg_t *reg, uint32_t gateway_ip, const char *protocol,
+                 int external_port);
+pmap_reg_entry_t *pmap_reg_find(pmap_reg_t *reg, uint32_t gateway_ip,
+                                const char *protocol, int external_port);
+int pmap_reg_foreach(pmap_reg_t *reg, pmap_reg_fn fn, void *arg);
+int pmap_reg_compact(pmap_reg_t *reg);
+int pmap_reg_resume(pmap_reg_t *reg, pmap_renew_t *rn);
+
+#endif // _PMAP_REGISTRY_H
@@ -0,0 +1,516 @@
+/*
+ *    pmap_renew.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pmap.h"
+#include "pmap_debug.h"
+#include "pmap_npmp.h"
+#include "pmap_renew.h"
+#include "util.h"
+
+/* -------------------------------------------- */
+
+/**
+ * Create a renewal engine.
+ *
+ * @param ctx The client context used for renewals (see 'pmap_ensureport', a
+ * UPnP mapping still current is not rewritten), it must outlive the engine.
+ * @param cb Called after every renewal attempt, may be NULL.
+ * @param arg Passed to `cb`.
+ * @return A new engine, or NULL if memory allocation fails. The caller is
+ * responsible for freeing it by calling 'pmap_renew_destroy' function.
+ */
+pmap_renew_t *pmap_renew_create(pmap_ctx_t *ctx, pmap_renew_cb cb, void *arg) {
+
+  pmap_renew_t *rn = malloc(sizeof(pmap_renew_t));
+  if (NULL == rn) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  rn->ctx = ctx;
+  rn->cb = cb;
+  rn->cb_arg = arg;
+  rn->releasing = NULL;
+  rn->fraction_num = PMAP_RENEW_FRACTION_NUM;
+  rn->fraction_den = PMAP_RENEW_FRACTION_DEN;
+  rn->jitter_pct = PMAP_RENEW_JITTER_PCT;
+  rn->batch_ms = PMAP_RENEW_BATCH_MS;
+  rn->seed = (uint32_t)pmap_ut_now_ms() ^ ((uint32_t)getpid() << 16);
+  if (rn->seed == 0) {
+    rn->seed = 1;
+  }
+
+  pmap_wheel_init(&rn->wheel, PMAP_RENEW_TICK_MS, pmap_ut_now_ms());
+
+  return rn;
+}
+
+/**
+ * Destroy a renewal engine and its leases. The mappings are not deleted on
+ * the gateways, they expire at the end of their lifetime.
+ *
+ * @param rn The engine, NULL is allowed.
+ */
+void pmap_renew_destroy(pmap_renew_t *rn) {
+
+  if (NULL != rn) {
+    for (int level = 0; level < PMAP_WHEEL_LEVELS; level++) {
+      for (int i = 0; i < PMAP_WHEEL_SIZE; i++) {
+        pmap_timer_t *head = &rn->wheel.slots[level][i];
+        while (!pmap_timer_list_empty(head)) {
+          pmap_timer_t *timer = head->next;
+          pmap_timer_list_del(timer);
+          free(timer);
+        }
+      }
+    }
+    free(rn);
+  }
+}
+
+/**
+ * Change the renewal policy.
+ *
+ * @param rn The engine.
+ * @param fraction_num Renew after fraction_num/fraction_den of the lifetime.
+ * @param fraction_den See `fraction_num`.
+ * @param jitter_pct Random spread of the renewal time, in percent.
+ * @param batch_ms Renewals of a gateway due within this time are done
+ * together, 0 to disable.
+ */
+void pmap_renew_config(pmap_renew_t *rn, int fraction_num, int fraction_den,
+                       int jitter_pct, int batch_ms) {
+
+  if (fraction_num > 0 && fraction_den > fraction_num) {
+    rn->fraction_num = fraction_num;
+    rn->fraction_den = fraction_den;
+  }
+  if (jitter_pct >= 0 && jitter_pct < 100) {
+    rn->jitter_pct = jitter_pct;
+  }
+  if (batch_ms >= 0) {
+    rn->batch_ms = batch_ms;
+  }
+}
+
+/* -------------------------------------------- */
+
+/**
+ * xorshift32, enough to spread renewals.
+ */
+static uint32_t _pmap_renew_rand(pmap_renew_t *rn) {
+
+  uint32_t x = rn->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  rn->seed = x;
+
+  return x;
+}
+
+/**
+ * Schedule the next renewal of a lease `delay_ms` from now.
+ */
+static void _pmap_renew_schedule(pmap_renew_t *rn, pmap_lease_t *lease,
+                                 int64_t delay_ms) {
+
+  pmap_wheel_add(&rn->wheel, &lease->timer, pmap_ut_now_ms() + delay_ms);
+}
+
+/**
+ * Delay until the renewal of a lease granted for `lifetime_sec`: the
+ * configured fraction of the lifetime, spread by the jitter, but always
+ * before the lease expires.
+ */
+static int64_t _pmap_renew_delay(pmap_renew_t *rn, int lifetime_sec) {
+
+  int64_t lifetime_ms = (int64_t)lifetime_sec * 1000;
+  int64_t delay = lifetime_ms * rn->fraction_num / rn->fraction_den;
+
+  if (rn->jitter_pct > 0) {
+    int64_t spread = delay * rn->jitter_pct / 100;
+    delay += (int64_t)(_pmap_renew_rand(rn) % (uint32_t)(2 * spread + 1)) -
+             spread;
+  }
+
+  if (delay > lifetime_ms - PMAP_RENEW_TICK_MS) {
+    delay = lifetime_ms - PMAP_RENEW_TICK_MS;
+  }
+  if (delay < PMAP_RENEW_TICK_MS) {
+    delay = PMAP_RENEW_TICK_MS;
+  }
+
+  return delay;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Allocate a lease and schedule its first renewal.
+ */
+static pmap_lease_t *_pmap_renew_new(pmap_renew_t *rn,
+                                     const pmap_field_t *pfield,
+                                     int64_t delay_ms) {
+
+  if (pfield->lifetime_sec <= 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  pmap_lease_t *lease = malloc(sizeof(pmap_lease_t));
+  if (NULL == lease) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  pmap_timer_list_init(&lease->timer);
+  lease->field = *pfield;
+  lease->lifetime_sec = pfield->lifetime_sec;
+  lease->failures = 0;
+  lease->batch_ret = 0;
+  lease->user = NULL;
+
+  _pmap_renew_schedule(rn, lease, delay_ms);
+
+  return lease;
+}
+
+/**
+ * Keep a mapping alive. The mapping must already exist (e.g. created with
+ * 'pmap_addport'), the first renewal is scheduled from now.
+ *
+ * @param rn The engine.
+ * @param pfield The mapping, `lifetime_sec` is requested on every renewal and
+ * must not be 0 (a permanent mapping needs no renewal).
+ * @return The lease, or NULL on failure (caller should check errno value).
+ * It is owned by the engine, release it with 'pmap_renew_remove'.
+ */
+pmap_lease_t *pmap_renew_add(pmap_renew_t *rn, const pmap_field_t *pfield) {
+
+  return _pmap_renew_new(rn, pfield,
+                         _pmap_renew_delay(rn, pfield->lifetime_sec));
+}
+
+/**
+ * Keep alive a mapping created earlier (e.g. by a previous process), which
+ * has `remain_sec` of its lifetime left. The first renewal is scheduled at
+ * the configured fraction of what is left, at once if it already expired.
+ *
+ * @param rn The engine.
+ * @param pfield The mapping, see 'pmap_renew_add'.
+ * @param remain_sec Seconds until the gateway drops the mapping.
+ * @return The lease, or NULL on failure (caller should check errno value).
+ */
+pmap_lease_t *pmap_renew_resume(pmap_renew_t *rn, const pmap_field_t *pfield,
+                                int remain_sec) {
+
+  int64_t delay = (remain_sec > 0) ? _pmap_renew_delay(rn, remain_sec) : 0;
+
+  return _pmap_renew_new(rn, pfield, delay);
+}
+
+/**
+ * Stop renewing a mapping and release the lease. The mapping is not deleted
+ * on the gateway. May be called from the renewal callback.
+ *
+ * @param rn The engine.
+ * @param lease The lease, NULL is allowed.
+ */
+void pmap_renew_remove(pmap_renew_t *rn, pmap_lease_t *lease) {
+
+  if (lease == rn->releasing) {
+    return; // Never renewable, freed by the engine after the callback
+  }
+
+  if (NULL != lease) {
+    if (lease->timer.slot >= 0) {
+      pmap_wheel_del(&rn->wheel, &lease->timer);
+    } else {
+      pmap_timer_list_del(&lease->timer); // Waiting in a renewal batch
+    }
+    free(lease);
+  }
+}
+
+/**
+ * @return Number of scheduled leases.
+ */
+int pmap_renew_count(pmap_renew_t *rn) {
+
+  return rn->wheel.count;
+}
+
+/**
+ * Time the caller should call 'pmap_renew_run' next.
+ *
+ * @param rn The engine.
+ * @return The time (pmap_ut_now_ms), -1 if there is no lease.
+ */
+int64_t pmap_renew_next(pmap_renew_t *rn) {
+
+  return pmap_wheel_next(&rn->wheel);
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Gateways with a renewal due, to pull their upcoming renewals forward.
+ */
+typedef struct {
+  uint32_t *ips;
+  int count;
+} _pmap_renew_gws;
+
+static int _pmap_renew_same_gw(pmap_timer_t *timer, void *arg) {
+
+  _pmap_renew_gws *gws = arg;
+  uint32_t ip = ((pmap_lease_t *)timer)->field.gateway_ip;
+
+  for (int i = 0; i < gws->count; i++) {
+    if (gws->ips[i] == ip) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Schedule the next renewal (or retry) of a lease after a renewal attempt
+ * and report it.
+ */
+static void _pmap_renew_done(pmap_renew_t *rn, pmap_lease_t *lease, int ret,
+                             const pmap_field_t *field, const char *error) {
+
+  int64_t delay;
+
+  if (ret == 0) {
+    lease->field = *field;
+    lease->failures = 0;
+    delay = _pmap_renew_delay(rn, (field->lifetime_sec > 0)
+                                      ? field->lifetime_sec
+                                      : lease->lifetime_sec);
+  } else {
+    int retry = PMAP_RENEW_RETRY_MIN;
+    for (int i = 0; i < lease->failures && retry < PMAP_RENEW_RETRY_MAX; i++) {
+      retry *= 2;
+    }
+    if (retry > PMAP_RENEW_RETRY_MAX) {
+      retry = PMAP_RENEW_RETRY_MAX;
+    }
+    lease->failures++;
+    delay = (int64_t)retry * 1000;
+    PMAP_DEBUG_LOG("Renewal of %d/%s failed (%d), retry in %ds\n",
+                   lease->field.external_port, lease->field.protocol, errno,
+                   retry);
+  }
+
+  if (ret != -2) {
+    /* Scheduled before the callback, which may remove the lease */
+    _pmap_renew_schedule(rn, lease, delay);
+    if (NULL != rn->cb) {
+      rn->cb(lease, ret, error, rn->cb_arg);
+    }
+    return;
+  }
+
+  /*
+   * Protocol not supported, never renewable. The lease is out of the wheel
+   * already; the engine frees it once the callback returns, a removal from
+   * the callback is a no-op.
+   */
+  rn->releasing = lease;
+  if (NULL != rn->cb) {
+    rn->cb(lease, ret, error, rn->cb_arg);
+  }
+  rn->releasing = NULL;
+  free(lease);
+}
+
+/**
+ * Renew one lease and schedule the next renewal (or retry).
+ */
+static void _pmap_renew_lease(pmap_renew_t *rn, pmap_lease_t *lease) {
+
+  char error[64];
+  pmap_field_t field = lease->field;
+
+  memset(error, 0x00, sizeof(error));
+  field.lifetime_sec = lease->lifetime_sec;
+
+  /* Renewals give way to the calls someone waits for */
+  int prio = pmap_priority(PMAP_PRIO_BACKGROUND);
+  int written = 0;
+  int ret = pmap_ensureport(rn->ctx, &field, &written, error, sizeof(error));
+  pmap_priority(prio);
+  if (ret == 0 && !written) {
+    PMAP_DEBUG_LOG("Mapping %d/%s current, %ds left\n",
+                   lease->field.external_port, lease->field.protocol,
+                   field.lifetime_sec);
+  }
+
+  _pmap_renew_done(rn, lease, ret, &field, error);
+}
+
+/**
+ * Renew the leases of one gateway in `batch` with one 'pmap_ensureport_batch',
+ * so UPnP renewals share a keep-alive connection and a current mapping is
+ * read but not written again. A single lease, or one of a
+ * protocol NAT-PMP does not know, goes through 'pmap_ensureport'. The leases
+ * stay in `batch` until reported since a callback may remove any of them.
+ */
+static void _pmap_renew_batch(pmap_renew_t *rn, pmap_timer_t *batch) {
+
+  pmap_field_t *fields = NULL;
+  int *status = NULL;
+  int count = 0;
+
+  for (pmap_timer_t *t = batch->next; t != batch; t = t->next) {
+    if (pmap_npmp_opcode(((pmap_lease_t *)t)->field.protocol) >= 0) {
+      count++;
+    }
+  }
+
+  if (count > 1) {
+    fields = malloc(count * sizeof(pmap_field_t));
+    status = malloc(count * sizeof(int));
+  }
+
+  if (NULL != fields && NULL != status) {
+    int i = 0;
+    for (pmap_timer_t *t = batch->next; t != batch; t = t->next) {
+      pmap_lease_t *lease = (pmap_lease_t *)t;
+      if (pmap_npmp_opcode(lease->field.protocol) >= 0) {
+        fields[i] = lease->field;
+        fields[i++].lifetime_sec = lease->lifetime_sec;
+      }
+    }
+
+    int prio = pmap_priority(PMAP_PRIO_BACKGROUND);
+    pmap_ensureport_batch(rn->ctx, fields, count, status);
+    pmap_priority(prio);
+
+    i = 0;
+    for (pmap_timer_t *t = batch->next; t != batch; t = t->next) {
+      pmap_lease_t *lease = (pmap_lease_t *)t;
+      if (pmap_npmp_opcode(lease->field.protocol) >= 0) {
+        lease->batch_ret = status[i];
+        if (status[i] == 0) {
+          lease->field = fields[i];
+        }
+        i++;
+      }
+    }
+
+    while (!pmap_timer_list_empty(batch)) {
+      pmap_lease_t *lease = (pmap_lease_t *)batch->next;
+      pmap_timer_list_del(&lease->timer);
+      if (pmap_npmp_opcode(lease->field.protocol) < 0) {
+        _pmap_renew_lease(rn, lease); // Released with -2
+      } else {
+        _pmap_renew_done(rn, lease, lease->batch_ret, &lease->field,
+                         lease->batch_ret ? "Renewal failed" : "");
+      }
+    }
+  }
+
+  free(fields);
+  free(status);
+
+  /* Nothing to batch or out of memory, one by one */
+  while (!pmap_timer_list_empty(batch)) {
+    pmap_lease_t *lease = (pmap_lease_t *)batch->next;
+    pmap_timer_list_del(&lease->timer);
+    _pmap_renew_lease(rn, lease);
+  }
+}
+
+/**
+ * Renew every lease that is due. Renewals of the same gateway that are due
+ * within the batch window are pulled forward and done together with
+ * 'pmap_ensureport_batch', one gateway after the other.
+ *
+ * @param rn The engine.
+ * @param now_ms Current time (pmap_ut_now_ms).
+ * @return Number of renewal attempts.
+ */
+int pmap_renew_run(pmap_renew_t *rn, int64_t now_ms) {
+
+  pmap_timer_t due, batch;
+  _pmap_renew_gws gws = {NULL, 0};
+  int renewed = 0;
+
+  pmap_timer_list_init(&due);
+  if (pmap_wheel_expire(&rn->wheel, now_ms, &due) == 0) {
+    return 0;
+  }
+
+  /* Gateways with a renewal due */
+  for (pmap_timer_t *t = due.next; t != &due; t = t->next) {
+    if (!_pmap_renew_same_gw(t, &gws)) {
+      uint32_t *ips = realloc(gws.ips, (gws.count + 1) * sizeof(uint32_t));
+      if (NULL == ips) {
+        break; // Only batching is lost
+      }
+      gws.ips = ips;
+      gws.ips[gws.count++] = ((pmap_lease_t *)t)->field.gateway_ip;
+    }
+  }
+
+  if (rn->batch_ms > 0 && gws.count > 0) {
+    pmap_wheel_collect(&rn->wheel, now_ms + rn->batch_ms, _pmap_renew_same_gw,
+                       &gws, &due);
+  }
+  free(gws.ips);
+
+  /* Renew gateway by gateway */
+  pmap_timer_list_init(&batch);
+  while (!pmap_timer_list_empty(&due)) {
+
+    uint32_t gateway_ip = ((pmap_lease_t *)due.next)->field.gateway_ip;
+    pmap_timer_t *t = due.next;
+    while (t != &due) {
+      pmap_timer_t *next = t->next;
+      if (((pmap_lease_t *)t)->field.gateway_ip == gateway_ip) {
+        pmap_timer_list_del(t);
+        pmap_timer_list_add(&batch, t);
+        renewed++;
+      }
+      t = next;
+    }
+
+    _pmap_renew_batch(rn, &batch);
+  }
+
+  return renewed;
+}
@@ -0,0 +1,89 @@
+/*
+ *    pmap_renew.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_RENEW_H
+#define _PMAP_RENEW_H
+
+#include <stdint.h>
+
+#include "pmap.h"
+#include "pmap_cfg.h"
+#include "pmap_wheel.h"
+
+struct pmap_lease_t_;
+
+/**
+ * Called after every renewal attempt.
+ *
+ * @param lease The renewed mapping, `field` holds the values granted by the
+ * gateway (NAT-PMP may change the external port).
+ * @param ret Return value of 'pmap_addport'. With -2 (protocol not
+ * supported) the lease is released by the engine when the callback returns.
+ * @param error Error description if `ret` is not 0.
+ * @param arg Argument given to 'pmap_renew_create'.
+ */
+typedef void (*pmap_renew_cb)(struct pmap_lease_t_ *lease, int ret,
+                              const char *error, void *arg);
+
+/**
+ * A mapping kept alive by the renewal engine.
+ */
+typedef struct pmap_lease_t_ {
+  pmap_timer_t timer; /* Must be first */
+  pmap_field_t field; /* Mapping, as last granted */
+  int lifetime_sec;   /* Lifetime requested on every renewal */
+  int failures;       /* Failed renewals in a row */
+  int batch_ret;      /* Result of a batch renewal not reported yet */
+  void *user;         /* Caller data */
+} pmap_lease_t;
+
+/**
+ * Renewal engine. It has no thread, the caller sleeps until
+ * 'pmap_renew_next' and then calls 'pmap_renew_run'.
+ */
+typedef struct pmap_renew_t_ {
+  pmap_ctx_t *ctx;
+  pmap_wheel_t wheel;
+  int fraction_num;
+  int fraction_den;
+  int jitter_pct;
+  int batch_ms;
+  uint32_t seed; /* Jitter PRNG state */
+  pmap_renew_cb cb;
+  void *cb_arg;
+  pmap_lease_t *releasing; /* Freed after its callback, see 'pmap_renew_cb' */
+} pmap_renew_t;
+
+pmap_renew_t *pmap_renew_create(pmap_ctx_t *ctx, pmap_renew_cb cb, void *arg);
+void pmap_renew_destroy(pmap_renew_t *rn);
+void pmap_renew_config(pmap_renew_t *rn, int fraction_num, int fraction_den,
+                       int jitter_pct, int batch_ms);
+pmap_lease_t *pmap_renew_add(pmap_renew_t *rn, const pmap_field_t *pfield);
+pmap_lease_t *pmap_renew_resume(pmap_renew_t *rn, const pmap_field_t *pfield,
+                                int remain_sec);
+void pmap_renew_remove(pmap_renew_t *rn, pmap_lease_t *lease);
+int pmap_renew_count(pmap_renew_t *rn);
+int64_t pmap_renew_next(pmap_renew_t *rn);
+int pmap_renew_run(pmap_renew_t *rn, int64_t now_ms);
+
+#endif // _PMAP_RENEW_H
@@ -0,0 +1,163 @@
+/*
+ *    pmap_rtt.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pmap_rtt.h"
+
+/* RFC 6298 constants, alpha = 1/8, beta = 1/4, K = 4 */
+#define RTT_ALPHA_SHIFT PMAP_RTT_SRTT_SHIFT
+#define RTT_BETA_SHIFT PMAP_RTT_RTTVAR_SHIFT
+#define RTT_K 4
+#define RTT_GRANULARITY_MS 10
+
+/* -------------------------------------------- */
+
+/**
+ * Feed a measured round trip time into the estimator.
+ *
+ * Only unambiguous samples should be fed, that is responses to requests which
+ * were not retransmitted (Karn's algorithm).
+ *
+ * @param rtt The estimator.
+ * @param rtt_ms The measured round trip time in milliseconds.
+ */
+void pmap_rtt_sample(pmap_rtt_t *rtt, int rtt_ms) {
+
+  if (rtt_ms < 0) {
+    return;
+  }
+
+  if (rtt->samples == 0) {
+    /* SRTT = R, RTTVAR = R / 2 */
+    rtt->srtt = rtt_ms << RTT_ALPHA_SHIFT;
+    rtt->rttvar = (rtt_ms << RTT_BETA_SHIFT) / 2;
+  } else {
+    /* RTTVAR += beta * (|SRTT - R| - RTTVAR), SRTT += alpha * (R - SRTT) */
+    int delta = rtt_ms - (rtt->srtt >> RTT_ALPHA_SHIFT);
+    rtt->srtt += delta;
+    if (delta < 0) {
+      delta = -delta;
+    }
+    rtt->rttvar += delta - (rtt->rttvar >> RTT_BETA_SHIFT);
+  }
+
+  rtt->samples++;
+}
+
+/**
+ * Forget the estimate after a timeout, the next operation uses the default
+ * timeout again instead of a (too short) estimate of a path that changed.
+ *
+ * @param rtt The estimator.
+ */
+void pmap_rtt_timeout(pmap_rtt_t *rtt) {
+
+  rtt->srtt = 0;
+  rtt->rttvar = 0;
+  rtt->samples = 0;
+}
+
+/**
+ * The smoothed round trip time.
+ *
+ * @param rtt The estimator.
+ * @return SRTT in milliseconds, 0 while there is no sample.
+ */
+int pmap_rtt_srtt_ms(const pmap_rtt_t *rtt) {
+
+  return rtt->srtt >> RTT_ALPHA_SHIFT;
+}
+
+/**
+ * Compute the timeout, SRTT + max(G, K * RTTVAR), clamped to
+ * [floor_ms, ceil_ms].
+ *
+ * @param rtt The estimator.
+ * @param def_ms The timeout to use while there is no sample.
+ * @param floor_ms The lower bound.
+ * @param ceil_ms The upper bound.
+ * @return The timeout in milliseconds.
+ */
+int pmap_rtt_rto(const pmap_rtt_t *rtt, int def_ms, int floor_ms,
+                 int ceil_ms) {
+
+  int rto = def_ms; // No sample, the bounds still apply
+
+  if (rtt != NULL && rtt->samples > 0) {
+    /* K * RTTVAR, K = 4 is the scale of `rttvar` */
+    int var = (RTT_K * rtt->rttvar) >> RTT_BETA_SHIFT;
+    rto = ((rtt->srtt + (1 << RTT_ALPHA_SHIFT) - 1) >> RTT_ALPHA_SHIFT) +
+          ((var > RTT_GRANULARITY_MS) ? var : RTT_GRANULARITY_MS);
+  }
+
+  if (rto < floor_ms) {
+    rto = floor_ms;
+  } else if (rto > ceil_ms) {
+    rto = ceil_ms;
+  }
+
+  return rto;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Fill a timeout set with the historic fixed values.
+ *
+ * @param tmo The timeouts to be filled.
+ */
+void pmap_tmo_default(pmap_tmo_t *tmo) {
+
+  tmo->discovery_ms = PMAP_TMO_DISCOVERY_DEF;
+  tmo->connect_ms = PMAP_TMO_CONNECT_DEF;
+  tmo->response_ms = PMAP_TMO_RESPONSE_DEF;
+  tmo->retransmit_ms = PMAP_TMO_RETRANSMIT_DEF;
+}
+
+/**
+ * Derive the timeouts of an operation from the estimators of a gateway. The
+ * M-SEARCH window is set by PMAP_SSDP_MX instead.
+ *
+ * @param rtt Array of PMAP_RTT_MAX estimators.
+ * @param floor The lower bounds.
+ * @param ceil The upper bounds.
+ * @param tmo The timeouts to be filled.
+ */
+void pmap_tmo_estimate(const pmap_rtt_t *rtt, const pmap_tmo_t *floor,
+                       const pmap_tmo_t *ceil, pmap_tmo_t *tmo) {
+
+  /* A device delays its M-SEARCH response at random up to MX seconds, so
+     the time to the response is no round trip: the window covers MX */
+  tmo->discovery_ms =
+      pmap_rtt_rto(NULL, PMAP_SSDP_MX * 1000 + PMAP_SSDP_SLACK_MS,
+                   floor->discovery_ms, ceil->discovery_ms);
+  tmo->connect_ms = pmap_rtt_rto(&rtt[PMAP_RTT_HTTP], PMAP_TMO_CONNECT_DEF,
+                                 floor->connect_ms, ceil->connect_ms);
+  tmo->response_ms = pmap_rtt_rto(&rtt[PMAP_RTT_HTTP], PMAP_TMO_RESPONSE_DEF,
+                                  floor->response_ms, ceil->response_ms);
+  tmo->retransmit_ms =
+      pmap_rtt_rto(&rtt[PMAP_RTT_NPMP], PMAP_TMO_RETRANSMIT_DEF,
+                   floor->retransmit_ms, ceil->retransmit_ms);
+}
@@ -0,0 +1,60 @@
+/*
+ *    pmap_rtt.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_RTT_H
+#define _PMAP_RTT_H
+
+#include <stdint.h>
+
+#include "pmap_cfg.h"
+
+/* Estimators kept per gateway */
+#define PMAP_RTT_NPMP 0 /* NAT-PMP request => response */
+#define PMAP_RTT_SSDP 1 /* Unused, see 'pmap_tmo_estimate' (file layout) */
+#define PMAP_RTT_HTTP 2 /* SOAP request => response, connect included */
+#define PMAP_RTT_MAX 3
+
+/* Fixed point of the estimator, as in TCP implementations of RFC 6298 */
+#define PMAP_RTT_SRTT_SHIFT 3   /* srtt in 1/8 ms */
+#define PMAP_RTT_RTTVAR_SHIFT 2 /* rttvar in 1/4 ms */
+
+/**
+ * Round trip time estimator in the style of TCP (RFC 6298). The smoothed RTT
+ * and the RTT variance are scaled by 1/alpha and 1/beta, so the updates keep
+ * the fractions an integer shift of the unscaled values would lose.
+ */
+typedef struct pmap_rtt_t_ {
+  int srtt;   /* 8 * SRTT in milliseconds */
+  int rttvar; /* 4 * RTTVAR in milliseconds */
+  int samples;
+} pmap_rtt_t;
+
+void pmap_rtt_sample(pmap_rtt_t *rtt, int rtt_ms);
+void pmap_rtt_timeout(pmap_rtt_t *rtt);
+int pmap_rtt_srtt_ms(const pmap_rtt_t *rtt);
+int pmap_rtt_rto(const pmap_rtt_t *rtt, int def_ms, int floor_ms, int ceil_ms);
+void pmap_tmo_default(pmap_tmo_t *tmo);
+void pmap_tmo_estimate(const pmap_rtt_t *rtt, const pmap_tmo_t *floor,
+                       const pmap_tmo_t *ceil, pmap_tmo_t *tmo);
+
+#endif // _PMAP_RTT_H
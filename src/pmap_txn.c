@@ -0,0 +1,409 @@
+/*
+ *    pmap_txn.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pmap.h"
+#include "pmap_async.h"
+#include "pmap_debug.h"
+#include "pmap_engine.h"
+#include "pmap_txn.h"
+#include "util.h"
+
+static void _pmap_txn_done(pmap_aop_t *op, void *arg);
+
+/* -------------------------------------------- */
+
+/**
+ * Record the failure of an add. The first one fails the transaction: the
+ * adds still waiting for admission are dropped, nothing was sent for them.
+ */
+static void _pmap_txn_fail(pmap_txn_t *txn, int index, int err,
+                           const char *error) {
+
+  txn->status[index] = PMAP_TXN_FAILED;
+  if (txn->failed >= 0) {
+    return;
+  }
+
+  txn->failed = index;
+  txn->err = err;
+  if (NULL != error && error[0] != 0) {
+    snprintf(txn->error, sizeof(txn->error), "%s", error);
+  } else {
+    const char *msg = pmap_ut_strerror(err);
+    snprintf(txn->error, sizeof(txn->error), "%s", msg ? msg : strerror(err));
+  }
+
+  for (int i = 0; i < txn->count; i++) {
+    pmap_txn_child_t *child = &txn->children[i];
+    if (NULL != child->op && child->op->state == PMAP_AOP_ST_QUEUED) {
+      pmap_async_cancel(child->op);
+      child->op = NULL;
+      txn->pending--;
+      txn->status[i] = PMAP_TXN_SKIPPED;
+    }
+  }
+}
+
+/**
+ * Start every add at once, a failure to start one skips the others.
+ */
+static void _pmap_txn_add(pmap_txn_t *txn) {
+
+  for (int i = 0; i < txn->count; i++) {
+    pmap_txn_child_t *child = &txn->children[i];
+
+    if (txn->failed >= 0) {
+      txn->status[i] = PMAP_TXN_SKIPPED;
+      continue;
+    }
+
+    child->op = pmap_addport_async(txn->ctx, &txn->fields[i], _pmap_txn_done,
+                                   child);
+    if (NULL == child->op) {
+      _pmap_txn_fail(txn, i, errno, NULL);
+    } else {
+      txn->pending++;
+    }
+  }
+}
+
+/**
+ * Delete every mapping added, all at once. So are the adds that got no
+ * answer, the gateway may have applied them.
+ */
+static void _pmap_txn_rollback(pmap_txn_t *txn) {
+
+  txn->rollback = 1;
+
+  for (int i = 0; i < txn->count; i++) {
+    pmap_txn_child_t *child = &txn->children[i];
+
+    if (txn->status[i] != PMAP_TXN_MAPPED && !child->unsure) {
+      continue;
+    }
+
+    child->op = pmap_delport_async(txn->ctx, &txn->fields[i], _pmap_txn_done,
+                                   child);
+    if (NULL == child->op) {
+      txn->status[i] = PMAP_TXN_LEFT;
+    } else {
+      txn->pending++;
+    }
+  }
+}
+
+/**
+ * Move to the next phase once every operation of the current one is back:
+ * rollback after a failed add, then the callback.
+ */
+static void _pmap_txn_next(pmap_txn_t *txn) {
+
+  if (txn->pending > 0) {
+    return;
+  }
+
+  if (txn->failed >= 0 && !txn->rollback) {
+    _pmap_txn_rollback(txn);
+    if (txn->pending > 0) {
+      return;
+    }
+  }
+
+  txn->ret = (txn->failed >= 0) ? 1 : 0;
+  if (NULL != txn->cb) {
+    txn->cb(txn, txn->arg);
+  }
+
+  free(txn->children);
+  free(txn);
+}
+
+/**
+ * Completion of a discovery, an add or a rollback delete.
+ */
+static void _pmap_txn_done(pmap_aop_t *op, void *arg) {
+
+  pmap_txn_child_t *child = arg;
+  pmap_txn_t *txn = child->txn;
+  int i = child->index;
+
+  child->op = NULL;
+  txn->pending--;
+
+  if (child - txn->children >= txn->count) {
+    if (txn->pending == 0) {
+      _pmap_txn_add(txn); // Every gateway known, or known not to answer
+    }
+  } else if (txn->rollback) {
+    /* NoSuchEntryInArray, the mapping is not there either */
+    if (op->status == 0 || op->upnp_error == PMAP_UPNP_ERR_NO_SUCH_ENTRY) {
+      txn->status[i] = child->unsure ? PMAP_TXN_FAILED : PMAP_TXN_UNDONE;
+    } else {
+      txn->status[i] = PMAP_TXN_LEFT;
+      PMAP_DEBUG_ERROR("Rollback of port %d failed: %s",
+                       txn->fields[i].external_port, op->error);
+    }
+  } else if (op->status == 0) {
+    txn->fields[i] = op->field; // NAT-PMP may grant another port
+    txn->status[i] = PMAP_TXN_MAPPED;
+  } else {
+    child->unsure = pmap_ut_unsure(op->err);
+    _pmap_txn_fail(txn, i, op->err, op->error);
+  }
+
+  _pmap_txn_next(txn);
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Add a set of mappings, all of them or none. The adds are sent at once,
+ * each over its own exchange. If one fails, the adds not sent yet are
+ * dropped and the mappings already added are deleted, again all at once.
+ * So are the adds that failed without an answer (timeout, connection
+ * reset): the gateway may have applied them.
+ * A gateway whose protocol is not known yet is discovered first, once, so
+ * that the adds don't race the protocols each.
+ *
+ * Driven by 'pmap_process' like the other asynchronous operations.
+ *
+ * @param ctx The client context.
+ * @param pfields The mappings, as for 'pmap_addport' (gateway_ip may
+ * differ between them). Updated with what was granted.
+ * @param status Receives the PMAP_TXN_* of each mapping.
+ * @param count The number of mappings.
+ * @param cb Called by 'pmap_process' when done, `txn->ret` is 0 if every
+ * mapping is in place, 1 if the transaction was rolled back.
+ * @param arg Passed to `cb`.
+ * @return The transaction, valid until `cb` returns, `pfields` and `status`
+ * must stay valid as long. NULL if no add could be started: `status` tells
+ * why (errno is set, nothing was added).
+ */
+pmap_txn_t *pmap_addport_txn_async(pmap_ctx_t *ctx, pmap_field_t *pfields,
+                                   int *status, int count, pmap_txn_cb cb,
+                                   void *arg) {
+
+  if (count <= 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  pmap_txn_t *txn = calloc(1, sizeof(pmap_txn_t));
+  pmap_txn_child_t *children = calloc(2 * count, sizeof(pmap_txn_child_t));
+  if (NULL == txn || NULL == children) {
+    free(txn);
+    free(children);
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  txn->ctx = ctx;
+  txn->fields = pfields;
+  txn->status = status;
+  txn->count = count;
+  txn->cb = cb;
+  txn->arg = arg;
+  txn->failed = -1;
+  txn->children = children;
+  for (int i = 0; i < 2 * count; i++) {
+    children[i].txn = txn;
+    children[i].index = i % count;
+  }
+
+  for (int i = 0; i < count; i++) {
+    status[i] = PMAP_TXN_SKIPPED;
+
+    pmap_gw_t *gw = pmap_ctx_gateway(ctx, pfields[i].gateway_ip);
+    if (NULL == gw || pmap_gw_protocol(ctx, gw, NULL) != PMAP_PROTO_NONE) {
+      continue; // Out of memory is reported by the add
+    }
+
+    int seen = 0;
+    for (int j = 0; j < i && !seen; j++) {
+      seen = (pfields[j].gateway_ip == pfields[i].gateway_ip);
+    }
+    if (seen) {
+      continue;
+    }
+
+    pmap_txn_child_t *child = &children[count + txn->discoveries++];
+    child->index = i;
+    child->op = pmap_discover_async(ctx, pfields[i].gateway_ip,
+                                    _pmap_txn_done, child);
+    if (NULL != child->op) {
+      txn->pending++;
+    }
+  }
+
+  if (txn->pending == 0) {
+    _pmap_txn_add(txn);
+  }
+
+  if (txn->pending == 0) {
+    errno = txn->err; // Nothing started, so nothing added
+    free(children);
+    free(txn);
+    return NULL;
+  }
+
+  return txn;
+}
+
+/**
+ * Result of a blocking transaction.
+ */
+typedef struct _pmap_txn_wait_ {
+  int done;
+  int ret;
+  int err;
+  char error[64];
+} _pmap_txn_wait;
+
+static void _pmap_txn_wake(pmap_txn_t *txn, void *arg) {
+
+  _pmap_txn_wait *wait = arg;
+
+  wait->done = 1;
+  wait->ret = txn->ret;
+  wait->err = txn->err;
+  memcpy(wait->error, txn->error, sizeof(wait->error));
+}
+
+/**
+ * Run a transaction on the calling thread, which must be the one driving
+ * the asynchronous operations of the context.
+ */
+static int _pmap_txn_run(pmap_ctx_t *ctx, pmap_field_t *pfields, int count,
+                         int *status, _pmap_txn_wait *wait) {
+
+  int max = 0;
+  struct pollfd *fds = NULL;
+  int64_t deadline_ms;
+
+  if (NULL == pmap_addport_txn_async(ctx, pfields, status, count,
+                                     _pmap_txn_wake, wait)) {
+    wait->err = errno;
+    return 1;
+  }
+
+  while (!wait->done) {
+    int n = pmap_fds(ctx, fds, max, &deadline_ms);
+    if (n > max) {
+      struct pollfd *more = realloc(fds, n * sizeof(struct pollfd));
+      if (NULL == more) {
+        n = max; // The others are polled on a later round
+      } else {
+        fds = more;
+        max = n;
+        n = pmap_fds(ctx, fds, max, &deadline_ms);
+      }
+    }
+
+    int64_t now = pmap_ut_now_ms();
+    int tmo = -1;
+    if (deadline_ms >= 0) {
+      tmo = (deadline_ms > now) ? (int)(deadline_ms - now) : 0;
+    }
+
+    int ret = poll(fds, n, tmo);
+    pmap_process(ctx, fds, (ret > 0) ? n : 0, pmap_ut_now_ms());
+  }
+
+  free(fds);
+
+  return wait->ret;
+}
+
+/**
+ * Add a set of mappings, all of them or none, and wait for the result. See
+ * 'pmap_addport_txn_async': the total time is about one round trip to the
+ * gateway, two when the transaction is rolled back.
+ *
+ * With an I/O engine on the context ('pmap_engine_create') the transaction
+ * runs on the engine thread, otherwise on the calling thread: no other
+ * thread may drive the asynchronous operations of the context meanwhile.
+ *
+ * @param ctx The client context.
+ * @param pfields The mappings, updated with what was granted.
+ * @param count The number of mappings.
+ * @param status Receives the PMAP_TXN_* of each mapping.
+ * @param error Receives the first error.
+ * @param size The size of `error`.
+ * @return 0 if every mapping is in place, 1 on failure (caller should check
+ * errno value): every mapping added was deleted again, but for those in
+ * PMAP_TXN_LEFT state.
+ */
+int pmap_addport_txn(pmap_ctx_t *ctx, pmap_field_t *pfields, int count,
+                     int *status, char *error, int size) {
+
+  _pmap_txn_wait wait;
+  int ret;
+
+  memset(&wait, 0x00, sizeof(wait));
+
+  if (NULL != ctx->engine) {
+    pmap_engine_req_t req;
+    pmap_engine_req_t *done;
+    pmap_engine_cq_t *cq = pmap_engine_cq_create();
+
+    memset(&req, 0x00, sizeof(req));
+    req.action = PMAP_ENGINE_TXN;
+    req.fields = pfields;
+    req.statuses = status;
+    req.count = count;
+    if (NULL == cq || pmap_engine_submit(ctx->engine, cq, &req) != 0) {
+      wait.err = errno;
+      ret = 1;
+    } else {
+      pmap_engine_reap(cq, &done, 1, -1);
+      ret = req.status;
+      wait.err = req.err;
+      memcpy(wait.error, req.error, sizeof(wait.error));
+    }
+    pmap_engine_cq_destroy(cq);
+  } else {
+    ret = _pmap_txn_run(ctx, pfields, count, status, &wait);
+  }
+
+  if (ret != 0) {
+    if (wait.error[0] == 0) {
+      const char *msg = pmap_ut_strerror(wait.err);
+      snprintf(wait.error, sizeof(wait.error), "%s",
+               msg ? msg : strerror(wait.err));
+    }
+    snprintf(error, size, "%s", wait.error);
+    PMAP_DEBUG_ERROR("Transaction of %d mappings failed: %s", count,
+                     wait.error);
+    errno = wait.err;
+  }
+
+  return ret;
+}
@@ -0,0 +1,88 @@
+/*
+ *    pmap_txn.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_TXN_H
+#define _PMAP_TXN_H
+
+#include <stdint.h>
+
+#include "pmap.h"
+#include "pmap_async.h"
+#include "pmap_cfg.h"
+
+/* What became of a mapping of a transaction (status[i]) */
+#define PMAP_TXN_MAPPED 0  /* Added, and kept unless the transaction failed */
+#define PMAP_TXN_FAILED 1  /* The add failed, nothing was left behind */
+#define PMAP_TXN_SKIPPED 2 /* Not sent, another add failed first */
+#define PMAP_TXN_UNDONE 3  /* Added, then deleted by the rollback */
+#define PMAP_TXN_LEFT 4    /* Added or maybe added (add not answered), the
+                              rollback delete failed too */
+
+typedef struct pmap_txn_t_ pmap_txn_t;
+
+/**
+ * Completion callback, called from 'pmap_process' once the transaction is
+ * committed or rolled back. The transaction is freed when it returns.
+ */
+typedef void (*pmap_txn_cb)(pmap_txn_t *txn, void *arg);
+
+/**
+ * Asynchronous operation of one mapping of a transaction.
+ */
+typedef struct pmap_txn_child_t_ {
+  pmap_txn_t *txn;
+  int index;       /* Mapping, first one of the gateway for a discovery */
+  pmap_aop_t *op;  /* NULL once called back or cancelled */
+  int unsure;      /* The add failed without an answer, it may be applied */
+} pmap_txn_child_t;
+
+/**
+ * All-or-nothing set of mappings. The fields from `ret` to `failed` are the
+ * result, the others are private.
+ */
+struct pmap_txn_t_ {
+  pmap_ctx_t *ctx;
+  pmap_field_t *fields; /* Caller's, updated as by 'pmap_addport' */
+  int *status;          /* Caller's, PMAP_TXN_* of each mapping */
+  int count;
+  pmap_txn_cb cb;
+  void *arg;            /* Caller data, passed to `cb` */
+
+  int ret;              /* 0 all mapped, 1 rolled back (see `status`) */
+  int err;              /* errno of the first failure */
+  char error[64];
+  int failed;           /* Mapping that failed first, -1 if none */
+
+  pmap_txn_child_t *children; /* One per mapping, then the discoveries */
+  int discoveries;
+  int pending;          /* Operations not called back yet */
+  int rollback;         /* Deleting the mappings added */
+};
+
+pmap_txn_t *pmap_addport_txn_async(pmap_ctx_t *ctx, pmap_field_t *pfields,
+                                   int *status, int count, pmap_txn_cb cb,
+                                   void *arg);
+int pmap_addport_txn(pmap_ctx_t *ctx, pmap_field_t *pfields, int count,
+                     int *status, char *error, int size);
+
+#endif // _PMAP_TXN_H
@@ -21,16 +21,23 @@
  *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
  */
 
+#ifdef LINUX
+#define _GNU_SOURCE /* recvmmsg() */
+#endif
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -39,6 +46,7 @@
 #include "http.h"
 #include "pmap_debug.h"
 #include "pmap_upnp.h"
+#include "pmap_xml.h"
 #include "upnp_msg.h"
 #include "util.h"
 
@@ -59,52 +67,222 @@ uint8_t pmap_debug = false;
 void pmap_set_debug(uint8_t debug) {
 
   /* This global variable - false mean disable debug, true enable */
-  pmap_debug = debug;
+  __atomic_store_n(&pmap_debug, debug, __ATOMIC_RELAXED);
 }
 
 /* -------------------------------------------- */
 
 /**
- * Discover UPnP devices in the local network and filter Internet Gateway
- * Devices (IGDs).
+ * Receive ring, PMAP_SSDP_BATCH preallocated datagram slots filled by one
+ * recvmmsg() call (or a non-blocking recvfrom() drain where recvmmsg() is not
+ * available).
+ */
+typedef struct pmap_ssdp_ring_t_ {
+  char *data; /* PMAP_SSDP_BATCH slots of PMAP_SSDP_DGRAM_LEN + 1 bytes */
+  int len[PMAP_SSDP_BATCH];
+  struct sockaddr_in addr[PMAP_SSDP_BATCH];
+#ifdef LINUX
+  struct mmsghdr msgs[PMAP_SSDP_BATCH];
+  struct iovec iov[PMAP_SSDP_BATCH];
+#endif
+} pmap_ssdp_ring_t;
+
+#define PMAP_SSDP_SLOT(ring, i) ((ring)->data + (i) * (PMAP_SSDP_DGRAM_LEN + 1))
+
+/* -------------------------------------------- */
+
+static pmap_ssdp_ring_t *_pmap_ssdp_ring_create(void) {
+
+  pmap_ssdp_ring_t *ring = calloc(1, sizeof(pmap_ssdp_ring_t));
+  if (NULL == ring) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  ring->data = calloc(PMAP_SSDP_BATCH, PMAP_SSDP_DGRAM_LEN + 1);
+  if (NULL == ring->data) {
+    errno = ENOMEM;
+    free(ring);
+    return NULL;
+  }
+
+#ifdef LINUX
+  for (int i = 0; i < PMAP_SSDP_BATCH; i++) {
+    ring->iov[i].iov_base = PMAP_SSDP_SLOT(ring, i);
+    ring->iov[i].iov_len = PMAP_SSDP_DGRAM_LEN;
+    ring->msgs[i].msg_hdr.msg_iov = &ring->iov[i];
+    ring->msgs[i].msg_hdr.msg_iovlen = 1;
+    ring->msgs[i].msg_hdr.msg_name = &ring->addr[i];
+  }
+#endif
+
+  return ring;
+}
+
+static void _pmap_ssdp_ring_destroy(pmap_ssdp_ring_t *ring) {
+
+  if (NULL != ring) {
+    free(ring->data);
+    free(ring);
+  }
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Wait up to `timeout_ms` for datagrams and receive as many as fit into the
+ * ring with a single syscall.
  *
- * This function initiates the discovery of UPnP devices within the local
- * network by broadcasting an M-SEARCH message via UDP to the multicast address
- * 239.255.255.250. The discovered devices, including Internet Gateway Devices
- * (IGDs) and other devices, are filtered and identified based on their
- * response.
+ * @return Number of datagrams received, 0 on timeout, -1 on error.
+ */
+static int _pmap_ssdp_recv(int sockfd, pmap_ssdp_ring_t *ring,
+                           int timeout_ms) {
+
+  fd_set read_fds;
+  struct timeval tv;
+  int n = 0;
+
+  FD_ZERO(&read_fds);
+  FD_SET(sockfd, &read_fds);
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+  int ready = select(sockfd + 1, &read_fds, NULL, NULL, &tv);
+  if (ready <= 0) {
+    if (ready < 0) {
+      PMAP_DEBUG_ERROR("select() %s", strerror(errno));
+    }
+    return ready;
+  }
+
+#ifdef LINUX
+  for (int i = 0; i < PMAP_SSDP_BATCH; i++) {
+    ring->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  }
+
+  n = recvmmsg(sockfd, ring->msgs, PMAP_SSDP_BATCH, MSG_DONTWAIT, NULL);
+  if (n < 0) {
+    PMAP_DEBUG_ERROR("recvmmsg() %s", strerror(errno));
+    return -1;
+  }
+
+  for (int i = 0; i < n; i++) {
+    ring->len[i] = ring->msgs[i].msg_len;
+  }
+#else
+  while (n < PMAP_SSDP_BATCH) {
+    socklen_t ca_size = sizeof(struct sockaddr_in);
+    int len = recvfrom(sockfd, PMAP_SSDP_SLOT(ring, n), PMAP_SSDP_DGRAM_LEN,
+                       MSG_DONTWAIT, (struct sockaddr *)&ring->addr[n],
+                       &ca_size);
+    if (len < 0) {
+      break; // EWOULDBLOCK, socket drained
+    }
+    ring->len[n++] = len;
+  }
+#endif
+
+  return n;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Find a header in an SSDP response, header names are case-insensitive.
  *
- * @param urls A pointer to a pointer for storing the list of discovered and
- * filtered UPnP devices.
- * @param only_igds Set to 1 to filter and retrieve only Internet Gateway
- * Devices (IGDs).
- * @return 0 on success, 1 on failure.
+ * @return Pointer to the (left trimmed) header value or NULL.
  */
-int pmap_list_upnp(pmap_url_comp_t **urls, uint8_t only_igds) {
+static const char *_pmap_ssdp_header(const char *msg, const char *name) {
+
+  size_t nlen = strlen(name);
+
+  for (const char *line = msg; line != NULL && *line != '\0';) {
+    if (strncasecmp(line, name, nlen) == 0 && line[nlen] == ':') {
+      line += nlen + 1;
+      while (*line == ' ' || *line == '\t') {
+        line++;
+      }
+      return line;
+    }
+    line = strchr(line, '\n');
+    if (line != NULL) {
+      line++;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Cheap checks done before any URL parsing or HTTP request. Drops error
+ * responses, responses from other hosts than `gateway_ip` (if set), responses
+ * without LOCATION and, when only IGDs are wanted, responses that announce a
+ * device type other than InternetGatewayDevice.
+ *
+ * @return 1 to keep the datagram, 0 to drop it.
+ */
+static int _pmap_ssdp_prefilter(const char *msg, int len,
+                                const struct sockaddr_in *src,
+                                uint32_t gateway_ip, uint8_t only_igds) {
+
+  if (len < 12 || strncmp(msg, "HTTP/1.1 200", 12) != 0) {
+    return 0;
+  }
+
+  if (gateway_ip != INADDR_ANY && src->sin_addr.s_addr != gateway_ip) {
+    return 0;
+  }
+
+  if (_pmap_ssdp_header(msg, "LOCATION") == NULL) {
+    return 0;
+  }
+
+  if (only_igds) {
+    const char *st = _pmap_ssdp_header(msg, "ST");
+    const char *eol = (st != NULL) ? strchr(st, '\r') : NULL;
+    if (st != NULL && eol != NULL) {
+      const char *dev = strstr(st, ":device:");
+      if (dev != NULL && dev < eol &&
+          strncmp(dev + 8, "InternetGatewayDevice", 21) != 0) {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Create the SSDP socket and multicast the M-SEARCH request.
+ *
+ * The socket gets a PMAP_SSDP_RCVBUF receive buffer, responses are read with
+ * pmap_ssdp_read() or by the discovery functions.
+ *
+ * @return The socket file descriptor, or -1 on error (errno is set).
+ */
+int pmap_ssdp_search(void) {
 
   int sockfd = 0;
   struct sockaddr_in igds;
-  struct sockaddr_in client;
-  uint32_t ca_size = sizeof(client);
-  int len;
-
-  pmap_url_comp_t *url_comp = *urls = NULL;
-  pmap_url_comp_t *head = NULL;
 
   /*
    * Create a datagram(UDP) socket in the internet domain
    */
   if ((sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
     PMAP_DEBUG_ERROR("socket() %s", strerror(errno));
-    return 1;
+    return -1;
   }
 
-  struct timeval tv;
-  tv.tv_sec = PMAP_DEFAULT_WAIT_TIMEOUT;
-  tv.tv_usec = 0;
-  if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+  /**
+   * Responses arrive in bursts within the MX window, a large receive buffer
+   * keeps the kernel from dropping them while we are busy. The kernel may
+   * clamp the value (net.core.rmem_max), that is not an error.
+   */
+  int rcvbuf = PMAP_SSDP_RCVBUF;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
     PMAP_DEBUG_ERROR("setsockopt() %s", strerror(errno));
-    return 1;
   }
 
   /**
@@ -117,7 +295,7 @@ int pmap_list_upnp(pmap_url_comp_t **urls, uint8_t only_igds) {
   igds.sin_addr.s_addr = inet_addr("239.255.255.250");
 
   PMAP_DEBUG_LOG("M-SEARCH REQUEST: =>>>\n%s\n", m_search);
-  if (pmap_debug) {
+  if (PMAP_DEBUG_DUMP()) {
     PMAP_RUNTIME_LOG("M-SEARCH REQUEST: =>>>\n%s\n", m_search);
   }
 
@@ -125,92 +303,211 @@ int pmap_list_upnp(pmap_url_comp_t **urls, uint8_t only_igds) {
   if (sendto(sockfd, m_search, (strlen(m_search)), 0, (struct sockaddr *)&igds,
              sizeof(igds)) < 0) {
     PMAP_DEBUG_ERROR("sendto() %s", strerror(errno));
+    close(sockfd);
+    return -1;
+  }
+
+  return sockfd;
+}
+
+/**
+ * Read the pending M-SEARCH responses without blocking and return the
+ * location of the first one sent by `gateway_ip`.
+ *
+ * @param sockfd Socket returned by pmap_ssdp_search().
+ * @param gateway_ip The gateway address, network byte order.
+ * @return The parsed location, or NULL if no matching response is pending.
+ * The caller is responsible for freeing it with 'pmap_ut_free_url'.
+ */
+pmap_url_comp_t *pmap_ssdp_read(int sockfd, uint32_t gateway_ip) {
+
+  char msg[PMAP_SSDP_DGRAM_LEN + 1];
+  struct sockaddr_in client;
+  socklen_t ca_size;
+  int len;
+
+  while (true) {
+    ca_size = sizeof(client);
+    if ((len = recvfrom(sockfd, msg, PMAP_SSDP_DGRAM_LEN, MSG_DONTWAIT,
+                        (struct sockaddr *)&client, &ca_size)) < 0) {
+      return NULL; // Drained
+    }
+    msg[len] = 0;
+
+    PMAP_DEBUG_LOG("M-SEARCH RESPONSE: =>>>\n%s\n", msg);
+    if (PMAP_DEBUG_DUMP()) {
+      PMAP_RUNTIME_LOG("M-SEARCH RESPONSE: =>>>\n%s\n", msg);
+    }
+
+    if (!_pmap_ssdp_prefilter(msg, len, &client, gateway_ip, false)) {
+      continue;
+    }
+
+    const char *location = _pmap_ssdp_header(msg, "LOCATION");
+    char tmp[128];
+    int loc_len = strcspn(location, "\r\n");
+    if (loc_len < (int)sizeof(tmp)) {
+      memcpy(tmp, location, loc_len);
+      tmp[loc_len] = 0;
+      pmap_url_comp_t *url_comp = pmap_ut_parse_url(tmp);
+      if (NULL != url_comp) {
+        return url_comp;
+      }
+    }
+  }
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Discovery worker of pmap_list_upnp(), optionally restricted to responses
+ * sent by `gateway_ip` (INADDR_ANY for all hosts).
+ */
+static int _pmap_list_upnp(pmap_url_comp_t **urls, uint8_t only_igds,
+                           uint32_t gateway_ip) {
+
+  int sockfd = 0;
+  int count = 0;
+
+  pmap_url_comp_t *url_comp = *urls = NULL;
+  pmap_url_comp_t *head = NULL;
+
+  if ((sockfd = pmap_ssdp_search()) < 0) {
     return 1;
   }
-  pbuffer_t *pbfr = pbfr_create(1024);
+
+  pmap_ssdp_ring_t *ring = _pmap_ssdp_ring_create();
+  if (NULL == ring) {
+    close(sockfd);
+    return 1;
+  }
+
+  /**
+   * Wait until PMAP_DEFAULT_WAIT_TIMEOUT of silence, but never longer than
+   * PMAP_SSDP_MAX_WAIT in total so a chatty device can't keep us here.
+   */
+  int64_t deadline = pmap_ut_now_ms() + PMAP_SSDP_MAX_WAIT * 1000;
 
   while (true) {
 
-    /* Receive M-SEARCH response */
-    if ((len = recvfrom(sockfd, pbfr->buffer, pbfr->size, 0,
-                        (struct sockaddr *)&client, &ca_size)) > 0) {
+    int64_t remain = deadline - pmap_ut_now_ms();
+    if (remain <= 0) {
+      break;
+    }
+    if (remain > PMAP_DEFAULT_WAIT_TIMEOUT * 1000) {
+      remain = PMAP_DEFAULT_WAIT_TIMEOUT * 1000;
+    }
+
+    int n = _pmap_ssdp_recv(sockfd, ring, (int)remain);
+    if (n <= 0) {
+      /* Timeout, nothing received  */
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+
+      char *msg = PMAP_SSDP_SLOT(ring, i);
+      msg[ring->len[i]] = 0;
+
+      PMAP_DEBUG_LOG("M-SEARCH RESPONSE: =>>>\n%s\n", msg);
+      if (PMAP_DEBUG_DUMP()) {
+        PMAP_RUNTIME_LOG("M-SEARCH RESPONSE: =>>>\n%s\n", msg);
+      }
 
-      pbfr->buffer[len] = 0;
+      /* Table is full, keep draining the socket but don't grow the list */
+      if (count >= PMAP_SSDP_MAX_DEVICES) {
+        continue;
+      }
 
-      PMAP_DEBUG_LOG("M-SEARCH RESPONSE: =>>>\n%s\n", pbfr->buffer);
-      if (pmap_debug) {
-        PMAP_RUNTIME_LOG("M-SEARCH RESPONSE: =>>>\n%s\n", pbfr->buffer);
+      if (!_pmap_ssdp_prefilter(msg, ring->len[i], &ring->addr[i],
+                                gateway_ip, only_igds)) {
+        continue;
       }
 
       char tmp[128];
-      if (pmap_ut_substr("LOCATION:", "\r\n", pbfr->buffer, tmp, sizeof(tmp)) ==
-          0) {
+      const char *location = _pmap_ssdp_header(msg, "LOCATION");
+      int loc_len = strcspn(location, "\r\n");
+      if (loc_len >= (int)sizeof(tmp)) {
+        continue;
+      }
+      memcpy(tmp, location, loc_len);
+      tmp[loc_len] = 0;
 
-        url_comp = pmap_ut_parse_url(tmp);
-        if (NULL != url_comp) {
-
-          /**
-           * Here we check IGD by calling HTTP get request to see device type.
-           * NOTE: this is time consuming process !
-           */
-          if (only_igds) {
-            int http_status;
-            memset(tmp, 0x00, sizeof(tmp));
-            if ((http_status = pmap_req_ctrlurl(url_comp, tmp, sizeof(tmp))) !=
-                0) {
-              /* Cleanup */
-              pmap_ut_free_url(url_comp);
-              continue;
-            } else {
-              int ctrl_url_len = strlen(tmp);
-              if (ctrl_url_len) {
-                url_comp->crtl_url = malloc(ctrl_url_len + 1);
-                strncpy(url_comp->crtl_url, tmp, ctrl_url_len);
-                url_comp->crtl_url[ctrl_url_len] = 0;
-              } else {
-                /* Cleanup */
-                pmap_ut_free_url(url_comp);
-                continue;
-              }
-            }
-          }
-
-          int found = 0;
-          for (pmap_url_comp_t *ucmp = *urls; ucmp != NULL; ucmp = ucmp->next) {
-            if (PMAP_COMPARE_URLCOMP(ucmp, url_comp)) {
-              found = 1;
-            }
-          }
-
-          if (!found) {
-            if (head != NULL) {
-              head->next = url_comp;
-            }
-            head = url_comp;
-            if (*urls == NULL) {
-              *urls = head;
-            }
-          } else {
-            /* Cleanup */
-            pmap_ut_free_url(url_comp);
-          }
-        } else {
-          PMAP_DEBUG_ERROR("Can't parse URL [%s]", tmp);
-          return 1;
+      url_comp = pmap_ut_parse_url(tmp);
+      if (NULL == url_comp) {
+        PMAP_DEBUG_ERROR("Can't parse URL [%s]", tmp);
+        continue;
+      }
+
+      int found = 0;
+      for (pmap_url_comp_t *ucmp = *urls; ucmp != NULL; ucmp = ucmp->next) {
+        if (PMAP_COMPARE_URLCOMP(ucmp, url_comp)) {
+          found = 1;
         }
       }
 
-    } else {
-      /* Timeout, nothing received  */
-      break;
+      if (found) {
+        /* Cleanup */
+        pmap_ut_free_url(url_comp);
+        continue;
+      }
+
+      /**
+       * Here we check IGD by calling HTTP get request to see device type.
+       * NOTE: this is time consuming process !
+       */
+      if (only_igds) {
+        memset(tmp, 0x00, sizeof(tmp));
+        if (pmap_req_ctrlurl(url_comp, tmp, sizeof(tmp), NULL) != 0 ||
+            strlen(tmp) == 0) {
+          /* Cleanup */
+          pmap_ut_free_url(url_comp);
+          continue;
+        }
+        url_comp->crtl_url = strdup(tmp);
+      }
+
+      if (head != NULL) {
+        head->next = url_comp;
+      }
+      head = url_comp;
+      if (*urls == NULL) {
+        *urls = head;
+      }
+      count++;
     }
   }
 
-  pbfr_destroy(pbfr);
+  _pmap_ssdp_ring_destroy(ring);
+  close(sockfd);
 
   return 0;
 }
 
+/**
+ * Discover UPnP devices in the local network and filter Internet Gateway
+ * Devices (IGDs).
+ *
+ * This function initiates the discovery of UPnP devices within the local
+ * network by broadcasting an M-SEARCH message via UDP to the multicast address
+ * 239.255.255.250. The discovered devices, including Internet Gateway Devices
+ * (IGDs) and other devices, are filtered and identified based on their
+ * response.
+ *
+ * Responses are received in batches (recvmmsg() on Linux) into a preallocated
+ * ring, filtered by a cheap header check before any parsing, and the list is
+ * bounded to PMAP_SSDP_MAX_DEVICES entries.
+ *
+ * @param urls A pointer to a pointer for storing the list of discovered and
+ * filtered UPnP devices.
+ * @param only_igds Set to 1 to filter and retrieve only Internet Gateway
+ * Devices (IGDs).
+ * @return 0 on success, 1 on failure.
+ */
+int pmap_list_upnp(pmap_url_comp_t **urls, uint8_t only_igds) {
+  return _pmap_list_upnp(urls, only_igds, INADDR_ANY);
+}
+
 /**
  * Discover and filter Internet Gateway Devices (IGDs) in the local network.
  *
@@ -248,6 +545,56 @@ void pmap_list_free(pmap_url_comp_t *urls) {
   }
 }
 
+/**
+ * Extract the WANIPConnection control URL and service version from a device
+ * description.
+ *
+ * @return 0 if the device is an IGD with a WANIPConnection service, 1
+ * otherwise.
+ */
+static int _pmap_upnp_desc(const char *xml, char *ctrl_url, int size,
+                           int *version) {
+
+  char tmp[128];
+
+  /* Extract Device Type from XML */
+  if (pmap_ut_substr("<deviceType>", "</deviceType>", xml, tmp,
+                     sizeof(tmp)) != 0) {
+    return 1;
+  }
+
+  /**
+   * Device type should be urn:schemas-upnp-org:device:InternetGatewayDevice:1
+   * or :2 string
+   */
+  if (strcmp(tmp, "urn:schemas-upnp-org:device:InternetGatewayDevice:1") !=
+          0 &&
+      strcmp(tmp, "urn:schemas-upnp-org:device:InternetGatewayDevice:2") !=
+          0) {
+    return 1;
+  }
+
+  PMAP_DEBUG_LOG("InternetGatewayDevice=[%s]\n", tmp);
+
+  /* WANIPConnection:2 is preferred, an IGD:2 may offer both */
+  *version = 2;
+  const char *start =
+      strstr(xml, "urn:schemas-upnp-org:service:WANIPConnection:2");
+  if (NULL == start) {
+    *version = 1;
+    start = strstr(xml, "urn:schemas-upnp-org:service:WANIPConnection:1");
+  }
+  if (NULL == start || pmap_ut_substr("<controlURL>", "</controlURL>", start,
+                                      tmp, sizeof(tmp)) != 0) {
+    return 1;
+  }
+
+  strncpy(ctrl_url, tmp, size);
+  ctrl_url[size] = 0;
+
+  return 0;
+}
+
 /**
  * Request the control URL from a UPnP device and extract it for Internet
  * Gateway Device (IGD) identification.
@@ -260,76 +607,118 @@ void pmap_list_free(pmap_url_comp_t *urls) {
  * UPnP device.
  * @param ctrl_url A buffer to store the control URL if found.
  * @param size The size of the control URL buffer.
+ * @param tmo Timeouts to use, NULL for the defaults.
  * @return 0 on success (HTTP status 200), 1 on failure.
  */
-int pmap_req_ctrlurl(pmap_url_comp_t *ucmp, char *ctrl_url, int size) {
+int pmap_req_ctrlurl(pmap_url_comp_t *ucmp, char *ctrl_url, int size,
+                     const pmap_tmo_t *tmo) {
 
-  pbuffer_t *pbfr_recv = NULL;
-  int ret = 0;
   int http_status = 0;
-
-  pbuffer_t *pbfr_tmp = pbfr_create(128);
-  if (NULL == pbfr_tmp) {
-    return http_status;
-  }
+  int version;
 
   /* Get rootDesc.xml from device to extract control endpoint */
-  pbfr_recv = pmap_http_get(ucmp->host, ucmp->port, ucmp->path, &http_status);
+  pbuffer_t *pbfr_recv =
+      pmap_http_get(ucmp->host, ucmp->port, ucmp->path, &http_status, tmo);
 
-  if (NULL == pbfr_recv) {
-    goto cleanup;
+  if (NULL != pbfr_recv &&
+      _pmap_upnp_desc(pbfr_recv->buffer, ctrl_url, size, &version) == 0) {
+    ucmp->version = version;
   }
 
-  /* Extract Device Type from XML */
-  if ((ret = pmap_ut_substr("<deviceType>", "</deviceType>", pbfr_recv->buffer,
-                            pbfr_tmp->buffer, pbfr_tmp->size)) != 0) {
-    goto cleanup;
-  }
+  pbfr_destroy(pbfr_recv);
 
-  /**
-   * Device type should be urn:schemas-upnp-org:device:InternetGatewayDevice:1
-   * string
-   */
-  if (strcmp(pbfr_tmp->buffer,
-             "urn:schemas-upnp-org:device:InternetGatewayDevice:1") != 0) {
-    goto cleanup;
-  }
+  return (http_status == 200) ? 0 : 1;
+}
 
-  PMAP_DEBUG_LOG("InternetGatewayDevice=[%s]\n", pbfr_tmp->buffer);
+/**
+ * Store the control URL and service version found in a device description
+ * (fetched by the caller) in `ucmp`.
+ *
+ * @param ucmp The device location.
+ * @param xml The device description.
+ * @return 0 if the device is an IGD with a WANIPConnection service, 1
+ * otherwise.
+ */
+int pmap_upnp_desc_parse(pmap_url_comp_t *ucmp, const char *xml) {
 
-  char *start = strstr(pbfr_recv->buffer,
-                       "urn:schemas-upnp-org:service:WANIPConnection:1");
-  if (start) {
-    if ((ret = pmap_ut_substr("<controlURL>", "</controlURL>", start,
-                              pbfr_tmp->buffer, pbfr_tmp->size)) == 0) {
-      strncpy(ctrl_url, pbfr_tmp->buffer, size);
-      ctrl_url[size] = 0;
-    }
+  char ctrl_url[128];
+  int version;
+
+  if (_pmap_upnp_desc(xml, ctrl_url, sizeof(ctrl_url) - 1, &version) != 0 ||
+      strlen(ctrl_url) == 0) {
+    return 1;
   }
 
-cleanup:
-  pbfr_destroy(pbfr_recv);
-  pbfr_destroy(pbfr_tmp);
+  free(ucmp->crtl_url);
+  if (NULL == (ucmp->crtl_url = strdup(ctrl_url))) {
+    return 1;
+  }
+  ucmp->version = version;
 
-  return (http_status == 200) ? 0 : 1;
+  return 0;
 }
 
 /**
- * Add a port mapping using UPnP.
+ * Error code of a failed UPnP action.
  *
- * This function is used to add a port mapping on a UPnP-enabled device,
- * typically a router or gateway, in the local network. It sends the UPnP action
- * to add the port mapping and checks the HTTP response status for success or
- * failure. If the operation is unsuccessful, it can provide an error
- * description if available.
+ * @param http_status The HTTP status code of the response.
+ * @param upnp_error The errorCode of the SOAP fault, 0 if none.
+ * @return EGWOVERLOAD for an HTTP 5xx without a SOAP fault (the gateway is
+ * overloaded), EUPNPFAULT otherwise.
+ */
+int pmap_upnp_errno(int http_status, int upnp_error) {
+
+  return (http_status >= 500 && upnp_error == 0) ? EGWOVERLOAD : EUPNPFAULT;
+}
+
+/**
+ * Interpret the response of a UPnP action and release it.
  *
- * @param pfield A pointer to a `pmap_field_t` structure containing the details
- * of the port mapping to be added.
+ * @param pbfr_recv The response returned by 'pmap_upnp_action' (may be NULL).
+ * @param http_status The HTTP status code of the response.
+ * @param external_ip Where NewExternalIPAddress is stored on success, NULL if
+ * the action has no output.
+ * @param esize The size of the `external_ip` character array.
  * @param error A character array where an error description will be stored in
  * case of failure.
  * @param size The size of the `error` character array.
- *
- * @return An integer representing the result of the operation.
+ * @return 0 on success (HTTP status 200), 1 on failure.
+ */
+int pmap_upnp_result(pbuffer_t *pbfr_recv, int http_status, char *external_ip,
+                     int esize, char *error, int size) {
+
+  if (pbfr_recv) {
+    if (http_status == 200) {
+      if (external_ip != NULL) {
+        pmap_ut_substr("<NewExternalIPAddress>", "</NewExternalIPAddress>",
+                       pbfr_recv->buffer, external_ip, esize);
+      }
+    } else {
+      pmap_ut_substr("<errorDescription>", "</errorDescription>",
+                     pbfr_recv->buffer, error, size);
+    }
+    pbfr_destroy(pbfr_recv);
+  }
+
+  return (http_status == 200) ? 0 : 1;
+}
+
+/**
+ * Add a port mapping using UPnP.
+ *
+ * This function is used to add a port mapping on a UPnP-enabled device,
+ * typically a router or gateway, in the local network. It sends the UPnP action
+ * to add the port mapping and checks the HTTP response status for success or
+ * failure. If the operation is unsuccessful, it can provide an error
+ * description if available.
+ *
+ * @param pfield A pointer to a `pmap_field_t` structure containing the details
+ * of the port mapping to be added.
+ * @param error A character array where an error description will be stored in
+ * case of failure.
+ * @param size The size of the `error` character array.
+ *
+ * @return An integer representing the result of the operation.
  *         - If the port mapping is added successfully, it returns 0.
  *         - If the operation fails or an error occurs, it returns 1.
  *
@@ -347,15 +736,7 @@ int pmap_upnp_addport(pmap_field_t *pfield, char *error, int size) {
   pbuffer_t *pbfr_recv =
       pmap_upnp_action(PMAP_UPNP_ACTION_ADDPORT, pfield, &http_status);
 
-  if (pbfr_recv) {
-    if (http_status != 200) {
-      pmap_ut_substr("<errorDescription>", "</errorDescription>",
-                     pbfr_recv->buffer, error, size);
-    }
-    pbfr_destroy(pbfr_recv);
-  }
-
-  return (http_status == 200) ? 0 : 1;
+  return pmap_upnp_result(pbfr_recv, http_status, NULL, 0, error, size);
 }
 
 /**
@@ -390,15 +771,7 @@ int pmap_upnp_delport(pmap_field_t *pfield, char *error, int size) {
   pbuffer_t *pbfr_recv =
       pmap_upnp_action(PMAP_UPNP_ACTION_DELPORT, pfield, &http_status);
 
-  if (pbfr_recv) {
-    if (http_status != 200) {
-      pmap_ut_substr("<errorDescription>", "</errorDescription>",
-                     pbfr_recv->buffer, error, size);
-    }
-    pbfr_destroy(pbfr_recv);
-  }
-
-  return (http_status == 200) ? 0 : 1;
+  return pmap_upnp_result(pbfr_recv, http_status, NULL, 0, error, size);
 }
 
 /**
@@ -442,18 +815,80 @@ int pmap_upnp_getexip(pmap_field_t *pfield, char *external_ip, int esize,
   pbuffer_t *pbfr_recv =
       pmap_upnp_action(PMAP_UPNP_ACTION_GETEXTIP, pfield, &http_status);
 
-  if (pbfr_recv) {
-    if (http_status == 200) {
-      pmap_ut_substr("<NewExternalIPAddress>", "</NewExternalIPAddress>",
-                     pbfr_recv->buffer, external_ip, esize);
-    } else {
-      pmap_ut_substr("<errorDescription>", "</errorDescription>",
-                     pbfr_recv->buffer, error, size);
+  return pmap_upnp_result(pbfr_recv, http_status, external_ip, esize, error,
+                          size);
+}
+
+/**
+ * Fetch the device description and store the WANIPConnection control URL in
+ * `ucmp` if it is not known yet.
+ *
+ * @return 0 on success (`ucmp->crtl_url` is NULL if the device has none), or
+ * the HTTP status / 1 on failure.
+ */
+static int _pmap_upnp_ctrlurl(pmap_url_comp_t *ucmp, const pmap_tmo_t *tmo) {
+
+  if (NULL == ucmp->crtl_url) {
+    char ctrl_url[128];
+    int ret;
+    memset(ctrl_url, 0x00, sizeof(ctrl_url));
+    /* The 'controlURL' value will be stored in the ctrl_url buffer. */
+    if ((ret = pmap_req_ctrlurl(ucmp, ctrl_url, sizeof(ctrl_url) - 1, tmo)) !=
+        0) {
+      return ret;
+    }
+    if (strlen(ctrl_url) > 0) {
+      ucmp->crtl_url = strdup(ctrl_url);
     }
-    pbfr_destroy(pbfr_recv);
   }
 
-  return (http_status == 200) ? 0 : 1;
+  return 0;
+}
+
+/**
+ * Write the SOAP body of an action into `pbfr_body` and its SOAPAction header
+ * into `header`.
+ *
+ * @param action The UPnP action (PMAP_UPNP_ACTION_*).
+ * @param version The WANIPConnection service version.
+ * @param pfield The port mapping.
+ * @param pbfr_body Receives the body.
+ * @param header Receives the SOAPAction header.
+ * @param size Size of `header`.
+ */
+static void _pmap_upnp_soap(int action, int version, pmap_field_t *pfield,
+                            pbuffer_t *pbfr_body, char *header, int size) {
+
+  char internal_ip[16];
+
+  if (version < 1) {
+    version = 1;
+  }
+
+  if (action == PMAP_UPNP_ACTION_ADDPORT) {
+    snprintf(header, size, soap_header, version, "AddPortMapping");
+    pmap_ut_inet_ntoa_r(pfield->internal_ip, internal_ip, sizeof(internal_ip));
+    pbfr_add(pbfr_body, soap_action_add, version, pfield->external_port,
+             pfield->protocol, pfield->internal_port, internal_ip,
+             pfield->lifetime_sec);
+  } else if (action == PMAP_UPNP_ACTION_ADDANY) {
+    snprintf(header, size, soap_header, version, "AddAnyPortMapping");
+    pmap_ut_inet_ntoa_r(pfield->internal_ip, internal_ip, sizeof(internal_ip));
+    pbfr_add(pbfr_body, soap_action_addany, version, pfield->external_port,
+             pfield->protocol, pfield->internal_port, internal_ip,
+             pfield->lifetime_sec);
+  } else if (action == PMAP_UPNP_ACTION_DELPORT) {
+    snprintf(header, size, soap_header, version, "DeletePortMapping");
+    pbfr_add(pbfr_body, soap_action_del, version, pfield->external_port,
+             pfield->protocol);
+  } else if (action == PMAP_UPNP_ACTION_GETEXTIP) {
+    snprintf(header, size, soap_header, version, "GetExternalIPAddress");
+    pbfr_add(pbfr_body, soap_action_getextip, version);
+  } else if (action == PMAP_UPNP_ACTION_GETSPECIFIC) {
+    snprintf(header, size, soap_header, version, "GetSpecificPortMappingEntry");
+    pbfr_add(pbfr_body, soap_action_getspecific, version,
+             pfield->external_port, pfield->protocol);
+  }
 }
 
 /**
@@ -492,71 +927,1258 @@ pbuffer_t *pmap_upnp_action(int action, pmap_field_t *pfield,
 
   pmap_url_comp_t *urls = NULL;
   pbuffer_t *pbfr_rcv = NULL;
+  char host[16];
 
-  pbuffer_t *pbfr_tmp = pbfr_create(128);
-  if (NULL == pbfr_tmp) {
+  /* Get list of UPnP devices of the gateway (M-SEARCH) */
+  if (_pmap_list_upnp(&urls, PMAP_UPNP_LIST_ALL, pfield->gateway_ip) != 0) {
     return NULL;
   }
 
-  /* Get list of all UPnP devices (M-SEARCH) */
-  if (pmap_list_upnp(&urls, PMAP_UPNP_LIST_ALL) != 0) {
-    goto cleanup;
-  }
+  pmap_ut_inet_ntoa_r(pfield->gateway_ip, host, sizeof(host));
 
   for (pmap_url_comp_t *ucmp = urls; ucmp != NULL; ucmp = ucmp->next) {
 
     /* Skip other UPnP devices */
-    if (strcmp(ucmp->host, pmap_ut_inet_ntoa(pfield->gateway_ip)) != 0) {
+    if (strcmp(ucmp->host, host) != 0) {
       continue;
     }
 
-    /* The 'controlURL' value will be stored in the pbfr_tmp buffer. */
-    if ((*http_status =
-             pmap_req_ctrlurl(ucmp, pbfr_tmp->buffer, pbfr_tmp->size)) == 0) {
-
-      PMAP_DEBUG_LOG("[controlURL=%s]\n", pbfr_tmp->buffer);
-
-      pbuffer_t *pbfr_body = pbfr_create(1024);
-      char *soap_header = NULL;
-      if (action == PMAP_UPNP_ACTION_ADDPORT) {
-        soap_header = "SOAPAction: "
-                      "\"urn:schemas-upnp-org:service:WANIPConnection:1#"
-                      "AddPortMapping\"\r\n";
-        pbfr_add(pbfr_body, soap_action_add, pfield->external_port,
-                 pfield->protocol, pfield->internal_port,
-                 pmap_ut_inet_ntoa(pfield->internal_ip), pfield->lifetime_sec);
-      } else if (action == PMAP_UPNP_ACTION_DELPORT) {
-        soap_header = "SOAPAction: "
-                      "\"urn:schemas-upnp-org:service:WANIPConnection:1#"
-                      "DeletePortMapping\"\r\n";
-        pbfr_add(pbfr_body, soap_action_del, pfield->external_port,
-                 pfield->protocol);
-      } else if (action == PMAP_UPNP_ACTION_GETEXTIP) {
-        soap_header = "SOAPAction: "
-                      "\"urn:schemas-upnp-org:service:WANIPConnection:1#"
-                      "GetExternalIPAddress\"\r\n";
-        pbfr_add(pbfr_body, soap_action_getextip);
-      }
+    /* Devices without WANIPConnection control URL are skipped */
+    if ((pbfr_rcv = pmap_upnp_action_url(action, pfield, ucmp, http_status,
+                                         NULL)) != NULL) {
+      break;
+    }
+  }
+
+  /* Destroy components allocated by 'pmap_get_ids' function */
+  pmap_list_free(urls);
+
+  return pbfr_rcv;
+}
+
+/**
+ * Perform a UPnP action on an already discovered device.
+ *
+ * This is the second half of 'pmap_upnp_action' without the M-SEARCH
+ * discovery. If `ucmp->crtl_url` is not known yet the device description is
+ * fetched and the control URL is stored in `ucmp`, so a caller that keeps
+ * `ucmp` skips that step on the next call.
+ *
+ * @param action The UPnP action (PMAP_UPNP_ACTION_*).
+ * @param pfield A pointer to a `pmap_field_t` structure containing the
+ * necessary information for the UPnP action.
+ * @param ucmp The device location (LOCATION header of the M-SEARCH response).
+ * @param http_status A pointer to an integer where the HTTP response status
+ * code will be stored.
+ * @param tmo Timeouts to use, NULL for the defaults.
+ * @return The HTTP response, or NULL if the device has no control URL or the
+ * request failed. The caller is responsible for freeing it.
+ */
+pbuffer_t *pmap_upnp_action_url(int action, pmap_field_t *pfield,
+                                pmap_url_comp_t *ucmp, int *http_status,
+                                const pmap_tmo_t *tmo) {
+
+  pbuffer_t *pbfr_rcv = NULL;
+
+  *http_status = 0;
+
+  if ((*http_status = _pmap_upnp_ctrlurl(ucmp, tmo)) != 0 ||
+      NULL == ucmp->crtl_url) {
+    return NULL;
+  }
+
+  PMAP_DEBUG_LOG("[controlURL=%s]\n", ucmp->crtl_url);
+
+  pbuffer_t *pbfr_body = pbfr_create(1024);
+  if (NULL == pbfr_body) {
+    return NULL;
+  }
+
+  char header[128];
+  _pmap_upnp_soap(action, ucmp->version, pfield, pbfr_body, header,
+                  sizeof(header));
+
+  pbfr_rcv = pmap_http_post(ucmp->host, ucmp->port, ucmp->crtl_url, header,
+                            pbfr_body, http_status, tmo);
+
+  pbfr_destroy(pbfr_body);
+  PMAP_DEBUG_LOG("[HTTP Status Code=%d]\n", *http_status);
+
+  return pbfr_rcv;
+}
+
+/**
+ * Build the HTTP request of a UPnP action without sending it, for callers
+ * that drive the socket themselves (see pmap_async.c).
+ *
+ * @param action The action (PMAP_UPNP_ACTION_*).
+ * @param ucmp The device, its control URL must be known.
+ * @param pfield The details of the action.
+ * @return The request, or NULL if memory allocation fails. The caller is
+ * responsible for freeing it by calling 'pbfr_destroy' function.
+ */
+pbuffer_t *pmap_upnp_request(int action, const pmap_url_comp_t *ucmp,
+                             pmap_field_t *pfield) {
+
+  char header[128];
+
+  pbuffer_t *pbfr_body = pbfr_create(1024);
+  if (NULL == pbfr_body) {
+    return NULL;
+  }
+
+  _pmap_upnp_soap(action, ucmp->version, pfield, pbfr_body, header,
+                  sizeof(header));
+  pbuffer_t *pbfr = pmap_http_post_create(ucmp->host, ucmp->port,
+                                          ucmp->crtl_url, header, pbfr_body);
+
+  pbfr_destroy(pbfr_body);
+
+  return pbfr;
+}
+
+/**
+ * Build the GetGenericPortMappingEntry request of entry `index`, see
+ * 'pmap_upnp_request'.
+ */
+pbuffer_t *pmap_upnp_request_generic(const pmap_url_comp_t *ucmp, int index) {
+
+  char header[128];
+  int version = (ucmp->version < 1) ? 1 : ucmp->version;
+
+  pbuffer_t *pbfr_body = pbfr_create(1024);
+  if (NULL == pbfr_body) {
+    return NULL;
+  }
+
+  pbfr_add(pbfr_body, soap_action_getgeneric, version, index);
+  snprintf(header, sizeof(header), soap_header, version,
+           "GetGenericPortMappingEntry");
+  pbuffer_t *pbfr = pmap_http_post_create(ucmp->host, ucmp->port,
+                                          ucmp->crtl_url, header, pbfr_body);
+
+  pbfr_destroy(pbfr_body);
+
+  return pbfr;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Fill the fields of an entry found in a GetGenericPortMappingEntry or
+ * GetSpecificPortMappingEntry response, the others are left as they are.
+ *
+ * @param xml The response.
+ * @param entry The entry to fill.
+ */
+void pmap_upnp_entry_parse(const char *xml, pmap_upnp_entry_t *entry) {
+
+  char tmp[64];
+
+  pmap_ut_substr("<NewRemoteHost>", "</NewRemoteHost>", xml,
+                 entry->remote_host, sizeof(entry->remote_host));
+  pmap_ut_substr("<NewProtocol>", "</NewProtocol>", xml, entry->field.protocol,
+                 sizeof(entry->field.protocol));
+  pmap_ut_substr("<NewPortMappingDescription>",
+                 "</NewPortMappingDescription>", xml, entry->description,
+                 sizeof(entry->description));
+
+  if (pmap_ut_substr("<NewExternalPort>", "</NewExternalPort>", xml, tmp,
+                     sizeof(tmp)) == 0) {
+    entry->field.external_port = atoi(tmp);
+  }
+  if (pmap_ut_substr("<NewInternalPort>", "</NewInternalPort>", xml, tmp,
+                     sizeof(tmp)) == 0) {
+    entry->field.internal_port = atoi(tmp);
+  }
+  if (pmap_ut_substr("<NewInternalClient>", "</NewInternalClient>", xml, tmp,
+                     sizeof(tmp)) == 0) {
+    entry->field.internal_ip = inet_addr(tmp);
+  }
+  if (pmap_ut_substr("<NewEnabled>", "</NewEnabled>", xml, tmp,
+                     sizeof(tmp)) == 0) {
+    entry->enabled = (strcmp(tmp, "1") == 0 || strcasecmp(tmp, "true") == 0);
+  }
+  if (pmap_ut_substr("<NewLeaseDuration>", "</NewLeaseDuration>", xml, tmp,
+                     sizeof(tmp)) == 0) {
+    entry->field.lifetime_sec = atoi(tmp);
+  }
+}
+
+/**
+ * Finish a GetSpecificPortMappingEntry request, see 'pmap_upnp_getspecific'.
+ */
+static int _pmap_upnp_getspecific_done(pbuffer_t *pbfr_recv, int http_status,
+                                       pmap_field_t *pfield,
+                                       pmap_upnp_entry_t *entry,
+                                       int *upnp_error) {
+
+  char code[16] = {0};
+  int fault = 0;
+
+  if (NULL != upnp_error) {
+    *upnp_error = 0;
+  }
+
+  if (NULL == pbfr_recv) {
+    return 1; // caller should check errno value
+  }
+
+  if (http_status == 200) {
+    /* The response only has the fields that are not part of the request */
+    memset(entry, 0x00, sizeof(pmap_upnp_entry_t));
+    entry->index = -1;
+    entry->field.gateway_ip = pfield->gateway_ip;
+    entry->field.external_port = pfield->external_port;
+    strncpy(entry->field.protocol, pfield->protocol,
+            sizeof(entry->field.protocol) - 1);
+    pmap_upnp_entry_parse(pbfr_recv->buffer, entry);
+  } else if (pmap_ut_substr("<errorCode>", "</errorCode>", pbfr_recv->buffer,
+                            code, sizeof(code)) == 0) {
+    fault = atoi(code);
+  }
+
+  pbfr_destroy(pbfr_recv);
+
+  if (http_status == 200) {
+    return 0;
+  }
+
+  if (NULL != upnp_error) {
+    *upnp_error = fault;
+  }
+  errno = (fault == PMAP_UPNP_ERR_NO_SUCH_ENTRY ||
+           fault == PMAP_UPNP_ERR_NOT_FOUND)
+              ? ENOENT
+              : pmap_upnp_errno(http_status, fault);
+
+  return 1;
+}
+
+/**
+ * Read the port mapping of an external port (GetSpecificPortMappingEntry).
+ *
+ * @param pfield The gateway, external port and protocol of the mapping.
+ * @param entry Receives the mapping, `index` is -1 and `field.lifetime_sec`
+ * is the lease left (0 for a static mapping).
+ * @param upnp_error Receives the errorCode of the SOAP fault, 0 if none. May
+ * be NULL.
+ * @return 0 if `entry` was filled, 1 otherwise (errno is ENOENT if the
+ * gateway has no such mapping, EUPNPFAULT for another SOAP fault).
+ */
+int pmap_upnp_getspecific(pmap_field_t *pfield, pmap_upnp_entry_t *entry,
+                          int *upnp_error) {
+
+  int http_status = 0;
+
+  pbuffer_t *pbfr_recv =
+      pmap_upnp_action(PMAP_UPNP_ACTION_GETSPECIFIC, pfield, &http_status);
+
+  return _pmap_upnp_getspecific_done(pbfr_recv, http_status, pfield, entry,
+                                     upnp_error);
+}
+
+/**
+ * Read the port mapping of an external port on an already discovered device,
+ * see 'pmap_upnp_getspecific'.
+ *
+ * @param ucmp The device location, the control URL is fetched if not known.
+ * @param tmo Timeouts to use, NULL for the defaults.
+ */
+int pmap_upnp_getspecific_url(pmap_url_comp_t *ucmp, pmap_field_t *pfield,
+                              pmap_upnp_entry_t *entry, int *upnp_error,
+                              const pmap_tmo_t *tmo) {
+
+  int http_status = 0;
+
+  pbuffer_t *pbfr_recv = pmap_upnp_action_url(
+      PMAP_UPNP_ACTION_GETSPECIFIC, pfield, ucmp, &http_status, tmo);
+
+  return _pmap_upnp_getspecific_done(pbfr_recv, http_status, pfield, entry,
+                                     upnp_error);
+}
+
+/**
+ * Tell whether a mapping read from the gateway already is the wanted one.
+ *
+ * It is when it is enabled, goes to the same internal client, port and
+ * protocol, and its lease is static or has at least PMAP_UPNP_ENSURE_PCT of
+ * the wanted lifetime left. A leased entry is not the static mapping asked
+ * for with a lifetime of 0.
+ *
+ * @param entry The mapping read ('pmap_upnp_getspecific').
+ * @param pfield The wanted mapping.
+ * @return 1 if no AddPortMapping is needed, 0 otherwise.
+ */
+int pmap_upnp_entry_current(const pmap_upnp_entry_t *entry,
+                            const pmap_field_t *pfield) {
 
-      if (NULL != pbfr_rcv) {
-        pbfr_destroy(pbfr_rcv);
+  if (!entry->enabled || entry->field.internal_ip != pfield->internal_ip ||
+      entry->field.internal_port != pfield->internal_port ||
+      strcasecmp(entry->field.protocol, pfield->protocol) != 0) {
+    return 0;
+  }
+
+  if (entry->field.lifetime_sec == 0) {
+    return 1; // Static, never expires
+  }
+  if (pfield->lifetime_sec <= 0) {
+    return 0;
+  }
+
+  return (int64_t)entry->field.lifetime_sec * 100 >=
+         (int64_t)pfield->lifetime_sec * PMAP_UPNP_ENSURE_PCT;
+}
+
+/**
+ * Make sure a port mapping exists without rewriting an identical one.
+ *
+ * The mapping is read first (GetSpecificPortMappingEntry) and AddPortMapping
+ * is sent only when it is missing or differs ('pmap_upnp_entry_current').
+ * Some gateways rewrite their flash or flush connection tracking on every
+ * AddPortMapping, a read costs one round trip and changes nothing. The
+ * mapping is added as well when the gateway does not know the read action.
+ *
+ * @param ucmp The device location, the control URL is fetched if not known.
+ * @param pfield The wanted mapping. When nothing was written `lifetime_sec`
+ * is updated with the lease left (0 for a static mapping).
+ * @param written Set to 1 if AddPortMapping changed the gateway, 0 otherwise.
+ * @param tmo Timeouts to use, NULL for the defaults.
+ * @param error A character array where an error description will be stored in
+ * case of failure.
+ * @param size The size of the `error` character array.
+ * @return 0 if the mapping is in place, 1 on failure.
+ */
+int pmap_upnp_ensure_url(pmap_url_comp_t *ucmp, pmap_field_t *pfield,
+                         int *written, const pmap_tmo_t *tmo, char *error,
+                         int size) {
+
+  pmap_upnp_entry_t entry;
+  int http_status = 0;
+
+  *written = 0;
+
+  if (pmap_upnp_getspecific_url(ucmp, pfield, &entry, NULL, tmo) == 0 &&
+      pmap_upnp_entry_current(&entry, pfield)) {
+    PMAP_DEBUG_LOG("Mapping %d/%s is current\n", pfield->external_port,
+                   pfield->protocol);
+    pfield->lifetime_sec = entry.field.lifetime_sec;
+    return 0;
+  }
+
+  pbuffer_t *pbfr_recv = pmap_upnp_action_url(PMAP_UPNP_ACTION_ADDPORT, pfield,
+                                              ucmp, &http_status, tmo);
+
+  int ret = pmap_upnp_result(pbfr_recv, http_status, NULL, 0, error, size);
+  *written = (ret == 0);
+
+  return ret;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * First device of a gateway with a WANIPConnection control URL.
+ *
+ * @param urls The devices found by M-SEARCH.
+ * @param gateway_ip The gateway.
+ * @return The device, or NULL if the gateway has no IGD.
+ */
+static pmap_url_comp_t *_pmap_upnp_device(pmap_url_comp_t *urls,
+                                          uint32_t gateway_ip) {
+
+  char host[16];
+
+  pmap_ut_inet_ntoa_r(gateway_ip, host, sizeof(host));
+
+  for (pmap_url_comp_t *ucmp = urls; ucmp != NULL; ucmp = ucmp->next) {
+    if (strcmp(ucmp->host, host) == 0 && _pmap_upnp_ctrlurl(ucmp, NULL) == 0 &&
+        NULL != ucmp->crtl_url) {
+      return ucmp;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Run one action for all entries of `pfields` going to the same gateway as
+ * `pfields[first]`, over one control URL and one keep-alive connection. With
+ * PMAP_UPNP_ACTION_ENSURE each mapping is read first and AddPortMapping is
+ * sent only when it is missing or stale, see 'pmap_upnp_ensure_url'.
+ *
+ * @param device The IGD of the gateway with its control URL, NULL if it has
+ * none (all entries fail).
+ */
+static void _pmap_upnp_batch_gw(int action, pmap_field_t *pfields, int count,
+                                int first, pmap_url_comp_t *device,
+                                pmap_upnp_res_t *results, bool *done,
+                                const pmap_tmo_t *tmo) {
+
+  uint32_t gateway_ip = pfields[first].gateway_ip;
+
+  pmap_http_conn_t *conn = NULL;
+  pbuffer_t *pbfr_body = NULL;
+  if (NULL != device) {
+    PMAP_DEBUG_LOG("[controlURL=%s]\n", device->crtl_url);
+    conn = pmap_http_conn_create(device->host, device->port, tmo);
+    pbfr_body = pbfr_create(1024);
+  }
+
+  bool broken = (NULL == conn || NULL == pbfr_body);
+
+  for (int i = first; i < count; i++) {
+
+    if (done[i] || pfields[i].gateway_ip != gateway_ip) {
+      continue;
+    }
+    done[i] = true;
+
+    /* No IGD or the gateway stopped answering, the rest fails as well */
+    if (broken) {
+      continue;
+    }
+
+    char header[128];
+    pbuffer_t *pbfr_recv;
+
+    if (action == PMAP_UPNP_ACTION_ENSURE) {
+      pmap_upnp_entry_t entry;
+      pbfr_body->offset = 0;
+      _pmap_upnp_soap(PMAP_UPNP_ACTION_GETSPECIFIC, device->version,
+                      &pfields[i], pbfr_body, header, sizeof(header));
+      pbfr_recv = pmap_http_conn_post(conn, device->crtl_url, header,
+                                      pbfr_body, &results[i].http_status);
+      if (NULL == pbfr_recv) {
+        broken = true;
+        continue;
+      }
+      if (_pmap_upnp_getspecific_done(pbfr_recv, results[i].http_status,
+                                      &pfields[i], &entry, NULL) == 0 &&
+          pmap_upnp_entry_current(&entry, &pfields[i])) {
+        PMAP_DEBUG_LOG("Mapping %d/%s is current\n", pfields[i].external_port,
+                       pfields[i].protocol);
+        pfields[i].lifetime_sec = entry.field.lifetime_sec;
+        results[i].status = 0;
+        continue;
       }
+      /* Missing, different or not readable */
+    }
 
-      pbfr_rcv = pmap_http_post(ucmp->host, ucmp->port, pbfr_tmp->buffer,
-                                soap_header, pbfr_body, http_status);
+    pbfr_body->offset = 0;
+    _pmap_upnp_soap((action == PMAP_UPNP_ACTION_ENSURE)
+                        ? PMAP_UPNP_ACTION_ADDPORT
+                        : action,
+                    device->version, &pfields[i], pbfr_body, header,
+                    sizeof(header));
+
+    pbfr_recv = pmap_http_conn_post(conn, device->crtl_url, header, pbfr_body,
+                                    &results[i].http_status);
+    if (NULL == pbfr_recv) {
+      broken = true;
+      continue;
+    }
 
-      pbfr_destroy(pbfr_body);
-      PMAP_DEBUG_LOG("[HTTP Status Code=%d]\n", *http_status);
-      break;
+    if (results[i].http_status == 200) {
+      results[i].status = 0;
+      results[i].written = (action == PMAP_UPNP_ACTION_ENSURE);
+    } else {
+      char code[16] = {0};
+      pmap_ut_substr("<errorCode>", "</errorCode>", pbfr_recv->buffer, code,
+                     sizeof(code) - 1);
+      results[i].upnp_error = atoi(code);
     }
+    pbfr_destroy(pbfr_recv);
   }
 
-cleanup:
+  pbfr_destroy(pbfr_body);
+  pmap_http_conn_destroy(conn);
+}
 
-  /* Destroy components allocated by 'pmap_get_ids' function */
-  pmap_list_free(urls);
-  //  pbfr_destroy(pbfr_rcv);
-  pbfr_destroy(pbfr_tmp);
+/**
+ * Batch version of 'pmap_upnp_action' for add and delete actions.
+ */
+static int _pmap_upnp_batch(int action, pmap_field_t *pfields, int count,
+                            pmap_upnp_res_t *results) {
 
-  return pbfr_rcv;
+  pmap_url_comp_t *urls = NULL;
+  int ret = 0;
+
+  for (int i = 0; i < count; i++) {
+    results[i].status = 1;
+    results[i].http_status = 0;
+    results[i].upnp_error = 0;
+    results[i].written = 0;
+  }
+
+  if (count <= 0) {
+    return 0;
+  }
+
+  bool *done = calloc(count, sizeof(bool));
+  if (NULL == done) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return 1;
+  }
+
+  /* One M-SEARCH, filtered on the gateway if all entries share it */
+  uint32_t gateway_ip = pfields[0].gateway_ip;
+  for (int i = 1; i < count; i++) {
+    if (pfields[i].gateway_ip != gateway_ip) {
+      gateway_ip = INADDR_ANY;
+      break;
+    }
+  }
+
+  if (_pmap_list_upnp(&urls, PMAP_UPNP_LIST_ALL, gateway_ip) != 0) {
+    free(done);
+    return 1; // caller should check errno value
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (!done[i]) {
+      _pmap_upnp_batch_gw(action, pfields, count, i,
+                          _pmap_upnp_device(urls, pfields[i].gateway_ip),
+                          results, done, NULL);
+    }
+    if (results[i].status != 0) {
+      ret = 1;
+    }
+  }
+
+  pmap_list_free(urls);
+  free(done);
+
+  return ret;
+}
+
+/**
+ * Add several port mappings with UPnP IGD.
+ *
+ * The gateways are discovered with one M-SEARCH, the control URL of each
+ * gateway is fetched once and all AddPortMapping requests of a gateway are
+ * sent over one keep-alive connection. Entries may go to different gateways.
+ *
+ * @param pfields The port mappings to add.
+ * @param count Number of entries in `pfields`.
+ * @param results Array of `count` entries receiving the status of each
+ * mapping: status (0 success, 1 failure), HTTP status (0 if the gateway did
+ * not answer) and UPnP error code of the SOAP fault (e.g. 718
+ * ConflictInMappingEntry, 0 if none).
+ * @return 0 if all mappings were added, 1 otherwise (check `results`, errno
+ * is set if discovery failed).
+ */
+int pmap_upnp_addport_batch(pmap_field_t *pfields, int count,
+                            pmap_upnp_res_t *results) {
+
+  return _pmap_upnp_batch(PMAP_UPNP_ACTION_ADDPORT, pfields, count, results);
+}
+
+/**
+ * Delete several port mappings with UPnP IGD, see 'pmap_upnp_addport_batch'.
+ * A mapping not known by the gateway fails with UPnP error 714
+ * NoSuchEntryInArray.
+ *
+ * @param pfields The port mappings to delete.
+ * @param count Number of entries in `pfields`.
+ * @param results Array of `count` entries receiving the status of each
+ * mapping.
+ * @return 0 if all mappings were deleted, 1 otherwise.
+ */
+int pmap_upnp_delport_batch(pmap_field_t *pfields, int count,
+                            pmap_upnp_res_t *results) {
+
+  return _pmap_upnp_batch(PMAP_UPNP_ACTION_DELPORT, pfields, count, results);
+}
+
+/**
+ * Batch version of 'pmap_upnp_action_url' for add, delete and ensure
+ * actions.
+ */
+static int _pmap_upnp_batch_url(int action, pmap_url_comp_t *ucmp,
+                                pmap_field_t *pfields, int count,
+                                pmap_upnp_res_t *results,
+                                const pmap_tmo_t *tmo) {
+
+  int ret = 0;
+
+  for (int i = 0; i < count; i++) {
+    results[i].status = 1;
+    results[i].http_status = 0;
+    results[i].upnp_error = 0;
+    results[i].written = 0;
+  }
+
+  if (count <= 0) {
+    return 0;
+  }
+
+  bool *done = calloc(count, sizeof(bool));
+  if (NULL == done) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return 1;
+  }
+
+  pmap_url_comp_t *device = NULL;
+  if (_pmap_upnp_ctrlurl(ucmp, tmo) == 0 && NULL != ucmp->crtl_url) {
+    device = ucmp;
+  }
+
+  _pmap_upnp_batch_gw(action, pfields, count, 0, device, results, done, tmo);
+
+  for (int i = 0; i < count; i++) {
+    if (results[i].status != 0) {
+      ret = 1;
+    }
+  }
+  free(done);
+
+  return ret;
+}
+
+/**
+ * Add several port mappings on one known device, see
+ * 'pmap_upnp_addport_batch'. No M-SEARCH is sent.
+ *
+ * @param ucmp The device location, its control URL is fetched if needed.
+ * @param pfields The port mappings to add, all on the gateway of `ucmp`.
+ * @param count Number of entries in `pfields`.
+ * @param results Array of `count` entries receiving the status of each
+ * mapping.
+ * @param tmo Timeouts to use, NULL for the defaults.
+ * @return 0 if all mappings were added, 1 otherwise.
+ */
+int pmap_upnp_addport_batch_url(pmap_url_comp_t *ucmp, pmap_field_t *pfields,
+                                int count, pmap_upnp_res_t *results,
+                                const pmap_tmo_t *tmo) {
+
+  return _pmap_upnp_batch_url(PMAP_UPNP_ACTION_ADDPORT, ucmp, pfields, count,
+                              results, tmo);
+}
+
+/**
+ * Delete several port mappings of one known device, see
+ * 'pmap_upnp_delport_batch'. No M-SEARCH is sent.
+ *
+ * @param ucmp The device location, its control URL is fetched if needed.
+ * @param pfields The port mappings to delete, all on the gateway of `ucmp`.
+ * @param count Number of entries in `pfields`.
+ * @param results Array of `count` entries receiving the status of each
+ * mapping.
+ * @param tmo Timeouts to use, NULL for the defaults.
+ * @return 0 if all mappings were deleted, 1 otherwise.
+ */
+int pmap_upnp_delport_batch_url(pmap_url_comp_t *ucmp, pmap_field_t *pfields,
+                                int count, pmap_upnp_res_t *results,
+                                const pmap_tmo_t *tmo) {
+
+  return _pmap_upnp_batch_url(PMAP_UPNP_ACTION_DELPORT, ucmp, pfields, count,
+                              results, tmo);
+}
+
+/**
+ * Make sure several port mappings exist on one known device without
+ * rewriting those that are current, see 'pmap_upnp_ensure_url'. Each mapping
+ * is read with GetSpecificPortMappingEntry over the keep-alive connection and
+ * AddPortMapping follows only for those missing or stale. No M-SEARCH is
+ * sent.
+ *
+ * @param ucmp The device location, its control URL is fetched if needed.
+ * @param pfields The wanted port mappings, all on the gateway of `ucmp`. The
+ * `lifetime_sec` of those left as they were is updated with the lease left
+ * (0 for a static mapping).
+ * @param count Number of entries in `pfields`.
+ * @param results Array of `count` entries receiving the status of each
+ * mapping, `written` tells whether AddPortMapping was sent.
+ * @param tmo Timeouts to use, NULL for the defaults.
+ * @return 0 if all mappings are in place, 1 otherwise.
+ */
+int pmap_upnp_ensure_batch_url(pmap_url_comp_t *ucmp, pmap_field_t *pfields,
+                               int count, pmap_upnp_res_t *results,
+                               const pmap_tmo_t *tmo) {
+
+  return _pmap_upnp_batch_url(PMAP_UPNP_ACTION_ENSURE, ucmp, pfields, count,
+                              results, tmo);
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Create an iterator over the port mapping table of a known device, see
+ * 'pmap_upnp_iter_create'.
+ *
+ * @param ucmp The device location, its control URL is fetched if needed.
+ * @param depth Max number of requests in flight, see 'pmap_upnp_iter_create'.
+ * @param tmo Timeouts to use, NULL for the defaults.
+ * @return The iterator, or NULL on failure (caller should check errno value).
+ */
+pmap_upnp_iter_t *pmap_upnp_iter_create_url(pmap_url_comp_t *ucmp, int depth,
+                                            const pmap_tmo_t *tmo) {
+
+  if (_pmap_upnp_ctrlurl(ucmp, tmo) != 0 || NULL == ucmp->crtl_url) {
+    errno = EGWUNSUPPORTED;
+    return NULL;
+  }
+
+  pmap_upnp_iter_t *it = calloc(1, sizeof(pmap_upnp_iter_t));
+  if (NULL == it) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+
+  strncpy(it->ctrl_url, ucmp->crtl_url, sizeof(it->ctrl_url) - 1);
+  it->gateway_ip = inet_addr(ucmp->host);
+  it->version = (ucmp->version > 0) ? ucmp->version : 1;
+  it->depth = (depth > 0) ? depth : PMAP_UPNP_PIPELINE_DEF;
+  it->window = 1;
+
+  it->conn = pmap_http_conn_create(ucmp->host, ucmp->port, tmo);
+  it->body = pbfr_create(1024);
+  if (NULL == it->conn || NULL == it->body) {
+    pmap_upnp_iter_destroy(it);
+    return NULL;
+  }
+
+  return it;
+}
+
+/**
+ * Create an iterator over the port mapping table of a gateway
+ * (GetGenericPortMappingEntry). The gateway is discovered with M-SEARCH.
+ *
+ * Entries are requested by index over one keep-alive connection. Once the
+ * gateway has kept the connection open, up to `depth` requests are sent
+ * before reading the responses (pipelining). If the gateway drops
+ * pipelined requests the iterator goes back to one request at a time. The
+ * memory used does not depend on the size of the table.
+ *
+ * @param gateway_ip The gateway.
+ * @param depth Max number of requests in flight, 1 disables pipelining and 0
+ * selects PMAP_UPNP_PIPELINE_DEF.
+ * @return The iterator, or NULL on failure (caller should check errno value,
+ * EGWUNSUPPORTED if the gateway has no IGD). The caller is responsible for
+ * freeing it by calling 'pmap_upnp_iter_destroy' function.
+ */
+pmap_upnp_iter_t *pmap_upnp_iter_create(uint32_t gateway_ip, int depth) {
+
+  pmap_url_comp_t *urls = NULL;
+  pmap_upnp_iter_t *it = NULL;
+
+  if (_pmap_list_upnp(&urls, PMAP_UPNP_LIST_ALL, gateway_ip) != 0) {
+    return NULL; // caller should check errno value
+  }
+
+  pmap_url_comp_t *device = _pmap_upnp_device(urls, gateway_ip);
+  if (NULL != device) {
+    it = pmap_upnp_iter_create_url(device, depth, NULL);
+  } else {
+    errno = EGWUNSUPPORTED;
+  }
+
+  pmap_list_free(urls);
+
+  return it;
+}
+
+/**
+ * Free an iterator and close its connection.
+ *
+ * @param it The iterator, NULL is allowed.
+ */
+void pmap_upnp_iter_destroy(pmap_upnp_iter_t *it) {
+
+  if (NULL != it) {
+    pmap_http_conn_destroy(it->conn);
+    pbfr_destroy(it->body);
+    free(it);
+  }
+}
+
+/**
+ * Send the GetGenericPortMappingEntry request of index `it->sent`.
+ */
+static int _pmap_upnp_iter_send(pmap_upnp_iter_t *it) {
+
+  char header[128];
+
+  it->body->offset = 0;
+  pbfr_add(it->body, soap_action_getgeneric, it->version, it->sent);
+  snprintf(header, sizeof(header), soap_header, it->version,
+           "GetGenericPortMappingEntry");
+
+  pbuffer_t *pbfr =
+      pmap_http_conn_post_create(it->conn, it->ctrl_url, header, it->body);
+  if (NULL == pbfr) {
+    return 1;
+  }
+
+  int ret = pmap_http_conn_send(it->conn, pbfr);
+  pbfr_destroy(pbfr);
+  if (ret == 0) {
+    it->sent++;
+  }
+
+  return ret;
+}
+
+/**
+ * Fill an entry from a GetGenericPortMappingEntry response.
+ */
+static void _pmap_upnp_iter_parse(pmap_upnp_iter_t *it, const char *xml,
+                                  pmap_upnp_entry_t *entry) {
+
+  memset(entry, 0x00, sizeof(pmap_upnp_entry_t));
+  entry->index = it->index;
+  entry->field.gateway_ip = it->gateway_ip;
+
+  pmap_upnp_entry_parse(xml, entry);
+}
+
+/**
+ * Get the next entry of the port mapping table.
+ *
+ * Indices of a table changed by someone else during the walk move, so an
+ * entry may be missed or returned twice.
+ *
+ * @param it The iterator.
+ * @param entry Receives the entry.
+ * @return 0 if `entry` was filled, 1 at the end of the table (errno is 0) or
+ * on failure (errno is set, EUPNPFAULT with `it->upnp_error` for a SOAP
+ * fault).
+ */
+int pmap_upnp_iter_next(pmap_upnp_iter_t *it, pmap_upnp_entry_t *entry) {
+
+  pbuffer_t *pbfr_recv = NULL;
+  int http_status = 0;
+
+  if (it->done) {
+    errno = it->err;
+    return 1;
+  }
+
+  for (int attempt = 0; attempt < 2 && NULL == pbfr_recv; attempt++) {
+
+    /* Keep the pipeline full */
+    int ret = 0;
+    while (ret == 0 && it->sent - it->index < it->window) {
+      ret = _pmap_upnp_iter_send(it);
+    }
+    if (ret == 0) {
+      pbfr_recv = pmap_http_conn_recv(it->conn, &http_status);
+    }
+
+    if (NULL == pbfr_recv) {
+      /* Requests in flight are lost, ask again one at a time */
+      PMAP_DEBUG_LOG("Index %d failed, pipelining disabled\n", it->index);
+      it->sent = it->index;
+      it->window = 1;
+      it->depth = 1;
+    }
+  }
+
+  if (NULL == pbfr_recv) {
+    it->done = true;
+    it->err = errno;
+    return 1; // caller should check errno value
+  }
+
+  if (it->conn->fd < 0) {
+    /* Gateway closes after each response, no pipelining */
+    it->sent = it->index + 1;
+    it->window = 1;
+    it->depth = 1;
+  } else {
+    it->window = it->depth;
+  }
+
+  int ret = 0;
+  if (http_status == 200) {
+    _pmap_upnp_iter_parse(it, pbfr_recv->buffer, entry);
+    it->index++;
+  } else {
+    char code[16] = {0};
+    pmap_ut_substr("<errorCode>", "</errorCode>", pbfr_recv->buffer, code,
+                   sizeof(code) - 1);
+    it->upnp_error = atoi(code);
+    it->done = true;
+    it->err = (it->upnp_error == PMAP_UPNP_ERR_INVALID_INDEX)
+                  ? 0
+                  : pmap_upnp_errno(http_status, it->upnp_error);
+    /* Responses of the requests past the end are not needed */
+    pmap_http_conn_destroy(it->conn);
+    it->conn = NULL;
+    errno = it->err;
+    ret = 1;
+  }
+
+  pbfr_destroy(pbfr_recv);
+
+  return ret;
+}
+
+/* -------------------------------------------- */
+
+/* Fields of a PortMappingEntry (GetListOfPortMappings) */
+#define PMAP_UPNP_LF_NONE 0
+#define PMAP_UPNP_LF_REMOTE_HOST 1
+#define PMAP_UPNP_LF_EXTERNAL_PORT 2
+#define PMAP_UPNP_LF_PROTOCOL 3
+#define PMAP_UPNP_LF_INTERNAL_PORT 4
+#define PMAP_UPNP_LF_INTERNAL_CLIENT 5
+#define PMAP_UPNP_LF_ENABLED 6
+#define PMAP_UPNP_LF_DESCRIPTION 7
+#define PMAP_UPNP_LF_LEASE_TIME 8
+
+/**
+ * Parse state of GetListOfPortMappings responses. The SOAP envelope is read
+ * by `outer`, the text of NewPortListing (the escaped list document) is fed
+ * to `inner` while it arrives, so no response is held in memory.
+ */
+typedef struct pmap_upnp_list_t_ {
+  pmap_xml_t outer;
+  pmap_xml_t inner;
+  int in_listing;     /* Inside NewPortListing */
+  int in_code;        /* Inside errorCode */
+  char code[16];      /* errorCode of a SOAP fault */
+  int field;          /* PMAP_UPNP_LF_* being read */
+  char text[64];      /* Text of the field being read */
+  int text_len;
+  pmap_upnp_entry_t cur;
+  pmap_upnp_entry_t *entries;
+  int count;
+  int size;
+  int page;           /* Entries in the current response */
+  int next_port;      /* Highest external port seen + 1 */
+  uint32_t gateway_ip;
+  int oom;
+} pmap_upnp_list_t;
+
+/**
+ * Field of a PortMappingEntry element name.
+ */
+static int _pmap_upnp_list_field(const char *name) {
+
+  static const char *names[] = {
+      "",           "NewRemoteHost",     "NewExternalPort",
+      "NewProtocol", "NewInternalPort",  "NewInternalClient",
+      "NewEnabled", "NewDescription",    "NewLeaseTime",
+      NULL};
+
+  for (int i = 1; names[i] != NULL; i++) {
+    if (strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+
+  return PMAP_UPNP_LF_NONE;
+}
+
+/**
+ * Store the text of a field in the current entry.
+ */
+static void _pmap_upnp_list_store(pmap_upnp_list_t *lp) {
+
+  pmap_upnp_entry_t *e = &lp->cur;
+  char *text = lp->text;
+
+  text[lp->text_len] = '\0';
+  text = pmap_ut_rtrim(pmap_ut_ltrim(text));
+
+  switch (lp->field) {
+  case PMAP_UPNP_LF_REMOTE_HOST:
+    strncpy(e->remote_host, text, sizeof(e->remote_host) - 1);
+    break;
+  case PMAP_UPNP_LF_EXTERNAL_PORT:
+    e->field.external_port = atoi(text);
+    break;
+  case PMAP_UPNP_LF_PROTOCOL:
+    strncpy(e->field.protocol, text, sizeof(e->field.protocol) - 1);
+    break;
+  case PMAP_UPNP_LF_INTERNAL_PORT:
+    e->field.internal_port = atoi(text);
+    break;
+  case PMAP_UPNP_LF_INTERNAL_CLIENT:
+    e->field.internal_ip = inet_addr(text);
+    break;
+  case PMAP_UPNP_LF_ENABLED:
+    e->enabled = (strcmp(text, "1") == 0 || strcasecmp(text, "true") == 0);
+    break;
+  case PMAP_UPNP_LF_DESCRIPTION:
+    strncpy(e->description, text, sizeof(e->description) - 1);
+    break;
+  case PMAP_UPNP_LF_LEASE_TIME:
+    e->field.lifetime_sec = atoi(text);
+    break;
+  }
+}
+
+/**
+ * Tags of the list document.
+ */
+static void _pmap_upnp_list_tag(void *arg, const char *name, int end) {
+
+  pmap_upnp_list_t *lp = (pmap_upnp_list_t *)arg;
+
+  if (strcmp(name, "PortMappingEntry") == 0) {
+    if (!end) {
+      memset(&lp->cur, 0x00, sizeof(pmap_upnp_entry_t));
+      return;
+    }
+
+    if (lp->count == lp->size) {
+      int size = (lp->size > 0) ? lp->size * 2 : 64;
+      pmap_upnp_entry_t *entries =
+          realloc(lp->entries, size * sizeof(pmap_upnp_entry_t));
+      if (NULL == entries) {
+        lp->oom = 1;
+        return;
+      }
+      lp->entries = entries;
+      lp->size = size;
+    }
+
+    lp->cur.index = lp->count;
+    lp->cur.field.gateway_ip = lp->gateway_ip;
+    lp->entries[lp->count++] = lp->cur;
+    lp->page++;
+    if (lp->cur.field.external_port >= lp->next_port) {
+      lp->next_port = lp->cur.field.external_port + 1;
+    }
+    return;
+  }
+
+  if (!end) {
+    lp->field = _pmap_upnp_list_field(name);
+    lp->text_len = 0;
+  } else if (lp->field != PMAP_UPNP_LF_NONE) {
+    _pmap_upnp_list_store(lp);
+    lp->field = PMAP_UPNP_LF_NONE;
+  }
+}
+
+/**
+ * Text of the list document.
+ */
+static void _pmap_upnp_list_text(void *arg, const char *text, int len) {
+
+  pmap_upnp_list_t *lp = (pmap_upnp_list_t *)arg;
+
+  if (lp->field != PMAP_UPNP_LF_NONE) {
+    int n = sizeof(lp->text) - 1 - lp->text_len;
+    n = (len < n) ? len : n;
+    memcpy(lp->text + lp->text_len, text, n);
+    lp->text_len += n;
+  }
+}
+
+/**
+ * Tags of the SOAP envelope.
+ */
+static void _pmap_upnp_env_tag(void *arg, const char *name, int end) {
+
+  pmap_upnp_list_t *lp = (pmap_upnp_list_t *)arg;
+
+  if (strcmp(name, "NewPortListing") == 0) {
+    lp->in_listing = !end;
+    if (!end) {
+      pmap_xml_init(&lp->inner, _pmap_upnp_list_tag, _pmap_upnp_list_text,
+                    lp);
+    }
+  } else if (strcmp(name, "errorCode") == 0) {
+    lp->in_code = !end;
+  }
+}
+
+/**
+ * Text of the SOAP envelope, NewPortListing is unescaped already.
+ */
+static void _pmap_upnp_env_text(void *arg, const char *text, int len) {
+
+  pmap_upnp_list_t *lp = (pmap_upnp_list_t *)arg;
+
+  if (lp->in_listing) {
+    pmap_xml_feed(&lp->inner, text, len);
+  } else if (lp->in_code) {
+    int n = strlen(lp->code);
+    int room = sizeof(lp->code) - 1 - n;
+    memcpy(lp->code + n, text, (len < room) ? len : room);
+  }
+}
+
+/**
+ * HTTP sink of GetListOfPortMappings responses.
+ */
+static int _pmap_upnp_list_sink(const char *data, int len, void *arg) {
+
+  pmap_upnp_list_t *lp = (pmap_upnp_list_t *)arg;
+
+  pmap_xml_feed(&lp->outer, data, len);
+  if (lp->oom) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Read a range of the port mapping table of a known device with
+ * GetListOfPortMappings, see 'pmap_upnp_list'.
+ *
+ * @param ucmp The device location, its control URL is fetched if needed.
+ * @param protocol "TCP" or "UDP".
+ * @param start_port First external port of the range.
+ * @param end_port Last external port of the range.
+ * @param entries Receives the array of entries, NULL if there is none. The
+ * caller is responsible for freeing it with 'free' function.
+ * @param count Receives the number of entries.
+ * @param tmo Timeouts to use, NULL for the defaults.
+ * @return 0 on success, 1 on failure (caller should check errno value,
+ * ENOTSUP if the device has no WANIPConnection:2 service).
+ */
+int pmap_upnp_list_url(pmap_url_comp_t *ucmp, const char *protocol,
+                       int start_port, int end_port,
+                       pmap_upnp_entry_t **entries, int *count,
+                       const pmap_tmo_t *tmo) {
+
+  pmap_upnp_list_t lp;
+  char header[128];
+  int manage = 1;
+  int ret = 1;
+
+  memset(&lp, 0x00, sizeof(lp));
+  *entries = NULL;
+  *count = 0;
+
+  /* A control URL loaded from a saved context has no version */
+  if (NULL != ucmp->crtl_url && ucmp->version == 0) {
+    free(ucmp->crtl_url);
+    ucmp->crtl_url = NULL;
+  }
+  if (_pmap_upnp_ctrlurl(ucmp, tmo) != 0 || NULL == ucmp->crtl_url) {
+    errno = EGWUNSUPPORTED;
+    return 1;
+  }
+  if (ucmp->version < 2) {
+    errno = ENOTSUP;
+    return 1;
+  }
+
+  pmap_http_conn_t *conn = pmap_http_conn_create(ucmp->host, ucmp->port, tmo);
+  pbuffer_t *pbfr_body = pbfr_create(1024);
+  if (NULL == conn || NULL == pbfr_body) {
+    goto cleanup;
+  }
+
+  lp.gateway_ip = inet_addr(ucmp->host);
+  lp.next_port = start_port;
+  snprintf(header, sizeof(header), soap_header, ucmp->version,
+           "GetListOfPortMappings");
+
+  while (lp.next_port <= end_port) {
+
+    int http_status = 0;
+
+    pbfr_body->offset = 0;
+    pbfr_add(pbfr_body, soap_action_getlist, ucmp->version, lp.next_port,
+             end_port, protocol, manage, PMAP_UPNP_LIST_PAGE);
+    pbuffer_t *pbfr =
+        pmap_http_conn_post_create(conn, ucmp->crtl_url, header, pbfr_body);
+    if (NULL == pbfr) {
+      goto cleanup;
+    }
+
+    pmap_xml_init(&lp.outer, _pmap_upnp_env_tag, _pmap_upnp_env_text, &lp);
+    lp.in_listing = lp.in_code = 0;
+    lp.field = PMAP_UPNP_LF_NONE;
+    memset(lp.code, 0x00, sizeof(lp.code));
+    lp.page = 0;
+
+    int rc = pmap_http_conn_req_sink(conn, pbfr, &http_status, NULL,
+                                     _pmap_upnp_list_sink, &lp);
+    pbfr_destroy(pbfr);
+    if (rc != 0) {
+      goto cleanup; // caller should check errno value
+    }
+
+    if (http_status != 200) {
+      int upnp_error = atoi(lp.code);
+      if (upnp_error == PMAP_UPNP_ERR_NOT_FOUND) {
+        break; // Nothing (more) in the range
+      }
+      if (upnp_error == PMAP_UPNP_ERR_NOT_AUTHORIZED && manage) {
+        manage = 0; // Only the mappings of this host then
+        continue;
+      }
+      PMAP_DEBUG_ERROR("GetListOfPortMappings error %d", upnp_error);
+      errno = pmap_upnp_errno(http_status, upnp_error);
+      goto cleanup;
+    }
+
+    /* A short page is the last one */
+    if (lp.page < PMAP_UPNP_LIST_PAGE) {
+      break;
+    }
+  }
+
+  *entries = lp.entries;
+  *count = lp.count;
+  lp.entries = NULL;
+  ret = 0;
+
+cleanup:
+  if (ret != 0) {
+    free(lp.entries);
+  }
+  pbfr_destroy(pbfr_body);
+  pmap_http_conn_destroy(conn);
+
+  return ret;
+}
+
+/**
+ * Read a range of the port mapping table of an IGD:2 gateway at once
+ * (GetListOfPortMappings). Ranges larger than PMAP_UPNP_LIST_PAGE entries
+ * are read page by page over one keep-alive connection. The list is parsed
+ * while it arrives, only the entries are kept. Gateways without
+ * WANIPConnection:2 fail with ENOTSUP, walk them with
+ * 'pmap_upnp_iter_create'.
+ *
+ * @param gateway_ip The gateway.
+ * @param protocol "TCP" or "UDP".
+ * @param start_port First external port of the range.
+ * @param end_port Last external port of the range.
+ * @param entries Receives the array of entries, NULL if there is none. The
+ * caller is responsible for freeing it with 'free' function.
+ * @param count Receives the number of entries.
+ * @return 0 on success, 1 on failure (caller should check errno value).
+ */
+int pmap_upnp_list(uint32_t gateway_ip, const char *protocol, int start_port,
+                   int end_port, pmap_upnp_entry_t **entries, int *count) {
+
+  pmap_url_comp_t *urls = NULL;
+  int ret = 1;
+
+  *entries = NULL;
+  *count = 0;
+
+  if (_pmap_list_upnp(&urls, PMAP_UPNP_LIST_ALL, gateway_ip) != 0) {
+    return 1; // caller should check errno value
+  }
+
+  pmap_url_comp_t *device = _pmap_upnp_device(urls, gateway_ip);
+  if (NULL != device) {
+    ret = pmap_upnp_list_url(device, protocol, start_port, end_port, entries,
+                             count, NULL);
+  } else {
+    errno = EGWUNSUPPORTED;
+  }
+
+  pmap_list_free(urls);
+
+  return ret;
 }
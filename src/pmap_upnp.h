@@ -24,27 +24,131 @@
 #ifndef _PMAP_UPNP_H
 #define _PMAP_UPNP_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "buffer.h"
+#include "http.h"
 #include "pmap_cfg.h"
 #include "util.h"
 
 #define PMAP_UPNP_ACTION_ADDPORT 1
 #define PMAP_UPNP_ACTION_DELPORT 2
 #define PMAP_UPNP_ACTION_GETEXTIP 3
+#define PMAP_UPNP_ACTION_ADDANY 4 /* AddAnyPortMapping, IGD:2 only */
+#define PMAP_UPNP_ACTION_GETSPECIFIC 5 /* GetSpecificPortMappingEntry */
+#define PMAP_UPNP_ACTION_ENSURE 6 /* Batches: read, add if missing or stale */
 
 #define PMAP_UPNP_LIST_ALL 0
 #define PMAP_UPNP_LIST_IGD 1
 
+/* UPnP error codes (errorCode of a SOAP fault) */
+#define PMAP_UPNP_ERR_INVALID_ACTION 401 /* Invalid Action */
+#define PMAP_UPNP_ERR_INVALID_INDEX 713 /* SpecifiedArrayIndexInvalid */
+#define PMAP_UPNP_ERR_NO_SUCH_ENTRY 714 /* NoSuchEntryInArray */
+#define PMAP_UPNP_ERR_CONFLICT 718      /* ConflictInMappingEntry */
+#define PMAP_UPNP_ERR_NOT_AUTHORIZED 606 /* Action not authorized */
+#define PMAP_UPNP_ERR_NOT_FOUND 730     /* PortMappingNotFound (IGD:2) */
+
+/**
+ * Result of one entry of a batch ('pmap_upnp_addport_batch').
+ */
+typedef struct pmap_upnp_res_t_ {
+  int status;      /* 0 success, 1 failure */
+  int http_status; /* 0 if the gateway did not answer */
+  int upnp_error;  /* errorCode of the SOAP fault, 0 if none */
+  int written;     /* 1 if AddPortMapping changed the gateway (ensure) */
+} pmap_upnp_res_t;
+
+/**
+ * One entry of the port mapping table of a gateway. `field` can be passed
+ * as is to 'pmap_upnp_delport'.
+ */
+typedef struct pmap_upnp_entry_t_ {
+  int index;          /* Index in the table */
+  pmap_field_t field; /* lifetime_sec is the remaining lease, 0 = static */
+  char remote_host[40];
+  int enabled;
+  char description[64];
+} pmap_upnp_entry_t;
+
+/**
+ * Iterator over the port mapping table, see 'pmap_upnp_iter_create'.
+ */
+typedef struct pmap_upnp_iter_t_ {
+  pmap_http_conn_t *conn;
+  pbuffer_t *body; /* Request body, reused */
+  char ctrl_url[128];
+  int version; /* WANIPConnection service version */
+  uint32_t gateway_ip;
+  int index;      /* Index of the next entry returned */
+  int sent;       /* Index of the next request sent */
+  int window;     /* Requests allowed in flight now */
+  int depth;      /* Requests allowed in flight once keep-alive is seen */
+  bool done;      /* End of table or failure */
+  int err;        /* errno of the end, 0 at the end of the table */
+  int upnp_error; /* errorCode of the SOAP fault that ended the walk */
+} pmap_upnp_iter_t;
+
 void pmap_set_debug(uint8_t debug);
 int pmap_list_upnp(pmap_url_comp_t **urls, uint8_t only_igds);
 int pmap_list_igd(pmap_url_comp_t **urls);
 void pmap_list_free(pmap_url_comp_t *urls);
 
-int pmap_req_ctrlurl(pmap_url_comp_t *ucmp, char *ctrl_url, int size);
+int pmap_ssdp_search(void);
+pmap_url_comp_t *pmap_ssdp_read(int sockfd, uint32_t gateway_ip);
+
+int pmap_req_ctrlurl(pmap_url_comp_t *ucmp, char *ctrl_url, int size,
+                     const pmap_tmo_t *tmo);
+int pmap_upnp_desc_parse(pmap_url_comp_t *ucmp, const char *xml);
 int pmap_upnp_addport(pmap_field_t *pfield, char *error, int size);
 int pmap_upnp_delport(pmap_field_t *pfield, char *error, int size);
 int pmap_upnp_getexip(pmap_field_t *pfield, char *external_ip, int esize,
                       char *error, int size);
 pbuffer_t *pmap_upnp_action(int action, pmap_field_t *pfield, int *http_status);
+pbuffer_t *pmap_upnp_action_url(int action, pmap_field_t *pfield,
+                                pmap_url_comp_t *ucmp, int *http_status,
+                                const pmap_tmo_t *tmo);
+pbuffer_t *pmap_upnp_request(int action, const pmap_url_comp_t *ucmp,
+                             pmap_field_t *pfield);
+pbuffer_t *pmap_upnp_request_generic(const pmap_url_comp_t *ucmp, int index);
+void pmap_upnp_entry_parse(const char *xml, pmap_upnp_entry_t *entry);
+int pmap_upnp_getspecific(pmap_field_t *pfield, pmap_upnp_entry_t *entry,
+                          int *upnp_error);
+int pmap_upnp_getspecific_url(pmap_url_comp_t *ucmp, pmap_field_t *pfield,
+                              pmap_upnp_entry_t *entry, int *upnp_error,
+                              const pmap_tmo_t *tmo);
+int pmap_upnp_entry_current(const pmap_upnp_entry_t *entry,
+                            const pmap_field_t *pfield);
+int pmap_upnp_ensure_url(pmap_url_comp_t *ucmp, pmap_field_t *pfield,
+                         int *written, const pmap_tmo_t *tmo, char *error,
+                         int size);
+int pmap_upnp_addport_batch(pmap_field_t *pfields, int count,
+                            pmap_upnp_res_t *results);
+int pmap_upnp_delport_batch(pmap_field_t *pfields, int count,
+                            pmap_upnp_res_t *results);
+int pmap_upnp_addport_batch_url(pmap_url_comp_t *ucmp, pmap_field_t *pfields,
+                                int count, pmap_upnp_res_t *results,
+                                const pmap_tmo_t *tmo);
+int pmap_upnp_delport_batch_url(pmap_url_comp_t *ucmp, pmap_field_t *pfields,
+                                int count, pmap_upnp_res_t *results,
+                                const pmap_tmo_t *tmo);
+int pmap_upnp_ensure_batch_url(pmap_url_comp_t *ucmp, pmap_field_t *pfields,
+                               int count, pmap_upnp_res_t *results,
+                               const pmap_tmo_t *tmo);
+pmap_upnp_iter_t *pmap_upnp_iter_create(uint32_t gateway_ip, int depth);
+pmap_upnp_iter_t *pmap_upnp_iter_create_url(pmap_url_comp_t *ucmp, int depth,
+                                            const pmap_tmo_t *tmo);
+void pmap_upnp_iter_destroy(pmap_upnp_iter_t *it);
+int pmap_upnp_iter_next(pmap_upnp_iter_t *it, pmap_upnp_entry_t *entry);
+int pmap_upnp_list(uint32_t gateway_ip, const char *protocol, int start_port,
+                   int end_port, pmap_upnp_entry_t **entries, int *count);
+int pmap_upnp_list_url(pmap_url_comp_t *ucmp, const char *protocol,
+                       int start_port, int end_port,
+                       pmap_upnp_entry_t **entries, int *count,
+                       const pmap_tmo_t *tmo);
+int pmap_upnp_errno(int http_status, int upnp_error);
+int pmap_upnp_result(pbuffer_t *pbfr_recv, int http_status, char *external_ip,
+                     int esize, char *error, int size);
 
 #endif // _PMAP_UPNP_H
@@ -0,0 +1,630 @@
+/*
+ *    pmap_uring.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "pmap_cfg.h"
+#include "pmap_debug.h"
+#include "pmap_uring.h"
+
+#ifdef LINUX
+
+/* user_data of the requests whose completion is not reported */
+#define PMAP_URING_NO_SLOT 0
+
+/* -------------------------------------------- */
+
+static int _pmap_uring_setup(unsigned entries, struct io_uring_params *p) {
+
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _pmap_uring_enter(pmap_uring_t *ring, unsigned to_submit,
+                             unsigned min_complete, unsigned flags) {
+
+  ring->enters++;
+  return (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                      flags, NULL, 0);
+}
+
+/**
+ * Publish the queued entries and hand them to the kernel.
+ *
+ * @return 0 on success, 1 on failure (errno is set).
+ */
+int pmap_uring_submit(pmap_uring_t *ring) {
+
+  unsigned tail = *ring->sq_tail;
+  unsigned count = ring->sq_local - tail;
+
+  if (count == 0) {
+    return 0;
+  }
+
+  __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+
+  while (count > 0) {
+    int n = _pmap_uring_enter(ring, count, 0, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PMAP_DEBUG_ERROR("io_uring_enter() %s", strerror(errno));
+      return 1;
+    } else if (n == 0) {
+      break;
+    }
+    count -= n;
+  }
+
+  return 0;
+}
+
+/**
+ * Get `n` consecutive submission queue entries (a request and its linked
+ * timeout must not be split), submitting the queued ones if the queue is
+ * full.
+ */
+static struct io_uring_sqe *_pmap_uring_sqe(pmap_uring_t *ring, unsigned n) {
+
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (ring->sq_local + n - head > ring->sq_entries) {
+    if (pmap_uring_submit(ring) != 0) {
+      return NULL;
+    }
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local + n - head > ring->sq_entries) {
+      errno = EBUSY;
+      return NULL;
+    }
+  }
+
+  struct io_uring_sqe *sqes = ring->sqes;
+  struct io_uring_sqe *sqe = NULL;
+  for (unsigned i = 0; i < n; i++) {
+    unsigned index = ring->sq_local & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    memset(&sqes[index], 0x00, sizeof(struct io_uring_sqe));
+    if (i == 0) {
+      sqe = &sqes[index];
+    }
+    ring->sq_local++;
+  }
+
+  return sqe;
+}
+
+/**
+ * Next entry after `sqe` in the submission queue.
+ */
+static struct io_uring_sqe *_pmap_uring_next(pmap_uring_t *ring,
+                                             struct io_uring_sqe *sqe) {
+
+  struct io_uring_sqe *sqes = ring->sqes;
+  unsigned index = (unsigned)(sqe - sqes);
+
+  return &sqes[(index + 1) & *ring->sq_mask];
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Create an io_uring instance with `slots` requests in flight at most, each
+ * with a PMAP_URING_BUF_LEN receive buffer.
+ *
+ * Sockets need the fast poll of Linux 5.7, without it a receive would hold a
+ * kernel worker thread while it waits.
+ *
+ * @param entries Submission queue entries.
+ * @param slots Requests in flight.
+ * @return The ring, or NULL if io_uring is not available (errno is set,
+ * ENOSYS if the kernel is too old). The caller is responsible for freeing
+ * it by calling 'pmap_uring_destroy' function.
+ */
+pmap_uring_t *pmap_uring_create(int entries, int slots) {
+
+  struct io_uring_params p;
+
+  pmap_uring_t *ring = calloc(1, sizeof(pmap_uring_t));
+  if (NULL == ring) {
+    errno = ENOMEM;
+    PMAP_DEBUG_ERROR("Out of memory");
+    return NULL;
+  }
+  ring->fd = -1;
+
+  memset(&p, 0x00, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = 4 * slots; /* Request, linked timeout and cancel */
+
+  if ((ring->fd = _pmap_uring_setup(entries, &p)) < 0) {
+    PMAP_DEBUG_ERROR("io_uring_setup() %s", strerror(errno));
+    goto fail;
+  }
+  if (!(p.features & IORING_FEAT_FAST_POLL) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    errno = ENOSYS;
+    goto fail;
+  }
+
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_len > ring->sq_len) {
+      ring->sq_len = ring->cq_len;
+    }
+    ring->cq_len = 0;
+  }
+
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (MAP_FAILED == ring->sq_ptr) {
+    ring->sq_ptr = NULL;
+    goto fail;
+  }
+  if (ring->cq_len > 0) {
+    ring->cq_ptr =
+        mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (MAP_FAILED == ring->cq_ptr) {
+      ring->cq_ptr = NULL;
+      goto fail;
+    }
+  }
+  char *cq = (ring->cq_len > 0) ? ring->cq_ptr : ring->sq_ptr;
+
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (MAP_FAILED == ring->sqes) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  char *sq = ring->sq_ptr;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring->sq_entries = p.sq_entries;
+  ring->sq_local = *ring->sq_tail;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = cq + p.cq_off.cqes;
+
+  /* Slots and their receive buffers */
+  ring->slots = calloc(slots, sizeof(pmap_uring_slot_t));
+  ring->bufs = mmap(NULL, (size_t)slots * PMAP_URING_BUF_LEN,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (NULL == ring->slots || MAP_FAILED == ring->bufs) {
+    ring->bufs = NULL;
+    errno = ENOMEM;
+    goto fail;
+  }
+  ring->nslots = slots;
+  for (int i = 0; i < slots; i++) {
+    ring->slots[i].buf = ring->bufs + (size_t)i * PMAP_URING_BUF_LEN;
+    ring->slots[i].next = (i + 1 < slots) ? i + 1 : -1;
+  }
+  ring->free = 0;
+
+  /**
+   * One registered buffer covers every slot, a receive then skips the page
+   * pinning of each request. Registration may fail (RLIMIT_MEMLOCK), plain
+   * receives are used then.
+   */
+  struct iovec iov = {ring->bufs, (size_t)slots * PMAP_URING_BUF_LEN};
+  ring->fixed = (syscall(__NR_io_uring_register, ring->fd,
+                         IORING_REGISTER_BUFFERS, &iov, 1) == 0);
+  if (!ring->fixed) {
+    PMAP_DEBUG_LOG("Buffers not registered: %s\n", strerror(errno));
+  }
+
+  return ring;
+
+fail:
+  pmap_uring_destroy(ring);
+  return NULL;
+}
+
+/**
+ * Destroy a ring. Requests still in flight are cancelled and their
+ * completions awaited (bounded), so the kernel no longer uses the buffers.
+ *
+ * @param ring The ring, NULL is allowed.
+ */
+void pmap_uring_destroy(pmap_uring_t *ring) {
+
+  if (NULL == ring) {
+    return;
+  }
+
+  if (NULL != ring->slots && NULL != ring->sqes) {
+    for (int i = 0; i < ring->nslots; i++) {
+      if (ring->slots[i].busy) {
+        pmap_uring_cancel(ring, i);
+      }
+    }
+    pmap_uring_submit(ring);
+    for (int tries = 0; tries < 100; tries++) {
+      int busy = 0;
+      pmap_uring_reap(ring, NULL, NULL);
+      for (int i = 0; i < ring->nslots && !busy; i++) {
+        busy = ring->slots[i].busy;
+      }
+      if (!busy || _pmap_uring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+        break;
+      }
+    }
+  }
+
+  if (NULL != ring->slots) {
+    for (int i = 0; i < ring->nslots; i++) {
+      free(ring->slots[i].data);
+    }
+    free(ring->slots);
+  }
+  if (NULL != ring->bufs) {
+    munmap(ring->bufs, (size_t)ring->nslots * PMAP_URING_BUF_LEN);
+  }
+  if (NULL != ring->sqes) {
+    munmap(ring->sqes, ring->sqes_len);
+  }
+  if (NULL != ring->cq_ptr) {
+    munmap(ring->cq_ptr, ring->cq_len);
+  }
+  if (NULL != ring->sq_ptr) {
+    munmap(ring->sq_ptr, ring->sq_len);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+  free(ring);
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Take a free slot.
+ */
+static int _pmap_uring_slot(pmap_uring_t *ring, void *owner, int kind) {
+
+  int slot = ring->free;
+  if (slot < 0) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  pmap_uring_slot_t *s = &ring->slots[slot];
+  ring->free = s->next;
+  s->owner = owner;
+  s->kind = kind;
+  s->busy = 1;
+
+  return slot;
+}
+
+/**
+ * Give back a slot whose request completed.
+ */
+static void _pmap_uring_put(pmap_uring_t *ring, int slot) {
+
+  pmap_uring_slot_t *s = &ring->slots[slot];
+
+  free(s->data);
+  s->data = NULL;
+  s->owner = NULL;
+  s->busy = 0;
+  s->next = ring->free;
+  ring->free = slot;
+}
+
+/**
+ * Queue a request of a slot, followed by a linked timeout if `tmo_ms` is
+ * positive. The request completes with -ECANCELED when the timeout fires.
+ */
+static struct io_uring_sqe *_pmap_uring_prep(pmap_uring_t *ring, int slot,
+                                             int opcode, int fd, int tmo_ms) {
+
+  struct io_uring_sqe *sqe = _pmap_uring_sqe(ring, (tmo_ms > 0) ? 2 : 1);
+  if (NULL == sqe) {
+    return NULL;
+  }
+
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = (uint64_t)slot + 1;
+
+  if (tmo_ms > 0) {
+    pmap_uring_slot_t *s = &ring->slots[slot];
+    s->ts.tv_sec = tmo_ms / 1000;
+    s->ts.tv_nsec = (long long)(tmo_ms % 1000) * 1000000;
+
+    sqe->flags |= IOSQE_IO_LINK;
+    struct io_uring_sqe *link = _pmap_uring_next(ring, sqe);
+    link->opcode = IORING_OP_LINK_TIMEOUT;
+    link->fd = -1;
+    link->addr = (uint64_t)(uintptr_t)&s->ts;
+    link->len = 1;
+    link->user_data = PMAP_URING_NO_SLOT;
+  }
+
+  return sqe;
+}
+
+/**
+ * Queue a receive into the buffer of a new slot.
+ *
+ * @param ring The ring.
+ * @param owner Passed back to the completion callback.
+ * @param kind Passed back to the completion callback.
+ * @param fd A connected socket.
+ * @param tmo_ms Timeout, 0 for none.
+ * @return The slot, or -1 on failure (errno is set).
+ */
+int pmap_uring_read(pmap_uring_t *ring, void *owner, int kind, int fd,
+                    int tmo_ms) {
+
+  int slot = _pmap_uring_slot(ring, owner, kind);
+  if (slot < 0) {
+    return -1;
+  }
+
+  struct io_uring_sqe *sqe =
+      _pmap_uring_prep(ring, slot,
+                       ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_RECV, fd,
+                       tmo_ms);
+  if (NULL == sqe) {
+    _pmap_uring_put(ring, slot);
+    return -1;
+  }
+  sqe->addr = (uint64_t)(uintptr_t)ring->slots[slot].buf;
+  sqe->len = PMAP_URING_BUF_LEN;
+  sqe->buf_index = 0;
+
+  return slot;
+}
+
+/**
+ * Queue a send of a copy of `data`, see 'pmap_uring_read'. With a NULL
+ * `owner` the completion is not reported.
+ */
+int pmap_uring_send(pmap_uring_t *ring, void *owner, int kind, int fd,
+                    const void *data, int len, int tmo_ms) {
+
+  int slot = _pmap_uring_slot(ring, owner, kind);
+  if (slot < 0) {
+    return -1;
+  }
+
+  pmap_uring_slot_t *s = &ring->slots[slot];
+  if (NULL == (s->data = malloc(len))) {
+    _pmap_uring_put(ring, slot);
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(s->data, data, len);
+
+  struct io_uring_sqe *sqe =
+      _pmap_uring_prep(ring, slot, IORING_OP_SEND, fd, tmo_ms);
+  if (NULL == sqe) {
+    _pmap_uring_put(ring, slot);
+    return -1;
+  }
+  sqe->addr = (uint64_t)(uintptr_t)s->data;
+  sqe->len = len;
+  sqe->msg_flags = MSG_NOSIGNAL;
+
+  return slot;
+}
+
+/**
+ * Queue a connect, see 'pmap_uring_read'.
+ */
+int pmap_uring_connect(pmap_uring_t *ring, void *owner, int kind, int fd,
+                       const struct sockaddr_in *addr, int tmo_ms) {
+
+  int slot = _pmap_uring_slot(ring, owner, kind);
+  if (slot < 0) {
+    return -1;
+  }
+
+  pmap_uring_slot_t *s = &ring->slots[slot];
+  s->addr = *addr;
+
+  struct io_uring_sqe *sqe =
+      _pmap_uring_prep(ring, slot, IORING_OP_CONNECT, fd, tmo_ms);
+  if (NULL == sqe) {
+    _pmap_uring_put(ring, slot);
+    return -1;
+  }
+  sqe->addr = (uint64_t)(uintptr_t)&s->addr;
+  sqe->off = sizeof(s->addr);
+
+  return slot;
+}
+
+/**
+ * Queue a one shot poll, see 'pmap_uring_read'.
+ */
+int pmap_uring_poll(pmap_uring_t *ring, void *owner, int kind, int fd,
+                    short events) {
+
+  int slot = _pmap_uring_slot(ring, owner, kind);
+  if (slot < 0) {
+    return -1;
+  }
+
+  struct io_uring_sqe *sqe =
+      _pmap_uring_prep(ring, slot, IORING_OP_POLL_ADD, fd, 0);
+  if (NULL == sqe) {
+    _pmap_uring_put(ring, slot);
+    return -1;
+  }
+  sqe->poll32_events = (unsigned short)events;
+
+  return slot;
+}
+
+/**
+ * Orphan a slot and cancel its request, the slot is released by the
+ * completion and its owner is not called anymore.
+ *
+ * @param ring The ring.
+ * @param slot A slot returned by one of the pmap_uring_* requests.
+ */
+void pmap_uring_cancel(pmap_uring_t *ring, int slot) {
+
+  ring->slots[slot].owner = NULL;
+
+  struct io_uring_sqe *sqe = _pmap_uring_sqe(ring, 1);
+  if (NULL != sqe) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)slot + 1;
+    sqe->user_data = PMAP_URING_NO_SLOT;
+  }
+}
+
+/**
+ * Queue the close of a socket after the requests queued on it, a request
+ * still in the submission queue is never applied to a new socket that got
+ * the same number. Closes it at once if the queue is full.
+ */
+void pmap_uring_close(pmap_uring_t *ring, int fd) {
+
+  struct io_uring_sqe *sqe = _pmap_uring_sqe(ring, 1);
+  if (NULL == sqe) {
+    close(fd);
+    return;
+  }
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+  sqe->user_data = PMAP_URING_NO_SLOT;
+}
+
+/**
+ * Handle the completions available without waiting.
+ *
+ * @param ring The ring.
+ * @param cb Called for each completion of a slot still owned, may queue new
+ * requests.
+ * @param arg Passed to `cb`.
+ * @return The number of completions.
+ */
+int pmap_uring_reap(pmap_uring_t *ring, pmap_uring_cb cb, void *arg) {
+
+  struct io_uring_cqe *cqes = ring->cqes;
+  int count = 0;
+
+  while (true) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+
+    struct io_uring_cqe cqe = cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    count++;
+
+    if (cqe.user_data == PMAP_URING_NO_SLOT) {
+      continue;
+    }
+
+    int slot = (int)(cqe.user_data - 1);
+    pmap_uring_slot_t *s = &ring->slots[slot];
+    void *owner = s->owner;
+    int kind = s->kind;
+
+    _pmap_uring_put(ring, slot);
+    if (NULL != owner && NULL != cb) {
+      cb(owner, kind, cqe.res, s->buf, arg);
+    }
+  }
+
+  return count;
+}
+
+#else
+
+/* -------------------------------------------- */
+
+pmap_uring_t *pmap_uring_create(int entries, int slots) {
+
+  errno = ENOSYS; // io_uring is Linux only
+  return NULL;
+}
+
+void pmap_uring_destroy(pmap_uring_t *ring) {}
+
+int pmap_uring_read(pmap_uring_t *ring, void *owner, int kind, int fd,
+                    int tmo_ms) {
+
+  errno = ENOSYS;
+  return -1;
+}
+
+int pmap_uring_send(pmap_uring_t *ring, void *owner, int kind, int fd,
+                    const void *data, int len, int tmo_ms) {
+
+  errno = ENOSYS;
+  return -1;
+}
+
+int pmap_uring_connect(pmap_uring_t *ring, void *owner, int kind, int fd,
+                       const struct sockaddr_in *addr, int tmo_ms) {
+
+  errno = ENOSYS;
+  return -1;
+}
+
+int pmap_uring_poll(pmap_uring_t *ring, void *owner, int kind, int fd,
+                    short events) {
+
+  errno = ENOSYS;
+  return -1;
+}
+
+void pmap_uring_cancel(pmap_uring_t *ring, int slot) {}
+
+void pmap_uring_close(pmap_uring_t *ring, int fd) { close(fd); }
+
+int pmap_uring_submit(pmap_uring_t *ring) { return 0; }
+
+int pmap_uring_reap(pmap_uring_t *ring, pmap_uring_cb cb, void *arg) {
+
+  return 0;
+}
+
+#endif // LINUX
@@ -0,0 +1,105 @@
+/*
+ *    pmap_uring.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_URING_H
+#define _PMAP_URING_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#ifdef LINUX
+#include <linux/io_uring.h>
+#endif
+
+/**
+ * One request in flight. The slot, not the caller, owns everything the
+ * kernel reads or writes after submission (receive buffer, address, timeout,
+ * data sent), so the caller may go away at any time: 'pmap_uring_cancel'
+ * orphans the slot and it is released by its completion.
+ */
+typedef struct pmap_uring_slot_t_ {
+  void *owner; /* NULL while free or once orphaned */
+  int kind;    /* Meaning defined by the owner */
+  int busy;    /* Request queued or in flight */
+  int next;    /* Next free slot, -1 at the end */
+  char *buf;   /* PMAP_URING_BUF_LEN bytes, registered with the kernel */
+  char *data;  /* Copy of the data being sent */
+  struct sockaddr_in addr;
+#ifdef LINUX
+  struct __kernel_timespec ts; /* Linked timeout */
+#endif
+} pmap_uring_slot_t;
+
+/**
+ * io_uring instance, set up with raw system calls (no liburing).
+ */
+typedef struct pmap_uring_t_ {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned sq_local; /* Tail of the queued entries not published yet */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  void *sq_ptr;
+  size_t sq_len;
+  void *cq_ptr;
+  size_t cq_len;
+  void *sqes;
+  size_t sqes_len;
+  void *cqes;
+  pmap_uring_slot_t *slots;
+  int nslots;
+  int free;     /* First free slot, -1 if none */
+  char *bufs;   /* Receive buffers of all slots */
+  int fixed;    /* Receive buffers are registered */
+  uint64_t enters; /* io_uring_enter() calls */
+} pmap_uring_t;
+
+/**
+ * Called by 'pmap_uring_reap' for each completion of a slot still owned.
+ * `res` is the result of the request (negative errno on failure), `buf` the
+ * received data. The slot is already free again.
+ */
+typedef void (*pmap_uring_cb)(void *owner, int kind, int res, const char *buf,
+                              void *arg);
+
+pmap_uring_t *pmap_uring_create(int entries, int slots);
+void pmap_uring_destroy(pmap_uring_t *ring);
+int pmap_uring_read(pmap_uring_t *ring, void *owner, int kind, int fd,
+                    int tmo_ms);
+int pmap_uring_send(pmap_uring_t *ring, void *owner, int kind, int fd,
+                    const void *data, int len, int tmo_ms);
+int pmap_uring_connect(pmap_uring_t *ring, void *owner, int kind, int fd,
+                       const struct sockaddr_in *addr, int tmo_ms);
+int pmap_uring_poll(pmap_uring_t *ring, void *owner, int kind, int fd,
+                    short events);
+void pmap_uring_cancel(pmap_uring_t *ring, int slot);
+void pmap_uring_close(pmap_uring_t *ring, int fd);
+int pmap_uring_submit(pmap_uring_t *ring);
+int pmap_uring_reap(pmap_uring_t *ring, pmap_uring_cb cb, void *arg);
+
+#endif // _PMAP_URING_H
@@ -0,0 +1,318 @@
+/*
+ *    pmap_wheel.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pmap_wheel.h"
+
+#define LEVEL_SHIFT(level) ((level) * PMAP_WHEEL_BITS)
+
+/* -------------------------------------------- */
+
+void pmap_timer_list_init(pmap_timer_t *head) {
+
+  head->next = head;
+  head->prev = head;
+  head->slot = -1;
+}
+
+int pmap_timer_list_empty(const pmap_timer_t *head) {
+
+  return head->next == head;
+}
+
+/**
+ * Append a timer to the tail of a list.
+ */
+void pmap_timer_list_add(pmap_timer_t *head, pmap_timer_t *timer) {
+
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+void pmap_timer_list_del(pmap_timer_t *timer) {
+
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer;
+  timer->prev = timer;
+}
+
+/* -------------------------------------------- */
+
+/**
+ * Initialize an empty wheel.
+ *
+ * @param wheel The wheel.
+ * @param tick_ms Resolution in milliseconds.
+ * @param now_ms Current time (pmap_ut_now_ms), becomes tick 0.
+ */
+void pmap_wheel_init(pmap_wheel_t *wheel, int tick_ms, int64_t now_ms) {
+
+  wheel->base_ms = now_ms;
+  wheel->tick_ms = tick_ms;
+  wheel->tick = 0;
+  wheel->count = 0;
+
+  for (int level = 0; level < PMAP_WHEEL_LEVELS; level++) {
+    wheel->used[level] = 0;
+    for (int i = 0; i < PMAP_WHEEL_SIZE; i++) {
+      pmap_timer_list_init(&wheel->slots[level][i]);
+    }
+  }
+}
+
+/**
+ * Put a timer in the slot of its expiry tick, relative to the current tick.
+ */
+static void _pmap_wheel_insert(pmap_wheel_t *wheel, pmap_timer_t *timer) {
+
+  uint64_t expires = timer->expires;
+  int level, index;
+
+  if (expires < wheel->tick) {
+    expires = wheel->tick; // Already due, expire on the next tick
+  } else if (expires - wheel->tick >= PMAP_WHEEL_SPAN) {
+    expires = wheel->tick + PMAP_WHEEL_SPAN - 1;
+  }
+
+  uint64_t delta = expires - wheel->tick;
+  for (level = 0; level < PMAP_WHEEL_LEVELS - 1; level++) {
+    if (delta < ((uint64_t)1 << LEVEL_SHIFT(level + 1))) {
+      break;
+    }
+  }
+
+  index = (expires >> LEVEL_SHIFT(level)) & PMAP_WHEEL_MASK;
+  timer->expires = expires;
+  timer->slot = level * PMAP_WHEEL_SIZE + index;
+  pmap_timer_list_add(&wheel->slots[level][index], timer);
+  wheel->used[level] |= (uint64_t)1 << index;
+}
+
+/**
+ * Remove a timer from its slot, keeping the slot bitmap up to date.
+ */
+static void _pmap_wheel_unlink(pmap_wheel_t *wheel, pmap_timer_t *timer) {
+
+  int level = timer->slot / PMAP_WHEEL_SIZE;
+  int index = timer->slot % PMAP_WHEEL_SIZE;
+
+  pmap_timer_list_del(timer);
+  timer->slot = -1;
+  if (pmap_timer_list_empty(&wheel->slots[level][index])) {
+    wheel->used[level] &= ~((uint64_t)1 << index);
+  }
+}
+
+/**
+ * Schedule a timer, a pending timer is moved.
+ *
+ * @param wheel The wheel.
+ * @param timer The timer.
+ * @param expires_ms Expiry time (pmap_ut_now_ms), rounded up to a tick.
+ */
+void pmap_wheel_add(pmap_wheel_t *wheel, pmap_timer_t *timer,
+                    int64_t expires_ms) {
+
+  if (timer->slot >= 0) {
+    pmap_wheel_del(wheel, timer);
+  }
+
+  int64_t offset = expires_ms - wheel->base_ms;
+  timer->expires =
+      (offset <= 0) ? 0 : (uint64_t)((offset + wheel->tick_ms - 1) /
+                                     wheel->tick_ms);
+
+  _pmap_wheel_insert(wheel, timer);
+  wheel->count++;
+}
+
+/**
+ * Cancel a pending timer, nothing is done if it is not pending.
+ */
+void pmap_wheel_del(pmap_wheel_t *wheel, pmap_timer_t *timer) {
+
+  if (timer->slot >= 0) {
+    _pmap_wheel_unlink(wheel, timer);
+    wheel->count--;
+  }
+}
+
+/**
+ * Move the timers of a slot of an upper level to the levels below.
+ */
+static void _pmap_wheel_cascade(pmap_wheel_t *wheel, int level, int index) {
+
+  pmap_timer_t *head = &wheel->slots[level][index];
+
+  while (!pmap_timer_list_empty(head)) {
+    pmap_timer_t *timer = head->next;
+    _pmap_wheel_unlink(wheel, timer);
+    _pmap_wheel_insert(wheel, timer);
+  }
+}
+
+/**
+ * Advance the wheel to `now_ms` and move every expired timer to `due`.
+ *
+ * @param wheel The wheel.
+ * @param now_ms Current time (pmap_ut_now_ms).
+ * @param due List head (see 'pmap_timer_list_init'), expired timers are
+ * appended and are not pending anymore.
+ * @return Number of expired timers.
+ */
+int pmap_wheel_expire(pmap_wheel_t *wheel, int64_t now_ms, pmap_timer_t *due) {
+
+  int expired = 0;
+
+  if (now_ms < wheel->base_ms) {
+    return 0;
+  }
+  uint64_t now = (uint64_t)(now_ms - wheel->base_ms) / wheel->tick_ms;
+
+  while (wheel->tick <= now) {
+
+    if (wheel->count == 0) {
+      wheel->tick = now + 1; // Nothing to expire, jump
+      break;
+    }
+
+    int index = wheel->tick & PMAP_WHEEL_MASK;
+
+    /* Level 0 wrapped, cascade the next slot of each level above */
+    for (int level = 1; index == 0 && level < PMAP_WHEEL_LEVELS; level++) {
+      index = (wheel->tick >> LEVEL_SHIFT(level)) & PMAP_WHEEL_MASK;
+      _pmap_wheel_cascade(wheel, level, index);
+    }
+    index = wheel->tick & PMAP_WHEEL_MASK;
+
+    pmap_timer_t *head = &wheel->slots[0][index];
+    while (!pmap_timer_list_empty(head)) {
+      pmap_timer_t *timer = head->next;
+      _pmap_wheel_unlink(wheel, timer);
+      pmap_timer_list_add(due, timer);
+      wheel->count--;
+      expired++;
+    }
+
+    wheel->tick++;
+  }
+
+  return expired;
+}
+
+/**
+ * Take timers that expire before `until_ms` early, e.g. to batch them with
+ * timers that just expired. Only the level 0 (the next PMAP_WHEEL_SIZE ticks)
+ * is searched.
+ *
+ * @param wheel The wheel.
+ * @param until_ms Latest expiry time taken.
+ * @param match Called for each candidate, the timer is taken if it returns
+ * non zero.
+ * @param arg Passed to `match`.
+ * @param due List head, taken timers are appended.
+ * @return Number of timers taken.
+ */
+int pmap_wheel_collect(pmap_wheel_t *wheel, int64_t until_ms,
+                       pmap_timer_match match, void *arg, pmap_timer_t *due) {
+
+  int taken = 0;
+
+  if (until_ms < wheel->base_ms) {
+    return 0;
+  }
+  uint64_t until = (uint64_t)(until_ms - wheel->base_ms) / wheel->tick_ms;
+
+  for (uint64_t tick = wheel->tick;
+       tick <= until && tick < wheel->tick + PMAP_WHEEL_SIZE; tick++) {
+
+    int index = tick & PMAP_WHEEL_MASK;
+    if (!(wheel->used[0] & ((uint64_t)1 << index))) {
+      continue;
+    }
+
+    pmap_timer_t *head = &wheel->slots[0][index];
+    pmap_timer_t *timer = head->next;
+    while (timer != head) {
+      pmap_timer_t *next = timer->next;
+      if (timer->expires <= until && match(timer, arg)) {
+        _pmap_wheel_unlink(wheel, timer);
+        pmap_timer_list_add(due, timer);
+        wheel->count--;
+        taken++;
+      }
+      timer = next;
+    }
+  }
+
+  return taken;
+}
+
+/**
+ * Time of the next wake up. That is the earliest expiry if it is within the
+ * level 0, otherwise the next cascade (call 'pmap_wheel_expire' then and ask
+ * again), so a caller never sleeps past a timer.
+ *
+ * @param wheel The wheel.
+ * @return The wake up time (pmap_ut_now_ms), -1 if no timer is pending.
+ */
+int64_t pmap_wheel_next(const pmap_wheel_t *wheel) {
+
+  uint64_t next = UINT64_MAX;
+
+  if (wheel->count == 0) {
+    return -1;
+  }
+
+  for (int level = 0; level < PMAP_WHEEL_LEVELS; level++) {
+
+    uint64_t used = wheel->used[level];
+    if (used == 0) {
+      continue;
+    }
+
+    /* Ticks of a slot at this level, and the slot of the current tick */
+    uint64_t unit = (uint64_t)1 << LEVEL_SHIFT(level);
+    uint64_t cur = wheel->tick >> LEVEL_SHIFT(level);
+
+    /* The slot of the current tick is still to be cascaded at its start */
+    int first = (level == 0 || (wheel->tick & (unit - 1)) == 0) ? 0 : 1;
+
+    for (int k = first; k <= PMAP_WHEEL_SIZE; k++) {
+      if (used & ((uint64_t)1 << ((cur + k) & PMAP_WHEEL_MASK))) {
+        uint64_t tick = (level == 0) ? cur + k : (cur + k) * unit;
+        if (tick < next) {
+          next = tick;
+        }
+        break;
+      }
+    }
+  }
+
+  return wheel->base_ms + (int64_t)next * wheel->tick_ms;
+}
@@ -0,0 +1,77 @@
+/*
+ *    pmap_wheel.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_WHEEL_H
+#define _PMAP_WHEEL_H
+
+#include <stdint.h>
+
+/**
+ * Hierarchical timer wheel, PMAP_WHEEL_LEVELS levels of PMAP_WHEEL_SIZE slots.
+ * Level 0 has one slot per tick, every level above covers PMAP_WHEEL_SIZE
+ * times more and is cascaded down when the level below wraps. Adding and
+ * removing a timer is O(1), expiring costs O(1) per tick plus the timers.
+ */
+#define PMAP_WHEEL_BITS 6
+#define PMAP_WHEEL_SIZE (1 << PMAP_WHEEL_BITS)
+#define PMAP_WHEEL_MASK (PMAP_WHEEL_SIZE - 1)
+#define PMAP_WHEEL_LEVELS 4
+#define PMAP_WHEEL_SPAN ((uint64_t)1 << (PMAP_WHEEL_BITS * PMAP_WHEEL_LEVELS))
+
+/**
+ * Timer, to be embedded in the structure it belongs to. Also used as the head
+ * of a (circular, doubly linked) timer list.
+ */
+typedef struct pmap_timer_t_ {
+  struct pmap_timer_t_ *next;
+  struct pmap_timer_t_ *prev;
+  uint64_t expires; /* Tick */
+  int slot;         /* level * PMAP_WHEEL_SIZE + index, -1 if not pending */
+} pmap_timer_t;
+
+typedef struct pmap_wheel_t_ {
+  int64_t base_ms; /* Time of tick 0 */
+  int tick_ms;
+  uint64_t tick; /* Next tick to be expired */
+  int count;     /* Pending timers */
+  uint64_t used[PMAP_WHEEL_LEVELS]; /* Non-empty slots */
+  pmap_timer_t slots[PMAP_WHEEL_LEVELS][PMAP_WHEEL_SIZE];
+} pmap_wheel_t;
+
+typedef int (*pmap_timer_match)(pmap_timer_t *timer, void *arg);
+
+void pmap_timer_list_init(pmap_timer_t *head);
+int pmap_timer_list_empty(const pmap_timer_t *head);
+void pmap_timer_list_add(pmap_timer_t *head, pmap_timer_t *timer);
+void pmap_timer_list_del(pmap_timer_t *timer);
+
+void pmap_wheel_init(pmap_wheel_t *wheel, int tick_ms, int64_t now_ms);
+void pmap_wheel_add(pmap_wheel_t *wheel, pmap_timer_t *timer,
+                    int64_t expires_ms);
+void pmap_wheel_del(pmap_wheel_t *wheel, pmap_timer_t *timer);
+int pmap_wheel_expire(pmap_wheel_t *wheel, int64_t now_ms, pmap_timer_t *due);
+int pmap_wheel_collect(pmap_wheel_t *wheel, int64_t until_ms,
+                       pmap_timer_match match, void *arg, pmap_timer_t *due);
+int64_t pmap_wheel_next(const pmap_wheel_t *wheel);
+
+#endif // _PMAP_WHEEL_H
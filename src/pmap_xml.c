@@ -0,0 +1,215 @@
+/*
+ *    pmap_xml.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pmap_xml.h"
+
+/* Tokenizer states */
+#define PMAP_XML_TEXT 0
+#define PMAP_XML_TAG 1
+#define PMAP_XML_ENTITY 2
+#define PMAP_XML_CDATA 3
+
+/**
+ * Initialize a tokenizer.
+ *
+ * @param xml The tokenizer.
+ * @param on_tag Called for start and end tags, may be NULL.
+ * @param on_text Called for character data, may be NULL.
+ * @param arg Passed to the callbacks.
+ */
+void pmap_xml_init(pmap_xml_t *xml, pmap_xml_tag_cb on_tag,
+                   pmap_xml_text_cb on_text, void *arg) {
+
+  memset(xml, 0x00, sizeof(pmap_xml_t));
+  xml->state = PMAP_XML_TEXT;
+  xml->on_tag = on_tag;
+  xml->on_text = on_text;
+  xml->arg = arg;
+}
+
+/**
+ * Pass character data to the text callback.
+ */
+static void _pmap_xml_text(pmap_xml_t *xml, const char *text, int len) {
+
+  if (len > 0 && NULL != xml->on_text) {
+    xml->on_text(xml->arg, text, len);
+  }
+}
+
+/**
+ * A complete tag is in `xml->tag`, report it.
+ */
+static void _pmap_xml_tag(pmap_xml_t *xml) {
+
+  char *name = xml->tag;
+  int end = 0, empty = 0;
+
+  xml->tag[xml->tag_len] = '\0';
+
+  /* Declarations, comments and processing instructions */
+  if (name[0] == '?' || name[0] == '!') {
+    return;
+  }
+
+  if (name[0] == '/') {
+    end = 1;
+    name++;
+  }
+  if (xml->tag_len > 0 && xml->tag[xml->tag_len - 1] == '/') {
+    empty = 1;
+  }
+
+  name[strcspn(name, " \t\r\n/")] = '\0';
+  char *colon = strchr(name, ':');
+  if (NULL != colon) {
+    name = colon + 1;
+  }
+
+  if (NULL != xml->on_tag) {
+    xml->on_tag(xml->arg, name, end);
+    if (empty) {
+      xml->on_tag(xml->arg, name, 1);
+    }
+  }
+}
+
+/**
+ * A complete entity is in `xml->ent`, pass the character to the text
+ * callback. Unknown entities are passed as is.
+ */
+static void _pmap_xml_entity(pmap_xml_t *xml) {
+
+  static const struct {
+    const char *name;
+    char c;
+  } entities[] = {{"lt", '<'},   {"gt", '>'},    {"amp", '&'},
+                  {"quot", '"'}, {"apos", '\''}, {NULL, 0}};
+
+  xml->ent[xml->ent_len] = '\0';
+
+  for (int i = 0; entities[i].name != NULL; i++) {
+    if (strcmp(xml->ent, entities[i].name) == 0) {
+      _pmap_xml_text(xml, &entities[i].c, 1);
+      return;
+    }
+  }
+
+  if (xml->ent[0] == '#') {
+    char c = (char)((xml->ent[1] == 'x') ? strtol(xml->ent + 2, NULL, 16)
+                                         : strtol(xml->ent + 1, NULL, 10));
+    _pmap_xml_text(xml, &c, 1);
+    return;
+  }
+
+  _pmap_xml_text(xml, "&", 1);
+  _pmap_xml_text(xml, xml->ent, xml->ent_len);
+  _pmap_xml_text(xml, ";", 1);
+}
+
+/**
+ * Feed the next piece of the document.
+ *
+ * @param xml The tokenizer.
+ * @param data The piece, it may end anywhere (inside a tag or an entity).
+ * @param len Length of the piece.
+ */
+void pmap_xml_feed(pmap_xml_t *xml, const char *data, int len) {
+
+  int run = 0; /* Start of the pending run of character data */
+
+  for (int i = 0; i < len; i++) {
+
+    char c = data[i];
+
+    switch (xml->state) {
+
+    case PMAP_XML_TEXT:
+      if (c == '<' || c == '&') {
+        _pmap_xml_text(xml, data + run, i - run);
+        xml->state = (c == '<') ? PMAP_XML_TAG : PMAP_XML_ENTITY;
+        xml->tag_len = xml->ent_len = 0;
+      }
+      break;
+
+    case PMAP_XML_TAG:
+      if (c == '>') {
+        _pmap_xml_tag(xml);
+        xml->state = PMAP_XML_TEXT;
+        run = i + 1;
+        break;
+      }
+      if (xml->tag_len < PMAP_XML_NAME_LEN - 1) {
+        xml->tag[xml->tag_len++] = c;
+      }
+      if (xml->tag_len == 8 && memcmp(xml->tag, "![CDATA[", 8) == 0) {
+        xml->state = PMAP_XML_CDATA;
+        xml->cdata_end = 0;
+        run = i + 1;
+      }
+      break;
+
+    case PMAP_XML_ENTITY:
+      if (c == ';') {
+        _pmap_xml_entity(xml);
+        xml->state = PMAP_XML_TEXT;
+        run = i + 1;
+      } else if (xml->ent_len < (int)sizeof(xml->ent) - 1) {
+        xml->ent[xml->ent_len++] = c;
+      }
+      break;
+
+    case PMAP_XML_CDATA:
+      if (c == ']' && xml->cdata_end < 2) {
+        /* Pass what came before, the ']' may start the end marker */
+        _pmap_xml_text(xml, data + run, i - run);
+        xml->cdata_end++;
+        run = i + 1;
+      } else if (c == '>' && xml->cdata_end == 2) {
+        xml->state = PMAP_XML_TEXT;
+        xml->cdata_end = 0;
+        run = i + 1;
+      } else if (xml->cdata_end > 0) {
+        /* Not the end marker, pass the ']' held back ("]]]" keeps two) */
+        int held = (c == ']') ? 1 : xml->cdata_end;
+        for (int k = 0; k < held; k++) {
+          _pmap_xml_text(xml, "]", 1);
+        }
+        if (c != ']') {
+          xml->cdata_end = 0;
+          run = i;
+        } else {
+          run = i + 1;
+        }
+      }
+      break;
+    }
+  }
+
+  if (xml->state == PMAP_XML_TEXT || xml->state == PMAP_XML_CDATA) {
+    _pmap_xml_text(xml, data + run, len - run);
+  }
+}
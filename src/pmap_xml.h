@@ -0,0 +1,62 @@
+/*
+ *    pmap_xml.h
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+#ifndef _PMAP_XML_H
+#define _PMAP_XML_H
+
+#define PMAP_XML_NAME_LEN 64 /* Longer tag names are cut */
+
+/**
+ * Called for each start tag (`end` is 0) and end tag (`end` is 1), `name` is
+ * the local name (namespace prefix removed). An empty element calls it twice.
+ */
+typedef void (*pmap_xml_tag_cb)(void *arg, const char *name, int end);
+
+/**
+ * Called for each run of character data, entities are decoded and CDATA
+ * sections are passed as is.
+ */
+typedef void (*pmap_xml_text_cb)(void *arg, const char *text, int len);
+
+/**
+ * Incremental XML tokenizer. The document is fed in pieces of any size with
+ * 'pmap_xml_feed', nothing is kept but the tag being read. It is meant for
+ * the small and well known documents of UPnP, not as a validating parser.
+ */
+typedef struct pmap_xml_t_ {
+  int state;
+  char tag[PMAP_XML_NAME_LEN]; /* Tag being read */
+  int tag_len;
+  char ent[8]; /* Entity being read */
+  int ent_len;
+  int cdata_end; /* Characters of "]]>" matched in a CDATA section */
+  pmap_xml_tag_cb on_tag;
+  pmap_xml_text_cb on_text;
+  void *arg;
+} pmap_xml_t;
+
+void pmap_xml_init(pmap_xml_t *xml, pmap_xml_tag_cb on_tag,
+                   pmap_xml_text_cb on_text, void *arg);
+void pmap_xml_feed(pmap_xml_t *xml, const char *data, int len);
+
+#endif // _PMAP_XML_H
@@ -24,17 +24,27 @@
 #ifndef UPNP_MSG_H
 #define UPNP_MSG_H
 
+#include "pmap_cfg.h"
+
+#define UPNP_MSG_STR_(x) #x
+#define UPNP_MSG_STR(x) UPNP_MSG_STR_(x)
+
 /* M-SEARCH body */
 const static char *m_search = "M-SEARCH * HTTP/1.1\r\n"
                               "HOST: 239.255.255.250:1900\r\n"
                               "MAN: \"ssdp:discover\"\r\n"
-                              "MX: 5\r\n"
+                              "MX: " UPNP_MSG_STR(PMAP_SSDP_MX) "\r\n"
                               "ST: upnp:rootdevice\r\n"
                               "\r\n";
 
+/* SOAPAction header, placeholders for the service version and action name */
+const static char *soap_header =
+    "SOAPAction: \"urn:schemas-upnp-org:service:WANIPConnection:%d#%s\"\r\n";
+
 /**
  * SOAP request body for adding a port mapping in the context of UPnP. It
- * includes placeholders for various parameters such as external port, protocol,
+ * includes placeholders for the service version and various parameters such
+ * as external port, protocol,
  * internal port, internal client IP, enabled status, port mapping description,
  * and lease duration. Later we can fill in these placeholders with specific
  * values to create a SOAP HTTP POST request.
@@ -46,7 +56,7 @@ const static char *soap_action_add =
     "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n"
     "  <s:Body>\r\n"
     "    <u:AddPortMapping "
-    "      xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:1\">\r\n"
+    "      xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:%d\">\r\n"
     "      <NewRemoteHost></NewRemoteHost>\r\n"
     "      <NewExternalPort>%d</NewExternalPort>\r\n"
     "      <NewProtocol>%s</NewProtocol>\r\n"
@@ -59,10 +69,36 @@ const static char *soap_action_add =
     "  </s:Body>\r\n"
     "</s:Envelope>\r\n";
 
+/**
+ * SOAP request body for adding a port mapping on any free external port
+ * (WANIPConnection:2 only), the external port is the preferred one. Same
+ * placeholders as `soap_action_add`.
+ */
+const static char *soap_action_addany =
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+    "<s:Envelope "
+    "xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n"
+    "  <s:Body>\r\n"
+    "    <u:AddAnyPortMapping "
+    "      xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:%d\">\r\n"
+    "      <NewRemoteHost></NewRemoteHost>\r\n"
+    "      <NewExternalPort>%d</NewExternalPort>\r\n"
+    "      <NewProtocol>%s</NewProtocol>\r\n"
+    "      <NewInternalPort>%d</NewInternalPort>\r\n"
+    "      <NewInternalClient>%s</NewInternalClient>\r\n"
+    "      <NewEnabled>1</NewEnabled>\r\n"
+    "      <NewPortMappingDescription>pMAP</NewPortMappingDescription>\r\n"
+    "      <NewLeaseDuration>%d</NewLeaseDuration>\r\n"
+    "    </u:AddAnyPortMapping>\r\n"
+    "  </s:Body>\r\n"
+    "</s:Envelope>\r\n";
+
 /**
  * SOAP request body for delete a port mapping in the context of UPnP. It
- * includes placeholders for  external port and protocol. Later we can fill in
- * these placeholders with specific values to create a SOAP HTTP POST request.
+ * includes placeholders for the service version, external port and protocol.
+ * Later we can fill in these placeholders with specific values to create a
+ * SOAP HTTP POST request.
  */
 const static char *soap_action_del =
     "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
@@ -71,7 +107,7 @@ const static char *soap_action_del =
     "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n"
     "  <s:Body>\r\n"
     "    <u:DeletePortMapping "
-    "      xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:1\">\r\n"
+    "      xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:%d\">\r\n"
     "      <NewRemoteHost></NewRemoteHost>\r\n"
     "      <NewExternalPort>%d</NewExternalPort>\r\n"
     "      <NewProtocol>%s</NewProtocol>\r\n"
@@ -80,9 +116,28 @@ const static char *soap_action_del =
     "</s:Envelope>\r\n";
 
 /**
- * SOAP request body for delete a port mapping in the context of UPnP. It
- * includes placeholders for  external port and protocol. Later we can fill in
- * these placeholders with specific values to create a SOAP HTTP POST request.
+ * SOAP request body for reading the port mapping of one external port in the
+ * context of UPnP. It includes placeholders for the service version, external
+ * port and protocol.
+ */
+const static char *soap_action_getspecific =
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+    "<s:Envelope "
+    "xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n"
+    "  <s:Body>\r\n"
+    "    <u:GetSpecificPortMappingEntry "
+    "      xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:%d\">\r\n"
+    "      <NewRemoteHost></NewRemoteHost>\r\n"
+    "      <NewExternalPort>%d</NewExternalPort>\r\n"
+    "      <NewProtocol>%s</NewProtocol>\r\n"
+    "    </u:GetSpecificPortMappingEntry>\r\n"
+    "  </s:Body>\r\n"
+    "</s:Envelope>\r\n";
+
+/**
+ * SOAP request body for getting the external IP address in the context of
+ * UPnP. It includes a placeholder for the service version.
  */
 const static char *soap_action_getextip =
     "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
@@ -91,9 +146,48 @@ const static char *soap_action_getextip =
     "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n"
     "  <s:Body>\r\n"
     "    <u:GetExternalIPAddress "
-    "      xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:1\">\r\n"
+    "      xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:%d\">\r\n"
     "    </u:GetExternalIPAddress>\r\n"
     "  </s:Body>\r\n"
     "</s:Envelope>\r\n";
 
+/**
+ * SOAP request body for reading one entry of the port mapping table. It
+ * includes placeholders for the service version and the index of the entry.
+ */
+const static char *soap_action_getgeneric =
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+    "<s:Envelope "
+    "xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n"
+    "  <s:Body>\r\n"
+    "    <u:GetGenericPortMappingEntry "
+    "      xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:%d\">\r\n"
+    "      <NewPortMappingIndex>%d</NewPortMappingIndex>\r\n"
+    "    </u:GetGenericPortMappingEntry>\r\n"
+    "  </s:Body>\r\n"
+    "</s:Envelope>\r\n";
+
+/**
+ * SOAP request body for reading a range of the port mapping table at once
+ * (WANIPConnection:2 only). It includes placeholders for the service version,
+ * start port, end port, protocol, manage flag and max number of entries.
+ */
+const static char *soap_action_getlist =
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+    "<s:Envelope "
+    "xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n"
+    "  <s:Body>\r\n"
+    "    <u:GetListOfPortMappings "
+    "      xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:%d\">\r\n"
+    "      <NewStartPort>%d</NewStartPort>\r\n"
+    "      <NewEndPort>%d</NewEndPort>\r\n"
+    "      <NewProtocol>%s</NewProtocol>\r\n"
+    "      <NewManage>%d</NewManage>\r\n"
+    "      <NewNumberOfPorts>%d</NewNumberOfPorts>\r\n"
+    "    </u:GetListOfPortMappings>\r\n"
+    "  </s:Body>\r\n"
+    "</s:Envelope>\r\n";
+
 #endif // UPNP_MSG_H
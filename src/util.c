@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "pmap_debug.h"
 #include "util.h"
@@ -203,6 +204,37 @@ pmap_url_comp_t *pmap_ut_parse_url(const char *url) {
   return ucomp;
 }
 
+/**
+ * Copy a pmap_url_comp_t structure, control URL and service version
+ * included. The copy is independent of the original (`next` is not copied).
+ *
+ * @param url The structure to copy.
+ * @return A new structure the caller frees with 'pmap_ut_free_url', or NULL
+ * if memory allocation fails (errno is ENOMEM).
+ */
+pmap_url_comp_t *pmap_ut_dup_url(const pmap_url_comp_t *url) {
+
+  char location[256];
+
+  snprintf(location, sizeof(location), "%s://%s:%d/%s", url->scheme,
+           url->host, url->port, url->path);
+  pmap_url_comp_t *copy = pmap_ut_parse_url(location);
+  if (NULL == copy) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (NULL != url->crtl_url &&
+      NULL == (copy->crtl_url = strdup(url->crtl_url))) {
+    pmap_ut_free_url(copy);
+    errno = ENOMEM;
+    return NULL;
+  }
+  copy->version = url->version;
+
+  return copy;
+}
+
 /**
  * Free the memory allocated for a pmap_url_comp_t structure.
  *
@@ -236,26 +268,140 @@ void pmap_ut_free_url(pmap_url_comp_t *url) {
  * format (e.g., "192.168.1.1").
  *
  * @param ip The 32-bit IP address to be converted to a string.
+ * @param buffer Receives the string, 16 bytes are enough.
+ * @param size The size of `buffer`.
  *
- * @return A pointer to a character array containing the human-readable IP
- * address string.
- *         - The returned pointer points to a static character array, so it
- * should not be modified or freed.
- *
+ * @return `buffer`.
  */
-char *pmap_ut_inet_ntoa(uint32_t ip) {
+char *pmap_ut_inet_ntoa_r(uint32_t ip, char *buffer, int size) {
 
   unsigned char bytes[4];
-  static char b[18];
 
   bytes[0] = ip & 0xFF;
   bytes[1] = (ip >> 8) & 0xFF;
   bytes[2] = (ip >> 16) & 0xFF;
   bytes[3] = (ip >> 24) & 0xFF;
 
-  snprintf(b, sizeof(b), "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+  snprintf(buffer, size, "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2],
+           bytes[3]);
+
+  return buffer;
+}
+
+/**
+ * Convert a 32-bit IP address to a human-readable string representation, see
+ * 'pmap_ut_inet_ntoa_r'.
+ *
+ * @param ip The 32-bit IP address to be converted to a string.
+ *
+ * @return A pointer to a character array containing the human-readable IP
+ * address string.
+ *         - The returned pointer points to a buffer of the calling thread
+ * that the next call overwrites, so it should not be modified or freed.
+ *
+ */
+char *pmap_ut_inet_ntoa(uint32_t ip) {
+
+  static __thread char b[18];
+
+  return pmap_ut_inet_ntoa_r(ip, b, sizeof(b));
+}
+
+/**
+ * Describe an error code of the library (EINVALIDURL and following, see
+ * pmap_cfg.h).
+ *
+ * @param err The errno value.
+ * @return A constant string, or NULL if `err` is a system error code (use
+ * strerror_r for those).
+ */
+const char *pmap_ut_strerror(int err) {
+
+  switch (err) {
+  case EINVALIDURL:
+    return "Invalid URL";
+  case EINVALIDPROT:
+    return "Invalid protocol";
+  case EGWUNSUPPORTED:
+    return "No port mapping protocol on gateway";
+  case EUPNPFAULT:
+    return "UPnP SOAP fault";
+  case ELIMITED:
+    return "Gateway rate limit, try again later";
+  case EGWOVERLOAD:
+    return "Gateway overloaded";
+  case NPMP_OK:
+    return "Success";
+  case ENPMP_UNSUPPORTED_VER:
+    return "NAT-PMP unsupported version";
+  case ENPMP_NOT_AUTHORIZED:
+    return "NAT-PMP not authorized/refused";
+  case ENPMP_NETWORK_FAIL:
+    return "NAT-PMP network failure";
+  case ENPMP_OUTOF_RESOURCE:
+    return "NAT-PMP out of resources";
+  case ENPMP_UNSUPPORTED_OPCODE:
+    return "NAT-PMP unsupported opcode";
+  case PCP_OK:
+    return "Success";
+  case EPCP_UNSUPP_VERSION:
+    return "PCP unsupported version";
+  case EPCP_NOT_AUTHORIZED:
+    return "PCP not authorized/refused";
+  case EPCP_MALFORMED_REQUEST:
+    return "PCP malformed request";
+  case EPCP_UNSUPP_OPCODE:
+    return "PCP unsupported opcode";
+  case EPCP_UNSUPP_OPTION:
+    return "PCP unsupported mandatory option";
+  case EPCP_MALFORMED_OPTION:
+    return "PCP malformed option";
+  case EPCP_NETWORK_FAILURE:
+    return "PCP network failure";
+  case EPCP_NO_RESOURCES:
+    return "PCP out of resources";
+  case EPCP_UNSUPP_PROTOCOL:
+    return "PCP unsupported protocol";
+  case EPCP_USER_EX_QUOTA:
+    return "PCP user exceeded quota";
+  case EPCP_CANNOT_PROVIDE_EXTERNAL:
+    return "PCP suggested port not available";
+  case EPCP_ADDRESS_MISMATCH:
+    return "PCP source address mismatch";
+  case EPCP_EXCESSIVE_REMOTE_PEERS:
+    return "PCP too many remote peers";
+  }
+
+  return NULL;
+}
+
+/**
+ * Whether a request failed without a definitive answer from the gateway
+ * (timeout, connection reset): it may have been applied, and the answer lost.
+ *
+ * @param err The errno value of the failure.
+ * @return 1 if the request may have been applied, 0 otherwise.
+ */
+int pmap_ut_unsure(int err) {
+
+  return err == ETIMEDOUT || err == ECONNRESET || err == ECONNABORTED ||
+         err == EPIPE;
+}
+
+/**
+ * Get the current time of a monotonic clock in milliseconds.
+ *
+ * The value has no relation to the wall clock, it is only meant to measure
+ * intervals and deadlines that are not affected by system time changes.
+ *
+ * @return Milliseconds elapsed since an unspecified starting point.
+ */
+int64_t pmap_ut_now_ms(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-  return b;
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 #if PMAP_DEBUG_LOG_DEBUG
@@ -27,6 +27,7 @@
 #include "pmap_errno.h"
 #include <stdint.h>
 
+#ifndef __cplusplus /* Keywords in C++ */
 #ifndef true
 #define true 1
 #endif
@@ -34,6 +35,7 @@
 #ifndef false
 #define false 0
 #endif
+#endif
 
 typedef struct pmap_url_comp_t_ {
 
@@ -44,6 +46,7 @@ typedef struct pmap_url_comp_t_ {
   int port;
   char *path;
   char *crtl_url;
+  int version; /* WANIPConnection service version, 0 if not known */
 } pmap_url_comp_t;
 
 #define PMAP_COMPARE_URLCOMP(a, b)                                             \
@@ -56,7 +59,12 @@ char *pmap_ut_trim(char *s);
 int pmap_ut_substr(const char *startTxt, const char *endTxt,
                    const char *xmlSnippet, char *buffer, int len);
 pmap_url_comp_t *pmap_ut_parse_url(const char *url);
+pmap_url_comp_t *pmap_ut_dup_url(const pmap_url_comp_t *url);
 void pmap_ut_free_url(pmap_url_comp_t *url);
+char *pmap_ut_inet_ntoa_r(uint32_t ip, char *buffer, int size);
 char *pmap_ut_inet_ntoa(uint32_t ip);
+const char *pmap_ut_strerror(int err);
+int pmap_ut_unsure(int err);
 void pmap_ut_dump_hex(const void *data, size_t size);
+int64_t pmap_ut_now_ms(void);
 #endif // _UTIL_H
@@ -0,0 +1,300 @@
+const dgram = require("dgram");
+const http = require("http");
+
+/*
+ * Mock gateways for the stress test and the benchmarks. Each given address
+ * gets a NAT-PMP server (RFC 6886) on port 5351, a UPnP IGD (SSDP responder
+ * and SOAP control point on port 5000), or both. Mappings are kept per
+ * gateway and protocol so adds, deletes and lookups answer as a real gateway
+ * does, with a UPnP fault 718 for a port held by another client and 714 for
+ * a missing entry. A connection is kept open only when the request asks for
+ * it, as with the batch calls.
+ *
+ * NAT-PMP works on any local address, e.g. 127.0.0.2-127.0.0.255 on Linux.
+ * The SSDP response must come from the gateway address, so a UPnP gateway
+ * has to be the address of the interface that carries the multicast route.
+ */
+
+const modes = ["npmp", "upnp", "both"];
+
+if (process.argv.length < 4 || !modes.includes(process.argv[2])) {
+  console.log("Usage: node mock_gateway.js <npmp|upnp|both> <IPv4> [<IPv4> ...]");
+  process.exit(1);
+}
+
+const mode = process.argv[2];
+const hosts = process.argv.slice(3);
+const externalIp = "203.0.113.1";
+const epochStart = Date.now();
+
+const NPMP_PORT = 5351;
+const SSDP_PORT = 1900;
+const SSDP_GROUP = "239.255.255.250";
+const HTTP_PORT = 5000;
+
+const stats = { npmp: 0, soap: 0, connections: 0 };
+
+/* -------------------------------------------- */
+
+function epoch() {
+  return Math.floor((Date.now() - epochStart) / 1000);
+}
+
+function npmpServer(host) {
+  const mappings = new Map(); // "op/client/internal port" => { externalPort }
+  const socket = dgram.createSocket("udp4");
+
+  socket.on("message", (req, rinfo) => {
+    stats.npmp++;
+    if (req.length < 2) {
+      return;
+    }
+    if (req[0] !== 0) {
+      /* Unsupported Version, e.g. to a PCP request (RFC 6886 3.5) */
+      const resp = Buffer.alloc(8);
+      resp[1] = 128 + (req[1] & 0x7f);
+      resp[3] = 1;
+      resp.writeUInt32BE(epoch(), 4);
+      socket.send(resp, rinfo.port, rinfo.address);
+      return;
+    }
+
+    const op = req[1];
+    if (op === 0) {
+      const resp = Buffer.alloc(12);
+      resp[1] = 128;
+      resp.writeUInt32BE(epoch(), 4);
+      Buffer.from(externalIp.split(".").map(Number)).copy(resp, 8);
+      socket.send(resp, rinfo.port, rinfo.address);
+      return;
+    }
+    if ((op !== 1 && op !== 2) || req.length < 12) {
+      return;
+    }
+
+    const internalPort = req.readUInt16BE(4);
+    let externalPort = req.readUInt16BE(6);
+    const lifetime = req.readUInt32BE(8);
+    const key = `${op}/${rinfo.address}/${internalPort}`;
+
+    if (lifetime === 0) {
+      mappings.delete(key);
+    } else {
+      const current = mappings.get(key);
+      if (current) {
+        externalPort = current.externalPort;
+      } else {
+        const used = new Set();
+        for (const [k, m] of mappings) {
+          if (k.startsWith(`${op}/`)) {
+            used.add(m.externalPort);
+          }
+        }
+        if (externalPort === 0) {
+          externalPort = internalPort;
+        }
+        while (used.has(externalPort)) {
+          externalPort = (externalPort % 65535) + 1;
+        }
+      }
+      mappings.set(key, { externalPort });
+    }
+
+    const resp = Buffer.alloc(16);
+    resp[1] = 128 + op;
+    resp.writeUInt32BE(epoch(), 4);
+    resp.writeUInt16BE(internalPort, 8);
+    resp.writeUInt16BE(lifetime === 0 ? 0 : externalPort, 10);
+    resp.writeUInt32BE(lifetime, 12);
+    socket.send(resp, rinfo.port, rinfo.address);
+  });
+
+  socket.on("error", (err) => {
+    console.error(`NAT-PMP ${host}: ${err}`);
+    process.exit(1);
+  });
+
+  socket.bind(NPMP_PORT, host);
+}
+
+/* -------------------------------------------- */
+
+const rootDesc =
+  '<?xml version="1.0"?><root xmlns="urn:schemas-upnp-org:device-1-0"><device>' +
+  "<deviceType>urn:schemas-upnp-org:device:InternetGatewayDevice:1</deviceType>" +
+  "<serviceList><service>" +
+  "<serviceType>urn:schemas-upnp-org:service:WANIPConnection:1</serviceType>" +
+  "<controlURL>/ctl/IPConn</controlURL>" +
+  "</service></serviceList></device></root>";
+
+function arg(body, name) {
+  const m = body.match(new RegExp(`<${name}>([^<]*)</${name}>`));
+  return m ? m[1].trim() : "";
+}
+
+function fault(code, description) {
+  return [
+    500,
+    "<s:Envelope><s:Body><s:Fault><detail><UPnPError>" +
+      `<errorCode>${code}</errorCode><errorDescription>${description}</errorDescription>` +
+      "</UPnPError></detail></s:Fault></s:Body></s:Envelope>",
+  ];
+}
+
+function soap(table, action, body) {
+  const key = `${arg(body, "NewExternalPort")}/${arg(body, "NewProtocol")}`;
+  let out = "";
+
+  switch (action) {
+    case "GetExternalIPAddress":
+      out = `<NewExternalIPAddress>${externalIp}</NewExternalIPAddress>`;
+      break;
+    case "AddPortMapping":
+    case "AddAnyPortMapping": {
+      const client = arg(body, "NewInternalClient");
+      const internalPort = Number(arg(body, "NewInternalPort"));
+      let externalPort = Number(arg(body, "NewExternalPort"));
+      let k = key;
+      if (action === "AddAnyPortMapping") {
+        while (table.has(k) && table.get(k).client !== client) {
+          externalPort = (externalPort % 65535) + 1;
+          k = `${externalPort}/${arg(body, "NewProtocol")}`;
+        }
+        out = `<NewReservedPort>${externalPort}</NewReservedPort>`;
+      } else if (table.has(k) && table.get(k).client !== client) {
+        return fault(718, "ConflictInMappingEntry");
+      }
+      table.set(k, {
+        client,
+        internalPort,
+        description: arg(body, "NewPortMappingDescription"),
+        lease: Number(arg(body, "NewLeaseDuration")),
+      });
+      break;
+    }
+    case "DeletePortMapping":
+      if (!table.delete(key)) {
+        return fault(714, "NoSuchEntryInArray");
+      }
+      break;
+    case "GetSpecificPortMappingEntry": {
+      const m = table.get(key);
+      if (!m) {
+        return fault(714, "NoSuchEntryInArray");
+      }
+      out =
+        `<NewInternalPort>${m.internalPort}</NewInternalPort>` +
+        `<NewInternalClient>${m.client}</NewInternalClient><NewEnabled>1</NewEnabled>` +
+        `<NewPortMappingDescription>${m.description}</NewPortMappingDescription>` +
+        `<NewLeaseDuration>${m.lease}</NewLeaseDuration>`;
+      break;
+    }
+    case "GetGenericPortMappingEntry": {
+      const keys = [...table.keys()].sort();
+      const i = Number(arg(body, "NewPortMappingIndex"));
+      if (i >= keys.length) {
+        return fault(713, "SpecifiedArrayIndexInvalid");
+      }
+      const [port, proto] = keys[i].split("/");
+      const m = table.get(keys[i]);
+      out =
+        `<NewRemoteHost></NewRemoteHost><NewExternalPort>${port}</NewExternalPort>` +
+        `<NewProtocol>${proto}</NewProtocol><NewInternalPort>${m.internalPort}</NewInternalPort>` +
+        `<NewInternalClient>${m.client}</NewInternalClient><NewEnabled>1</NewEnabled>` +
+        `<NewPortMappingDescription>${m.description}</NewPortMappingDescription>` +
+        `<NewLeaseDuration>${m.lease}</NewLeaseDuration>`;
+      break;
+    }
+    default:
+      return fault(401, "Invalid Action");
+  }
+
+  return [
+    200,
+    `<s:Envelope><s:Body><u:${action}Response>${out}</u:${action}Response></s:Body></s:Envelope>`,
+  ];
+}
+
+function upnpServer(host) {
+  const table = new Map(); // "external port/protocol" => mapping
+
+  const server = http.createServer((req, res) => {
+    let body = "";
+    req.on("data", (chunk) => (body += chunk));
+    req.on("end", () => {
+      let code = 200;
+      let out = rootDesc;
+      if (req.method === "POST") {
+        stats.soap++;
+        const action = (req.headers.soapaction || "").replace(/"/g, "").split("#")[1];
+        [code, out] = soap(table, action, body);
+      }
+      const headers = {
+        "Content-Type": 'text/xml; charset="utf-8"',
+        "Content-Length": Buffer.byteLength(out),
+      };
+      if ((req.headers.connection || "").toLowerCase() !== "keep-alive") {
+        headers.Connection = "close"; // As most IGDs do
+      }
+      res.writeHead(code, headers);
+      res.end(out);
+    });
+  });
+
+  server.keepAliveTimeout = 30000;
+  server.on("connection", () => stats.connections++);
+  server.on("error", (err) => {
+    console.error(`UPnP ${host}: ${err}`);
+    process.exit(1);
+  });
+  server.listen(HTTP_PORT, host);
+}
+
+function ssdpServer(upnpHosts) {
+  const socket = dgram.createSocket({ type: "udp4", reuseAddr: true });
+
+  socket.on("message", (msg, rinfo) => {
+    if (!msg.toString().startsWith("M-SEARCH")) {
+      return;
+    }
+    for (const host of upnpHosts) {
+      const resp =
+        "HTTP/1.1 200 OK\r\nCACHE-CONTROL: max-age=120\r\n" +
+        "ST: urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n" +
+        `USN: uuid:mock-${host}::urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n` +
+        `LOCATION: http://${host}:${HTTP_PORT}/rootDesc.xml\r\n\r\n`;
+      socket.send(resp, rinfo.port, rinfo.address);
+    }
+  });
+
+  socket.on("listening", () => socket.addMembership(SSDP_GROUP));
+  socket.on("error", (err) => {
+    console.error(`SSDP: ${err}`);
+    process.exit(1);
+  });
+  socket.bind(SSDP_PORT);
+}
+
+/* -------------------------------------------- */
+
+for (const host of hosts) {
+  if (mode !== "upnp") {
+    npmpServer(host);
+  }
+  if (mode !== "npmp") {
+    upnpServer(host);
+  }
+}
+if (mode !== "npmp") {
+  ssdpServer(hosts);
+}
+
+console.log(`Mock gateways (${mode}) listening on ${hosts.join(", ")}.`);
+
+process.on("SIGTERM", () => {
+  console.log(
+    `NAT-PMP requests ${stats.npmp}, SOAP requests ${stats.soap}, ` +
+      `HTTP connections ${stats.connections}`
+  );
+  process.exit(0);
+});
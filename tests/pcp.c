@@ -0,0 +1,174 @@
+/*
+ *    pcp.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+/**
+ * PCP cases of 'make test', run against the mock gateways. The PCP gateway
+ * (tests/pcp_server.js) maps ports and refuses a delete with another nonce.
+ * The NAT-PMP only gateway (tests/mock_gateway.js) answers PCP with
+ * Unsupported Version, so adds and deletes fall back to NAT-PMP. Exits 1 if
+ * any case failed.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pmap_pcp.h"
+
+#define PCP_TEST_PORT 40000
+
+static int failures;
+
+/**
+ * Print a failed case.
+ */
+static void _pcp_fail(const char *what, const pmap_field_t *pfield,
+                      const char *error) {
+
+  failures++;
+  fprintf(stderr, "%s %d/%s on %s failed [%s]\n", what,
+          pfield->external_port, pfield->protocol,
+          pmap_ut_inet_ntoa(pfield->gateway_ip), error);
+}
+
+static void _pcp_field(pmap_field_t *pfield, uint32_t gateway_ip,
+                       int internal_port) {
+
+  memset(pfield, 0x00, sizeof(*pfield));
+  pfield->gateway_ip = gateway_ip;
+  strcpy(pfield->protocol, "UDP");
+  pfield->internal_port = internal_port;
+  pfield->external_port = PCP_TEST_PORT;
+  pfield->lifetime_sec = 60;
+}
+
+/**
+ * A MAP request creates a mapping: the gateway grants the port and the
+ * lifetime asked for, and the client picks a nonce.
+ */
+static void _pcp_map(uint32_t gateway_ip) {
+
+  static const uint8_t zero[PCP_NONCE_LEN];
+  pmap_field_t field;
+  char error[64] = "";
+
+  _pcp_field(&field, gateway_ip, PCP_TEST_PORT + 10);
+  field.external_port = PCP_TEST_PORT + 10;
+  if (pmap_pcp_addport(&field, error, sizeof(error)) != 0 ||
+      field.external_port != PCP_TEST_PORT + 10 || field.lifetime_sec != 60 ||
+      memcmp(field.nonce, zero, PCP_NONCE_LEN) == 0) {
+    _pcp_fail("map", &field, error);
+    return;
+  }
+  if (pmap_pcp_delport(&field, error, sizeof(error)) != 0) {
+    _pcp_fail("map delete", &field, error);
+  }
+}
+
+/**
+ * Only the nonce of the request that created a mapping deletes it: another
+ * nonce is refused with NOT_AUTHORIZED and the mapping stays.
+ */
+static void _pcp_nonce_delete(uint32_t gateway_ip) {
+
+  pmap_field_t field, other;
+  char error[64] = "";
+
+  _pcp_field(&field, gateway_ip, PCP_TEST_PORT + 20);
+  field.external_port = PCP_TEST_PORT + 20;
+  if (pmap_pcp_addport(&field, error, sizeof(error)) != 0) {
+    _pcp_fail("nonce add", &field, error);
+    return;
+  }
+
+  other = field;
+  other.nonce[0] ^= 0xff;
+  if (pmap_pcp_delport(&other, error, sizeof(error)) == 0 ||
+      errno != EPCP_NOT_AUTHORIZED) {
+    _pcp_fail("delete with another nonce", &other, "not refused");
+  }
+
+  /* Still there: a new mapping of the same internal port is refused too */
+  memset(other.nonce, 0x00, PCP_NONCE_LEN);
+  if (pmap_pcp_addport(&other, error, sizeof(error)) == 0) {
+    _pcp_fail("add over a kept mapping", &other, "not refused");
+  }
+
+  if (pmap_pcp_delport(&field, error, sizeof(error)) != 0 ||
+      field.lifetime_sec != 0) {
+    _pcp_fail("delete with the nonce", &field, error);
+    return;
+  }
+
+  /* Gone: the same internal port can be mapped with a new nonce */
+  _pcp_field(&other, gateway_ip, PCP_TEST_PORT + 20);
+  if (pmap_pcp_addport(&other, error, sizeof(error)) != 0) {
+    _pcp_fail("add after delete", &other, error);
+  }
+  pmap_pcp_delport(&other, error, sizeof(error));
+}
+
+/**
+ * A delete that falls back to NAT-PMP removes the mapping: the external port
+ * is free again for another internal port.
+ */
+static void _pcp_fallback_delete(uint32_t gateway_ip) {
+
+  pmap_field_t field, other;
+  char error[64] = "";
+
+  _pcp_field(&field, gateway_ip, PCP_TEST_PORT);
+  if (pmap_pcp_addport(&field, error, sizeof(error)) != 0 ||
+      field.lifetime_sec != 60) {
+    _pcp_fail("fallback add", &field, error);
+    return;
+  }
+  if (pmap_pcp_delport(&field, error, sizeof(error)) != 0 ||
+      field.lifetime_sec != 0) {
+    _pcp_fail("fallback delete", &field, error);
+    return;
+  }
+
+  _pcp_field(&other, gateway_ip, PCP_TEST_PORT + 1);
+  if (pmap_pcp_addport(&other, error, sizeof(error)) != 0 ||
+      other.external_port != PCP_TEST_PORT) {
+    _pcp_fail("fallback add after delete", &other, error);
+  }
+  pmap_pcp_delport(&other, error, sizeof(error));
+}
+
+int main(int argc, char **argv) {
+
+  if (argc < 3) {
+    printf("usage: %s <NAT-PMP_gateway_IPv4> <PCP_gateway_IPv4>\n", argv[0]);
+    return 1;
+  }
+
+  _pcp_map(inet_addr(argv[2]));
+  _pcp_nonce_delete(inet_addr(argv[2]));
+  _pcp_fallback_delete(inet_addr(argv[1]));
+
+  printf("PCP: %d failed\n", failures);
+  return (failures == 0) ? 0 : 1;
+}
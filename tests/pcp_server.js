@@ -0,0 +1,161 @@
+const dgram = require("dgram");
+
+/*
+ * Mock PCP server (RFC 6887), MAP opcode only. Mappings are kept by internal
+ * address, protocol and internal port together with the nonce of the request
+ * that created them: a renewal or delete with another nonce is refused with
+ * NOT_AUTHORIZED as a real gateway does. The internal address is the client
+ * address of the request, or the one of the THIRD_PARTY option.
+ *
+ * The server listens on the PCP port 5351 of the given address, e.g. a
+ * loopback address the client uses as gateway (127.0.0.6 on Linux, the
+ * PCP_GATEWAY of 'make test').
+ */
+
+if (process.argv.length !== 3) {
+  console.log("Usage: node tests/pcp_server.js <IPv4>");
+  process.exit(1);
+}
+
+const host = process.argv[2];
+const externalIp = Buffer.from([0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 255, 255, 203, 0, 113, 1]);
+const epochStart = Date.now();
+
+const PCP_VERSION = 2;
+const OPCODE_MAP = 1;
+const OPCODE_RESPONSE = 0x80;
+const OPTION_THIRD_PARTY = 1;
+const OPTION_PREFER_FAILURE = 2;
+
+const SUCCESS = 0;
+const UNSUPP_VERSION = 1;
+const NOT_AUTHORIZED = 2;
+const MALFORMED_REQUEST = 3;
+const UNSUPP_OPCODE = 4;
+const CANNOT_PROVIDE_EXTERNAL = 11;
+
+const MAX_LIFETIME = 86400;
+const HDR_LEN = 24;
+const MAP_LEN = 36;
+
+const mappings = new Map(); // "ip/proto/port" => { nonce, externalPort, expires }
+
+function ipString(buf) {
+  return buf.subarray(12, 16).join(".");
+}
+
+function externalInUse(proto, port, key) {
+  for (const [k, m] of mappings) {
+    if (k !== key && m.proto === proto && m.externalPort === port) {
+      return true;
+    }
+  }
+  return false;
+}
+
+function respond(socket, rinfo, req, resCode, lifetime, map) {
+  const resp = Buffer.alloc(HDR_LEN + (map ? MAP_LEN : 0));
+  resp[0] = PCP_VERSION;
+  resp[1] = (req.length > 1 ? req[1] : 0) | OPCODE_RESPONSE;
+  resp[3] = resCode;
+  resp.writeUInt32BE(lifetime, 4);
+  resp.writeUInt32BE(Math.floor((Date.now() - epochStart) / 1000), 8);
+  if (map) {
+    map.copy(resp, HDR_LEN);
+  }
+  socket.send(resp, rinfo.port, rinfo.address);
+}
+
+function handle(socket, req, rinfo) {
+  if (req.length < HDR_LEN || req[0] !== PCP_VERSION) {
+    respond(socket, rinfo, req, UNSUPP_VERSION, 0, null);
+    return;
+  }
+  if (req[1] !== OPCODE_MAP) {
+    respond(socket, rinfo, req, UNSUPP_OPCODE, 0, null);
+    return;
+  }
+  if (req.length < HDR_LEN + MAP_LEN) {
+    respond(socket, rinfo, req, MALFORMED_REQUEST, 0, null);
+    return;
+  }
+
+  let lifetime = req.readUInt32BE(4);
+  let internalIp = ipString(req.subarray(8, 24));
+  const map = Buffer.from(req.subarray(HDR_LEN, HDR_LEN + MAP_LEN));
+  const nonce = map.subarray(0, 12).toString("hex");
+  const proto = map[12];
+  const internalPort = map.readUInt16BE(16);
+  let externalPort = map.readUInt16BE(18);
+  let preferFailure = false;
+
+  for (let off = HDR_LEN + MAP_LEN; off + 4 <= req.length;) {
+    const code = req[off];
+    const len = req.readUInt16BE(off + 2);
+    if (code === OPTION_THIRD_PARTY && len === 16 && off + 20 <= req.length) {
+      internalIp = ipString(req.subarray(off + 4, off + 20));
+    } else if (code === OPTION_PREFER_FAILURE) {
+      preferFailure = true;
+    }
+    off += 4 + ((len + 3) & ~3);
+  }
+
+  const key = `${internalIp}/${proto}/${internalPort}`;
+  let current = mappings.get(key);
+  if (current && current.expires <= Date.now()) {
+    mappings.delete(key); // Expired
+    current = undefined;
+  }
+
+  if (current && current.nonce !== nonce) {
+    console.log(`${key}: nonce mismatch, refused`);
+    respond(socket, rinfo, req, NOT_AUTHORIZED, 0, map);
+    return;
+  }
+
+  if (lifetime === 0) {
+    mappings.delete(key);
+    console.log(`${key}: deleted`);
+    respond(socket, rinfo, req, SUCCESS, 0, map);
+    return;
+  }
+
+  lifetime = Math.min(lifetime, MAX_LIFETIME);
+  if (current) {
+    externalPort = current.externalPort; // Renewal
+  } else {
+    if (externalPort === 0) {
+      externalPort = internalPort;
+    }
+    if (externalInUse(proto, externalPort, key)) {
+      if (preferFailure) {
+        respond(socket, rinfo, req, CANNOT_PROVIDE_EXTERNAL, 0, map);
+        return;
+      }
+      while (externalInUse(proto, externalPort, key)) {
+        externalPort = (externalPort % 65535) + 1;
+      }
+    }
+  }
+
+  mappings.set(key, { nonce, proto, externalPort, expires: Date.now() + lifetime * 1000 });
+  console.log(`${key}: ${current ? "renewed" : "mapped"} to ${externalPort} for ${lifetime} secs`);
+
+  map.writeUInt16BE(externalPort, 18);
+  externalIp.copy(map, 20);
+  respond(socket, rinfo, req, SUCCESS, lifetime, map);
+}
+
+const server = dgram.createSocket("udp4");
+
+server.on("message", (msg, rinfo) => handle(server, msg, rinfo));
+
+server.on("listening", () => {
+  console.log(`PCP server is listening on ${host}:5351.`);
+});
+
+server.on("error", (err) => {
+  console.error(`Server error: ${err}`);
+});
+
+server.bind(5351, host);
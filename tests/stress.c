@@ -0,0 +1,200 @@
+/*
+ *    stress.c
+ *
+ *    Copyright (c) 2023 Alien Green LLC
+ *
+ *    This file is part of Mostat.
+ *
+ *    Mostat is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    Mostat is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with Mostat. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    ASCII font see http://patorjk.com/software/taag/#p=display&f=3D-ASCII
+ */
+
+/**
+ * Stress test of the re-entrant library core, meant to run under
+ * ThreadSanitizer ('make test'). 64 threads map, check, read the external
+ * address of and delete ports on the mock gateways given on the command line
+ * (tests/mock_gateway.js). All threads share one client context, so
+ * several of them work on the same gateway at once, and one mapping pool.
+ * Exits 1 if any call failed.
+ */
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pmap.h"
+#include "pmap_pool.h"
+#include "pmap_upnp.h"
+
+#define STRESS_THREADS 64
+#define STRESS_ROUNDS 20
+#define STRESS_PORT 20000
+#define STRESS_POOL_PORT 50000
+#define STRESS_POOL_SIZE 256
+
+static pmap_ctx_t *shared;
+static pmap_pool_t *pool;
+static uint32_t *gateways;
+static int gateway_count;
+static int failures[STRESS_THREADS];
+static int calls[STRESS_THREADS];
+
+/**
+ * Count one call, print it if it failed.
+ */
+static void _stress_check(int id, const char *what, int ret,
+                          const pmap_field_t *pfield, const char *error) {
+
+  calls[id]++;
+  if (ret != 0) {
+    failures[id]++;
+    fprintf(stderr, "thread %d: %s %d/%s on %s failed [%s]\n", id, what,
+            pfield->external_port, pfield->protocol,
+            pmap_ut_inet_ntoa(pfield->gateway_ip), error);
+  }
+}
+
+static void *_stress_thread(void *arg) {
+
+  int id = (int)(long)arg;
+  char error[64], external_ip[32], ip[16];
+
+  for (int i = 0; i < STRESS_ROUNDS; i++) {
+    pmap_field_t field;
+    int written;
+
+    memset(&field, 0x00, sizeof(field));
+    field.gateway_ip = gateways[(id + i) % gateway_count];
+    field.internal_ip = inet_addr("127.0.0.1");
+    strcpy(field.protocol, (i % 2) ? "UDP" : "TCP");
+    field.external_port = STRESS_PORT + id * STRESS_ROUNDS + i;
+    field.internal_port = field.external_port;
+    field.lifetime_sec = 3600;
+
+    memset(error, 0x00, sizeof(error));
+    _stress_check(id, "add", pmap_addport(shared, &field, error, sizeof(error)),
+                  &field, error);
+    _stress_check(id, "ensure",
+                  pmap_ensureport(shared, &field, &written, error,
+                                  sizeof(error)),
+                  &field, error);
+    _stress_check(id, "external address",
+                  pmap_getexip(shared, &field, external_ip,
+                               sizeof(external_ip), error, sizeof(error)),
+                  &field, error);
+    _stress_check(id, "delete",
+                  pmap_delport(shared, &field, error, sizeof(error)),
+                  &field, error);
+
+    /* Formatting buffers of one thread are not shared with another */
+    pmap_ut_inet_ntoa_r(field.gateway_ip + i, ip, sizeof(ip));
+    if (strcmp(pmap_ut_inet_ntoa(field.gateway_ip + i), ip) != 0) {
+      failures[id]++;
+      fprintf(stderr, "thread %d: pmap_ut_inet_ntoa gave another address\n",
+              id);
+    }
+
+    /* Ports of the pool go back as soon as they are taken */
+    pmap_field_t pooled;
+    if (pmap_pool_get(pool, &pooled) == 0) {
+      calls[id]++;
+      if (pooled.internal_port < STRESS_POOL_PORT ||
+          pooled.internal_port >= STRESS_POOL_PORT + STRESS_POOL_SIZE ||
+          pmap_pool_put(pool, &pooled) != 0) {
+        failures[id]++;
+        fprintf(stderr, "thread %d: pool handed out port %d\n", id,
+                pooled.internal_port);
+      }
+    }
+
+    /* The gateway list of the shared context grows under the others */
+    pmap_ctx_gateway(shared, htonl(0x0a000000 + id * STRESS_ROUNDS + i));
+    if (i % 5 == 0) {
+      pmap_ctx_flush_negative(shared);
+      pmap_set_debug(0);
+    }
+  }
+
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+
+  pthread_t threads[STRESS_THREADS];
+  int total_calls = 0, total_failures = 0, count = 0;
+
+  if (argc < 2) {
+    printf("usage: %s <gateway_IPv4> [<gateway_IPv4> ...]\n", argv[0]);
+    return 1;
+  }
+
+  gateway_count = argc - 1;
+  gateways = calloc(gateway_count, sizeof(uint32_t));
+  shared = pmap_ctx_create();
+  if (NULL == gateways || NULL == shared) {
+    return 1;
+  }
+  for (int i = 0; i < gateway_count; i++) {
+    gateways[i] = inet_addr(argv[i + 1]);
+  }
+
+  /* Under ThreadSanitizer a mock may answer far slower than the round trips
+   * measured so far, keep the default response timeout */
+  pmap_tmo_t floor = {PMAP_TMO_DISCOVERY_FLOOR, PMAP_TMO_CONNECT_FLOOR,
+                      PMAP_TMO_RESPONSE_DEF, PMAP_TMO_RETRANSMIT_FLOOR};
+  pmap_ctx_set_timeouts(shared, &floor, NULL);
+
+  pmap_field_t field;
+  memset(&field, 0x00, sizeof(field));
+  field.gateway_ip = gateways[0];
+  field.internal_ip = inet_addr("127.0.0.1");
+  strcpy(field.protocol, "UDP");
+  field.internal_port = STRESS_POOL_PORT;
+  field.lifetime_sec = 2; // Renewed while the threads run
+  pool = pmap_pool_create(&field, STRESS_POOL_SIZE, 64, 16);
+  if (NULL == pool) {
+    return 1;
+  }
+
+  int64_t start = pmap_ut_now_ms();
+  for (long i = 0; i < STRESS_THREADS; i++) {
+    pthread_create(&threads[i], NULL, _stress_thread, (void *)i);
+  }
+  for (int i = 0; i < STRESS_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (int i = 0; i < STRESS_THREADS; i++) {
+    total_calls += calls[i];
+    total_failures += failures[i];
+  }
+  for (pmap_gw_t *gw = shared->gateways; gw != NULL; gw = gw->next) {
+    count++;
+  }
+
+  printf("%d threads, %d gateways: %d calls, %d failed, %d coalesced, "
+         "%d shared gateway entries, %lld ms\n",
+         STRESS_THREADS, gateway_count, total_calls, total_failures,
+         (int)pmap_ctx_coalesced(shared), count,
+         (long long)(pmap_ut_now_ms() - start));
+
+  pmap_pool_destroy(pool);
+  pmap_ctx_destroy(shared);
+  free(gateways);
+
+  return (total_failures == 0) ? 0 : 1;
+}